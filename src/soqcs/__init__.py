@@ -16,7 +16,7 @@ import sys
 import numpy as np
 import matplotlib.pyplot as plt
 import matplotlib.patches as patches
-from ctypes import cdll,c_char,c_int,c_long,c_double,POINTER
+from ctypes import cdll,c_char,c_int,c_long,c_longlong,c_ulonglong,c_double,POINTER,byref
 
 #------------------------------------------------------------------------------#      
 # CPP library configuration
@@ -101,6 +101,22 @@ def cfg_soqcs(nph):
     """  
     soqcs.all_cfg_soqcs(nph);   
 
+
+#------------------------------------------------------------------------------#
+# Wrapper for C++ SOQCS random number generator seed                           #
+# Reproducible sampling                                                        #
+#------------------------------------------------------------------------------#     
+def rng_seed(seed):
+    """
+
+    It sets the seed of the random number generators of SOQCS. Samplers and noise
+    models give the same results for the same seed.
+    
+    :seed (int): Seed of the random number generators.
+    
+    """  
+    soqcs.all_rng_seed(c_ulonglong(seed));   
+
     
 #------------------------------------------------------------------------------#      
 # Wrapper for C++ SOQCS class qocircit                                         #
@@ -163,6 +179,35 @@ class qocircuit(object):
         """
         return soqcs.qoc_num_levels(c_long(self.obj))
 
+    #---------------------------------------------------------------------------
+    # Return number of gates
+    #---------------------------------------------------------------------------
+    def num_gates(self):
+        """
+
+        Returns the number of gates recorded in the circuit. Gates are numbered in order starting from zero.
+        Each optical element adds one gate (add_gate and concatenate add one gate for the whole circuit added).
+        Detectors also record gates: a detector with efficiency lower than one adds a phase shifter gate and the
+        last detector adds one gate for the losses calculation (if losses are computed) and one for the emitter
+        (if it is defined). Emitter definitions do not record gates.
+
+        :return(int): Number of gates of the circuit.
+        """
+        return soqcs.qoc_num_gates(c_long(self.obj))
+
+    #---------------------------------------------------------------------------
+    # Selects a gate to be replaced
+    #---------------------------------------------------------------------------
+    def update(self, gid):
+        """
+
+        The next element added to the circuit replaces the recorded gate gid instead of being appended at the end.
+
+        :gid(int): Number of the gate to be replaced.
+        :return(int): 0 if success -1 if an error happened.
+        """
+        return soqcs.qoc_update(c_long(self.obj),gid)
+
     #---------------------------------------------------------------------------          
     # Adds to the circuit a random circuit
     #---------------------------------------------------------------------------      
@@ -444,6 +489,21 @@ class qocircuit(object):
         """
         soqcs.qoc_noise(c_long(self.obj),c_double(stdev2))
 
+    #---------------------------------------------------------------------------
+    # Selects the exact calculation of the detector dead time and dark counts
+    #---------------------------------------------------------------------------
+    def exact_detection(self, exact):
+        """
+
+        Selects how the detector dead time and dark counts are calculated. |br|
+        By default they are sampled with R random iterations. In exact mode each bin is convolved with the blinking and dark
+        counts probabilities. The result is deterministic and it is obtained in a single pass.
+
+        :exact(bool): True for the exact calculation. False for the random sampling.
+
+        """
+        soqcs.qoc_exact_detection(c_long(self.obj),exact)
+
     #---------------------------------------------------------------------------              
     # Adds to the circuit a packet definition
     #---------------------------------------------------------------------------      
@@ -1758,6 +1818,34 @@ class auxqodev(object):
         """
         soqcs.dev_prnt_packets(c_long(self.obj))  
 
+    #---------------------------------------------------------------------------
+    # Return number of gates
+    #---------------------------------------------------------------------------
+    def num_gates(self):
+        """
+
+        Returns the number of gates recorded in the circuit of the device. Gates are numbered in order starting from zero.
+        Each optical element adds one gate. Detectors also record gates: a detector with efficiency lower than one adds
+        a phase shifter gate and the last detector adds one gate for the losses calculation (if losses are computed) and
+        one for the emitter (if it is defined). Photon definitions do not record gates.
+
+        :return(int): Number of gates of the circuit.
+        """
+        return soqcs.dev_num_gates(c_long(self.obj))
+
+    #---------------------------------------------------------------------------
+    # Selects a gate to be replaced
+    #---------------------------------------------------------------------------
+    def update(self, gid):
+        """
+
+        The next element added to the device replaces the recorded gate gid instead of being appended at the end.
+
+        :gid(int): Number of the gate to be replaced.
+        :return(int): 0 if success -1 if an error happened.
+        """
+        return soqcs.dev_update(c_long(self.obj),gid)
+
     #---------------------------------------------------------------------------      
     # Adds to the metacircuit a random circuit
     #---------------------------------------------------------------------------      
@@ -2020,6 +2108,19 @@ class auxqodev(object):
         
         """
         soqcs.dev_noise(c_long(self.obj),c_double(stdev2))
+
+    #---------------------------------------------------------------------------
+    # Selects the exact calculation of the detector dead time and dark counts
+    #---------------------------------------------------------------------------
+    def exact_detection(self, exact):
+        """
+
+        Selects the exact calculation of the detector dead time and dark counts instead of their sampling with R random iterations.
+
+        :exact(bool): True for the exact calculation. False for the random sampling.
+
+        """
+        soqcs.dev_exact_detection(c_long(self.obj),exact)
     
     #---------------------------------------------------------------------------      
     #  Apply a *single ket* post-selection condition defined by the detectors 
@@ -2055,7 +2156,7 @@ class simulator(object):
     Simulator that can be used to calculate the outcomes of a quantum device or
     the output state of a circuit given an input state.
 
-    :mem(optional([int]): Reserved memory for the output expressed as a maximum number of terms. (Internal memory)
+    :mem(optional([int]): Initial number of terms reserved for the output. The output grows beyond it when needed. (Internal memory)
     
     """
     #---------------------------------------------------------------------------          
@@ -2072,6 +2173,62 @@ class simulator(object):
     def __del__(self):
         soqcs.sim_destroy_simulator(c_long(self.obj))
 
+    #---------------------------------------------------------------------------
+    # Enable the cache of permanents
+    #---------------------------------------------------------------------------
+    def set_cache(self, size):
+        """
+
+        Enables a bounded cache of permanents. Once it is full the least recently used permanent is removed. |br|
+        It is useful for peaked distributions where the same outputs are calculated many times.
+
+        :size(int): Maximum number of permanents stored. Zero disables the cache.
+
+        """
+        soqcs.sim_set_cache(c_long(self.obj),c_longlong(size))
+
+    #---------------------------------------------------------------------------
+    # Clear the cache of permanents
+    #---------------------------------------------------------------------------
+    def clear_cache(self):
+        """
+
+        Removes all the permanents stored in the cache and restarts its counters.
+
+        """
+        soqcs.sim_clear_cache(c_long(self.obj))
+
+    #---------------------------------------------------------------------------
+    # Counters of the cache of permanents
+    #---------------------------------------------------------------------------
+    def cache_stats(self):
+        """
+
+        Returns the counters of the cache of permanents.
+
+        :return(int,int): Number of hits and number of misses.
+
+        """
+        stats=(c_longlong*2)()
+        soqcs.sim_cache_stats(c_long(self.obj),stats)
+        return stats[0], stats[1]
+
+    #---------------------------------------------------------------------------
+    # Enable the dense output mode
+    #---------------------------------------------------------------------------
+    def set_dense(self, dense):
+        """
+
+        Enables the dense output mode of the Glynn and Ryser methods (2 to 5). |br|
+        The amplitude of each output is stored by its combinatorial rank in a preallocated array instead of being searched
+        in a dictionary. The memory used is known in advance but it grows with the size of the full output space.
+        It is only used when all the input kets have the same number of photons.
+
+        :dense(bool): True to enable the dense output mode. False to disable it.
+
+        """
+        soqcs.sim_set_dense(c_long(self.obj),dense)
+
     #---------------------------------------------------------------------------               
     # Run a simulator for a metacircuit
     #---------------------------------------------------------------------------      
@@ -2091,7 +2248,10 @@ class simulator(object):
                             5 = Ryser restricted: Same as the Ryser method but considering only output states of occupations by level zero or one. This restricts but speeds up the output. |br|
                             6 = Fast Ryser method: Same as the Ryser method but only those kets with non-zero contribution to post-selection are considered. This restriction speeds up the output. |br|
                             7 = Fast Ryser restricted: Same as the Fast Ryser method but considering only output states of occupations by level zero or one. This further restricts but speeds up the output. |br|                            
-        :nthreads (optional[int]): Number of threads to be used by Ryser methods.
+                            8 = Laplace method: Full distribution using permanents expanded by the last photon. The minors are shared between outputs that only differ in the level of the last photon. |br|
+                            9 = Direct photon by photon: Same as the direct method but the circuit is applied one input photon at a time merging equal partial occupations. |br|
+                            10 = Direct photon by photon restricted: Same as the direct photon by photon method but considering only output states of occupations by level zero or one. |br|
+        :nthreads (optional[int]): Number of threads to be used by Direct, Glynn and Ryser methods.
         :return(p_bin): Device outcome.
     
         """
@@ -2121,7 +2281,10 @@ class simulator(object):
                             5 = Ryser restricted: Same as the Ryser method but considering only output states of occupations by level zero or one. This restricts but speeds up the output. |br|
                             6 = Fast Ryser method: Same as the Ryser method but only those kets with non-zero contribution to post-selection are considered. This restriction speeds up the output. |br|
                             7 = Fast Ryser restricted: Same as the Fast Ryser method but considering only output states of occupations by level zero or one. This further restricts but speeds up the output. |br|                            
-        :nthreads (optional[int]): Number of threads to be used by Ryser methods.
+                            8 = Laplace method: Full distribution using permanents expanded by the last photon. The minors are shared between outputs that only differ in the level of the last photon. |br|
+                            9 = Direct photon by photon: Same as the direct method but the circuit is applied one input photon at a time merging equal partial occupations. |br|
+                            10 = Direct photon by photon restricted: Same as the direct photon by photon method but considering only output states of occupations by level zero or one. |br|
+        :nthreads (optional[int]): Number of threads to be used by Direct, Glynn and Ryser methods.
         :st_list (optional[state]): State that contains a list of ket (of any amplitude) to be calculated by run_st. If no list is provided the full output state is obtained.
         :return(state): Output state.
     
@@ -2139,15 +2302,44 @@ class simulator(object):
         newstate.obj=obj
         return newstate
 
+    #---------------------------------------------------------------------------
+    # Estimate the amplitudes of a list of kets with the Gurvits estimator
+    #---------------------------------------------------------------------------
+    def gurvits(self, istate, qoc, st_list, eps, conf=0.95, nthreads=-1):
+        """
+
+        Estimates the output amplitudes of a list of kets using the randomized Gurvits estimator of the permanent. |br|
+        The cost is polynomial in the number of photons. It is intended to validate large experiments where the exact methods are not feasible. |br|
+        The number of samples of each term is chosen so that its additive error is smaller than eps with probability conf. |br|
+        L. Gurvits, Lecture Notes in Computer Science 3618, 447-458 (2005).
+
+        :istate(state): Initial state.
+        :qoc(qocircuit): Input quantum circuit.
+        :st_list(state): State that contains the list of kets (of any amplitude) whose amplitudes are estimated.
+        :eps(float): Additive error of each term of the amplitudes.
+        :conf (optional[float]): Probability of each term being within the additive error.
+        :nthreads (optional[int]): Number of threads.
+        :return(state,list[float]): Output state with the estimated amplitudes and the standard error of the amplitude of each ket of the list in the same order.
+
+        """
+        nkets=soqcs.st_nkets(c_long(st_list.obj))
+        serr=(c_double*max(nkets,1))()
+        func=soqcs.sim_gurvits
+        func.restype=c_long
+        obj=func(c_long(self.obj),c_long(istate.obj),c_long(st_list.obj),c_long(qoc.obj),c_double(eps),c_double(conf),nthreads,serr)
+        newstate=state(1,True)
+        newstate.obj=obj
+        return newstate, [serr[i] for i in range(0,nkets)]
+
     #---------------------------------------------------------------------------      
-    # Run a Clifford A sampling for a device
+    # Run a Clifford B sampling for a device
     #---------------------------------------------------------------------------      
     def sample(self, dev, N):
         """
 
-        Sampling of a device using Clifford A algorithm. |br|
+        Sampling of a device using Clifford B algorithm. |br|
         Proceedings of the 2018 Annual ACM-SIAM Symposium on Discrete Algorithms (SODA). Page 146-155. SIAM Publications Library (2018). |br|
-        **Warning!** Clifford A is defined to be used with a single input term. Therefor neither Bell or QD initializations are recommended.
+        **Warning!** Clifford B is defined to be used with a single input term. Therefor neither Bell or QD initializations are recommended.
 
         :dev(qodev): Input quantum device.
         :N(int): Number of samples.
@@ -2166,11 +2358,12 @@ class simulator(object):
     #---------------------------------------------------------------------------      
     # Run a Metropolis sampling for a device
     #---------------------------------------------------------------------------      
-    def metropolis(self, dev, mode, N, Nburn=0, Nthin=1):
+    def metropolis(self, dev, mode, N, Nburn=0, Nthin=1, nchains=1, nthreads=1):
         """
 
         Sampling of a device using a metropolis algorithm. |br|
         Nature Physics 13, 1153-1157 (2017). |br|
+        The samples are split between independent chains run in parallel. Each chain is burned in and thinned on its own. |br|
         **Warning!** Metropolis is defined to be used with a single input term. Therefor neither Bell or QD initializations are recommended.
 
         :dev(qodev): Input quantum device.
@@ -2184,15 +2377,18 @@ class simulator(object):
         :N(int): Number of samples.
         :optional(Nburn(int)): Number of initial samples to be skipped.
         :optional(Nthin(int)): Number of thinning samples.
-        :return(p_bin): Device outcome.
+        :optional(nchains(int)): Number of independent chains.
+        :optional(nthreads(int)): Number of threads.
+        :return(p_bin,float,float,float): Device outcome, acceptance ratio, Gelman-Rubin R-hat diagnostic and effective sample size summed over the chains.
 
         """
+        diag=(c_double*3)()
         func=soqcs.sim_metropolis
         func.restype=c_long
-        obj=func(c_long(self.obj),c_long(dev.circ.obj),mode,N,Nburn,Nthin) 
+        obj=func(c_long(self.obj),c_long(dev.circ.obj),mode,N,Nburn,Nthin,nchains,nthreads,diag)
         newoutcome=p_bin(1,True)
         newoutcome.obj=obj
-        return newoutcome
+        return newoutcome, diag[0], diag[1], diag[2]
 
     #---------------------------------------------------------------------------      
     # Get a sample using one of the sampling methods available
@@ -2207,7 +2403,7 @@ class simulator(object):
         :dev(qodev): Input quantum device.
         :N(int): Number of samples.
         :method(int): Sampling method. |br|
-                      0: Clifford A. |br|
+                      0: Clifford B. |br|
                       1: Metropolis. |br|
                       5: g Classical  ( Restricted ). |br|
 
@@ -2262,7 +2458,7 @@ class thread_server(object):
 
     Thread server used to launch jobs in parallel.
 
-    :mem(optional([int]): Reserved memory for the output expressed as a maximum number of terms. (Internal memory)
+    :mem(optional([int]): Initial number of terms reserved for the output. The output grows beyond it when needed. (Internal memory)
     
     """
     #---------------------------------------------------------------------------          
@@ -2295,9 +2491,16 @@ class thread_server(object):
                     5 = Ryser restricted: Same as the Ryser method but considering only output states of occupations by level zero or one. This restricts but speeds up the output. |br|
                     6 = Fast Ryser method: Same as the Ryser method but only those kets with non-zero contribution to post-selection are considered. This restriction speeds up the output. |br|
                     7 = Fast Ryser restricted: Same as the Fast Ryser method but considering only output states of occupations by level zero or one. This further restricts but speeds up the output. |br|                            
+                    8 = Laplace method: Full distribution using permanents expanded by the last photon. The minors are shared between outputs that only differ in the level of the last photon. |br|
+                    9 = Direct photon by photon: Same as the direct method but the circuit is applied one input photon at a time merging equal partial occupations. |br|
+                    10 = Direct photon by photon restricted: Same as the direct photon by photon method but considering only output states of occupations by level zero or one. |br|
                     
+        :return(int): Job identifier.
+        
         """            
-        soqcs.mt_send_work(c_long(self.obj),c_long(istate.obj),c_long(qoc.obj),method) 
+        func=soqcs.mt_send_work
+        func.restype=c_long
+        return func(c_long(self.obj),c_long(istate.obj),c_long(qoc.obj),method) 
 
 
     def send(self, dev, method=0):
@@ -2316,11 +2519,16 @@ class thread_server(object):
                     5 = Ryser restricted: Same as the Ryser method but considering only output states of occupations by level zero or one. This restricts but speeds up the output. |br|
                     6 = Fast Ryser method: Same as the Ryser method but only those kets with non-zero contribution to post-selection are considered. This restriction speeds up the output. |br|
                     7 = Fast Ryser restricted: Same as the Fast Ryser method but considering only output states of occupations by level zero or one. This further restricts but speeds up the output. |br|                            
+                    8 = Laplace method: Full distribution using permanents expanded by the last photon. The minors are shared between outputs that only differ in the level of the last photon. |br|
+                    9 = Direct photon by photon: Same as the direct method but the circuit is applied one input photon at a time merging equal partial occupations. |br|
+                    10 = Direct photon by photon restricted: Same as the direct photon by photon method but considering only output states of occupations by level zero or one. |br|
                     
         """            
         istate=dev.input()
         qoc=dev.circuit()
-        soqcs.mt_send_work(c_long(self.obj),c_long(istate.obj),c_long(qoc.obj),method) 
+        func=soqcs.mt_send_work
+        func.restype=c_long
+        return func(c_long(self.obj),c_long(istate.obj),c_long(qoc.obj),method) 
         
 
     def receive(self):
@@ -2337,6 +2545,83 @@ class thread_server(object):
         newstate=state(1,True)
         newstate.obj=obj
         return newstate
+
+    def receive_any(self):
+        """
+
+        Receive the first job that finishes from the server 
+
+        :return(int,state): Job identifier and output state. If there are no jobs pending it returns -1 and None.
+        
+        """          
+        jobid=c_long(0)
+        func=soqcs.mt_receive_any
+        func.restype=c_long
+        obj=func(c_long(self.obj),byref(jobid)) 
+        if obj==0:
+            return -1, None
+        newstate=state(1,True)
+        newstate.obj=obj
+        return jobid.value, newstate
+
+    def cancel(self, jobid):
+        """
+
+        Cancel a job that has not started yet 
+
+        :jobid(int): Job identifier.
+        :return(bool): True if the job has been canceled.
+        
+        """          
+        return soqcs.mt_cancel_work(c_long(self.obj),c_long(jobid))==1
+
+    def send_dmat_st(self, istate, qoc, method=0):
+        """
+
+        Send a job to the server whose output is added to the density matrix of the worker that runs it ( Circuit version ). |br|
+        The detectors of the circuit define the post-selection. The accumulated density matrix is obtained with reduce_dmat().
+
+        :istate(state): Initial state
+        :qoc(qocircuit): Quantum optical circuit to be simulated.
+        :method (int): Core method selected. Same as in send_st.
+        :return(int): Job identifier.
+
+        """
+        func=soqcs.mt_send_dwork
+        func.restype=c_long
+        return func(c_long(self.obj),c_long(istate.obj),c_long(qoc.obj),method)
+
+    def send_dmat(self, dev, method=0):
+        """
+
+        Send a job to the server whose output is added to the density matrix of the worker that runs it ( Device version ). |br|
+        The detectors of the device define the post-selection. The accumulated density matrix is obtained with reduce_dmat().
+
+        :dev(qodev): Quantum optical device to be simulated.
+        :method (int): Core method selected. Same as in send.
+        :return(int): Job identifier.
+
+        """
+        istate=dev.input()
+        qoc=dev.circuit()
+        func=soqcs.mt_send_dwork
+        func.restype=c_long
+        return func(c_long(self.obj),c_long(istate.obj),c_long(qoc.obj),method)
+
+    def reduce_dmat(self):
+        """
+
+        Waits for all the jobs sent with send_dmat and merges the density matrices of the workers.
+        The workers start a new accumulation afterwards.
+
+        :return(dmatrix): Density matrix of all the accumulated jobs.
+
+        """
+        func=soqcs.mt_reduce_dmat
+        func.restype=c_long
+        aux=dmatrix(1,True)
+        aux.obj=func(c_long(self.obj))
+        return aux
         
 
 
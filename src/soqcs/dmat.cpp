@@ -53,8 +53,12 @@ void dmatrix:: create_dmtx(int i_mem){
     N=0;
     mem=i_mem;
 
-    // Reserve memory for density matrix
-    dens.setZero(mem,mem);
+    // Initialize block storage.
+    // Blocks are created when they are needed.
+    nsec=0;
+    nkey=0;
+    ssize=nullptr;
+    blk=nullptr;
 
     // Crete placeholder dictionary.
     // The good one will be created with the first element.
@@ -73,6 +77,7 @@ dmatrix:: ~dmatrix(){
 
     // Deleted dictionary
     delete dicc;
+    free_blocks();
 }
 
 
@@ -84,18 +89,31 @@ dmatrix:: ~dmatrix(){
 dmatrix *dmatrix:: clone(){
 //  Variables
     dmatrix *aux;      // New copy of this density matrix.
+//  Auxiliary index
+    int      i;        // Aux index
 
 
     // Initialize configuration
     aux=new dmatrix(mem);
     aux->N=N;
 
-    // Reserve memory for density matrix
-    aux->dens=dens;
+    // Copy the non-empty blocks
+    aux->nsec=nsec;
+    aux->nkey=nkey;
+    aux->ksec=ksec;
+    aux->kpos=kpos;
+    if(nsec>0){
+        aux->ssize=new int[nsec];
+        aux->blk=new matc*[nsec*nsec];
+        for(i=0;i<nsec;i++) aux->ssize[i]=ssize[i];
+        for(i=0;i<nsec*nsec;i++){
+            if(blk[i]!=nullptr) aux->blk[i]=new matc(*blk[i]);
+            else aux->blk[i]=nullptr;
+        }
+    }
 
-    // Crete placeholder dictionary.
-    // The good one will be created with the first element.
-    // Important data extracted from the first added state.
+    // Copy dictionary
+    delete aux->dicc;
     aux->dicc=dicc->clone();
 
     return aux;
@@ -113,8 +131,8 @@ void dmatrix:: clear(){
     // Initialize configuration
     N=0;
 
-    // Reserve memory for density matrix
-    dens.setZero(mem,mem);
+    // Release the blocks
+    free_blocks();
 
     // Crete placeholder dictionary.
     // The good one will be created with the first element.
@@ -133,9 +151,8 @@ void dmatrix:: add(dmatrix *addm){
 //  dmatrix *addm                  // Matrix to be added to the present one
 //  Variables
     double Nm;                     // Normalization coefficient between matrix
+    int   *irow;                   // Row of each entry of the added matrix dictionary in this matrix
 //  Auxiliary index
-    int   irow;                    // Index of rows
-    int   icol;                    // Index of columns
     int   k;                       // Aux index
     int   l;                       // Aux index
 
@@ -144,16 +161,59 @@ void dmatrix:: add(dmatrix *addm){
     // For each ket in the state we add it to the dictionary and
     // assign a row to it if it didn't exist before.  We obtain its
     // row otherwise.
+    irow=new int[max(addm->dicc->nket,1)];
+    for(k=0;k<addm->dicc->nket;k++) irow[k]=store_ket(addm->dicc->ket[k]);
+
+    // Only the non-empty blocks are added
     for(k=0;k<addm->dicc->nket;k++){
-        irow=dicc->add_ket(addm->dicc->ket[k]);
-        // For each ket in the state we add it to the dictionary and
-        // assign a column to it if it didn't exist before.  We obtain its
-        // column otherwise.
         for(l=0;l<addm->dicc->nket;l++){
-            icol=dicc->add_ket(addm->dicc->ket[l]);
-            dens(irow,icol)=dens(irow,icol)+addm->dens(k,l)*Nm;
+            if(addm->blk[addm->ksec(k)*addm->nsec+addm->ksec(l)]!=nullptr) add_entry(irow[k],irow[l],addm->get_entry(k,l)*Nm);
         }
     }
+
+    // Free memory
+    delete[] irow;
+}
+
+
+//----------------------------------------
+//
+// Merges the states accumulated in
+// another compatible density matrix
+//
+//----------------------------------------
+void dmatrix:: merge(dmatrix *addm){
+//  dmatrix *addm                  // Matrix to be merged with the present one
+//  Variables
+    int   *irow;                   // Row of each entry of the merged matrix dictionary in this matrix
+//  Auxiliary index
+    int   k;                       // Aux index
+    int   l;                       // Aux index
+
+
+    if(addm->dicc->nket==0){
+        N=N+addm->N;
+        return;
+    }
+    if(dicc->nket==0){
+        delete dicc;
+        dicc=new ket_list(addm->dicc->nph,addm->dicc->nlevel,mem,addm->dicc->vis);
+    }
+
+    // Find the rows of the kets in this matrix
+    irow=new int[addm->dicc->nket];
+    for(k=0;k<addm->dicc->nket;k++) irow[k]=store_ket(addm->dicc->ket[k]);
+
+    // Sum the non-empty blocks
+    for(k=0;k<addm->dicc->nket;k++){
+        for(l=0;l<addm->dicc->nket;l++){
+            if(addm->blk[addm->ksec(k)*addm->nsec+addm->ksec(l)]!=nullptr) add_entry(irow[k],irow[l],addm->get_entry(k,l));
+        }
+    }
+    N=N+addm->N;
+
+    // Free memory
+    delete[] irow;
 }
 
 
@@ -170,7 +230,7 @@ double dmatrix::trace(){
 
 
     tr=0.0;
-    for (i=0;i<dicc->nket;i++) tr=tr+dens(i,i);
+    for (i=0;i<dicc->nket;i++) tr=tr+get_entry(i,i);
     return real(tr);
 }
 
@@ -181,10 +241,15 @@ double dmatrix::trace(){
 //
 //----------------------------------------
 void dmatrix::normalize(){
+//  Variables
+    double tr;     // Trace
+//  Auxilaty index
+    int    i;      // Aux index
 
 
     N=1;
-    dens=dens/trace();
+    tr=trace();
+    for(i=0;i<nsec*nsec;i++) if(blk[i]!=nullptr) *blk[i]=*blk[i]/tr;
 }
 
 
@@ -275,14 +340,14 @@ void dmatrix::aux_prnt_mtx(int format, double thresh, qocircuit *qoc){
     rowsum.resize(nbase);
     for(i=0;i<nbase;i++){
         rowsum(i)=0.0;
-        for(j=0;j<nbase;j++) rowsum(i)=rowsum(i)+abs(dens(i,j));
+        for(j=0;j<nbase;j++) rowsum(i)=rowsum(i)+abs(get_entry(i,j));
     }
 
     // Check which columns are non zero
     colsum.resize(nbase);
     for(i=0;i<nbase;i++){
         colsum(i)=0.0;
-        for(j=0;j<nbase;j++) colsum(i)=colsum(i)+abs(dens(j,i));
+        for(j=0;j<nbase;j++) colsum(i)=colsum(i)+abs(get_entry(j,i));
     }
 
    // Print non-zero rows and columns of the density matrix (to avoid screen cluttering)
@@ -295,16 +360,16 @@ void dmatrix::aux_prnt_mtx(int format, double thresh, qocircuit *qoc){
                     kind=format/NFORMATS;
                     switch (kind){
                         case 0:
-                            cout  << setw(DEFWIDTH+1) << std::fixed << std::setprecision(4) << dens(i,j)/double(N) << RESET <<" ";
+                            cout  << setw(DEFWIDTH+1) << std::fixed << std::setprecision(4) << get_entry(i,j)/double(N) << RESET <<" ";
                             break;
                         case 1:
-                            cout  << setw(DEFWIDTH+1) << std::fixed << std::setprecision(4) << real(dens(i,j))/double(N) << RESET <<" ";
+                            cout  << setw(DEFWIDTH+1) << std::fixed << std::setprecision(4) << real(get_entry(i,j))/double(N) << RESET <<" ";
                             break;
                         case 2:
-                            cout  << setw(DEFWIDTH+1) << std::fixed << std::setprecision(4) << imag(dens(i,j))/double(N) << RESET <<" ";
+                            cout  << setw(DEFWIDTH+1) << std::fixed << std::setprecision(4) << imag(get_entry(i,j))/double(N) << RESET <<" ";
                             break;
                         case 3:
-                            cout  << setw(DEFWIDTH+1) << std::fixed << std::setprecision(4) << sign(real(dens(i,j)))*abs(dens(i,j))/double(N) << RESET <<" ";
+                            cout  << setw(DEFWIDTH+1) << std::fixed << std::setprecision(4) << sign(real(get_entry(i,j)))*abs(get_entry(i,j))/double(N) << RESET <<" ";
                             break;
                         default:
                             cout  << "aux_prnt_mtx error: Format number too larger/Format not recognized" << endl;
@@ -346,7 +411,7 @@ void dmatrix::prnt_results(int format,qocircuit *qoc){
     for(i=0;i<dicc->nket;i++){
         dicc->prnt_ket(i,format,qoc);
         cout << ": ";
-        cout << std::fixed << std::setprecision(4) << real(dens(i,i))/double(N) <<endl;
+        cout << std::fixed << std::setprecision(4) << real(get_entry(i,i))/double(N) <<endl;
 
     }
 }
@@ -373,7 +438,7 @@ double dmatrix::get_result(mati def,qocircuit *qoc){
     delete bra;
 
     // Return density matrix value if present.
-    if(irow>=0) return real(dens(irow,irow));
+    if(irow>=0) return real(get_entry(irow,irow));
 
     return 0.0;
 }
@@ -394,12 +459,12 @@ p_bin *dmatrix::get_pbin(){
 
 
     // Create the set of probability bin
-    aux=new p_bin(dicc->nph,dicc->nlevel,dicc->maxket,dicc->vis);
+    aux=new p_bin(dicc->nph,dicc->nlevel,max(dicc->nket,1),dicc->vis);
 
     // Store the values
-    for(i=0;i<dicc->maxket;i++){
+    for(i=0;i<dicc->nket;i++){
         j=aux->add_count(dicc->ket[i]);
-        aux->p[j]=real(dens(i,i));
+        aux->p[j]=real(get_entry(i,i));
     }
     aux->N=N;
 
@@ -436,7 +501,7 @@ double dmatrix::fidelity(state* input){
 
             // IF found the we calculate the corresponding fidelity measurement.
             if((irow>=0)&&(icol>=0)){
-                F=F+(real(conj(input->ampl[k])*dens(irow,icol)*input->ampl[l]));
+                F=F+(real(conj(input->ampl[k])*get_entry(irow,icol)*input->ampl[l]));
             }
         }
     }
@@ -517,7 +582,7 @@ void dmatrix::add_reduced_state(int ndec,mati def,veci chlist,state* input, qoci
     else nph=0;
 
     // Reserve memory
-    keysel=new int(nchtotal);
+    keysel=new int[max(nchtotal,1)];
     // For any number of photon loss
     for(ntrace=0;ntrace<=nph;ntrace++){
         selhash.clear();
@@ -627,6 +692,9 @@ void dmatrix:: add_state_cond(int ndec, mati def,state *in_state,qocircuit *qoc)
     int    j;                        // Aux index
     int    k;                        // Aux index
     int    l;                        // Aux index
+//  Batch of post-selected states
+    int    nbatch;                   // Number of states in the batch
+    state *batch[DEFSUMBATCH];       // Post-selected states waiting to be added
 
 
     if(ndec>0){
@@ -667,6 +735,7 @@ void dmatrix:: add_state_cond(int ndec, mati def,state *in_state,qocircuit *qoc)
 
         // Initialize projector aux variables.
         nprj=0;
+        nbatch=0;
         keyprj=new int[ndec*qoc->nm*qoc->ns]();
 
         // From the detector definition of conditional detection create
@@ -748,12 +817,18 @@ void dmatrix:: add_state_cond(int ndec, mati def,state *in_state,qocircuit *qoc)
                         prj=new projector(in_state->nph, qoc->num_levels(),1,in_state->vis);
                         prj->add_term(1.0,select,qoc);
 
-                        // Apply the projector to the input state and store the result
+                        // Apply the projector to the input state and store the result.
+                        // Results are added to the matrix in batches.
                         newstate=in_state->post_selection(prj,qoc);
-                        this->sum_state(newstate);
+                        batch[nbatch]=newstate;
+                        nbatch=nbatch+1;
+                        if(nbatch==DEFSUMBATCH){
+                            this->sum_states(nbatch,batch);
+                            for(i=0;i<nbatch;i++) delete batch[i];
+                            nbatch=0;
+                        }
 
                         // Free memory
-                        delete newstate;
                         delete prj;
                     }
                 }
@@ -782,6 +857,10 @@ void dmatrix:: add_state_cond(int ndec, mati def,state *in_state,qocircuit *qoc)
         // At the end of the loop free memory
         delete[] pol;
 
+        // Add the remaining states
+        this->sum_states(nbatch,batch);
+        for(i=0;i<nbatch;i++) delete batch[i];
+
         // Free memory;
         delete[] keyprj;
         selhash.clear();
@@ -802,34 +881,145 @@ void dmatrix:: add_state_cond(int ndec, mati def,state *in_state,qocircuit *qoc)
 //----------------------------------------
 void dmatrix:: sum_state(state *newstate){
 //  state *newstate                // New state to be added to the density matrix.
+
+
+    sum_states(1,&newstate);
+}
+
+
+//----------------------------------------
+//
+//  Adds a batch of states.
+//  Each block is updated with the
+//  product of the amplitudes of all
+//  the states in its sectors.
+//
+//----------------------------------------
+void dmatrix:: sum_states(int nst, state **newstates){
+//  int     nst;                   // Number of states
+//  state **newstates              // New states to be added to the density matrix.
 //  Variables
-    cmplx P;                      // Probability
+    int    nk;                     // Total number of kets in the batch
+    int    n;                      // Sector
+    int    u;                      // Index of a ket in the amplitudes of its sector
+    int    rmax;                   // Larger position in the row sector
+    int    cmax;                   // Larger position in the column sector
+    int   *irow;                   // Row of each ket of the batch
+    int   *nu;                     // Number of different kets of the batch in each sector
+    int   *sseen;                  // Last state with kets in each sector
+    int   *ssec;                   // Sectors with kets of the present state
+    int    ns;                     // Number of sectors with kets of the present state
+    int   *spair;                  // Pairs of sectors with kets of a same state. 1=Yes/0=No
+    veci  *urow;                   // Row of each ket in the amplitudes of each sector
+    matc  *A;                      // Amplitudes by sector. One column by state
+    matc   U;                      // Update of a block
+    matc  *b;                      // Block to update
+//  Hash table
+    thash  uhash;                  // Index in the amplitudes of its sector of each row
+    thash::const_iterator vuhash;  // Hash iterator
 //  Auxiliary index
-    int    irow;                   // Index of rows
-    int    icol;                   // Index of columns
+    int    is;                     // State index
+    int    sr;                     // Row sector index
+    int    sc;                     // Column sector index
+    int    i;                      // Aux index
+    int    j;                      // Aux index
     int    k;                      // Aux index
-    int    l;                      // Aux index
 
 
-    // For each ket in the state we add it to the dicctionary and
-    // assign a row to it if it didn't exist before.  We obtain its
-    // row otherwise.
+    if(nst<=0) return;
     if(dicc->nket==0){
         delete dicc;
-        dicc=new ket_list(newstate->nph,newstate->nlevel,mem,newstate->vis);
+        dicc=new ket_list(newstates[0]->nph,newstates[0]->nlevel,mem,newstates[0]->vis);
     }
 
-    for(k=0;k<newstate->nket;k++){
-        irow=dicc->add_ket(newstate->ket[k]);
-        for(l=0;l<newstate->nket;l++){
-            icol=dicc->add_ket(newstate->ket[l]);
+    // For each ket in the states we add it to the dicctionary and
+    // assign a row to it if it didn't exist before.  We obtain its
+    // row otherwise. This is done only once by ket.
+    nk=0;
+    for(is=0;is<nst;is++) nk=nk+newstates[is]->nket;
+    irow=new int[max(nk,1)];
+    k=0;
+    for(is=0;is<nst;is++){
+        for(i=0;i<newstates[is]->nket;i++){
+            irow[k]=store_ket(newstates[is]->ket[i]);
+            k=k+1;
+        }
+    }
 
-            P=(conj(newstate->ampl[k])*newstate->ampl[l]);
+    // Count the different kets of each sector
+    nu=new int[nsec]();
+    k=0;
+    for(is=0;is<nst;is++){
+        for(i=0;i<newstates[is]->nket;i++){
+            if((abs(newstates[is]->ampl[i])>xcut)&&(uhash.find(irow[k])==uhash.end())){
+                n=ksec(irow[k]);
+                uhash[irow[k]]=nu[n];
+                nu[n]=nu[n]+1;
+            }
+            k=k+1;
+        }
+    }
 
-            // We update the density coefficient at the proper row and column
-            if(abs(P)>xcut) dens(irow,icol)=dens(irow,icol)+P;
+    // Gather the amplitudes by sector. The pairs of sectors
+    // where a same state has kets are also recorded.
+    // Only their blocks receive a contribution.
+    A=new matc[nsec];
+    urow=new veci[nsec];
+    for(n=0;n<nsec;n++){
+        A[n].setZero(nu[n],nst);
+        urow[n].resize(nu[n]);
+    }
+    sseen=new int[nsec];
+    for(n=0;n<nsec;n++) sseen[n]=-1;
+    ssec=new int[nsec];
+    spair=new int[nsec*nsec]();
+    k=0;
+    for(is=0;is<nst;is++){
+        ns=0;
+        for(i=0;i<newstates[is]->nket;i++){
+            vuhash=uhash.find(irow[k]);
+            if(vuhash!=uhash.end()){
+                n=ksec(irow[k]);
+                u=vuhash->second;
+                A[n](u,is)=newstates[is]->ampl[i];
+                urow[n](u)=irow[k];
+                if(sseen[n]!=is){
+                    sseen[n]=is;
+                    ssec[ns]=n;
+                    ns=ns+1;
+                }
+            }
+            k=k+1;
         }
+        for(i=0;i<ns;i++) for(j=0;j<ns;j++) spair[ssec[i]*nsec+ssec[j]]=1;
     }
+
+    // Update each block with the product of the amplitudes
+    for(sr=0;sr<nsec;sr++){
+    for(sc=0;sc<nsec;sc++){
+        if(spair[sr*nsec+sc]==1){
+            U=A[sr].conjugate()*A[sc].transpose();
+            rmax=0;
+            cmax=0;
+            for(i=0;i<nu[sr];i++) rmax=max(rmax,kpos(urow[sr](i)));
+            for(j=0;j<nu[sc];j++) cmax=max(cmax,kpos(urow[sc](j)));
+            b=get_block(sr,sc,rmax,cmax);
+            for(j=0;j<nu[sc];j++){
+                for(i=0;i<nu[sr];i++){
+                    (*b)(kpos(urow[sr](i)),kpos(urow[sc](j)))+=U(i,j);
+                }
+            }
+        }
+    }}
+
+    // Free memory
+    delete[] irow;
+    delete[] nu;
+    delete[] sseen;
+    delete[] ssec;
+    delete[] spair;
+    delete[] A;
+    delete[] urow;
 }
 
 
@@ -961,19 +1151,19 @@ dmatrix *dmatrix::relabel(mati label_idx, qocircuit *qoc){
         }
 
         //Store entry
-        irow=newdmat->dicc->add_ket(rowocc);
-        icol=newdmat->dicc->add_ket(colocc);
+        irow=newdmat->store_ket(rowocc);
+        icol=newdmat->store_ket(colocc);
 
         // Diagonal element
         if((isempty==false)&&(i==j)){
-            newdmat->dens(irow,icol)=newdmat->dens(irow,icol)+dens(i,j);
-            prob(i)= prob(i)+real(dens(i,i));
+            newdmat->add_entry(irow,icol,get_entry(i,j));
+            prob(i)= prob(i)+real(get_entry(i,i));
         }
 
         // Probability by common labels
         if((isempty==false)&&(irow==icol)&&(i!=j)){
-            prob(i)= prob(i)+real(dens(j,j));
-            prob(j)= prob(j)+real(dens(i,i));
+            prob(i)= prob(i)+real(get_entry(j,j));
+            prob(j)= prob(j)+real(get_entry(i,i));
         }
 
         // Free memory
@@ -982,9 +1172,11 @@ dmatrix *dmatrix::relabel(mati label_idx, qocircuit *qoc){
     }}}
 
     // OFF DIAGONAL ELEMENTS
+    // Only the non-empty blocks are visited. All the new entries
+    // of the dictionary have already been stored.
     for(i=0;i<dicc->nket;i++){
     for(j=0;j<dicc->nket;j++){
-    if(ketcompatible(i,j,label_idx,qoc)==1){
+    if((blk[ksec(i)*nsec+ksec(j)]!=nullptr)&&(ketcompatible(i,j,label_idx,qoc)==1)){
         // Reserve memory
         rowocc=new int[dicc->nlevel]();
         colocc=new int[dicc->nlevel]();
@@ -1023,14 +1215,14 @@ dmatrix *dmatrix::relabel(mati label_idx, qocircuit *qoc){
         }
 
         //Store entry
-        irow=newdmat->dicc->add_ket(rowocc);
-        icol=newdmat->dicc->add_ket(colocc);
+        irow=newdmat->store_ket(rowocc);
+        icol=newdmat->store_ket(colocc);
         faci=0.0;
         facj=0.0;
 
-        if(prob(i)>xcut) faci=sqrt(real(dens(i,i)))/sqrt(prob(i));
-        if(prob(j)>xcut) facj=sqrt(real(dens(j,j)))/sqrt(prob(j));
-        if((isempty==false)&&(irow!=icol)) newdmat->dens(irow,icol)=newdmat->dens(irow,icol)+faci*facj*dens(i,j);
+        if(prob(i)>xcut) faci=sqrt(real(get_entry(i,i)))/sqrt(prob(i));
+        if(prob(j)>xcut) facj=sqrt(real(get_entry(j,j)))/sqrt(prob(j));
+        if((isempty==false)&&(irow!=icol)) newdmat->add_entry(irow,icol,faci*facj*get_entry(i,j));
 
         // Free memory
         delete[] rowocc;
@@ -1205,6 +1397,172 @@ int dmatrix::ketcompatible(int A, int B, mati label_idx, qocircuit *qoc){
 }
 
 
+//-------------------------------------------------------------------------------------------------
+//
+// Adds a ket to the dictionary. New kets are assigned
+// to the sector of their number of photons.
+// Auxiliary private function. Not intended for external use.
+//
+//-------------------------------------------------------------------------------------------------
+int dmatrix::store_ket(int *occ){
+//  int *occ;          // Occupation of the ket
+//  Variables
+    int    index;      // Row/column of the ket
+    int    n;          // Number of photons of the ket
+    int    newsec;     // New number of sectors
+    int    newmem;     // New size of the sector definitions
+    int   *newsize;    // New number of entries in each sector
+    matc **newblk;     // New block list
+//  Auxiliary index
+    int    i;          // Aux index
+    int    j;          // Aux index
+
+
+    index=dicc->add_ket(occ);
+    if(index>=nkey){
+        // Number of photons
+        n=0;
+        for(i=0;i<dicc->nlevel;i++) if(occ[i]>0) n=n+occ[i];
+
+        // Create the sectors up to n photons if needed
+        if(n>=nsec){
+            newsec=n+1;
+            newsize=new int[newsec]();
+            newblk=new matc*[newsec*newsec]();
+            for(i=0;i<nsec;i++){
+                newsize[i]=ssize[i];
+                for(j=0;j<nsec;j++) newblk[i*newsec+j]=blk[i*nsec+j];
+            }
+            if(ssize!=nullptr) delete[] ssize;
+            if(blk!=nullptr) delete[] blk;
+            ssize=newsize;
+            blk=newblk;
+            nsec=newsec;
+        }
+
+        // Assign a position in the sector
+        if(nkey>=ksec.size()){
+            newmem=max(max(2*(int)ksec.size(),nkey+1),mem);
+            ksec.conservativeResize(newmem);
+            kpos.conservativeResize(newmem);
+        }
+        ksec(nkey)=n;
+        kpos(nkey)=ssize[n];
+        ssize[n]=ssize[n]+1;
+        nkey=nkey+1;
+    }
+
+    return index;
+}
+
+
+//----------------------------------------
+//
+//  Returns an entry of the density matrix
+//
+//----------------------------------------
+cmplx dmatrix::get_entry(int irow, int icol){
+//  int irow;          // Row of the entry
+//  int icol;          // Column of the entry
+//  Variables
+    matc  *b;          // Block of the entry
+
+
+    if((irow<0)||(icol<0)||(irow>=nkey)||(icol>=nkey)) return 0.0;
+    b=blk[ksec(irow)*nsec+ksec(icol)];
+    if(b==nullptr) return 0.0;
+    if((kpos(irow)>=b->rows())||(kpos(icol)>=b->cols())) return 0.0;
+
+    return (*b)(kpos(irow),kpos(icol));
+}
+
+
+//----------------------------------------
+//
+//  Adds a value to an entry of the
+//  density matrix. Blocks are created
+//  and enlarged when needed.
+//
+//----------------------------------------
+void dmatrix::add_entry(int irow, int icol, cmplx value){
+//  int   irow;        // Row of the entry
+//  int   icol;        // Column of the entry
+//  cmplx value;       // Value to be added
+//  Variables
+    matc  *b;          // Block of the entry
+
+
+    if(value==0.0) return;
+    b=get_block(ksec(irow),ksec(icol),kpos(irow),kpos(icol));
+    (*b)(kpos(irow),kpos(icol))=(*b)(kpos(irow),kpos(icol))+value;
+}
+
+
+//----------------------------------------
+//
+//  Returns a block of the density matrix.
+//  It is created or enlarged if needed.
+//
+//----------------------------------------
+matc *dmatrix::get_block(int sr, int sc, int r, int c){
+//  int   sr;          // Sector of the rows
+//  int   sc;          // Sector of the columns
+//  int   r;           // Row position that has to be contained
+//  int   c;           // Column position that has to be contained
+//  Variables
+    int    ib;         // Index of the block
+    int    nr;         // Present number of rows of the block
+    int    nc;         // Present number of columns of the block
+    int    newr;       // New number of rows of the block
+    int    newc;       // New number of columns of the block
+    matc  *b;          // Block
+
+
+    // Create the block
+    ib=sr*nsec+sc;
+    if(blk[ib]==nullptr){
+        blk[ib]=new matc();
+        blk[ib]->setZero(max(max(DEFBLKDIM,ssize[sr]),r+1),max(max(DEFBLKDIM,ssize[sc]),c+1));
+    }
+
+    // Enlarge the block
+    b=blk[ib];
+    nr=b->rows();
+    nc=b->cols();
+    if((r>=nr)||(c>=nc)){
+        newr=nr;
+        newc=nc;
+        if(r>=nr) newr=max(2*nr,r+1);
+        if(c>=nc) newc=max(2*nc,c+1);
+        b->conservativeResize(newr,newc);
+        b->bottomRows(newr-nr).setZero();
+        b->topRightCorner(nr,newc-nc).setZero();
+    }
+
+    return b;
+}
+
+
+//----------------------------------------
+//
+//  Frees the memory of the blocks
+//
+//----------------------------------------
+void dmatrix::free_blocks(){
+//  Auxiliary index
+    int    i;          // Aux index
+
+
+    for(i=0;i<nsec*nsec;i++) if(blk[i]!=nullptr) delete blk[i];
+    if(blk!=nullptr) delete[] blk;
+    if(ssize!=nullptr) delete[] ssize;
+    nsec=0;
+    nkey=0;
+    blk=nullptr;
+    ssize=nullptr;
+}
+
+
 //----------------------------------------------------
 //
 //  Adds a conditional detection defined in the
@@ -31,9 +31,12 @@ public:
     double trace();                                               // Calculates trace of the density matrix
     void   normalize();                                           // Normalize to trace=1 density matrix
     void   add(dmatrix *addm);                                    // Sum two compatible density matrix
+    void   merge(dmatrix *addm);                                  // Merges the states accumulated in another compatible density matrix
     double fidelity(state* input);                                // Calculate the Fidelity of a density matrix with respect to a state.
     double get_result(mati def,qocircuit *qoc);                   // Gets the probability of an event defined by def.
     p_bin *get_pbin();                                            // Returns the diagonal elements of a density matrix as a set of probability bins
+    cmplx  get_entry(int irow, int icol);                         // Returns an entry of the density matrix
+    void   add_entry(int irow, int icol, cmplx value);            // Adds a value to an entry of the density matrix
 
     // Update matrix operations
     void add_state(state *newrun, qocircuit *qoc);                // Adds new state to the density matrix according with the detector definitions in qoc
@@ -41,6 +44,7 @@ public:
     void add_reduced_state(int ndec,mati def,veci chlist,state* input, qocircuit *qoc); // Adds a conditional detection and traces out channels
     void add_state_cond(int ndec, mati def,state *in_state,qocircuit *qoc);             // Adds a conditional detection
     void sum_state(state *newstate);                              // Adds new state to the density matrix
+    void sum_states(int nst, state **newstates);                  // Adds a batch of states to the density matrix
     dmatrix *calc_measure(qocircuit *qoc);                        // Adds a conditional detection from sampling results
     dmatrix *calc_measure(qodev *dev);                            // Adds a conditional detection from sampling results (uses qodev instead of qocircuit)
     dmatrix *get_counts(qocircuit *qoc);                          // Returns a density matrix independent of the wave packet degrees of freedom
@@ -67,6 +71,9 @@ protected:
     // Auxiliary function. (This ones can not be private).
     void create_dmtx(int i_mem);                                              // Create density matrix auxiliary function
     int ketcompatible(state* A, state*B,mati pack_idx,qocircuit *qoc);        // Check ket "compatibility"
+    int store_ket(int *occ);                                                  // Adds a ket to the dictionary and assigns it a sector
+    void free_blocks();                                                       // Frees the memory of the matrix blocks
+    matc *get_block(int sr, int sc, int r, int c);                            // Returns a block creating or enlarging it if needed
 };
 ***********************************************************************************/
 
@@ -74,6 +81,8 @@ protected:
 #include "pbin.h"
 
 const int DEFMATDIM= 100; ///< Default density matrix dimension
+const int DEFBLKDIM= 8;   ///< Default initial dimension of a density matrix block
+const int DEFSUMBATCH= 32;///< Default number of post-selected states added together to the density matrix
 const int DEFWIDTH = 6;   ///< Default number of spaces to print matrix entries
 
 
@@ -100,7 +109,16 @@ public:
     int mem;            ///< Reserved memory for the matrix dictionaries.
 
     ket_list *dicc;     ///< Base elements that correspond with each of the rows in the matrix.
-    matc     dens;      ///< Density matrix coefficients.
+
+    // The matrix is stored by blocks. Sector n contains the dictionary entries with n photons and
+    // block (n,m) the coefficients between sectors n and m. Blocks are only created when they have
+    // a non-zero coefficient and they grow on demand.
+    int      nsec;      ///< Number of photon number sectors.
+    int      nkey;      ///< Number of dictionary entries with an assigned sector.
+    int     *ssize;     ///< Number of dictionary entries in each sector.
+    veci     ksec;      ///< Sector of each dictionary entry.
+    veci     kpos;      ///< Position of each dictionary entry in the blocks of its sector.
+    matc   **blk;       ///< Density matrix coefficients by blocks. nullptr if the block is empty.
 
 
     // Management functions
@@ -115,7 +133,8 @@ public:
     */
     dmatrix();
     /**
-    *  Creates a density matrix object where the maximum dimension of the density matrix is set by its number of rows.
+    *  Creates a density matrix object reserving space in its dictionary for a number of rows. The matrix is stored by photon number
+    *  blocks that are created and enlarged on demand.
     *
     *  @param int i_mem Row number of the density matrix. (Internal memory).
     *  @ingroup Dens_management
@@ -168,6 +187,14 @@ public:
     */
     void   add(dmatrix *addm);
     /**
+    *  Merges the states accumulated in another compatible density matrix. The dictionaries are merged by ket and the coefficients
+    *  and number of states are summed. The result is the same as if all the states had been added to this matrix.
+    *
+    *  @param dmatrix *addm Density matrix to be merged.
+    *  @ingroup Dens_basic
+    */
+    void   merge(dmatrix *addm);
+    /**
     *  Calculates the fidelity of a density matrix with respect a reference state.
     *
     *  @param state *input Reference state to calculate the fidelity of the density matrix.
@@ -200,6 +227,24 @@ public:
     *  @ingroup Dens_basic
     */
     p_bin *get_pbin();
+    /**
+    *  Returns an entry of the density matrix.
+    *
+    *  @param int irow  Row of the entry. Position of the ket in the dictionary.
+    *  @param int icol  Column of the entry. Position of the ket in the dictionary.
+    *  @return Value of the entry. Zero if it has not been stored.
+    *  @ingroup Dens_basic
+    */
+    cmplx  get_entry(int irow, int icol);
+    /**
+    *  Adds a value to an entry of the density matrix. The block of the entry is created or enlarged if needed.
+    *
+    *  @param int irow     Row of the entry. Position of the ket in the dictionary.
+    *  @param int icol     Column of the entry. Position of the ket in the dictionary.
+    *  @param cmplx value  Value to be added.
+    *  @ingroup Dens_basic
+    */
+    void   add_entry(int irow, int icol, cmplx value);
 
     // Update matrix operations
     /** @defgroup Dens_update Density matrix update operations
@@ -259,6 +304,15 @@ public:
     */
     void sum_state(state *newstate);
     /**
+    *  Adds a batch of states to the density matrix. The row of each ket is resolved once and the amplitudes are gathered by
+    *  photon number sector. Each block is then updated with a single rank-k product. Kets with an amplitude below xcut are not added.
+    *
+    *  @param int nst  Number of states.
+    *  @param state **newstates List of states to be added to the density matrix.
+    *  @ingroup Dens_update
+    */
+    void sum_states(int nst, state **newstates);
+    /**
     *  Calculate measure. It means to remove degrees of freedom depending on the circuit configuration of the detectors. ( Circuit version ).
     *
     *  @param qocircuit *qoc Circuit to which the density matrix is related.
@@ -459,4 +513,34 @@ protected:
     *  @ingroup Dens_aux
     */
     void aux_prnt_mtx(int format, double thresh, qocircuit *qoc);
+    /**
+    *  Adds a ket to the dictionary of the density matrix. New kets are assigned to the sector
+    *  of their number of photons. <br>
+    *  <b> Intended for internal use of the library. </b>
+    *
+    *  @param int *occ Occupation of each level of the ket.
+    *  @return Row/column of the ket in the density matrix.
+    *  @ingroup Dens_aux
+    */
+    int store_ket(int *occ);
+    /**
+    *  Frees the memory of the density matrix blocks and of the sector definitions. <br>
+    *  <b> Intended for internal use of the library. </b>
+    *
+    *  @ingroup Dens_aux
+    */
+    void free_blocks();
+    /**
+    *  Returns a block of the density matrix. The block is created if it is empty and enlarged if it does not contain
+    *  the requested entry. <br>
+    *  <b> Intended for internal use of the library. </b>
+    *
+    *  @param int sr  Sector of the rows.
+    *  @param int sc  Sector of the columns.
+    *  @param int r   Row position in the block that has to be contained.
+    *  @param int c   Column position in the block that has to be contained.
+    *  @return Block of the density matrix.
+    *  @ingroup Dens_aux
+    */
+    matc *get_block(int sr, int sc, int r, int c);
 };
@@ -19,7 +19,7 @@
 mthread::mthread(){
 
 
-    sim=new simulator();
+    init(DEFSIMMEM,0,0);
 }
 
 
@@ -32,18 +32,64 @@ mthread::mthread(int mem){
 //  int i_mem            // Number of memory positions reserved.
 
 
-    sim=new simulator(mem);
+    init(mem,0,0);
 }
 
 
+//----------------------------------------
+//
+//  Create a multi-thread "server" for works
+//  with a given number of workers and
+//  maximum number of queued works.
+//
+//----------------------------------------
+mthread::mthread(int mem, int nworkers, int i_maxqueue){
+//  int mem              // Number of memory positions reserved.
+//  int nworkers         // Number of worker threads.
+//  int i_maxqueue       // Maximum number of works in the queues.
+
+
+    init(mem,nworkers,i_maxqueue);
+}
+
 
 //----------------------------------------
 //
-//  Destroy a multi-thread server
+//  Destroy a multi-thread server.
+//  Works not started are discarded.
+//  Works already running are finished.
 //
 //----------------------------------------
 mthread::~mthread(){
-
+//  Variables
+    wtask work;              // Discarded work
+//  Index
+    int   iw;                // Worker index
+
+
+    // Stop the workers
+    {
+        lock_guard<mutex> lock(mtx);
+        stop=true;
+    }
+    cv_work.notify_all();
+    for(iw=0;iw<(int)workers.size();iw++) workers[iw].join();
+
+    // Free the works not started and the results not received
+    for(iw=0;iw<(int)wqueue.size();iw++){
+        while(!wqueue[iw].empty()){
+            work=wqueue[iw].front();
+            wqueue[iw].pop_front();
+            delete work.input;
+            delete work.qoc;
+        }
+    }
+    for(auto &res : results){
+        delete res.second.input;
+        delete res.second.qoc;
+        delete res.second.output;
+    }
+    for(iw=0;iw<(int)wdmat.size();iw++) delete wdmat[iw];
 
     delete sim;
 }
@@ -51,56 +97,186 @@ mthread::~mthread(){
 
 //----------------------------------------
 //
-//  Send a work to the server
+//  Initialize the server and start
+//  the pool of workers.
 //
 //----------------------------------------
-void mthread::send_work(state *input, qocircuit *qoc, int method){
+void mthread::init(int mem, int nworkers, int i_maxqueue){
+//  int mem              // Number of memory positions reserved.
+//  int nworkers         // Number of worker threads.
+//  int i_maxqueue       // Maximum number of works in the queues.
+//  Index
+    int iw;              // Worker index
+
+
+    // Configure the server
+    sim=new simulator(mem);
+    if(nworkers<1) nworkers=(int)thread::hardware_concurrency();
+    if(nworkers<1) nworkers=1;
+    maxqueue=i_maxqueue;
+    if(maxqueue<1) maxqueue=4*nworkers;
+    nqueued=0;
+    nextw=0;
+    nextid=0;
+    ndwork=0;
+    stop=false;
+
+    // Start the workers
+    wqueue.resize(nworkers);
+    for(iw=0;iw<nworkers;iw++) wdmat.push_back(new dmatrix());
+    for(iw=0;iw<nworkers;iw++) workers.push_back(thread(&mthread::worker,this,iw));
+}
+
+
+//----------------------------------------
+//
+//  Send a work to the server.
+//  Works are distributed between the queues
+//  of the workers in round robin. If the queues
+//  are full the caller waits until a worker
+//  takes a work.
+//
+//----------------------------------------
+long int mthread::send_work(state *input, qocircuit *qoc, int method){
 //  state     *input;       // Input state to be run
-//  simulator *sim;         // Simulator employed to calculate the output from input.
 //  qocircuit *qoc;         // Circuit employed to run the simulation
 //  int        method;      // Simulation method
 //  Variables
-    promise<qelem> paux;    // Promise of a future result.
-    state    *copyinput;    // Internal copy of the input state
-    qocircuit*copyqoc;      // Internal copy of the circuit
+    wtask      work;        // Work to be queued
 
 
     // Make internal copies of variables than can be modified between runs
     // to maintain a record of their state when this routine is called.
     // Note that the simulator usually is not modified between runs.
-    copyinput=input->clone();
-    copyqoc=qoc->clone();
+    work.input=input->clone();
+    qoc->compile();
+    work.qoc=qoc->clone();
+    work.method=method;
+    work.accum=false;
+
+    {
+        // Wait for space in the queues
+        unique_lock<mutex> lock(mtx);
+        cv_space.wait(lock,[this]{ return nqueued<maxqueue; });
+
+        // Queue the work
+        work.id=nextid;
+        nextid=nextid+1;
+        wqueue[nextw].push_back(work);
+        nextw=(nextw+1)%(int)wqueue.size();
+        nqueued=nqueued+1;
+        pending.push_back(work.id);
+    }
+    cv_work.notify_one();
+
+    return work.id;
+}
 
-    // Pus into the queue the promise of future result.
-    fqueue.push_back(paux.get_future());
-    // Create a new thread and execute it.
-    threads.push_back(thread(new_thread, copyinput, copyqoc, sim, method, move(paux)));
+
+//----------------------------------------
+//
+//  Send a work to the server whose output
+//  is accumulated in the density matrix
+//  of the worker that runs it.
+//
+//----------------------------------------
+long int mthread::send_dwork(state *input, qocircuit *qoc, int method){
+//  state     *input;       // Input state to be run
+//  qocircuit *qoc;         // Circuit employed to run the simulation
+//  int        method;      // Simulation method
+//  Variables
+    wtask      work;        // Work to be queued
+
+
+    // Make internal copies of variables than can be modified between runs
+    work.input=input->clone();
+    qoc->compile();
+    work.qoc=qoc->clone();
+    work.method=method;
+    work.accum=true;
+
+    {
+        // Wait for space in the queues
+        unique_lock<mutex> lock(mtx);
+        cv_space.wait(lock,[this]{ return nqueued<maxqueue; });
+
+        // Queue the work. There is no result to be received.
+        work.id=nextid;
+        nextid=nextid+1;
+        wqueue[nextw].push_back(work);
+        nextw=(nextw+1)%(int)wqueue.size();
+        nqueued=nqueued+1;
+        ndwork=ndwork+1;
+    }
+    cv_work.notify_one();
+
+    return work.id;
+}
+
+
+//----------------------------------------
+//
+//  Reduce the density matrices accumulated
+//  by the workers into a single one.
+//
+//----------------------------------------
+dmatrix *mthread::reduce_dmat(){
+//  Variables
+    dmatrix *total;           // Reduced density matrix
+//  Index
+    int      iw;              // Worker index
+
+
+    // Wait for the accumulated works to be finished
+    {
+        unique_lock<mutex> lock(mtx);
+        cv_done.wait(lock,[this]{ return ndwork==0; });
+    }
+
+    // Merge the density matrices of the workers by ket
+    // and empty them for the next accumulation.
+    // No worker is accumulating at this point.
+    total=new dmatrix();
+    for(iw=0;iw<(int)wdmat.size();iw++){
+        total->merge(wdmat[iw]);
+        wdmat[iw]->clear();
+    }
+
+    return total;
 }
 
 
 //----------------------------------------
 //
 //  Receive a work from the server.
-//  Work results are tried to be read in launch order.
+//  Work results are read in launch order.
 //  If a work is not finished the main process is
 //  suspended to wait for the task to end.
 //
 //----------------------------------------
 state *mthread::receive_work(){
 //  Values
+    long int id;              // Identifier of the work
     qelem receive;            // Element to be received as a result of a work
 
 
-    // Get the first value from the vector of future results once it is ready.
-    receive=fqueue.front().get();
-    auto &th=threads.front();
+    {
+        unique_lock<mutex> lock(mtx);
+        if(pending.empty()){
+            cout << "receive_work: Warning! There are no works pending." << endl;
+            return nullptr;
+        }
 
-    // Wait to the thread to end
-    th.join();
+        // Wait for the oldest work to be finished
+        id=pending.front();
+        cv_done.wait(lock,[this,id]{ return results.count(id)>0; });
 
-    // Erase the value and the thread information from their corresponding vectors.
-    fqueue.erase(fqueue.begin());
-    threads.erase(threads.begin());
+        // Remove the work from the lists
+        receive=results[id];
+        results.erase(id);
+        pending.pop_front();
+        finished.erase(find(finished.begin(),finished.end(),id));
+    }
 
     // Delete the unneeded internal copies of the input state and circuit
     // once the calculation is finished.
@@ -114,25 +290,172 @@ state *mthread::receive_work(){
 
 //----------------------------------------
 //
-//  Work to be carried by a thread.
+//  Receive the first work that finishes.
+//  If no work is finished the main process is
+//  suspended to wait for any task to end.
 //
 //----------------------------------------
-void new_thread(state *input, qocircuit *qoc, simulator *sim, int method, promise<qelem> p){
-//  state     *input;       // Input state to be run
-//  qocircuit *qoc;         // Circuit employed to run the simulation
-//  simulator *sim;         // Simulator employed to calculate the output from input.
-//  int        method;      // Simulation method
-//  promise<qelem> p        // Promise of future result variable
-//  Variables
-    qelem send;             // Element to be sent as a result
+tuple<long int, state*> mthread::receive_any(){
+//  Values
+    long int id;              // Identifier of the work
+    qelem receive;            // Element to be received as a result of a work
 
 
-    // Calculate and compose the result to be sent once the task is finished
-    send.input=input;
-    send.output=sim->run(input,qoc,method);
-    send.qoc=qoc;
+    {
+        unique_lock<mutex> lock(mtx);
+        if(pending.empty()) return {-1,nullptr};
 
-    // Set the value of the promise to its definitive result.
-    p.set_value(send);
+        // Wait for any work to be finished
+        cv_done.wait(lock,[this]{ return !finished.empty(); });
+
+        // Remove the work from the lists
+        id=finished.front();
+        receive=results[id];
+        results.erase(id);
+        finished.pop_front();
+        pending.erase(find(pending.begin(),pending.end(),id));
+    }
+
+    // Delete the unneeded internal copies of the input state and circuit
+    delete receive.input;
+    delete receive.qoc;
+
+    // Return the identifier and output state
+    return {id,receive.output};
 }
 
+
+//----------------------------------------
+//
+//  Cancel a work that has not started yet.
+//
+//----------------------------------------
+bool mthread::cancel_work(long int id){
+//  long int id;              // Identifier of the work
+//  Values
+    bool  found;              // Has the work been found?
+    wtask work;               // Canceled work
+//  Index
+    int   iw;                 // Worker index
+
+
+    {
+        lock_guard<mutex> lock(mtx);
+
+        // Look for the work in the queues
+        found=false;
+        for(iw=0;(iw<(int)wqueue.size())&&(!found);iw++){
+            auto it=find_if(wqueue[iw].begin(),wqueue[iw].end(),[id](const wtask &w){ return w.id==id; });
+            if(it!=wqueue[iw].end()){
+                work=*it;
+                wqueue[iw].erase(it);
+                found=true;
+            }
+        }
+        if(!found) return false;
+
+        // Remove it from the pending list or from the accumulated works
+        nqueued=nqueued-1;
+        if(work.accum) ndwork=ndwork-1;
+        else pending.erase(find(pending.begin(),pending.end(),id));
+    }
+    cv_space.notify_one();
+    if(work.accum) cv_done.notify_all();
+
+    // Delete the internal copies
+    delete work.input;
+    delete work.qoc;
+
+    return true;
+}
+
+
+//----------------------------------------
+//
+//  Take a work from the front of the own queue
+//  or steal one from the back of another queue.
+//  The caller owns the lock.
+//
+//----------------------------------------
+bool mthread::take_work(int iw, wtask &work){
+//  int   iw;                // Worker index
+//  wtask work;              // Work taken. Output variable
+//  Variables
+    int   nw;                // Number of workers
+//  Auxiliary index
+    int   i;                 // Aux index
+    int   j;                 // Aux index
+
+
+    nw=(int)wqueue.size();
+    if(!wqueue[iw].empty()){
+        work=wqueue[iw].front();
+        wqueue[iw].pop_front();
+        return true;
+    }
+
+    for(i=1;i<nw;i++){
+        j=(iw+i)%nw;
+        if(!wqueue[j].empty()){
+            work=wqueue[j].back();
+            wqueue[j].pop_back();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+//----------------------------------------
+//
+//  Loop of a worker thread.
+//
+//----------------------------------------
+void mthread::worker(int iw){
+//  int   iw;                // Worker index
+//  Variables
+    wtask work;              // Work to be carried
+    qelem send;              // Element to be sent as a result
+
+
+    while(true){
+        {
+            // Wait for a work
+            unique_lock<mutex> lock(mtx);
+            cv_work.wait(lock,[this,iw,&work]{ return stop||take_work(iw,work); });
+            if(stop) return;
+            nqueued=nqueued-1;
+        }
+        cv_space.notify_one();
+
+        // Calculate and accumulate the result in the own density matrix
+        if(work.accum){
+            send.output=sim->run(work.input,work.qoc,work.method);
+            wdmat[iw]->add_state(send.output,work.qoc);
+            delete send.output;
+            delete work.input;
+            delete work.qoc;
+
+            {
+                lock_guard<mutex> lock(mtx);
+                ndwork=ndwork-1;
+            }
+            cv_done.notify_all();
+            continue;
+        }
+
+        // Calculate and compose the result
+        send.input=work.input;
+        send.output=sim->run(work.input,work.qoc,work.method);
+        send.qoc=work.qoc;
+
+        // Publish the result
+        {
+            lock_guard<mutex> lock(mtx);
+            results[work.id]=send;
+            finished.push_back(work.id);
+        }
+        cv_done.notify_all();
+    }
+}
@@ -18,26 +18,50 @@
 ************************************************************************************
 
 class mthread{
-    vector<thread> threads;         /// Vector of active threads
-    vector<future<qelem>> fqueue;   /// Vector of future results
+    vector<thread> workers;         /// Pool of worker threads
+    vector<deque<wtask>> wqueue;    /// Queue of pending works of each worker
+    unordered_map<long int,qelem> results; /// Finished works not yet received
+    deque<long int> pending;        /// Works sent and not yet received in submission order
+    deque<long int> finished;       /// Finished works in finalization order
+    mutex mtx;                      /// Lock of the server variables
+    condition_variable cv_work;     /// Signals new works or stop to the workers
+    condition_variable cv_space;    /// Signals free space in the queues
+    condition_variable cv_done;     /// Signals a finished work
+    int  nqueued;                   /// Number of works in the queues
+    int  maxqueue;                  /// Maximum number of works in the queues
+    int  nextw;                     /// Next worker to receive a work
+    long int nextid;                /// Identifier of the next work
+    bool stop;                      /// Stop the workers
+    vector<dmatrix*> wdmat;         /// Density matrix accumulated by each worker
+    int  ndwork;                    /// Number of accumulated works not finished
 public:
     // Public functions
     // Management functions
     mthread();                                                     //  Create a multi-thread "server" for works. Memory set by default.
     mthread(int mem);                                              //  Create a multi-thread "server" for works. Memory set by explicitly.
+    mthread(int mem, int nworkers, int maxqueue);                  //  Create a multi-thread "server" for works with a given number of workers and queue size.
     ~mthread();                                                    //  Destroy a multi-thread "server"
 
     // Server work handling methods
-    void send_work(state *input, qocircuit *qoc, int method);      //  Send a work to the server
-    state *receive_work();                                         //  Receive a work from the server.
+    long int send_work(state *input, qocircuit *qoc, int method);  //  Send a work to the server
+    state *receive_work();                                         //  Receive a work from the server in submission order.
+    tuple<long int, state*> receive_any();                         //  Receive the first work that finishes
+    bool cancel_work(long int id);                                 //  Cancel a work that has not started yet
+    long int send_dwork(state *input, qocircuit *qoc, int method); //  Send a work whose output is accumulated in a density matrix
+    dmatrix *reduce_dmat();                                        //  Reduce the density matrices accumulated by the workers
 
+protected:
+    void init(int mem, int nworkers, int i_maxqueue);              //  Start the pool of workers
+    void worker(int iw);                                           //  Loop of a worker thread
+    bool take_work(int iw, wtask &work);                           //  Takes a work from its own queue or steals it from other worker
 };
-
-void new_thread(state *input, qocircuit *qoc, simulator *sim, int method, promise<qelem> p);  // Work to be carried by a thread.
 ***********************************************************************************/
 
 
 #include "sim.h"
+#include <deque>
+#include <mutex>
+#include <condition_variable>
 
 /** @defgroup Mt_sim Multi-thread server
  *  Multi-thread server
@@ -54,6 +78,18 @@ struct qelem{
     qocircuit* qoc;     ///< Circuit to which input and output are referred.
 };
 
+/**
+*  \struct wtask
+*  \brief  Definition of a work waiting in a queue
+*/
+struct wtask{
+    long int id;        ///< Work identifier.
+    state* input;       ///< Input state.
+    qocircuit* qoc;     ///< Circuit to be simulated.
+    int method;         ///< Core method.
+    bool accum;         ///< Accumulate the output in the density matrix of the worker.
+};
+
 
 /** \class mthread
 *   \brief This object is a server of works. Different works can be executed in parallel if an input state, a simulator and a circuit are provided to the works server.
@@ -69,8 +105,22 @@ struct qelem{
 
 class mthread{
     // Private variables
-    vector<thread> threads;         ///< Vector of active threads.
-    vector<future<qelem>> fqueue;   ///< Vector of future results.
+    vector<thread> workers;                 ///< Pool of worker threads.
+    vector<deque<wtask>> wqueue;            ///< Queue of pending works of each worker.
+    unordered_map<long int,qelem> results;  ///< Finished works not yet received.
+    deque<long int> pending;                ///< Works sent and not yet received in submission order.
+    deque<long int> finished;               ///< Finished works in finalization order.
+    mutex mtx;                              ///< Lock of the server variables.
+    condition_variable cv_work;             ///< Signals new works or stop to the workers.
+    condition_variable cv_space;            ///< Signals free space in the queues.
+    condition_variable cv_done;             ///< Signals a finished work.
+    int  nqueued;                           ///< Number of works in the queues.
+    int  maxqueue;                          ///< Maximum number of works in the queues.
+    int  nextw;                             ///< Next worker to receive a work.
+    long int nextid;                        ///< Identifier of the next work.
+    bool stop;                              ///< Stop the workers.
+    vector<dmatrix*> wdmat;                 ///< Density matrix accumulated by each worker.
+    int  ndwork;                            ///< Number of accumulated works not finished.
 
 public:
     simulator* sim;
@@ -91,11 +141,20 @@ public:
     /**
     *  Creates a server object.
     *
-    *  @param int mem Reserved memory for the output expressed as a maximum number of terms.
+    *  @param int mem Initial number of terms reserved for the output. The output grows beyond it when it is full.
     *  @ingroup Serv_management
     */
     mthread(int mem);
     /**
+    *  Creates a server object with a given number of worker threads and maximum number of works waiting in the queues.
+    *
+    *  @param int mem Initial number of terms reserved for the output. The output grows beyond it when it is full.
+    *  @param int nworkers Number of worker threads. If it is smaller than one the number of hardware threads is used.
+    *  @param int maxqueue Maximum number of works waiting to be started. If it is smaller than one four works by worker are allowed.
+    *  @ingroup Serv_management
+    */
+    mthread(int mem, int nworkers, int maxqueue);
+    /**
     *  Destroys a server object.
     *
     *  @ingroup Serv_management
@@ -110,7 +169,8 @@ public:
     */
 
     /**
-    *  Sends a work to the "server".
+    *  Sends a work to the "server". The work is queued to be executed by a pool of worker threads.
+    *  If the queues are full the main process is suspended until a worker takes a work.
     *
     *  @param state     *istate Initial state.
     *  @param simulator *sim    Simulator employed to perform the work.
@@ -122,9 +182,10 @@ public:
     *                            <b style="color:blue;">2</b> = <b>Glynn method</b>:  The calculation is performed using permanents. We use the Balasubramanian/Bax/Franklin/Glynn formula implemented in gray code to calculate the permanents.<br>
     *                            <b style="color:blue;">3</b> = <b>Glynn restricted</b>: Same as the Glynn method but considering only output states of occupations by level zero or one. This restricts but speeds up the output. <br>
     *                            <br>
+    *  @return Identifier of the work.
     *  @ingroup Serv_handling
     */
-    void send_work(state *input, qocircuit *qoc, int method);
+    long int send_work(state *input, qocircuit *qoc, int method);
     /**
     *  Receives a work form the "server" and returns the output state.
     *  If no work has finished then the main process is
@@ -135,20 +196,76 @@ public:
     *  @ingroup Serv_handling
     */
     state *receive_work();
+    /**
+    *  Receives the first work that finishes from the "server". Works already finished are
+    *  returned in finalization order. If no work has finished then the main process is
+    *  suspended until a work ends.
+    *
+    *  @return Returns the identifier of the work and its output state. If there are no works
+    *  pending it returns the identifier -1 and a null output state.
+    *  @ingroup Serv_handling
+    */
+    tuple<long int, state*> receive_any();
+    /**
+    *  Cancels a work that is waiting in the queues. Works already started can not be canceled.
+    *
+    *  @param long int id Identifier of the work.
+    *  @return Returns true if the work has been canceled and false otherwise.
+    *  @ingroup Serv_handling
+    */
+    bool cancel_work(long int id);
+    /**
+    *  Sends a work to the "server" whose output is not returned. Instead, the worker that runs it adds the output state to
+    *  its own density matrix using the detectors of the circuit. Simulation and accumulation run in the workers while the main
+    *  process keeps sending works. The result is obtained with reduce_dmat().
+    *
+    *  @param state     *istate Initial state.
+    *  @param qocircuit *qoc    Circuit to be simulated. Its detectors define the post-selection of the density matrix.
+    *  @param int method  Core method. Same as in send_work().
+    *  @return Identifier of the work.
+    *  @see dmatrix::add_state(state *newrun, qocircuit *qoc);
+    *  @ingroup Serv_handling
+    */
+    long int send_dwork(state *input, qocircuit *qoc, int method);
+    /**
+    *  Waits for all the works sent with send_dwork() and merges the density matrices of the workers by ket.
+    *  The density matrices of the workers are emptied to start a new accumulation.
+    *
+    *  @return Density matrix of all the accumulated works. Its number of states N is the total number of works.
+    *  @ingroup Serv_handling
+    */
+    dmatrix *reduce_dmat();
 
+protected:
+    /**
+    *  Initializes the server variables and starts the pool of workers. <br>
+    *  <b>Not intended to be used outside the library.</b>
+    *
+    *  @param int mem Initial number of terms reserved for the output. The output grows beyond it when it is full.
+    *  @param int nworkers Number of worker threads.
+    *  @param int i_maxqueue Maximum number of works waiting to be started.
+    *  @ingroup Serv_management
+    */
+    void init(int mem, int nworkers, int i_maxqueue);
+    /**
+    *  Loop of a worker thread. It takes works from the queues until the server is destroyed. <br>
+    *  <b>Not intended to be used outside the library.</b>
+    *
+    *  @param int iw Worker index.
+    *  @ingroup Serv_handling
+    */
+    void worker(int iw);
+    /**
+    *  Takes a work from the front of the queue of the worker. If it is empty
+    *  a work is stolen from the back of the queue of another worker. <br>
+    *  The server lock has to be owned by the caller. <br>
+    *  <b>Not intended to be used outside the library.</b>
+    *
+    *  @param int iw Worker index.
+    *  @param wtask work Work taken. <b> Warning! this is an output variable </b>
+    *  @return Returns true if a work has been taken.
+    *  @ingroup Serv_handling
+    */
+    bool take_work(int iw, wtask &work);
 };
 
-/**
-*   Work to be carried by a thread. <br>
-*   <b>Not intended to be used outside the library.</b>
-*
-*  @param state     *istate Initial state.
-*  @param qocircuit *qoc    Circuit to be simulated.
-*  @param simulator *sim    Simulator employed to perform the work.
-*  @param int method  Core method.
-*  @param promise<qelem> p  Index of the promised value with the task finalization.
-*  @see send_work(state *input, qocircuit *qoc, int method);
-*  @ingroup Serv_handling
-*/
-void new_thread(state *input, qocircuit *qoc, simulator *sim, int method, promise<qelem> p);
-
@@ -99,23 +99,16 @@ p_bin *p_bin::clone(){
     // Variable
     p_bin *aux;     // Auxiliary state
     // Auxiliary index
-    int    i;       // Aux index
     int    j;       // Aux index
 
 
     aux=new p_bin(nph, nlevel,maxket);
-    aux->nket=nket;
-    for(i=0;i<nket;i++){
-        aux->p[i]=p[i];
-        for(j=0;j<nlevel;j++){
-            aux->ket[i][j]=ket[i][j];
-        }
-    }
+    copy_kets(aux);
+    memcpy(aux->p,p,nket*sizeof(double));
     for(j=0;j<nlevel;j++){
         aux->vis[j]=vis[j];
     }
 
-    aux->ketindex=ketindex;
     aux->N=N;
     return aux;
 }
@@ -134,6 +127,28 @@ void p_bin::clear(){
 }
 
 
+//----------------------------------------
+//
+//  Increases the number of bins that
+//  can be stored.
+//
+//----------------------------------------
+void p_bin::reserve(int i_maxket){
+//  int i_maxket    // New number of bins
+//  Variables
+    double *newp;   // New probabilities
+
+
+    if(i_maxket<=maxket) return;
+
+    newp=new double[i_maxket]();
+    memcpy(newp,p,maxket*sizeof(double));
+    delete[] p;
+    p=newp;
+    ket_list::reserve(i_maxket);
+}
+
+
 //----------------------------------------
 //
 //  Counts a new sample
@@ -535,99 +550,521 @@ p_bin *p_bin::post_selection(state *prj){
 //--------------------------------------------
 //
 //  Calculate a measurement from the stored statistics
-//  using the corresponding circuit detector definitions
+//  using the corresponding circuit detector definitions.
+//  All the stages are applied to each bin in a single
+//  pass. Only the dark counts create new bins.
 //
 //--------------------------------------------
 p_bin *p_bin::calc_measure(qocircuit *qoc){
 //  qocircuit *qoc;         // Circuit with the detector definitions to calculate the measurement.
 //  Variables
     int    S;               // Blinking and dark counts calculation number of iterations
+    int    nd;              // Number of levels where dark counts are added
+    int    nblink;          // Number of blinking passes. One if there is no blinking.
+    int    nbdec;           // Number of blinking decisions by pass and bin
+    int    newnlevel;       // Number of levels of the measured bins
+    int    number;          // Number of photons created by dark counts
+    int    total;           // Total number of photons created by dark counts
+    int    index;           // Index of a bin
+    int   *lmap;            // Level of the measured bins where the photons of each level are counted. -1 if they are not counted.
+    int   *lcond;           // Detection condition of each level. -1=None/-2=Has to be empty/Otherwise=Index of the condition
+    int   *lblk;            // Blinking decision that applies to each level. -1 if it does not blink.
+    int   *newvis;          // Visibility vector of the measured bins
+    int   *creq;            // Number of photons required by each detection condition
+    int   *ccnt;            // Number of photons counted for each detection condition
+    int   *blnk;            // Blinking decisions of the present pass and bin. 1 if the detector is blinking
+    int   *grp;             // Blinking decisions that affect a bin. Exact calculation work space.
+    int   *dlev;            // Levels where dark counts are added
+    int   *dpos;            // Position in this set of each dark counts bin. -1 if it is a new bin.
+    int   *occ;             // Level occupation
     double stdev;           // Gaussian white noise standard deviation
-    p_bin *inperiod;        // Output after removing photons that are not in the measurement period.
-    p_bin *dark;            // Output after adding dark counts
-    p_bin *blinked;         // Output after blinking effect considerations
-    p_bin *lossed;          // Output after considering the detector efficiency
-    p_bin *ignored;         // Output after removing ignored channels
-    p_bin *measured;        // Output after considering detector conditions and removing loss channels (if needed)
-    p_bin *counted;         // Output after removing temporal degrees of freedom (if needed)
-    p_bin *noisy;           // Output after adding some gaussian white noise
-    p_bin *aux;             // Auxiliary probability bin
+    double *pblk;           // Blinking probability of each blinking decision
+    double *dgam;           // Dark counts rate of each level where they are added
+    double scale;           // Weight of the input bins after dark counts
+    double w;               // Weight of a bin
+    double value;           // Sampled value of the normal distribution
+    p_bin *dark;            // Bins created by dark counts
+    p_bin *measured;        // Output after all the detector effects
+//  Hash table
+    thash  darkhash;        // Position in dark of the bins of this set modified by dark counts
+    thash::const_iterator vdark; // Dark hash iterator
+//  Index
+    int    ib;              // Index of blinking passes
+//  Auxiliary index
+    int    i;               // Aux index
+    int    ch;              // Aux index
+    int    m;               // Aux index
+    int    k;               // Aux index
 
 
     // Itialize variables
     S=qoc->R;
     stdev=sqrt(qoc->dev);
 
+    // Compile the level transformations of all the deterministic stages
+    list_levels();
+    lmap=new int[nlevel];
+    lcond=new int[nlevel];
+    lblk=new int[nlevel];
+    newvis=new int[nlevel]();
+    newnlevel=measure_levels(qoc,lmap,lcond,lblk,newvis);
+    creq=new int[max(qoc->ncond,1)]();
+    ccnt=new int[max(qoc->ncond,1)]();
+    for(i=0;i<qoc->ncond;i++) creq[i]=qoc->det_def(1,i);
+    measured=new p_bin(nph,newnlevel,maxket,newvis);
+    measured->N=N;
+
     // Compute Dark counts
-    if(qoc->timed==0) dark=this->dark_counts(S,qoc);
-    else dark=this->clone();
-
-    // Compute Blinking
-    blinked=dark->blink(S,qoc);
-
-    // Measure
-    if(qoc->losses==1) lossed=blinked->compute_loss(qoc);
-    else lossed=blinked->clone();
-
-    // Measurement window
-    if(qoc->np>1) inperiod=lossed->meas_window(qoc);
-    else inperiod=lossed->clone();
-
-    // ignore channels
-    if(qoc->nignored>0) ignored=inperiod->compute_ignored(qoc);
-    else ignored=inperiod->clone();
-
-    // Post-selection
-    if(qoc->ncond>0) measured=ignored->compute_cond(qoc);
-    else measured=ignored->clone();
-
-    // Remove time
-    if(qoc->ns>1){
-       switch(qoc->timed){
-            case 0:  // Counter
-                aux=measured->perform_count(qoc);
-                counted=aux->remove_time(qoc);
-                delete aux;
-                break;
-            case 1:  // Clock: Partial trace
-                counted=measured->remove_freq(qoc);
-                break;
-            case 2:  // Clock+Spectrum: Full
-                counted=measured->clone();
-                break;
-            case 3:  // Clock: Manual mode
-                counted=measured->remove_freq(qoc);
-                break;
-            case 4:  // Classify periods
-                counted=measured->classify_period(qoc);
-                break;
-            default: // Default: Error
-                cout << "calc_measure error: Time has a non-valid value" << endl;
-                exit(0);
-                break;
-
-       }
-    }else{
-        counted=measured->clone();
+    // Only the few bins they create are stored apart.
+    dark=new p_bin(nph,nlevel,max(S,1),vis);
+    scale=1.0;
+    if((qoc->timed==0)&&(qoc->exact)){
+        // Exact calculation. Every dark counts configuration
+        // is weighted with its Poissonian probability.
+        nd=qoc->ndetc*qoc->nm;
+        dlev=new int[max(nd,1)];
+        dgam=new double[max(nd,1)];
+        for(ch=0;ch<qoc->ndetc;ch++){
+        for(m=0;m<qoc->nm;m++){
+            k=0;
+            while(vis[k]!=qoc->i_idx[ch][m][0]) k=k+1;
+            dlev[ch*qoc->nm+m]=k;
+            dgam[ch*qoc->nm+m]=qoc->det_par(1,ch);
+        }}
+        occ=new int[nlevel]();
+        dark->exact_dark(0,nd,0,1.0,(double)N,dlev,dgam,occ);
+        delete[] occ;
+        delete[] dlev;
+        delete[] dgam;
+    }
+    if((qoc->timed==0)&&(S>0)&&(!qoc->exact)){
+        scale=(double)S;
+        measured->N=measured->N*S;
+        occ=new int[nlevel]();
+        for(i=0;i<S;i++){
+            total=0;
+            for(ch=0;ch<qoc->ndetc;ch++){
+            for(m=0;m<qoc->nm;m++){
+                // For each channels the number of extra dark counts photons is obtained
+                number=prand(qoc->det_par(1,ch));
+                k=0;
+                while(vis[k]!=qoc->i_idx[ch][m][0]) k=k+1;
+                occ[k]=number;
+                total=total+number;
+            }}
+            // If we add some new photon the new bin is stored
+            if(total>0){
+                index=dark->add_ket(occ);
+                dark->p[index]=dark->p[index]+(double)N;
+            }
+            for(k=0;k<nlevel;k++) occ[k]=0;
+        }
+        delete[] occ;
+    }
+    dpos=new int[max(dark->nket,1)];
+    for(i=0;i<dark->nket;i++){
+        dpos[i]=this->find_ket(dark->ket[i]);
+        if(dpos[i]>=0) darkhash[dpos[i]]=i;
+    }
+
+    // Blinking passes
+    nblink=1;
+    nbdec=qoc->ns*qoc->ndetc;
+    blnk=nullptr;
+    grp=nullptr;
+    pblk=nullptr;
+    if((S>0)||(qoc->exact)){
+        blnk=new int[max(nbdec,1)]();
+    }
+    if((S>0)&&(!qoc->exact)){
+        nblink=S;
+        measured->N=measured->N*S;
+    }
+    if(qoc->exact){
+        // Exact calculation. A single pass where every
+        // combination of blinking detectors is weighted.
+        grp=new int[max(nbdec,1)];
+        pblk=new double[max(nbdec,1)];
+        for(k=0;k<nbdec;k++) pblk[k]=qoc->det_par(0,k%qoc->ndetc);
+    }
+
+    // Single pass over the bins
+    dark->list_levels();
+    occ=new int[max(newnlevel,1)]();
+    for(ib=0;ib<nblink;ib++){
+        for(i=0;i<nket+dark->nket;i++){
+            // Bins of this set and then the new dark counts bins
+            if(i<nket){
+                w=scale*p[i];
+                vdark=darkhash.find(i);
+                if(vdark!=darkhash.end()) w=w+dark->p[vdark->second];
+            }else{
+                if(dpos[i-nket]>=0) continue;
+                w=dark->p[i-nket];
+            }
+
+            // Exact blinking. All the combinations are applied.
+            if(qoc->exact){
+                if(i<nket) this->measure_blink(i,w,pblk,blnk,grp,lmap,lcond,lblk,creq,ccnt,qoc->ncond,occ,measured);
+                else dark->measure_blink(i-nket,w,pblk,blnk,grp,lmap,lcond,lblk,creq,ccnt,qoc->ncond,occ,measured);
+                continue;
+            }
+
+            // Blinking of each detector at each time
+            if(blnk!=nullptr){
+                for(k=0;k<nbdec;k++){
+                    if(urand()>=qoc->det_par(0,k%qoc->ndetc)) blnk[k]=0;
+                    else blnk[k]=1;
+                }
+            }
+
+            // Apply the rest of the stages and store
+            if(i<nket) this->measure_bin(i,w,blnk,lmap,lcond,lblk,creq,ccnt,qoc->ncond,occ,measured);
+            else dark->measure_bin(i-nket,w,blnk,lmap,lcond,lblk,creq,ccnt,qoc->ncond,occ,measured);
+        }
     }
 
     // Add noise
-    if (stdev>xcut) noisy=counted->white_noise(stdev);
-    else noisy=counted->clone();
+    if(stdev>xcut){
+        for(i=0;i<measured->nket;i++){
+            value=grand(0.0,stdev);
+            measured->p[i]=measured->p[i]+measured->N*value;
+            if (measured->p[i]<0) measured->p[i]=0.0;
+        }
+    }
 
     // Free memory
+    delete[] lmap;
+    delete[] lcond;
+    delete[] lblk;
+    delete[] newvis;
+    delete[] creq;
+    delete[] ccnt;
+    delete[] dpos;
+    delete[] occ;
+    if(blnk!=nullptr) delete[] blnk;
+    if(grp!=nullptr) delete[] grp;
+    if(pblk!=nullptr) delete[] pblk;
     delete dark;
-    delete blinked;
-    delete lossed;
-    delete inperiod;
-    delete ignored;
-    delete measured;
-    delete counted;
 
     // Return final detection
-    return noisy;
+    return measured;
+}
+
+
+//--------------------------------------------
+//
+//  Compiles the deterministic stages of a measurement
+//  (losses, detection window, ignored channels,
+//  detection conditions and time/frequency treatment)
+//  into transformations of each level.
+//
+//--------------------------------------------
+int p_bin::measure_levels(qocircuit *qoc, int *lmap, int *lcond, int *lblk, int *newvis){
+//  qocircuit *qoc;     // Circuit with the detector definitions
+//  int *lmap;          // Level of the measured bins where the photons of each level are counted. Output variable.
+//  int *lcond;         // Detection condition of each level. Output variable.
+//  int *lblk;          // Blinking decision that applies to each level. Output variable.
+//  int *newvis;        // Visibility vector of the measured bins. Output variable.
+//  Variables
+    bool   filter;      // Is there a detection window?
+    int    ch;          // Channel number
+    int    m;           // Mode number
+    int    s;           // Wavepacket number
+    int    is;          // Packet number within a period
+    int    ip;          // Period number
+    int    nt;          // Number of times
+    int    nwi;         // First period that can be measured
+    int    nwf;         // Last period (+1) that can be measured
+    int    cnd;         // Detection condition of the channel. -1 if none.
+    int    removed;     // Is the channel removed? 0=No/1=Yes
+    int    target;      // Circuit level where the photons of a level are counted
+    int    newnlevel;   // Number of levels of the measured bins
+    int   *pos;         // Position of each circuit level in this set. -1 if not present
+    int   *newpos;      // Position of each level in the measured bins. -1 if not present
+//  Auxiliary index
+    int    i;           // Aux index
+    int    l;           // Aux index
+
+
+    // Check if there is filtering by measurement period
+    filter=false;
+    i=0;
+    while((qoc->np>1)&&(filter==false)&&(i<qoc->nch)){
+        if(qoc->det_win(0,i)>=0) filter=true;
+        if(qoc->det_win(1,i)>=0) filter=true;
+        i=i+1;
+    }
+
+    // Check the time treatment
+    if((qoc->ns>1)&&((qoc->timed<0)||(qoc->timed>4))){
+        cout << "calc_measure error: Time has a non-valid value" << endl;
+        exit(0);
+    }
+    nt=0;
+    if(qoc->emitted!=nullptr) nt=qoc->emitted->times.size();
+
+    // Position of the circuit levels
+    pos=new int[qoc->nlevel];
+    for(i=0;i<qoc->nlevel;i++) pos[i]=-1;
+    for(l=0;l<nlevel;l++) pos[vis[l]]=l;
+
+    // Levels that remain after removing the loss, ignored
+    // and conditioned channels and the packets different from 0
+    newnlevel=0;
+    newpos=new int[nlevel];
+    for(l=0;l<nlevel;l++){
+        ch=qoc->idx[vis[l]].ch;
+        s=qoc->idx[vis[l]].s;
+        removed=0;
+        if((qoc->losses==1)&&(ch>=qoc->nch/2)) removed=1;
+        for(i=0;i<qoc->nignored;i++) if(qoc->ch_ignored(i)==ch) removed=1;
+        for(i=0;i<qoc->ncond;i++) if(qoc->det_def(0,i)==ch) removed=1;
+        if((qoc->ns>1)&&(qoc->timed==0)&&(s!=0)) removed=1;
+
+        newpos[l]=-1;
+        if(removed==0){
+            newpos[l]=newnlevel;
+            newvis[newnlevel]=vis[l];
+            newnlevel=newnlevel+1;
+        }
+    }
+
+    // Transformation of each level
+    for(l=0;l<nlevel;l++){
+        ch=qoc->idx[vis[l]].ch;
+        m=qoc->idx[vis[l]].m;
+        s=qoc->idx[vis[l]].s;
+
+        // Blinking
+        if(ch<qoc->ndetc) lblk[l]=s*qoc->ndetc+ch;
+        else              lblk[l]=-1;
+
+        // Channels removed before the detection conditions.
+        removed=0;
+        if((qoc->losses==1)&&(ch>=qoc->nch/2)) removed=1;
+        for(i=0;i<qoc->nignored;i++) if(qoc->ch_ignored(i)==ch) removed=1;
+
+        // Measurement window
+        if(filter){
+            if(ch<qoc->ndetc){
+                nwi=qoc->det_win(0,ch);
+                nwf=qoc->det_win(1,ch)+1;
+                if(qoc->det_win(0,ch)<0) nwi=0;
+                if(qoc->det_win(1,ch)<0) nwf=qoc->np+1;
+                if((s<nwi*qoc->nsp)||(s>=nwf*qoc->nsp)) removed=1;
+            }else{
+                removed=1;
+            }
+        }
+
+        // Detection conditions
+        cnd=-1;
+        for(i=0;i<qoc->ncond;i++) if(qoc->det_def(0,i)==ch) cnd=i;
+        lcond[l]=-1;
+        if((cnd>=0)&&(removed==0)){
+            if((qoc->det_def(2,cnd)<0)||(qoc->det_def(2,cnd)==m)) lcond[l]=cnd;
+            else lcond[l]=-2;
+        }
+        if(cnd>=0) removed=1;
+
+        // Time and frequency treatment
+        target=vis[l];
+        if(qoc->ns>1){
+            switch(qoc->timed){
+                case 0:  // Counter
+                    target=qoc->i_idx[ch][m][0];
+                    break;
+                case 1:  // Clock: Partial trace
+                case 3:  // Clock: Manual mode
+                    if(qoc->emitted->pack_def.cols()>0){
+                        is=s%qoc->nsp;
+                        ip=s/qoc->nsp;
+                        if(is<qoc->emitted->pack_def.cols()) target=qoc->i_idx[ch][m][qoc->emitted->pack_def(0,is)+ip*nt];
+                        else target=-1;
+                    }
+                    break;
+                case 4:  // Classify periods
+                    if(qoc->emitted->pack_def.cols()>0) target=qoc->i_idx[ch][m][s/qoc->nsp];
+                    break;
+                default: // Clock+Spectrum: Full
+                    break;
+            }
+        }
+
+        // Store
+        lmap[l]=-1;
+        if((removed==0)&&(target>=0)&&(pos[target]>=0)) lmap[l]=newpos[pos[target]];
+    }
+
+    // Free memory
+    delete[] pos;
+    delete[] newpos;
+
+    // Return the number of levels of the measured bins
+    return newnlevel;
 }
 
+
+//--------------------------------------------
+//
+//  Applies the compiled measurement stages to a bin
+//  and stores the result. Only the occupied levels
+//  are visited.
+//
+//--------------------------------------------
+void p_bin::measure_bin(int i, double w, int *blnk, int *lmap, int *lcond, int *lblk, int *creq, int *ccnt, int ncond, int *occ, p_bin *out){
+//  int     i;          // Index of the bin
+//  double  w;          // Weight of the bin
+//  int    *blnk;       // Blinking decisions. nullptr if there is no blinking
+//  int    *lmap;       // Level of the measured bins where the photons of each level are counted
+//  int    *lcond;      // Detection condition of each level
+//  int    *lblk;       // Blinking decision that applies to each level
+//  int    *creq;       // Number of photons required by each detection condition
+//  int    *ccnt;       // Number of photons counted for each detection condition. Work space.
+//  int     ncond;      // Number of detection conditions
+//  int    *occ;        // Level occupation of the measured bin. Work space. It is returned empty.
+//  p_bin  *out;        // Measured bins
+//  Variables
+    int    selected;    // Is this bin selected 0=No/1=Yes
+    int    index;       // Index of the measured bin
+    int    l;           // Level
+//  Auxiliary index
+    int    k;           // Aux index
+
+
+    // Transform the occupied levels
+    selected=1;
+    for(k=0;k<ncond;k++) ccnt[k]=0;
+    for(k=sidx[i];k<sidx[i+1];k++){
+        l=slev[k];
+        if((blnk==nullptr)||(lblk[l]<0)||(blnk[lblk[l]]==0)){
+            if(lcond[l]>=0) ccnt[lcond[l]]=ccnt[lcond[l]]+socc[k];
+            if(lcond[l]==-2) selected=0;
+            if(lmap[l]>=0) occ[lmap[l]]=occ[lmap[l]]+socc[k];
+        }
+    }
+
+    // Check the detection conditions
+    for(k=0;k<ncond;k++) if(ccnt[k]!=creq[k]) selected=0;
+
+    // Store
+    if(selected==1){
+        index=out->add_ket(occ);
+        out->p[index]=out->p[index]+w;
+    }
+
+    // Leave the work space empty
+    for(k=sidx[i];k<sidx[i+1];k++) if(lmap[slev[k]]>=0) occ[lmap[slev[k]]]=0;
+}
+
+
+//--------------------------------------------
+//
+//  Applies the compiled measurement stages to a bin
+//  for every combination of blinking detectors.
+//  Each one is weighted by its probability.
+//
+//--------------------------------------------
+void p_bin::measure_blink(int i, double w, double *pblk, int *blnk, int *grp, int *lmap, int *lcond, int *lblk, int *creq, int *ccnt, int ncond, int *occ, p_bin *out){
+//  int     i;          // Index of the bin
+//  double  w;          // Weight of the bin
+//  double *pblk;       // Blinking probability of each blinking decision
+//  int    *blnk;       // Blinking decisions. Work space. It has to be zero and it is returned zero.
+//  int    *grp;        // Blinking decisions that affect the bin. Work space.
+//  int    *lmap;       // Level of the measured bins where the photons of each level are counted
+//  int    *lcond;      // Detection condition of each level
+//  int    *lblk;       // Blinking decision that applies to each level
+//  int    *creq;       // Number of photons required by each detection condition
+//  int    *ccnt;       // Number of photons counted for each detection condition. Work space.
+//  int     ncond;      // Number of detection conditions
+//  int    *occ;        // Level occupation of the measured bin. Work space. It is returned empty.
+//  p_bin  *out;        // Measured bins
+//  Variables
+    int    ng;          // Number of blinking decisions that affect the bin
+    int    b;           // Blinking decision
+    int    found;       // Has the blinking decision already been found 0=No/1=Yes
+    long   comb;        // Combination of blinking detectors
+    double wb;          // Weight of the bin for a combination of blinking detectors
+//  Auxiliary index
+    int    j;           // Aux index
+    int    k;           // Aux index
+
+
+    // Find the blinking decisions that affect the occupied levels
+    ng=0;
+    for(k=sidx[i];k<sidx[i+1];k++){
+        b=lblk[slev[k]];
+        if((b>=0)&&(pblk[b]>0.0)){
+            found=0;
+            for(j=0;j<ng;j++) if(grp[j]==b) found=1;
+            if(found==0){
+                grp[ng]=b;
+                ng=ng+1;
+            }
+        }
+    }
+
+    // Apply every combination of blinking detectors
+    for(comb=0;comb<(1L<<ng);comb++){
+        wb=w;
+        for(j=0;j<ng;j++){
+            blnk[grp[j]]=(comb>>j)&1;
+            if(blnk[grp[j]]==1) wb=wb*pblk[grp[j]];
+            else wb=wb*(1.0-pblk[grp[j]]);
+        }
+        if(wb>0.0) measure_bin(i,wb,blnk,lmap,lcond,lblk,creq,ccnt,ncond,occ,out);
+    }
+
+    // Leave the work space as it was
+    for(j=0;j<ng;j++) blnk[grp[j]]=0;
+}
+
+
+//--------------------------------------------
+//
+//  Adds the bins of every configuration of dark counts
+//  weighted by its Poissonian probability. Configurations
+//  with probability below DEFDARKTOL are discarded.
+//
+//--------------------------------------------
+void p_bin::exact_dark(int j, int nd, int total, double pp, double w, int *dlev, double *dgam, int *occ){
+//  int     j;          // Present dark counts level
+//  int     nd;         // Number of levels where dark counts are added
+//  int     total;      // Number of dark counts photons in the previous levels
+//  double  pp;         // Probability of the dark counts in the previous levels
+//  double  w;          // Weight of a configuration of probability one
+//  int    *dlev;       // Levels where dark counts are added
+//  double *dgam;       // Dark counts rate of each level
+//  int    *occ;        // Level occupation. Work space. It is returned empty.
+//  Variables
+    int    n;           // Number of dark counts photons in the present level
+    int    index;       // Index of a bin
+    double q;           // Probability of the dark counts up to the present level
+
+
+    // Store the configuration if it creates some photon
+    if(j==nd){
+        if(total>0){
+            index=add_ket(occ);
+            p[index]=p[index]+w*pp;
+        }
+        return;
+    }
+
+    // Poissonian number of photons in the present level
+    n=0;
+    q=pp*exp(-dgam[j]);
+    while((q>=DEFDARKTOL)||(n<dgam[j])){
+        occ[dlev[j]]=n;
+        if(q>=DEFDARKTOL) exact_dark(j+1,nd,total+n,q,w,dlev,dgam,occ);
+        n=n+1;
+        q=q*dgam[j]/(double)n;
+    }
+    occ[dlev[j]]=0;
+}
+
+
 //--------------------------------------------
 //
 // Filters the photons out of the measurement window
@@ -1346,6 +1783,7 @@ p_bin *p_bin::perform_count(qocircuit* qoc){
     int    m;           // Mode number
     int    index;       // Index of a ket in this set of bins
     int   *occ;         // Level occupation
+    int   *target;      // Level where the counts of each level are stored
     p_bin *newpbin;     // New output probability bin
 //  Auxiliary index
     int    i;           // Aux index
@@ -1354,28 +1792,35 @@ p_bin *p_bin::perform_count(qocircuit* qoc){
     int    l;           // Aux index
 
 
+    // We put all the counts in the same time/wavepacket.
+    // Find where the counts of each level are stored.
+    target=new int[nlevel];
+    for(j=0;j<nlevel;j++){
+        ch=qoc->idx[vis[j]].ch;
+        m=qoc->idx[vis[j]].m;
+        l=qoc->i_idx[ch][m][0];
+        k=0;
+        while(vis[k]!=l) k=k+1;
+        target[j]=k;
+    }
+
     // Calculate counts in a channel-polarization
+    // visiting only the occupied levels of each bin.
+    list_levels();
     newpbin=new p_bin(nph,nlevel,nket,vis);
+    occ=new int[nlevel]();
     for(i=0;i<nket;i++){
-        occ=new int[nlevel]();
-        for(j=0;j<nlevel;j++){
-            // We put all the counts in
-            // the same time/wavepacket
-            ch=qoc->idx[vis[j]].ch;
-            m=qoc->idx[vis[j]].m;
-            l=qoc->i_idx[ch][m][0];
-
-            // Store
-            k=0;
-            while(vis[k]!=l) k=k+1;
-            occ[k]=occ[k]+ket[i][j];
-        }
+        for(k=sidx[i];k<sidx[i+1];k++) occ[target[slev[k]]]=occ[target[slev[k]]]+socc[k];
         index=newpbin->add_ket(occ);
         newpbin->p[index]=newpbin->p[index]+p[i];
-        delete occ;
+        for(k=sidx[i];k<sidx[i+1];k++) occ[target[slev[k]]]=0;
     }
     newpbin->N=N;
 
+    // Free memory
+    delete[] occ;
+    delete[] target;
+
     // Return new bin.
     return newpbin;
 }
@@ -1395,21 +1840,21 @@ p_bin *p_bin:: remove_time(qocircuit *qoc){
     int    newnlevel;            // New number of levels
     int   *auxket;               // Auxiliary ket
     int   *newvis;               // New visibility vector
-    int   *isincluded;           // Levels included
+    int   *newpos;               // Position of each level in the new bins. -1 if not included
     p_bin *auxlist;              // Auxiliary ket list (to be returned)
 //  Auxiliary index
     int    i;                    // Aux index
-    int    j;                    // Aux index
     int    k;                    // Aux index
 
 
     // Init variables
     newnlevel=0;
     newvis=new int[nlevel]();
-    isincluded=new int[nlevel]();
+    newpos=new int[nlevel];
     for(i=0;i<nlevel;i++){
+        newpos[i]=-1;
         if(qoc->idx[vis[i]].s==0){
-                isincluded[i]=1;
+                newpos[i]=newnlevel;
                 newvis[newnlevel]=vis[i];
                 newnlevel=newnlevel+1;
         }
@@ -1417,24 +1862,25 @@ p_bin *p_bin:: remove_time(qocircuit *qoc){
     auxlist=new p_bin(nph,newnlevel,maxket,newvis);
     delete[] newvis;
 
-    // Perform operations
+    // Perform operations. Only the occupied
+    // levels of each bin are visited.
+    list_levels();
     auxket=new int[newnlevel]();
     for(i=0;i<nket;i++){
-        k=0;
-        for(j=0;j<nlevel;j++){
-            if(isincluded[j]==1){
-                auxket[k]=ket[i][j];
-                k++;
-            }
+        for(k=sidx[i];k<sidx[i+1];k++){
+            if(newpos[slev[k]]>=0) auxket[newpos[slev[k]]]=socc[k];
         }
         index=auxlist->add_ket(auxket);
         auxlist->p[index]=auxlist->p[index]+p[i];
+        for(k=sidx[i];k<sidx[i+1];k++){
+            if(newpos[slev[k]]>=0) auxket[newpos[slev[k]]]=0;
+        }
     }
     auxlist->N=N;
 
     // Free memory
-    delete auxket;
-    delete[] isincluded;
+    delete[] auxket;
+    delete[] newpos;
 
     // Return new bin
     return auxlist;
@@ -26,6 +26,7 @@ public:
     ~p_bin();                                                                  //  Destroys a set of probability bins
     p_bin *clone();                                                            //  Copies a set of probability bins
     void clear();                                                              //  Clears a set of probability bins
+    void reserve(int i_maxket);                                                //  Increases the number of bins that can be stored without reallocation
 
     // Bin basic operations
     double trace();                                                            // Obtain the total probability stored.
@@ -73,6 +74,12 @@ public:
     p_bin *translate(mati qdef,qodev *dev);                                    // Encodes the bin labels from photonic to qubit representation ( Path encoding, device version )
     p_bin *pol_translate(veci qdef,qocircuit *qoc);                            // Encodes the bin labels from photonic to qubit representation ( Polarization encoding, circuit version )
     p_bin *pol_translate(veci qdef,qodev *dev);                                // Encodes the bin labels from photonic to qubit representation ( Polarization encoding, device version )
+
+protected:
+    int measure_levels(qocircuit *qoc, int *lmap, int *lcond, int *lblk, int *newvis);                                                          // Compiles the deterministic measurement stages into level transformations
+    void measure_bin(int i, double w, int *blnk, int *lmap, int *lcond, int *lblk, int *creq, int *ccnt, int ncond, int *occ, p_bin *out);     // Applies the compiled measurement stages to a bin
+    void measure_blink(int i, double w, double *pblk, int *blnk, int *grp, int *lmap, int *lcond, int *lblk, int *creq, int *ccnt, int ncond, int *occ, p_bin *out); // Applies the compiled measurement stages to a bin for every combination of blinking detectors
+    void exact_dark(int j, int nd, int total, double pp, double w, int *dlev, double *dgam, int *occ);                                        // Adds the bins of every configuration of dark counts
 };
 
 ***********************************************************************************/
@@ -80,6 +87,9 @@ public:
 
 #include "qodev.h"
 
+// Constant defaults
+const double DEFDARKTOL = 1.0e-8;     ///< Default probability below which a configuration of dark counts is discarded in the exact calculation.
+
 /** @defgroup P_Bin Probability bin
  *  Set of probability bins to contabilize samples.
  */
@@ -129,7 +139,7 @@ public:
     *
     *  @param int i_nph     Maximum number of photons.
     *  @param int i_level   Number of levels.
-    *  @param int i_maxket  Maximum number of different bins in the set.
+    *  @param int i_maxket  Number of bins reserved. The set grows when it is full.
     *  @ingroup Bin_management
     */
     p_bin(int i_nph, int i_level,int i_maxket);
@@ -141,7 +151,7 @@ public:
     *
     *  @param int i_nph     Maximum number of photons.
     *  @param int i_level   Number of levels.
-    *  @param int i_maxket  Maximum number of different bins in the set.
+    *  @param int i_maxket  Number of bins reserved. The set grows when it is full.
     *  @param int i_vis  Vector that translates the p_bin levels to the circuit levels defined by the circuit indexes.
     *  @ingroup Bin_management
     */
@@ -165,6 +175,13 @@ public:
     *  @ingroup Bin_management
     */
     void clear();
+    /**
+    *  Increases the number of bins that can be stored. Probabilities are reallocated together with the kets.
+    *
+    *  @param int i_maxket  New number of bins. Nothing is done if it is not larger than the present one.
+    *  @ingroup Bin_management
+    */
+    void reserve(int i_maxket);
 
     // Bin basic operations
     /** @defgroup Bin_basic Set of probability bins basic operations
@@ -224,7 +241,9 @@ public:
     */
     /**
     *  Calculates the effect of the detectors defined in a circuit over the outcome contained in this set of probability bins.
-    *  These effect are post-selection-conditions, detection window ,dark counts, detector dead time, losses and circuit noise.
+    *  These effect are post-selection-conditions, detection window ,dark counts, detector dead time, losses and circuit noise. <br>
+    *  The stages are not applied one after the other. Each bin is transformed by all of them in a single pass and stored
+    *  directly in the output. The result is the same than applying the individual methods below in order.
     *
     *  @param qocircuit *qoc  Circuit where the detectors are defined.
     *  @return Returns a list of outcome probabilities considering the effects of physical detectors.
@@ -559,4 +578,75 @@ public:
     *  @ingroup Bin_qubit
     */
     p_bin *pol_translate(veci qdef,qodev *dev);
+
+protected:
+    /**
+    *  Compiles the deterministic stages of a measurement into transformations of each level. These are the losses, the detection
+    *  window, the ignored channels, the detection conditions and the time/frequency treatment. <br>
+    *  <b> Intended for internal use of the library. </b>
+    *
+    *  @param qocircuit *qoc  Circuit where the detectors are defined.
+    *  @param int *lmap   Level of the measured bins where the photons of each level are counted. -1 if they are not counted. <b> Warning! this is an output variable </b>
+    *  @param int *lcond  Detection condition of each level. -1 if none, -2 if the level has to be empty. <b> Warning! this is an output variable </b>
+    *  @param int *lblk   Blinking decision that applies to each level. -1 if the level does not blink. <b> Warning! this is an output variable </b>
+    *  @param int *newvis Vector of equivalence between the measured bin levels and the circuit levels. <b> Warning! this is an output variable </b>
+    *  @return Number of levels of the measured bins.
+    *  @see calc_measure(qocircuit *qoc);
+    */
+    int measure_levels(qocircuit *qoc, int *lmap, int *lcond, int *lblk, int *newvis);
+    /**
+    *  Applies the compiled measurement stages to a bin and adds its weight to the corresponding measured bin if it fulfills the detection conditions. <br>
+    *  <b> Intended for internal use of the library. </b>
+    *
+    *  @param int i        Index of the bin.
+    *  @param double w     Weight of the bin.
+    *  @param int *blnk    Blinking decision of each detector and packet. 1 if blinking. nullptr if there is no blinking.
+    *  @param int *lmap    Level of the measured bins where the photons of each level are counted.
+    *  @param int *lcond   Detection condition of each level.
+    *  @param int *lblk    Blinking decision that applies to each level.
+    *  @param int *creq    Number of photons required by each detection condition.
+    *  @param int *ccnt    Work space for the photons counted by each condition.
+    *  @param int ncond    Number of detection conditions.
+    *  @param int *occ     Work space for the measured occupation. It has to be empty and it is returned empty.
+    *  @param p_bin *out   Measured bins. <b> Warning! this is an output variable </b>
+    *  @see calc_measure(qocircuit *qoc);
+    */
+    void measure_bin(int i, double w, int *blnk, int *lmap, int *lcond, int *lblk, int *creq, int *ccnt, int ncond, int *occ, p_bin *out);
+    /**
+    *  Applies the compiled measurement stages to a bin for every combination of the blinking detectors that affect it.
+    *  Each combination is weighted by its probability. <br>
+    *  <b> Intended for internal use of the library. </b>
+    *
+    *  @param int i        Index of the bin.
+    *  @param double w     Weight of the bin.
+    *  @param double *pblk Blinking probability of each detector and packet.
+    *  @param int *blnk    Work space for the blinking decisions. It has to be zero and it is returned zero.
+    *  @param int *grp     Work space for the blinking decisions that affect the bin.
+    *  @param int *lmap    Level of the measured bins where the photons of each level are counted.
+    *  @param int *lcond   Detection condition of each level.
+    *  @param int *lblk    Blinking decision that applies to each level.
+    *  @param int *creq    Number of photons required by each detection condition.
+    *  @param int *ccnt    Work space for the photons counted by each condition.
+    *  @param int ncond    Number of detection conditions.
+    *  @param int *occ     Work space for the measured occupation. It has to be empty and it is returned empty.
+    *  @param p_bin *out   Measured bins. <b> Warning! this is an output variable </b>
+    *  @see calc_measure(qocircuit *qoc);
+    */
+    void measure_blink(int i, double w, double *pblk, int *blnk, int *grp, int *lmap, int *lcond, int *lblk, int *creq, int *ccnt, int ncond, int *occ, p_bin *out);
+    /**
+    *  Adds to this set the bins of every configuration of dark counts with at least one photon. Each one is weighted by its
+    *  Poissonian probability. Configurations with a probability below DEFDARKTOL are discarded. Recursive over the levels. <br>
+    *  <b> Intended for internal use of the library. </b>
+    *
+    *  @param int j         Present level. Zero in the first call.
+    *  @param int nd        Number of levels where dark counts are added.
+    *  @param int total     Number of dark counts photons in the previous levels. Zero in the first call.
+    *  @param double pp     Probability of the dark counts in the previous levels. One in the first call.
+    *  @param double w      Weight of a configuration of probability one.
+    *  @param int *dlev     Levels where dark counts are added.
+    *  @param double *dgam  Dark counts rate of each level.
+    *  @param int *occ      Work space for the level occupation. It has to be empty and it is returned empty.
+    *  @see calc_measure(qocircuit *qoc);
+    */
+    void exact_dark(int j, int nd, int total, double pp, double w, int *dlev, double *dgam, int *occ);
 };
@@ -118,6 +118,8 @@ extern "C" {
     void free_ptr(char *mem){ free_mem(mem); }
     // Configure SOQCS
     void all_cfg_soqcs(int nph){cfg_soqcs(nph);}
+    // Seed of the random number generators
+    void all_rng_seed(unsigned long long seed){rng_seed(seed);}
     //--------------------------------------------------------------------------------------------------------------------------
 
 
@@ -128,6 +130,8 @@ extern "C" {
                                                                                                   return (long int)new qocircuit(i_nch,i_nm,i_ns, i_np, i_dtp, clock,i_R,loss,ckind);}
     void qoc_destroy_qocircuit(long int qoc){qocircuit* aux=(qocircuit*)qoc; delete aux; }
     int qoc_num_levels(long int qoc){qocircuit* aux=(qocircuit*)qoc; return aux->num_levels();}
+    int qoc_num_gates(long int qoc){qocircuit* aux=(qocircuit*)qoc; return aux->num_gates();}
+    int qoc_update(long int qoc, int id){qocircuit* aux=(qocircuit*)qoc; return aux->update(id);}
 
     // Circuit elements
     //      Basic elements
@@ -149,6 +153,7 @@ extern "C" {
     //      Detection elements
     void qoc_detector(long int  qoc, int i_ch, int cond, int pol, int mpi, int mpo, double eff, double blnk, double gamma){ qocircuit* aux=(qocircuit*)qoc; aux->detector(i_ch,cond,pol,mpi,mpo,eff,blnk,gamma);}
     void qoc_noise(long int qoc, double stdev2){ qocircuit* aux=(qocircuit*)qoc; aux->noise(stdev2);}
+    void qoc_exact_detection(long int qoc, bool exact){ qocircuit* aux=(qocircuit*)qoc; aux->exact_detection(exact);}
 
     //      Emitter and distinguishability model.
     int qoc_def_packet(long int qoc, int n, double t, double f, double w){ qocircuit* aux=(qocircuit*)qoc;
@@ -167,6 +172,7 @@ extern "C" {
     // Management functions
     long int st_new_state(int i_nph, int i_level, int i_maxket){ return (long int)new state(i_nph,i_level,i_maxket);}
     void st_destroy_state(long int st){state* aux=(state*)st; delete aux; }
+    int st_nkets(long int st){state* aux=(state*)st; return aux->nket;}
 
     // State manipulation methods.
     double *st_braket(long int st1,long int st2){ state *auxst1=(state*)st1;
@@ -372,6 +378,8 @@ extern "C" {
     void dev_repack(long int dev, int* ipack, int n){   qodev *auxdev=(qodev *) dev; veci tmp=to_veci(ipack,n); auxdev->repack(tmp);}
     double dev_emitted_vis(long int dev, int i, int j){ qodev *auxdev=(qodev *) dev; return auxdev->emitted_vis(i,j);}
     void dev_prnt_packets(long int dev){ qodev *auxdev=(qodev *) dev; auxdev->prnt_packets(); cout << flush;}
+    int dev_num_gates(long int dev){ qodev *auxdev=(qodev *) dev; return auxdev->num_gates();}
+    int dev_update(long int dev, int id){ qodev *auxdev=(qodev *) dev; return auxdev->update(id);}
 
     // Circuit elements
     //      Basic elements
@@ -397,6 +405,7 @@ extern "C" {
     //      Detection elements
     void dev_detector(long int  dev, int i_ch, int cond, int pol, int mpi, int mpo, double eff, double blnk, double gamma){ qodev* aux=(qodev*)dev; aux->detector(i_ch,cond,pol,mpi,mpo,eff,blnk,gamma);}
     void dev_noise(long int dev, double stdev2){ qodev* aux=(qodev*)dev; aux->noise(stdev2);}
+    void dev_exact_detection(long int dev, bool exact){ qodev* aux=(qodev*)dev; aux->exact_detection(exact);}
     long int dev_apply_condition(long int dev,long int st, bool ignore){ qodev *auxdev=(qodev *) dev; state  *auxst=(state *) st; return (long int) auxdev->apply_condition(auxst,ignore);}
     //--------------------------------------------------------------------------------------------------------------------------
 
@@ -406,6 +415,10 @@ extern "C" {
     // Management methods
     long int sim_new_simulator(int i_mem){ return (long int) new simulator(i_mem);}
     void sim_destroy_simulator(long int sim){simulator *aux=(simulator *)sim; delete aux; }
+    void sim_set_cache(long int sim, long long int size){ simulator *aux=(simulator *)sim; aux->set_cache(size);}
+    void sim_clear_cache(long int sim){ simulator *aux=(simulator *)sim; aux->clear_cache();}
+    void sim_cache_stats(long int sim, long long int *stats){ simulator *aux=(simulator *)sim; tie(stats[0],stats[1])=aux->cache_stats();}
+    void sim_set_dense(long int sim, bool i_dense){ simulator *aux=(simulator *)sim; aux->set_dense(i_dense);}
 
     // Run methods
     long int sim_run(long int sim,long int dev, int method, int nthreads){ simulator *auxsim=(simulator *) sim; qodev  *auxdev=(qodev *) dev; return (long int) auxsim->run(auxdev,method,nthreads);}
@@ -416,6 +429,16 @@ extern "C" {
                                                                                               qocircuit *auxqoc=(qocircuit*)qoc;
                                                                                               return (long int) auxsim->run(auxst,auxls,auxqoc,method,nthreads);
                                                                                             }
+    long int sim_gurvits(long int sim,long int st,long int ls,long int qoc, double eps, double conf, int nthreads, double *serr){ simulator *auxsim=(simulator *) sim;
+                                                                                              state  *auxst=(state *) st;
+                                                                                              state  *auxls=(state *) ls;
+                                                                                              qocircuit *auxqoc=(qocircuit*)qoc;
+                                                                                              state  *ostate;
+                                                                                              vecd    err;
+                                                                                              tie(ostate,err)=auxsim->gurvits(auxst,auxls,auxqoc,eps,conf,nthreads);
+                                                                                              for(int i=0;i<err.size();i++) serr[i]=err(i);
+                                                                                              return (long int) ostate;
+                                                                                            }
     // Clifford sampling methods
     long int sim_sample(long int sim,long int dev, int N){ simulator *auxsim=(simulator *) sim; qodev  *auxdev=(qodev *) dev; return (long int) auxsim->sample(auxdev,N);}
     char *sim_get_sample(long int sim,long int dev, int mode ){ simulator *auxsim=(simulator *) sim;
@@ -430,12 +453,10 @@ extern "C" {
 
 
     // Metropolis sampling methods
-    long int sim_metropolis(long int sim,long int dev, int method,int N, int Nburn, int Nthin){ simulator *auxsim=(simulator *) sim;
+    long int sim_metropolis(long int sim,long int dev, int method,int N, int Nburn, int Nthin, int nchains, int nthreads, double *diag){ simulator *auxsim=(simulator *) sim;
                                                                                                 qodev  *auxdev=(qodev *) dev;
                                                                                                 p_bin *auxpbin;
-                                                                                                double p;
-                                                                                                tie(auxpbin,p)=auxsim->metropolis(auxdev,method,N,Nburn,Nthin);
-                                                                                                cout << "Metropolis success ratio: " << p << endl;
+                                                                                                tie(auxpbin,diag[0],diag[1],diag[2])=auxsim->metropolis(auxdev,method,N,Nburn,Nthin,nchains,nthreads);
                                                                                                 return (long int) auxpbin;}
 
     char *sim_get_metro(long int sim,long int dev, int mode){   simulator *auxsim=(simulator *) sim;
@@ -454,7 +475,11 @@ extern "C" {
     // MTHREAD
     long int mt_new_mthread(int i_mem){ return (long int) new mthread(i_mem);}
     void mt_destroy_mthread(long int mt){mthread *aux=(mthread *)mt; delete aux; }
-    void mt_send_work(long int mt,long int st, long int qoc, int method){ mthread *auxmt=(mthread *) mt; state  *auxst=(state *) st; qocircuit *auxqoc=(qocircuit*)qoc; auxmt->send_work(auxst,auxqoc,method);}
+    long int mt_send_work(long int mt,long int st, long int qoc, int method){ mthread *auxmt=(mthread *) mt; state  *auxst=(state *) st; qocircuit *auxqoc=(qocircuit*)qoc; return auxmt->send_work(auxst,auxqoc,method);}
     long int mt_receive_work(long int mt){ mthread *auxmt=(mthread *) mt; return (long int) auxmt->receive_work();}
+    long int mt_receive_any(long int mt, long int *id){ mthread *auxmt=(mthread *) mt; state *auxst; tie(*id,auxst)=auxmt->receive_any(); return (long int) auxst;}
+    int mt_cancel_work(long int mt, long int id){ mthread *auxmt=(mthread *) mt; return (int) auxmt->cancel_work(id);}
+    long int mt_send_dwork(long int mt,long int st, long int qoc, int method){ mthread *auxmt=(mthread *) mt; state  *auxst=(state *) st; qocircuit *auxqoc=(qocircuit*)qoc; return auxmt->send_dwork(auxst,auxqoc,method);}
+    long int mt_reduce_dmat(long int mt){ mthread *auxmt=(mthread *) mt; return (long int) auxmt->reduce_dmat();}
     //--------------------------------------------------------------------------------------------------------------------------
 }
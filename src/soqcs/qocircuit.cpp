@@ -148,6 +148,7 @@ int qocircuit::create_circuit(int i_nch, int i_nm, int i_ns, int i_np, double i_
     // Initialize blink, dark counts and noise parameters
     R=i_R;
     dev=0.0;
+    exact=false;
 
     // Create dictionaries
     nlevel=nch*nm*ns;
@@ -179,6 +180,19 @@ int qocircuit::create_circuit(int i_nch, int i_nm, int i_ns, int i_np, double i_
     // No elements in circuit is the identity matrix
     circmtx=matc::Identity(nlevel,nlevel);
 
+    // Create the gate list.
+    // Partial circuit matrices are not stored
+    // until a gate is updated for the first time.
+    ngate=0;
+    glist=make_shared<vector<gate>>();
+    glist->reserve(DEFGATEDIM);
+    ncomp=0;
+    upd=-1;
+    nseg=DEFSEGLEN;
+    nchk=0;
+    maxchk=0;
+    chk=nullptr;
+
     // Return success
     return 0;
 }
@@ -207,6 +221,7 @@ qocircuit::~qocircuit(){
     delete[] idx;
     delete[] i_idx;
     delete emitted;
+    delete[] chk;
 }
 
 
@@ -218,8 +233,19 @@ qocircuit::~qocircuit(){
 void qocircuit::reset(){
 
 
-    // Resent circuit matrix
+    // Resent circuit matrix and gate list
+    // (the old list may be shared with copies of the circuit).
     circmtx=matc::Identity(nlevel,nlevel);
+    glist=make_shared<vector<gate>>();
+    glist->reserve(DEFGATEDIM);
+    ngate=0;
+    ncomp=0;
+    upd=-1;
+    nseg=DEFSEGLEN;
+    nchk=0;
+    maxchk=0;
+    delete[] chk;
+    chk=nullptr;
     // Reset detectors
     ndetc=0;
     nignored=0;
@@ -232,6 +258,7 @@ void qocircuit::reset(){
     emitted=new photon_mdl();
     // Reset noise
     dev=0.0;
+    exact=false;
 
 }
 
@@ -294,9 +321,18 @@ qocircuit *qocircuit::clone(){
     // Copy noise and detection effects
     newcircuit->R=R;
     newcircuit->dev=dev;
-
-    // Copy the circuit configuration
-    newcircuit->circmtx=circmtx;
+    newcircuit->exact=exact;
+
+    // Share the gate list. It is copied
+    // only when one of the circuits modifies it.
+    // The circuit matrix is only copied if it is up to date.
+    // Otherwise it is computed when the copy is used.
+    newcircuit->glist=glist;
+    newcircuit->ngate=ngate;
+    if((ncomp==ngate)&&(upd<0)){
+        newcircuit->circmtx=circmtx;
+        newcircuit->ncomp=ngate;
+    }
 
     //Return a pointer to the new circuit object.
     return newcircuit;
@@ -312,37 +348,51 @@ int qocircuit::concatenate(qocircuit *qoc){
 //  qocircuit *qoc;      // Circuit to be appended
 //  Variables
     int nclose;          // Total number of channels
+    gate g;              // Gate to be recorded
+//  Auxiliary index
+    int i;               // Aux index
 
 
     // Check limitations
     if(nch!=qoc->nch){
         cout << "Concatenate error  #1: Circuits not compatible. Number of channels is different" << endl;
+        upd=-1;
         return -1;
     }
     if(nm!=qoc->nm){
         cout << "Concatenate error  #2: Circuits not compatible. Number of polarization is different" << endl;
+        upd=-1;
         return -1;
     }
     if(ns!=qoc->ns){
         cout << "Concatenate error  #3: Circuits not compatible. Number of packets is different" << endl;
+        upd=-1;
         return -1;
     }
     if(qoc->npack>0){
         cout << "Concatenate error  #4: Input must be defined entirely on the first circuit! " << endl;
+        upd=-1;
         return -1;
     }
     if(ncond>0){
         cout << "Concatenate error  #5: Detectors must be defined entirely on the last circuit!. " << endl;
+        upd=-1;
         return -1;
     }
 
     if (((losses==0)&&(qoc->losses>0))||((losses>0)&&(qoc->losses==0))){
         cout << "Concatenate error  #6: Both circuits must have the same loss configuration!. " << endl;
+        upd=-1;
         return -1;
     }
 
     // Merges circuits (in a limited way)
-    circmtx=qoc->circmtx*circmtx;
+    qoc->compile();
+    g.kind=1;
+    g.lev.resize(nlevel);
+    for(i=0;i<nlevel;i++) g.lev(i)=i;
+    g.U=qoc->circmtx;
+    record(g);
     ncond=qoc->ncond;
     ndetc=qoc->ndetc;
     nignored=qoc->nignored;
@@ -358,11 +408,17 @@ int qocircuit::concatenate(qocircuit *qoc){
     else nclose=nch/2;
 
     // If this is the last detector compute losses if needed.
-    if((losses>0)&&(ndetc==nclose)) compute_losses();
+    if((losses>0)&&(ndetc==nclose)){
+        g.kind=3;
+        record(g);
+    }
 
     // If this is the last detector add the emitter matrix
     // at the beginning. (Otherwise computing the losses breaks the calculation)
-    if((emiss==1)&&(ndetc==nclose)) circmtx=circmtx*init_dmat;
+    if((emiss==1)&&(ndetc==nclose)){
+        g.kind=4;
+        record(g);
+    }
 
     return 0;
 }
@@ -378,6 +434,84 @@ int qocircuit::num_levels(){
 }
 
 
+//----------------------------------------
+//
+//  Returns the number of recorded gates
+//
+//----------------------------------------
+int qocircuit::num_gates(){
+    return ngate;
+}
+
+
+//----------------------------------------
+//
+//  Selects the gate to be replaced by the
+//  next element added to the circuit
+//
+//----------------------------------------
+int qocircuit::update(int id){
+//  int id;      // Gate to be replaced
+//  Variables
+    long long int size;  // Size in bytes of a circuit matrix
+
+
+    // Check
+    if((id<0)||(id>=ngate)){
+        cout << "Update error: The gate "<< id << " has not been recorded." << endl;
+        return -1;
+    }
+
+    // The first time a gate is updated reserve the partial
+    // circuit matrices. Their number is limited by the memory
+    // budget DEFCHKMEM and they are spread along the gate list.
+    if(maxchk==0){
+        size=(long long int)nlevel*nlevel*sizeof(cmplx);
+        maxchk=(int)max(1LL,DEFCHKMEM/size);
+        nseg=max(DEFSEGLEN,(ngate+maxchk-1)/maxchk);
+        nchk=0;
+        chk=new matc[maxchk];
+    }
+
+    upd=id;
+    return 0;
+}
+
+
+//----------------------------------------
+//
+//  Computes the circuit matrix from
+//  the recorded gates
+//
+//----------------------------------------
+void qocircuit::compile(){
+
+
+    // Nothing to do
+    if(ncomp==ngate) return;
+
+    // A gate already applied has changed.
+    // Restart from the last valid partial matrix.
+    if(ncomp<0){
+        if(nchk>0) circmtx=chk[nchk-1];
+        else circmtx=matc::Identity(nlevel,nlevel);
+        ncomp=nchk*nseg;
+    }
+
+    // Apply the remaining gates storing the partial
+    // matrices on the way (if they have been reserved).
+    while(ncomp<ngate){
+        apply_record(ncomp);
+        ncomp=ncomp+1;
+
+        if((nchk<maxchk)&&(ncomp%nseg==0)&&(ncomp/nseg>nchk)){
+            chk[nchk]=circmtx;
+            nchk=nchk+1;
+        }
+    }
+}
+
+
 //----------------------------------------
 //
 //  Adds a beamsplitter to the circuit
@@ -502,6 +636,176 @@ void qocircuit::compute_losses(){
 }
 
 
+//-------------------------------------------------------
+//
+//  Applies a gate that acts on a few levels updating
+//  only the rows of the circuit matrix of those levels.
+//
+//-------------------------------------------------------
+void qocircuit::apply_gate(veci lev, matc G){
+//  veci lev;         // Levels on which the gate acts
+//  matc G;           // Gate matrix between the levels in lev
+//  Variables
+    int  nl;          // Number of levels on which the gate acts
+    matc rows;        // Rows of the circuit matrix of those levels
+//  Auxiliary index.
+    int  k;           // Aux index
+
+
+    // Gather
+    nl=lev.size();
+    rows.resize(nl,nlevel);
+    for(k=0;k<nl;k++) rows.row(k)=circmtx.row(lev(k));
+
+    // Update
+    rows=G*rows;
+
+    // Scatter
+    for(k=0;k<nl;k++) circmtx.row(lev(k))=rows.row(k);
+}
+
+
+//-------------------------------------------------------
+//
+//  Applies the emitter matrix at the beginning of the
+//  circuit. Only the packets of the same channel and
+//  polarization are mixed.
+//
+//-------------------------------------------------------
+void qocircuit::apply_emitter(){
+//  Variables
+    int  ch;          // Channel
+    int  m;           // Polarization
+    veci cols;        // Levels of the packets of a channel and polarization
+    matc T;           // Emitter matrix between those levels
+    matc block;       // Columns of the circuit matrix of those levels
+//  Auxiliary index.
+    int  k;           // Aux index
+    int  l;           // Aux index
+
+
+    // Reserve memory
+    cols.resize(ns);
+    T.resize(ns,ns);
+    block.resize(nlevel,ns);
+
+    for(ch=0;ch<nch;ch++){
+    for(m=0;m<nm;m++){
+        for(k=0;k<ns;k++) cols(k)=i_idx[ch][m][k];
+        for(k=0;k<ns;k++){
+        for(l=0;l<ns;l++){
+            T(k,l)=init_dmat(cols(k),cols(l));
+        }}
+
+        for(k=0;k<ns;k++) block.col(k)=circmtx.col(cols(k));
+        block=block*T;
+        for(k=0;k<ns;k++) circmtx.col(cols(k))=block.col(k);
+    }}
+}
+
+
+//-------------------------------------------------------
+//
+//  Adds a gate to the gate list or replaces the
+//  gate selected by update.
+//
+//-------------------------------------------------------
+void qocircuit::record(gate g){
+//  gate  g;          // Gate to be recorded
+
+
+    // The gate list is shared with other copies
+    // of the circuit. Make a private copy first.
+    if(glist.use_count()>1) glist=make_shared<vector<gate>>(*glist);
+
+    // Replace a recorded gate.
+    // The circuit matrix and the partial
+    // matrices after it are no longer valid.
+    if(upd>=0){
+        (*glist)[upd]=g;
+        nchk=min(nchk,upd/nseg);
+        if(upd<ncomp) ncomp=-1;
+        upd=-1;
+        return;
+    }
+
+    // Add the new gate
+    glist->push_back(g);
+    ngate=ngate+1;
+}
+
+
+//-------------------------------------------------------
+//
+//  Applies a recorded gate to the circuit matrix
+//
+//-------------------------------------------------------
+void qocircuit::apply_record(int ig){
+//  int  ig;          // Gate number
+//  Variables
+    int  nbmch;       // U square matrix row/column dimension
+    int  km;          // Mode of the channel
+    int  npol;        // Number of polarizations to which U is applied separately
+    int  ipol;        // Polarization index
+    int  ks;          // Wavepacket index
+    int  nl;          // Number of different levels on which the gate acts
+    veci lev;         // Levels on which the gate acts
+    veci pos;         // Position in lev of the level of each row/column of U
+    matc G;           // Gate definition between the levels in lev
+//  Auxiliary index.
+    int  i;           // Aux index
+    int  k;           // Aux index
+    int  l;           // Aux index.
+
+
+    if((*glist)[ig].kind==0){
+        // Gate defined on channels.
+        // The gate acts separately on each wavepacket (and polarization
+        // if it is not given) and only the rows of those levels change.
+        nbmch=(*glist)[ig].U.cols();
+        if((*glist)[ig].iodef.rows()>1) npol=1;
+        else npol=nm;
+        lev.resize(nbmch);
+        pos.resize(nbmch);
+        for(ks=0;ks<ns;ks++){
+        for(ipol=0;ipol<npol;ipol++){
+            nl=0;
+            for(k=0;k<nbmch;k++){
+                if((*glist)[ig].iodef.rows()>1) km=(*glist)[ig].iodef(1,k);
+                else km=ipol;
+                i=i_idx[(*glist)[ig].iodef(0,k)][km][ks];
+                l=0;
+                while((l<nl)&&(lev(l)!=i)) l=l+1;
+                if(l==nl){
+                    lev(nl)=i;
+                    nl=nl+1;
+                }
+                pos(k)=l;
+            }
+
+            G=matc::Identity(nl,nl);
+            for(k=0;k<nbmch;k++){
+            for(l=0;l<nbmch;l++){
+                G(pos(k),pos(l))=(*glist)[ig].U(k,l);
+            }}
+            apply_gate(lev.head(nl),G);
+        }}
+    }else if((*glist)[ig].kind==1){
+        // Gate defined on levels
+        apply_gate((*glist)[ig].lev,(*glist)[ig].U);
+    }else if((*glist)[ig].kind==2){
+        // Full circuit matrix
+        circmtx=(*glist)[ig].U;
+    }else if((*glist)[ig].kind==3){
+        // Losses
+        compute_losses();
+    }else{
+        // Emitter
+        apply_emitter();
+    }
+}
+
+
 //----------------------------------------
 //
 //  Creates a random circuit
@@ -511,15 +815,18 @@ void qocircuit:: random_circuit(){
 //  Variables
     cmplx trow;               // Row normalization constant
     HouseholderQR<matc> qr;   // Householder QR matrix;
+    gate g;                   // Gate to be recorded
 //  Auxiliary index.
     int i;                    // Channel 1 matrix index
     int j;                    // Channel 2 matrix index
 
 
     // Create random non-unitary matrix.
+    g.kind=2;
+    g.U.resize(nlevel,nlevel);
     for(i=0;i<nlevel;i++){
         for(j=0;j<nlevel;j++){
-            circmtx(i,j)=urand()*exp(jm*2.0*pi*urand());
+            g.U(i,j)=urand()*exp(jm*2.0*pi*urand());
 
         }
     }
@@ -527,8 +834,9 @@ void qocircuit:: random_circuit(){
     // We ask to the final matrix to be unitary.
     // Perform a QR decomposition and return
     // the unitary matrix Q.
-    qr.compute(circmtx);
-    circmtx = qr.householderQ();
+    qr.compute(g.U);
+    g.U = qr.householderQ();
+    record(g);
 
 }
 
@@ -789,6 +1097,7 @@ int qocircuit:: add_gate(veci chlist, qocircuit *qoc){
     int    nclose;   // number of detectors needed to close the circuit.
     matc   U;        // Gate matrix definition
     mati   W;        // Channels to which U refers
+    gate   g;        // Gate to be recorded
 //  Auxiliary index
     int    i;        // Aux index
     int    j;        // Aux index
@@ -798,33 +1107,39 @@ int qocircuit:: add_gate(veci chlist, qocircuit *qoc){
     // Check limitations
     if (chlist.size()!=qoc->nch){
         cout << "add_gate error (qocircuit) #1: The number of channels in the list has to be the same than in the gate circuit." << endl;
+        upd=-1;
         return -1;
     }
 
     if (qoc->losses>0){
         cout << "add_gate error (qocircuit) #2: Losses must be configured to False in the gate circuit." << endl;
+        upd=-1;
         return -1;
     }
 
     if ((qoc->emiss==0)&&(remdec()==qoc->ndetc)){
         cout << "add_gate error (qocircuit) #3: Photons should be emitted before adding all detectors." << endl;
+        upd=-1;
         return -1;
     }
 
     if ((qoc->emiss==1)&&(remdec()!=qoc->ndetc)){
         cout << "add_gate error (qocircuit) #4: Photons have been already emitted." << endl;
         cout << "Note that this may happen because the definition of a delay inside the gate. Delays are forbidden in gates." << endl;
+        upd=-1;
         return -1;
     }
 
 
     if (qoc->np>1){
         cout << "add_gate error (qocircuit) #5: The number of periods must be one. We can not define periods in gates." << endl;
+        upd=-1;
         return -1;
     }
 
 
     // Copy gate definition
+    qoc->compile();
     if(qoc->ns>1){
         // From a non-ideal circuit with packets
         U.resize(qoc->nch*qoc->nm,qoc->nch*qoc->nm);
@@ -866,6 +1181,7 @@ int qocircuit:: add_gate(veci chlist, qocircuit *qoc){
     ndetc=ndetc+qoc->ndetc;
     if(ndetc>nch){
         cout << "add_gate error (qocircuit) #6: More detectors than channels are being declared." << endl;
+        upd=-1;
         return -1;
     }
 
@@ -896,11 +1212,17 @@ int qocircuit:: add_gate(veci chlist, qocircuit *qoc){
     else nclose=nch/2;
 
     // If this is the last detector compute losses if needed.
-    if((losses==1)&&(ndetc==nclose)) compute_losses();
+    if((losses==1)&&(ndetc==nclose)){
+        g.kind=3;
+        record(g);
+    }
 
     // If this is the last detector add the emitter matrix
     // at the beginning. (Otherwise computing the losses breaks the calculation)
-    if((emiss==1)&&(ndetc==nclose)) circmtx=circmtx*init_dmat;
+    if((emiss==1)&&(ndetc==nclose)){
+        g.kind=4;
+        record(g);
+    }
 
     // Return success
     return 0;
@@ -915,20 +1237,11 @@ int qocircuit:: custom_gate(mati iodef, matc U){
 //  matc U;           // Custom gate nxn matrix definitions
 //  Variables
     int  nbmch;       // U square matrix row/column dimension
-    int  ch1;         // Channel evaluated 1
-    int  ch2;         // Channel evaluated 2
-    int  km;          // Mode of the channel i_ch
-    int  km1;         // Mode of the channel i_ch
-    int  km2;         // Mode of the channel i_ch
-    int  ks;          // Wavepacket index
     veci CH;          // Channels to which U refers
     veci P;           // Channels to which U refers
-    matc oelement;    // Extended nlevelxnlevel custom gate definition
+    gate g;           // Gate to be recorded
 //  Auxiliary index.
     int  i;           // Aux index
-    int  j;           // Aux index
-    int  k;           // Aux index
-    int  l;           // Aux index.
 
 
     // Definitions format adaptation
@@ -939,12 +1252,14 @@ int qocircuit:: custom_gate(mati iodef, matc U){
         CH(i)  = iodef(0,i);
         if (CH(i)>=nch){
             cout << "Gate error: Gate declared in an undefined channel." << endl;
+            upd=-1;
             return -1;
         }
         if(iodef.rows()>1){
             P(i)   = iodef(1,i);
             if (P(i)>=nm){
                 cout << "Gate error: Gate declared in an undefined polarization." << endl;
+                upd=-1;
                 return -1;
             }
         }else{
@@ -952,35 +1267,11 @@ int qocircuit:: custom_gate(mati iodef, matc U){
         }
     }
 
-    //Conversion to nlevelxnlevel matrix
-    oelement.resize(nlevel,nlevel);
-    oelement=matc::Identity(nlevel,nlevel);
-    for(k=0;k<nbmch;k++){
-        ch1=CH(k);
-        km1=P(k);
-        for(l=0;l<nbmch;l++){
-            ch2=CH(l);
-            km2=P(l);
-            if(iodef.rows()>1){
-                for(ks=0;ks<ns;ks++){
-                    i=i_idx[ch1][km1][ks];
-                    j=i_idx[ch2][km2][ks];
-                    oelement(i,j)=U(k,l);
-                }
-            }else{
-                for(km=0;km<nm;km++){
-                for(ks=0;ks<ns;ks++){
-                    i=i_idx[ch1][km][ks];
-                    j=i_idx[ch2][km][ks];
-                    oelement(i,j)=U(k,l);
-                }}
-
-            }
-        }
-    }
-
-    // Update circuit with new element
-    circmtx=oelement*circmtx;
+    // Record the new element
+    g.kind=0;
+    g.iodef=iodef;
+    g.U=U;
+    record(g);
 
     // Return success
     return 0;
@@ -1003,38 +1294,39 @@ int qocircuit:: dispersion(int ch, double dt){
     int    ks;        // Wavepacket index
     int    iw;        // Frequency index
     double w;         // Frequency
-    matc oelement;    // Extended nlevelxnlevel custom gate definition
+    gate   g;         // Gate to be recorded
 //  Auxiliary index.
     int    i;         // Aux index
-    int    j;         // Aux index
 
 
     // Check
     if(ch>=nch){
         cout << "dispersion error: Dispersion declared in an undefined channel." << endl;
+        upd=-1;
         return -1;
     }
 
     if(emiss==0){
         cout << "dispersion error: No emitter set therefore no photon packets information available to compute the phase." << endl;
+        upd=-1;
         return -1;
     }
 
-    //Conversion to nlevelxnlevel matrix
-    oelement.resize(nlevel,nlevel);
-    oelement=matc::Identity(nlevel,nlevel);
-
+    // Record the new element.
+    // The phase is diagonal on the levels of the channel.
+    g.kind=1;
+    g.lev.resize(nm*npack);
+    g.U=matc::Zero(nm*npack,nm*npack);
+    i=0;
     for(km=0;km<nm;km++){
     for(ks=0;ks<npack;ks++){
-        i=i_idx[ch][km][ks];
-        j=i_idx[ch][km][ks];
+        g.lev(i)=i_idx[ch][km][ks];
         iw=emitted->pack_def(1,ks);
         w=emitted->freq(0,iw);
-        oelement(i,j)=exp(jm*dt*w);
+        g.U(i,i)=exp(jm*dt*w);
+        i=i+1;
     }}
-
-    // Update circuit with new element
-    circmtx=oelement*circmtx;
+    record(g);
 
     // Return success
     return 0;
@@ -1057,38 +1349,34 @@ int qocircuit:: dispersion(int ch, int P, double dt){
     int    ks;        // Wavepacket index
     int    iw;        // Frequency index
     double w;         // Frequency
-    matc oelement;    // Extended nlevelxnlevel custom gate definition
-//  Auxiliary index.
-    int    i;         // Aux index
-    int    j;         // Aux index
+    gate   g;         // Gate to be recorded
 
 
     // Check
     if(ch>=nch){
         cout << "dispersion error (Polarized): Dispersion declared in an undefined channel." << endl;
+        upd=-1;
         return -1;
     }
 
     if(emiss==0){
         cout << "dispersion error (Polarized): No emitter set therefore no photon packets information available to compute the phase." << endl;
+        upd=-1;
         return -1;
     }
 
-    //Conversion to nlevelxnlevel matrix
-    oelement.resize(nlevel,nlevel);
-    oelement=matc::Identity(nlevel,nlevel);
-
-
+    // Record the new element.
+    // The phase is diagonal on the levels with polarization P.
+    g.kind=1;
+    g.lev.resize(ns);
+    g.U=matc::Zero(ns,ns);
     for(ks=0;ks<ns;ks++){
-        i=i_idx[ch][P][ks];
-        j=i_idx[ch][P][ks];
+        g.lev(ks)=i_idx[ch][P][ks];
         iw=emitted->pack_def(1,ks);
         w=emitted->freq(0,iw);
-        oelement(i,j)=exp(jm*dt*w);
+        g.U(ks,ks)=exp(jm*dt*w);
     }
-
-    // Update circuit with new element
-    circmtx=oelement*circmtx;
+    record(g);
 
     // Return success
     return 0;
@@ -1539,19 +1827,49 @@ veci qocircuit:: emitter(){
 int qocircuit:: delay(int ch){
 //  int    ch;   // Channel to be delayed
 //  Variables
+    int    m;    // Mode of the channel
+    int    ks;   // Wavepacket index
+    int    iw;   // Frequency index
+    double w;    // Frequency
+    gate   g;    // Gate to be recorded
+//  Auxiliary index.
+    int    k;    // Aux index
 
 
     // Check
     if(ch>=nch){
         cout << "delay error: Delay declared in an undefined channel." << endl;
+        upd=-1;
+        return -1;
+    }
+
+    if(emiss==0){
+        cout << "delay error: No emitter set therefore no photon packets information available to compute the phase." << endl;
+        upd=-1;
         return -1;
     }
 
-    // Delay one period.
-    delay(ch,+1);
+    // Delay one period and compute the phase shift due the delay.
+    // Both are recorded as a single element.
+    g.kind=1;
+    g.lev.resize(nm*ns);
+    g.U=matc::Zero(nm*ns,nm*ns);
+    for(m=0;m<nm;m++){
+        for(k=0;k<ns;k++){
+            g.lev(m*ns+k)=i_idx[ch][m][k];
+            if(k>=nsp) g.U(m*ns+k,m*ns+k-nsp)=1.0;
+        }
+
+        for(ks=0;ks<npack;ks++){
+            iw=emitted->pack_def(1,ks);
+            w=emitted->freq(0,iw);
+            g.U.row(m*ns+ks)=g.U.row(m*ns+ks)*exp(jm*dtp*w);
+        }
+    }
+    record(g);
 
-    // Compute the phase shift due the delay
-    return dispersion(ch,dtp);
+    // Return success
+    return 0;
 }
 
 
@@ -1565,11 +1883,8 @@ int qocircuit:: delay(int i_ch, int ip){
 //  int  ip              // Number of periods to be delayed
 //  Variables
     int  m;              // Mode of the channels.
-    matc invT;           // Inverse of matrix T (T^{-1})
-    matc oelement;       // Extended nlevelxnlevel beamsplitter definition
+    gate g;              // Gate to be recorded
 //  Auxiliary index.
-    int  i;              // Channel 1 matrix index
-    int  j;              // Channel 2 matrix index
     int  k;              // Aux index "Times"
     int  l;              // Aux index "Times"
 
@@ -1577,29 +1892,26 @@ int qocircuit:: delay(int i_ch, int ip){
     // Check
     if(i_ch>=nch){
         cout << "delay error (T matrix): Delay declared in an undefined channel." << endl;
+        upd=-1;
         return -1;
     }
 
     // Reserve memory
-    oelement.resize(nlevel,nlevel);
-    oelement=matc::Identity(nlevel,nlevel);
+    g.kind=1;
+    g.lev.resize(nm*ns);
+    g.U=matc::Zero(nm*ns,nm*ns);
 
+    // In this case is a non reversible operation.
+    // The packets are shifted between the channel levels
+    // of each mode.
     for(m=0;m<nm;m++){
-        // Initialize
-        // We do not want identity for certain cases
+        for(k=0;k<ns;k++) g.lev(m*ns+k)=i_idx[i_ch][m][k];
         for(k=0;k<ns;k++){
         for(l=0;l<ns;l++){
-
-            i=i_idx[i_ch][m][k];
-            j=i_idx[i_ch][m][l];
-            if(k==l+ip*nsp) oelement(i,j)=1.0;
-            else oelement(i,j)=0.0;
+            if(k==l+ip*nsp) g.U(m*ns+k,m*ns+l)=1.0;
         }}
-
     }
-
-    // In this case is a non reversible operation
-    circmtx=oelement*circmtx;
+    record(g);
 
     // Return success
     return 0;
@@ -1622,6 +1934,7 @@ int qocircuit:: detector(int i_ch, int cond, int pol, int mpi, int mpo, double e
 //  double gamma;       // Dark counts rate
 //  Variables
     int nclose;         // Total number of channels
+    gate g;             // Gate to be recorded
 
 
     // Adds a new detector definition entry to the corresponding matrices
@@ -1631,10 +1944,12 @@ int qocircuit:: detector(int i_ch, int cond, int pol, int mpi, int mpo, double e
     // Check configuration errors
     if(ndetc>nch){
         cout << "detector error: More detectors than channels are being declared." << endl;
+        upd=-1;
         return -1;
     }
     if((i_ch>=nch)||(i_ch<0)){
         cout << "detector error: This channel does not exist." << endl;
+        upd=-1;
         return -1;
     }
 
@@ -1672,11 +1987,17 @@ int qocircuit:: detector(int i_ch, int cond, int pol, int mpi, int mpo, double e
     else nclose=nch/2;
 
     // If this is the last detector compute losses if needed.
-    if((losses==1)&&(ndetc==nclose)) compute_losses();
+    if((losses==1)&&(ndetc==nclose)){
+        g.kind=3;
+        record(g);
+    }
 
     // If this is the last detector add the emitter matrix
     // at the beginning. (Otherwise computing the losses breaks the calculation)
-    if((emiss==1)&&(ndetc==nclose)) circmtx=circmtx*init_dmat;
+    if((emiss==1)&&(ndetc==nclose)){
+        g.kind=4;
+        record(g);
+    }
 
     // Return success
     return 0;
@@ -1776,6 +2097,21 @@ void qocircuit::noise(double stdev2){
 }
 
 
+//--------------------------------------------------
+//
+//  Selects between the exact calculation of the
+//  detector dead time and dark counts or their
+//  sampling with R random iterations.
+//
+//--------------------------------------------------
+void qocircuit::exact_detection(bool i_exact){
+//  bool i_exact;      // Exact calculation true=Yes/false=No
+
+
+    exact=i_exact;
+}
+
+
 //----------------------------------------
 //
 //  Print circuit matrix
@@ -1796,6 +2132,9 @@ void qocircuit:: prnt(int format){
     int j;         // Aux index
 
 
+    // Compute the circuit matrix if needed
+    compile();
+
     // For all possible levels.
     for(i=0;i<nlevel;i++){
         firstline=1;
@@ -32,6 +32,9 @@ public:
     void reset();                                                            // Reset circuit
     int concatenate(qocircuit *qoc);                                         // Concatenates two circuits
     int num_levels();                                                        // Returns the number of levels of this circuit
+    int num_gates();                                                         // Returns the number of gates recorded in this circuit
+    int update(int id);                                                      // The next element added replaces the recorded gate id
+    void compile();                                                          // Computes the circuit matrix from the recorded gates
 
 
     // Circuit elements
@@ -69,6 +72,7 @@ public:
     int detector(int i_ch, int cond, int pol, int mpi, int mpo, double eff, double blnk, double gamma); // Adds a general physical detector with a window of detection (and conditional detection by polarization)
     int remdec();                                                            // Returns the remaining number of not defined detectors
     void noise(double stdev2);                                               // Adds noise to the output
+    void exact_detection(bool i_exact);                                      // Selects the exact calculation of the detector dead time and dark counts
 
 
     //      Emitter and distinguishability model.
@@ -89,6 +93,10 @@ public:
     // Auxiliary functions
     void create_circuit(int i_nch, int i_nm, int i_ns, int i_np, double i_dtp, int clock, int i_R, bool loss, char ckind);          // Auxiliary function to create circuits
     void compute_losses();                                                   // Auxiliary function to compute the states with less photons at the input than the output.
+    void apply_gate(veci lev, matc G);                                       // Applies a gate to the circuit updating only the rows of the levels it acts on
+    void apply_emitter();                                                    // Applies the emitter matrix at the beginning of the circuit
+    void record(gate g);                                                     // Adds a gate to the gate list
+    void apply_record(int ig);                                               // Applies a recorded gate to the circuit matrix
 };
 
 
@@ -129,6 +137,9 @@ const char pl[2]={'H','V'};  ///< Alphabet to print polarizations.
 // Constant.
 const int H=0;               ///< Numerical value for horizontal polarization
 const int V=1;               ///< Numerical value for vertical polarization
+const int DEFGATEDIM=32;     ///< Default initial dimension of the gate list
+const int DEFSEGLEN=64;      ///< Default minimum number of gates between two stored partial circuit matrices
+const long long int DEFCHKMEM=67108864; ///< Default memory in bytes reserved for the partial circuit matrices
 
 
 //Group definitions
@@ -308,6 +319,16 @@ public:
         int m;              ///< Mode (Polarization).
         int s;              ///< Wavepacket index.
     };
+    /**
+    *  \struct gate
+    *  \brief  Definition of a recorded gate
+    */
+    struct gate{
+        int  kind;          ///< Kind of gate 0=On channels/1=On levels/2=Full matrix/3=Losses/4=Emitter
+        mati iodef;         ///< Channels and polarizations to which U refers (kind 0).
+        veci lev;           ///< Levels to which U refers (kind 1).
+        matc U;             ///< Gate matrix (kinds 0,1 and 2).
+    };
 
     // Public variables
     int    nlevel;          ///< Number of levels.
@@ -321,7 +342,17 @@ public:
     // Dictionary
     level *idx;             ///< Level index: index->level.
     int ***i_idx;           ///< Inverse level index: level->index
-    matc   circmtx;         ///< Matrix of the circuit as a function of the level number.
+    matc   circmtx;         ///< Matrix of the circuit as a function of the level number. Computed from the gate list by compile().
+
+    // Gate list
+    int    ngate;           ///< Number of recorded gates.
+    shared_ptr<vector<gate>> glist; ///< List of recorded gates. Shared between copies of the circuit until one of them modifies it.
+    int    ncomp;           ///< Number of gates already applied to circmtx (-1 if circmtx has to be recomputed).
+    int    upd;             ///< Gate replaced by the next element added (-1 if none).
+    int    nseg;            ///< Number of gates between two stored partial circuit matrices.
+    int    nchk;            ///< Number of valid partial circuit matrices.
+    int    maxchk;          ///< Maximum number of partial circuit matrices (0 until a gate is updated).
+    matc  *chk;             ///< Partial circuit matrices. chk[i] is the circuit matrix after the first (i+1)*nseg gates.
 
     // Emitter model
     char   ckind;           ///< Kind of emitter 'G'=Gaussian/'E'=Exponential
@@ -345,6 +376,7 @@ public:
     veci   ch_ignored;      ///< Channels with no detectors or ignored channels.
     int    R;               ///< Number of iterations to calculate detector dead time and dark-counts
     double dev;             ///< Detector standard deviation squared of the Gaussian noise
+    bool   exact;           ///< Exact calculation of detector dead time and dark counts instead of R random iterations
 
 
 
@@ -449,6 +481,35 @@ public:
     *  @ingroup Circuit_management
     */
     int num_levels();
+    /**
+    *  Returns the number of gates recorded in the circuit. Gates are numbered in order starting from zero.<br>
+    *  Each optical element adds one gate (add_gate and concatenate add one gate for the whole circuit added).
+    *  Detectors also record gates: a detector with efficiency lower than one adds a phase shifter gate and
+    *  the last detector adds one gate for the losses calculation (if losses are computed) and one for the emitter
+    *  (if it is defined). Emitter definitions do not record gates.
+    *
+    *  @return Number of gates of the circuit.
+    *  @ingroup Circuit_management
+    */
+    int num_gates();
+    /**
+    *  The next element added to the circuit replaces the recorded gate id instead of being appended at the end.
+    *  It allows to change the parameters of an element without building again the circuit. The first call reserves
+    *  a limited number of partial circuit matrices so later compilations only recompute the part after the gate.
+    *  If the next element can not be added the selection is cleared and the recorded gate is kept.
+    *
+    *  @param int id Number of the gate to be replaced.
+    *  @return 0 if success -1 if an error happened.
+    *  @ingroup Circuit_management
+    */
+    int update(int id);
+    /**
+    *  Computes the circuit matrix applying the recorded gates that have not been applied yet.
+    *  It is called by the simulator before the circuit matrix is used.
+    *
+    *  @ingroup Circuit_management
+    */
+    void compile();
 
 
 
@@ -848,6 +909,15 @@ public:
     *  @ingroup Circuit_detector
     */
     void noise(double stdev2);
+    /**
+    *  Selects how the detector dead time and dark counts are calculated. By default they are sampled with R random iterations.
+    *  In exact mode each bin is convolved with the blinking and dark counts probabilities. The result is deterministic and
+    *  it is obtained in a single pass. Poissonian dark counts are truncated when their probability is below DEFDARKTOL.
+    *
+    *  @param bool i_exact  True for the exact calculation. False for the random sampling.
+    *  @ingroup Circuit_detector
+    */
+    void exact_detection(bool i_exact);
 
     // Print functions
     /** @defgroup Circuit_print Circuit output information
@@ -909,5 +979,39 @@ public:
     *  @ingroup Circuit_aux
     */
     void compute_losses();
+    /**
+    *  Applies a gate that acts on a few levels to the circuit. Only the rows of those levels in the circuit matrix are updated
+    *  which is equivalent to multiply by the nlevelxnlevel extension of the gate. <br>
+    *  <b> Intended for internal use of the library. </b>
+    *
+    *  @param veci lev  Levels on which the gate acts.
+    *  @param matc G    Gate matrix between the levels in lev.
+    *  @ingroup Circuit_aux
+    */
+    void apply_gate(veci lev, matc G);
+    /**
+    *  Applies the emitter matrix init_dmat at the beginning of the circuit. Only the wavepackets of the same channel
+    *  and polarization are mixed therefore the columns of each of them are updated separately. <br>
+    *  <b> Intended for internal use of the library. </b>
+    *
+    *  @ingroup Circuit_aux
+    */
+    void apply_emitter();
+    /**
+    *  Adds a gate to the gate list or replaces the gate selected by update(int id). <br>
+    *  <b> Intended for internal use of the library. </b>
+    *
+    *  @param gate g Gate to be recorded.
+    *  @ingroup Circuit_aux
+    */
+    void record(gate g);
+    /**
+    *  Applies a recorded gate to the circuit matrix. <br>
+    *  <b> Intended for internal use of the library. </b>
+    *
+    *  @param int ig Number of the gate.
+    *  @ingroup Circuit_aux
+    */
+    void apply_record(int ig);
 };
 
@@ -1225,6 +1225,20 @@ void qodev::noise(double stdev2){
 }
 
 
+//----------------------------------------
+//
+//  Selects the exact calculation of the
+//  detector dead time and dark counts
+//
+//----------------------------------------
+void qodev::exact_detection(bool i_exact){
+//  bool i_exact;      // Exact calculation true=Yes/false=No
+
+
+    circ->exact_detection(i_exact);
+}
+
+
 //----------------------------------------
 //
 //  Adds a delay using the packet definition given by def_packet
@@ -1456,3 +1470,29 @@ void qodev::prnt_packets(){
     cout << "Table of packets:" << endl;
     circ->emitted->prnt_packets();
 }
+
+
+//----------------------------------------
+//
+//  Returns the number of recorded gates
+//
+//----------------------------------------
+int qodev::num_gates(){
+
+
+    return circ->num_gates();
+}
+
+
+//----------------------------------------
+//
+//  Selects the gate to be replaced by the
+//  next element added to the device
+//
+//----------------------------------------
+int qodev::update(int id){
+//  int id;      // Gate to be replaced
+
+
+    return circ->update(id);
+}
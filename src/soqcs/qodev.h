@@ -43,6 +43,8 @@ class qodev{
     void repack(veci ipack);                                                            // Changed packets Gram-Schmidt order
     double emitted_vis(int i,int j);                                                    // Probability of two wave packets given by def_packet to overlap.
     void prnt_packets();                                                                // Prints metacircuit packet configuration
+    int num_gates();                                                                    // Returns the number of gates recorded in the circuit
+    int update(int id);                                                                 // The next element added replaces the recorded gate id
 
     // Circuit elements
     //      Basic elements
@@ -74,6 +76,7 @@ class qodev{
     int detector(int i_ch, int cond, double eff, double blnk, double gamma);            // Adds a general physical detector
     int detector(int i_ch, int cond, int pol, int mpi, int mpo, double eff, double blnk, double gamma); // Adds a general physical detector with a window of detection (and conditional detection by polarization)
     void noise(double stdev2);                                                          // Adds noise to the output
+    void exact_detection(bool i_exact);                                                 // Selects the exact calculation of the detector dead time and dark counts
     state *apply_condition(state *input, bool ignore);                                  // Apply a single-ket post selection to ideal circuits.
     state *apply_condition(state *input);                                               // Apply a single-ket post selection to ideal circuits.
 
@@ -406,6 +409,25 @@ public:
     *  @ingroup QODev_initial
     */
     void prnt_packets();
+    /**
+    *  Returns the number of gates recorded in the circuit of the device. Gates are numbered in order starting from zero.<br>
+    *  Each optical element adds one gate. Detectors also record gates: a detector with efficiency lower than one adds
+    *  a phase shifter gate and the last detector adds one gate for the losses calculation (if losses are computed) and
+    *  one for the emitter (if it is defined). Photon definitions do not record gates.
+    *
+    *  @return Number of gates of the circuit.
+    *  @ingroup QODev_initial
+    */
+    int num_gates();
+    /**
+    *  The next element added to the device replaces the recorded gate id instead of being appended at the end.
+    *  It allows to change the parameters of an element without building again the device.
+    *
+    *  @param int id Number of the gate to be replaced.
+    *  @return 0 if success -1 if an error happened.
+    *  @ingroup QODev_initial
+    */
+    int update(int id);
 
 
     // Circuit elements
@@ -672,6 +694,13 @@ public:
     *  @ingroup QODev_Circuit_detector
     */
     void noise(double stdev2);
+    /**
+    *  Selects the exact calculation of the detector dead time and dark counts instead of their sampling with R random iterations.
+    *
+    *  @param bool i_exact  True for the exact calculation. False for the random sampling.
+    *  @ingroup QODev_Circuit_detector
+    */
+    void exact_detection(bool i_exact);
 
     /**
     *  Apply the post-selection condition defined by the detectors in an ideal circuit to a state. It is possible to overlook the ignored channels definition in the circuit and maintain those channels in the output.<br>
@@ -23,6 +23,8 @@ simulator::simulator(){
 
 
     mem=DEFSIMMEM;
+    cachesize=0;
+    dense=false;
 }
 
 
@@ -36,6 +38,8 @@ simulator::simulator(int i_mem){
 
 
     mem=i_mem;
+    cachesize=0;
+    dense=false;
 }
 
 
@@ -47,6 +51,57 @@ simulator::simulator(int i_mem){
 simulator::~simulator(){
 }
 
+
+//----------------------------------------
+//
+// Enables the cache of permanents.
+//
+//----------------------------------------
+void simulator::set_cache(long long int size){
+//  long long int size;  // Maximum number of permanents stored
+
+
+    cachesize=max(size,(long long int)0);
+    pcache.resize(cachesize);
+}
+
+
+//----------------------------------------
+//
+// Clears the cache of permanents.
+//
+//----------------------------------------
+void simulator::clear_cache(){
+
+
+    pcache.clear();
+}
+
+
+//----------------------------------------
+//
+// Counters of the cache of permanents.
+//
+//----------------------------------------
+tuple<long long int, long long int> simulator::cache_stats(){
+
+
+    return {pcache.hits(),pcache.misses()};
+}
+
+
+//----------------------------------------
+//
+// Enables the dense output mode.
+//
+//----------------------------------------
+void simulator::set_dense(bool i_dense){
+//  bool i_dense;        // True to enable the dense output mode
+
+
+    dense=i_dense;
+}
+
 //----------------------------------------
 //
 // Simulation of a device
@@ -115,23 +170,38 @@ state *simulator::run( state *istate, qocircuit *qoc, int method, int nthreads )
 //  int        nthreads          // Number of threads
 //  Variable
     state *empty_state;          // Empty state to return in case of bad init
+    state *ostate;               // Output state
+    dense_state *dstate;         // Output state stored by rank
 
 
+    // Compute the circuit matrix if needed
+    qoc->compile();
+
     if(nthreads<0) nthreads=1;
 
+    // Dense output mode
+    if(dense&&(method>=2)&&(method<=5)){
+        dstate=split_dense(istate,qoc,method,nthreads);
+        if(dstate!=nullptr){
+            ostate=dstate->to_state();
+            delete dstate;
+            return ostate;
+        }
+    }
+
     switch (method)
     {
         case 0: // DirectF
-            return DirectF(istate,qoc);
+            return DirectF(istate,qoc,nthreads);
             break;
         case 1: // DirectR
-            return DirectR(istate,qoc);
+            return DirectR(istate,qoc,nthreads);
             break;
         case 2: // GlynnF
-            return GlynnF(istate,qoc);
+            return GlynnF(istate,qoc,nthreads);
             break;
         case 3: // GlynnR
-            return GlynnR(istate,qoc);
+            return GlynnR(istate,qoc,nthreads);
             break;
         case 4: // OMP RyserF
             return RyserF(istate,qoc,nthreads);
@@ -145,6 +215,15 @@ state *simulator::run( state *istate, qocircuit *qoc, int method, int nthreads )
         case 7: // Fast Glynn R  + Selected distribution
             return Fast_Ryser(istate,qoc,false,nthreads);
             break;
+        case 8: // LaplaceF
+            return LaplaceF(istate,qoc);
+            break;
+        case 9: // DirectP full
+            return DirectP(istate,qoc,true);
+            break;
+        case 10: // DirectP restricted
+            return DirectP(istate,qoc,false);
+            break;
         default:
             cout << "Run error: No recognized backend." << endl;
             empty_state=new state(istate->nph,istate->nlevel,mem);
@@ -154,6 +233,32 @@ state *simulator::run( state *istate, qocircuit *qoc, int method, int nthreads )
 }
 
 
+//--------------------------------------------------------------
+//
+// Calculate output state as function of the input state.
+// The output is stored by rank in a dense state.
+//
+//---------------------------------------------------------------
+dense_state *simulator::run_dense( state *istate, qocircuit *qoc, int method, int nthreads ){
+//  state     *istate;           // Input state
+//  qocircuit *qoc               // Circuit to be simulated
+//  int        method            // Core method
+//  int        nthreads          // Number of threads
+
+
+    // Compute the circuit matrix if needed
+    qoc->compile();
+
+    if(nthreads<0) nthreads=1;
+    if((method<2)||(method>5)){
+        cout << "Run dense error: No recognized backend." << endl;
+        return nullptr;
+    }
+
+    return split_dense(istate,qoc,method,nthreads);
+}
+
+
 //--------------------------------------------------------------
 //
 // Calculate the output amplitudes for the kets in olist as a
@@ -181,6 +286,10 @@ state *simulator::run( state *istate, ket_list* olist, qocircuit *qoc, int metho
 //  Variable
     state *empty_state;     // Empty state to return in case of bad init
 
+
+    // Compute the circuit matrix if needed
+    qoc->compile();
+
     if(nthreads<0) nthreads=1;
 
     switch (method)
@@ -202,30 +311,94 @@ state *simulator::run( state *istate, ket_list* olist, qocircuit *qoc, int metho
 }
 
 
+//--------------------------------------------------------------
+//
+// Estimates the output amplitudes for the kets in olist
+// as a function of the input state using the randomized
+// Gurvits estimator. Also returns their standard errors.
+//
+//---------------------------------------------------------------
+tuple<state*, vecd> simulator::gurvits( state *istate, ket_list* olist, qocircuit *qoc, double eps, double conf, int nthreads ){
+//  state     *istate;      // Input state
+//  ket_list  *olist;       // Output ket list
+//  qocircuit *qoc          // Circuit to be simulated
+//  double     eps;         // Additive error
+//  double     conf;        // Confidence
+//  int        nthreads     // Number of threads
+//  Variables
+    state *ostate;          // Output state
+    vecd   serr;            // Standard errors
+
+
+    // Compute the circuit matrix if needed
+    qoc->compile();
+
+    if(nthreads<0) nthreads=1;
+    ostate=GurvitsS(istate,olist,qoc,eps,conf,nthreads,serr);
+    return {ostate,serr};
+}
+
+
 //--------------------------------------------------------------
 //
 // Direct method. Full distribution
 //
 //---------------------------------------------------------------
-state *simulator::DirectF( state *istate, qocircuit *qoc ){
+state *simulator::DirectF( state *istate, qocircuit *qoc, int nthreads ){
+//  state     *istate;      // Input state
+//  qocircuit *qoc          // Circuit to be simulated
+//  int        nthreads     // Number of threads
+
+
+    return split_outputs(istate,qoc,0,nthreads);
+}
+
+
+//--------------------------------------------------------------
+//
+// Direct method. Restricted distribution.
+// We consider only the output kets with occupation zero or 1.
+//
+//---------------------------------------------------------------
+state *simulator::DirectR( state *istate, qocircuit *qoc, int nthreads ){
 //  state     *istate;      // Input state
 //  qocircuit *qoc          // Circuit to be simulated
+//  int        nthreads     // Number of threads
+
+
+    return split_outputs(istate,qoc,1,nthreads);
+}
+
+
+//--------------------------------------------------------------
+//
+// Direct method applied photon by photon.
+// The creation operator of each input photon is transformed
+// by the circuit and applied to the partial output state.
+// Equal partial occupations are merged after each photon.
+//
+//---------------------------------------------------------------
+state *simulator::DirectP( state *istate, qocircuit *qoc, bool F ){
+//  state     *istate;      // Input state
+//  qocircuit *qoc          // Circuit to be simulated
+//  bool       F            // True: Full distribution. False: Only kets with at most one photon by level.
 //  Variables
-    int    tocc;            // Number of photons present in ket.
     int    nlevel;          // Number of levels (qoc has this information, but it is put in this variable for easy access)
-    int    index;           // Ket list position where a new term of the output state is stored.
+    int    nph;             // Number of photons already applied
+    int    maxket;          // Maximum number of kets of the partial output state
+    double nbound;          // Bound of the number of kets of the partial output state
+    int   *occ;             // Occupation
     double sqfact;          // Global sqrt factor to divide to get proper normalization
-    long   int ncoef;       // Number of coefficients
+    cmplx  u;               // Circuit matrix element
     cmplx  coef;            // Coefficient for the transformation of a ket.
-    veci   occs;            // Occupations of the states involved in the transformation of a ket.
-    veci   ilev;            // sequence input levels
+    state *pstate;          // Partial output state
+    state *nstate;          // Partial output state after one more photon
     state *ostate;          // Output state
 //  Index
     int    iket;            // Index of input kets elements
+    int    ipket;           // Index of partial state kets
     int    ilin;            // Index of input levels
     int    ilout;           // Index of output levels
-    int    icoef;           // Index of coefficients for a particular ket
-    int    iseq;            // Index of a position in a sequence
 //  Auxiliary index
     int    j;               // Aux index
 
@@ -233,416 +406,604 @@ state *simulator::DirectF( state *istate, qocircuit *qoc ){
     //Set up variables and reserve memory
     nlevel=qoc->nlevel;
     ostate=new state(istate->nph, nlevel,mem);
+    occ=new int[nlevel];
 
     // Main loop
     // For each ket of a state calculate transformation rule.
     for(iket=0;iket<istate->nket;iket++){
     if(abs(istate->ampl[iket])>xcut){
-        // Calculate number of photons of the ket
         // Normalization factors
-        tocc=0;
         sqfact=1.0;
         for(ilin=0;ilin<nlevel;ilin++){
-            tocc=tocc+istate->ket[iket][ilin];
             sqfact=sqfact*sqrt((double)factorial(istate->ket[iket][ilin]));
         }
 
+        // Start from the vacuum
+        nph=0;
+        pstate=new state(istate->nph, nlevel,2);
+        for(j=0;j<nlevel;j++) occ[j]=0;
+        pstate->add_term(istate->ampl[iket]/sqfact,occ);
 
-        //Calculate from which input constructor we obtain the output one
-        ncoef=pow(nlevel,tocc);
-        ilev.resize(tocc);
-        iseq=0;
+        // Apply the transformed creation operator of each input photon
         for(ilin=0;ilin<nlevel;ilin++){
-            for(j=0;j<istate->ket[iket][ilin];j++){
-                ilev(iseq)=ilin;
-                iseq++;
+        for(j=0;j<istate->ket[iket][ilin];j++){
+            // Reserve only the memory the partial state can use
+            nph=nph+1;
+            nbound=1.0;
+            for(ilout=0;ilout<nph;ilout++){
+                if(F) nbound=nbound*(double)(nlevel+ilout)/(double)(ilout+1);
+                else  nbound=nbound*(double)(nlevel-ilout)/(double)(ilout+1);
+            }
+            // One more so existing kets can still be updated when it is full.
+            maxket=(int)min((double)mem,nbound+1.5);
+            nstate=new state(istate->nph, nlevel,maxket);
+            for(ipket=0;ipket<pstate->nket;ipket++){
+            if(abs(pstate->ampl[ipket])>xcut){
+                for(ilout=0;ilout<nlevel;ilout++) occ[ilout]=pstate->ket[ipket][ilout];
+                for(ilout=0;ilout<nlevel;ilout++){
+                    u=qoc->circmtx(ilout,ilin);
+                    if((abs(u)>xcut)&&(F||(occ[ilout]==0))){
+                        occ[ilout]=occ[ilout]+1;
+                        coef=pstate->ampl[ipket]*u*sqrt((double)occ[ilout]);
+                        nstate->add_term(coef,occ);
+                        occ[ilout]=occ[ilout]-1;
+                    }
+                }
+            }}
+            delete pstate;
+            pstate=nstate;
+        }}
+
+        // Store
+        for(ipket=0;ipket<pstate->nket;ipket++){
+            if(abs(pstate->ampl[ipket])>xcut){
+                ostate->add_term(pstate->ampl[ipket],pstate->ket[ipket]);
             }
         }
+        delete pstate;
+    }
+    }
 
-        // Translate these sequences into actual coefficients and occupations
-        occs.resize(nlevel);
+    // Free memory
+    delete[] occ;
 
-        //For each coefficient and its occupation that correspond with one sequence
-        for(icoef=0;icoef<ncoef;icoef++){
-            coef=1.0;
-            occs.setZero(nlevel);
-            //Transform sequences int occupations and coefficients
-            iseq=0;
-            while((iseq<tocc)&&(abs(coef)>xcut)){
-                ilin=ilev(iseq);
-                ilout=(icoef/intpow(nlevel,iseq))%nlevel;
-                occs(ilout)=occs(ilout)+1;
-                coef=coef*qoc->circmtx(ilout,ilin)*sqrt((double)occs(ilout));
-                iseq++;
+    // Return output
+    return ostate;
+}
+
+
+//--------------------------------------------------------------
+//
+// Permanent calculation method (using Glynn formula). Full distribution.
+//
+//---------------------------------------------------------------
+state *simulator::GlynnF( state *istate, qocircuit *qoc, int nthreads ){
+//  state     *istate;      // Input state
+//  qocircuit *qoc          // Circuit to be simulated
+//  int        nthreads     // Number of threads
+
+
+    return split_outputs(istate,qoc,2,nthreads);
+}
+
+
+//--------------------------------------------------------------
+//
+// Permanent calculation method (using Glynn formula). Restricted distribution.
+// We consider only output states with occupation zero or one.
+//
+//---------------------------------------------------------------
+state *simulator::GlynnR( state *istate, qocircuit *qoc, int nthreads ){
+//  state     *istate;      // Input state
+//  qocircuit *qoc          // Circuit to be simulated
+//  int        nthreads     // Number of threads
+
+
+    return split_outputs(istate,qoc,3,nthreads);
+}
+
+
+//--------------------------------------------------------------
+//
+// Splits the enumeration of the outputs of each input ket in
+// consecutive ranges, one by thread. Each thread stores its
+// results in its own output state and these are merged at the
+// end in the order of the ranges.
+//
+//---------------------------------------------------------------
+state *simulator::split_outputs( state *istate, qocircuit *qoc, int core, int nthreads ){
+//  state     *istate;           // Input state
+//  qocircuit *qoc               // Circuit to be simulated
+//  int        core              // Core method 0=DirectF/1=DirectR/2=GlynnF/3=GlynnR
+//  int        nthreads          // Number of threads
+//  Variables
+    int    nph;                  // Number of photons present in input ket.
+    int    nlevel;               // Number of levels (qoc has this information, but it is put in this variable for easy access)
+    long long int nout;          // Number of outputs of an input ket
+    state **tstate;              // Output state of each thread
+    state *ostate;               // Output state
+//  Index
+    int    iket;                 // Index of input kets elements
+    int    ithread;              // Index of threads
+    int    ik;                   // Index of kets of the thread output states
+//  Auxiliary index
+    int    i;                    // Aux index
+
+
+    //Set up variables and reserve memory
+    nlevel=qoc->nlevel;
+    if(nthreads<1) nthreads=1;
+    ostate=new state(istate->nph,nlevel,mem);
+    tstate=new state*[nthreads];
+    tstate[0]=ostate;
+    for(ithread=1;ithread<nthreads;ithread++) tstate[ithread]=new state(istate->nph,nlevel,mem);
+
+    // Main loop
+    // For each ket of a state calculate transformation rule.
+    for(iket=0;iket<istate->nket;iket++){
+    if(abs(istate->ampl[iket])>xcut){
+        // Number of outputs
+        nph=0;
+        for(i=0;i<nlevel;i++) nph=nph+istate->ket[iket][i];
+        switch(core){
+            case 0:  nout=(long long int)pow(nlevel,nph);  break;
+            case 2:  nout=binomial(nlevel+nph-1,nph);     break;
+            default: nout=binomial(nlevel,nph);           break;
+        }
+
+        // Each thread calculates a range of outputs
+        #pragma omp parallel for schedule(static) num_threads(nthreads)
+        for(ithread=0;ithread<nthreads;ithread++){
+            switch(core){
+                case 0:  aux_DirectF(istate,iket,qoc,nout*ithread/nthreads,nout*(ithread+1)/nthreads,tstate[ithread]); break;
+                case 1:  aux_DirectR(istate,iket,qoc,nout*ithread/nthreads,nout*(ithread+1)/nthreads,tstate[ithread]); break;
+                case 2:  aux_GlynnF(istate,iket,qoc,nout*ithread/nthreads,nout*(ithread+1)/nthreads,tstate[ithread],nullptr);  break;
+                default: aux_GlynnR(istate,iket,qoc,nout*ithread/nthreads,nout*(ithread+1)/nthreads,tstate[ithread],nullptr);  break;
             }
-            // Normalize
-            coef=istate->ampl[iket]*coef/sqfact;
+        }
+    }}
+
+    // Merge the output of the threads
+    for(ithread=1;ithread<nthreads;ithread++){
+        for(ik=0;ik<tstate[ithread]->nket;ik++){
+            ostate->add_term(tstate[ithread]->ampl[ik],tstate[ithread]->ket[ik]);
+        }
+        delete tstate[ithread];
+    }
+
+    // Free memory
+    delete[] tstate;
+
+    // Return output
+    return ostate;
+}
+
+
+//--------------------------------------------------------------
+//
+// Splits the outputs of each input ket of the Glynn and Ryser
+// methods in consecutive ranges of ranks, one by thread. The
+// threads add their amplitudes directly into a dense state.
+// The ranges do not overlap so no locks are needed.
+//
+//---------------------------------------------------------------
+dense_state *simulator::split_dense( state *istate, qocircuit *qoc, int core, int nthreads ){
+//  state     *istate;           // Input state
+//  qocircuit *qoc               // Circuit to be simulated
+//  int        core              // Core method 2=GlynnF/3=GlynnR/4=RyserF/5=RyserR
+//  int        nthreads          // Number of threads
+//  Variables
+    int    nph;                  // Number of photons of the input kets
+    int    tocc;                 // Number of photons present in input ket.
+    int    nlevel;               // Number of levels (qoc has this information, but it is put in this variable for easy access)
+    long long int nout;          // Number of outputs of an input ket
+    veci   constraint;           // Constraint vector. No constraint.
+    veci   uclevels;             // List of levels without a constraint. All of them.
+    dense_state *dstate;         // Output state stored by rank
+//  Index
+    int    iket;                 // Index of input kets elements
+    int    ithread;              // Index of threads
+//  Auxiliary index
+    int    i;                    // Aux index
+
+
+    // All the kets must have the same number of photons
+    nlevel=qoc->nlevel;
+    if(nthreads<1) nthreads=1;
+    nph=-1;
+    for(iket=0;iket<istate->nket;iket++){
+    if(abs(istate->ampl[iket])>xcut){
+        tocc=0;
+        for(i=0;i<istate->sidx[iket+1]-istate->sidx[iket];i++) tocc=tocc+istate->socc[istate->sidx[iket]+i];
+        if(nph<0) nph=tocc;
+        if(tocc!=nph){
+            cout << "Simulator(dense): Warning! The input kets have different numbers of photons. The dense output is not available." << endl;
+            return nullptr;
+        }
+    }}
+    if(nph<0) nph=0;
+
+    // Set up variables and reserve memory
+    dstate=new dense_state(nph,nlevel,(core==2)||(core==4));
+    nout=dstate->size;
+    constraint.resize(nlevel);
+    uclevels.resize(nlevel);
+    for(i=0;i<nlevel;i++){
+        constraint(i)=-1;
+        uclevels(i)=i;
+    }
+
+    // Main loop
+    // For each ket of a state calculate transformation rule.
+    for(iket=0;iket<istate->nket;iket++){
+    if(abs(istate->ampl[iket])>xcut){
+        if((core<4)||((nthreads>1)&&(nout>=nthreads)&&(nph>0)&&(nph<32)&&(((long int)1<<(nph-1))<RYSERGRAIN*nthreads))){
+            // Each thread calculates a range of outputs
+            #pragma omp parallel for schedule(static) num_threads(nthreads)
+            for(ithread=0;ithread<nthreads;ithread++){
+                switch(core){
+                    case 2:  aux_GlynnF(istate,iket,qoc,nout*ithread/nthreads,nout*(ithread+1)/nthreads,nullptr,dstate->ampl); break;
+                    case 3:  aux_GlynnR(istate,iket,qoc,nout*ithread/nthreads,nout*(ithread+1)/nthreads,nullptr,dstate->ampl); break;
+                    case 4:  range_RyserF(istate,iket,nullptr,qoc,0,constraint,uclevels,nout*ithread/nthreads,nout*(ithread+1)/nthreads,1,dstate->ampl); break;
+                    default: range_RyserR(istate,iket,nullptr,qoc,0,constraint,uclevels,nout*ithread/nthreads,nout*(ithread+1)/nthreads,1,dstate->ampl); break;
+                }
+            }
+        }else{
+            // Large Ryser permanents. Each one is split between threads.
+            if(core==4) range_RyserF(istate,iket,nullptr,qoc,0,constraint,uclevels,0,nout,nthreads,dstate->ampl);
+            else        range_RyserR(istate,iket,nullptr,qoc,0,constraint,uclevels,0,nout,nthreads,dstate->ampl);
+        }
+    }}
+
+    // Return output
+    return dstate;
+}
+
+
+//--------------------------------------------------------------
+//
+// Auxiliary method of the Direct method. Full distribution.
+// Calculates the outputs from first to last-1 of an input ket.
+//
+//---------------------------------------------------------------
+void simulator::aux_DirectF( state *istate, int iket, qocircuit *qoc, long long int first, long long int last, state *ostate ){
+//  state     *istate;      // Input state
+//  int        iket;        // Input ket
+//  qocircuit *qoc          // Circuit to be simulated
+//  long long int first;    // First output sequence
+//  long long int last;     // Last output sequence (not included)
+//  state     *ostate;      // Output state
+//  Variables
+    int    tocc;            // Number of photons present in ket.
+    int    nlevel;          // Number of levels (qoc has this information, but it is put in this variable for easy access)
+    double sqfact;          // Global sqrt factor to divide to get proper normalization
+    long long int digits;   // Remaining digits of the sequence index
+    cmplx  coef;            // Coefficient for the transformation of a ket.
+    veci   occs;            // Occupations of the states involved in the transformation of a ket.
+    veci   ilev;            // sequence input levels
+//  Index
+    int    ilin;            // Index of input levels
+    int    ilout;           // Index of output levels
+    long long int icoef;    // Index of coefficients for a particular ket
+    int    iseq;            // Index of a position in a sequence
+//  Auxiliary index
+    int    j;               // Aux index
+
+
+    // Calculate number of photons of the ket
+    // Normalization factors
+    nlevel=qoc->nlevel;
+    tocc=0;
+    sqfact=1.0;
+    for(ilin=0;ilin<nlevel;ilin++){
+        tocc=tocc+istate->ket[iket][ilin];
+        sqfact=sqfact*sqrt((double)factorial(istate->ket[iket][ilin]));
+    }
+
 
-            // Store
-            if(abs(coef)>xcut){
-                index=ostate->add_term(coef,(int *)(occs.data()));
-                if(index<0){
-                    cout << "Simulator(DirectF): Warning! Simulation canceled because the memory limit has been exceeded.  Increase *mem* for more memory." << endl;
-                    return ostate;
-                }
-            }
+    //Calculate from which input constructor we obtain the output one
+    ilev.resize(tocc);
+    iseq=0;
+    for(ilin=0;ilin<nlevel;ilin++){
+        for(j=0;j<istate->ket[iket][ilin];j++){
+            ilev(iseq)=ilin;
+            iseq++;
         }
     }
-    }
 
-    // Return output
-    return ostate;
+    // Translate these sequences into actual coefficients and occupations
+    occs.resize(nlevel);
+
+    //For each coefficient and its occupation that correspond with one sequence
+    for(icoef=first;icoef<last;icoef++){
+        coef=1.0;
+        occs.setZero(nlevel);
+        //Transform sequences int occupations and coefficients
+        iseq=0;
+        digits=icoef;
+        while((iseq<tocc)&&(abs(coef)>xcut)){
+            ilin=ilev(iseq);
+            ilout=(int)(digits%nlevel);
+            digits=digits/nlevel;
+            occs(ilout)=occs(ilout)+1;
+            coef=coef*qoc->circmtx(ilout,ilin)*sqrt((double)occs(ilout));
+            iseq++;
+        }
+        // Normalize
+        coef=istate->ampl[iket]*coef/sqfact;
+
+        // Store
+        if(abs(coef)>xcut){
+            ostate->add_term(coef,(int *)(occs.data()));
+        }
+    }
 }
 
 
 //--------------------------------------------------------------
 //
-// Direct method. Restricted distribution.
-// We consider only the output kets with occupation zero or 1.
+// Auxiliary method of the Direct method. Restricted distribution.
+// Calculates the outputs from first to last-1 of an input ket.
 //
 //---------------------------------------------------------------
-
-state *simulator::DirectR( state *istate, qocircuit *qoc ){
+void simulator::aux_DirectR( state *istate, int iket, qocircuit *qoc, long long int first, long long int last, state *ostate ){
 //  state     *istate;      // Input state
+//  int        iket;        // Input ket
 //  qocircuit *qoc          // Circuit to be simulated
+//  long long int first;    // First output occupation
+//  long long int last;     // Last output occupation (not included)
+//  state     *ostate;      // Output state
 //  Variables
     int    tocc;            // Number of photons present in ket.
     int    nlevel;          // Number of levels (qoc has this information, but it is put in this variable for easy access)
-    int    index;           // Ket list position where a new term of the output state is stored.
     double sqfact;          // Global sqrt factor to divide to get proper normalization
     cmplx  coef;            // Coefficient for the transformation of a ket.
     veci   occs;            // Occupations of the states involved in the transformation of a ket.
     veci   ilev;            // sequence input levels
     string bitmask;         // Bit mask
     string perm;            // Permutations
-    state *ostate;          // Output state
 //  Index
-    int    iket;            // Index of input kets elements
     int    ilin;            // Index of input levels
     int    ilout;           // Index of output levels
     int    iseq;            // Index of a position in a sequence
+    long long int iout;     // Index of output occupations
 //  Auxiliary index
     int    i;               // Aux index
     int    j;               // Aux index
 
 
-    //Set up variables and reserve memory
+    // Calculate number of photons of the ket
+    // Normalization factors
     nlevel=qoc->nlevel;
-    ostate=new state(istate->nph,nlevel,mem);
+    tocc=0;
+    sqfact=1.0;
+    for(ilin=0;ilin<nlevel;ilin++){
+        tocc=tocc+istate->ket[iket][ilin];
+        sqfact=sqfact*sqrt((double)factorial(istate->ket[iket][ilin]));
+    }
 
-    // Main loop
-    // For each ket of a state calculate transformation rule.
-    for(iket=0;iket<istate->nket;iket++){
-    if(abs(istate->ampl[iket])>xcut){
-        // Calculate number of photons of the ket
-        // Normalization factors
-        tocc=0;
-        sqfact=1.0;
-        for(ilin=0;ilin<nlevel;ilin++){
-            tocc=tocc+istate->ket[iket][ilin];
-            sqfact=sqfact*sqrt((double)factorial(istate->ket[iket][ilin]));
-        }
 
+    //Calculate from which input constructor we obtain the output one
+    ilev.resize(tocc);
+    iseq=0;
+    for(ilin=0;ilin<nlevel;ilin++){
+        for(j=0;j<istate->ket[iket][ilin];j++){
+            ilev(iseq)=ilin;
+            iseq++;
+        }
+    }
 
-        //Calculate from which input constructor we obtain the output one
-        ilev.resize(tocc);
-        iseq=0;
-        for(ilin=0;ilin<nlevel;ilin++){
-            for(j=0;j<istate->ket[iket][ilin];j++){
-                ilev(iseq)=ilin;
-                iseq++;
+    // Translate these sequences into actual coefficients and occupations
+    occs.resize(nlevel);
+    //Initalize the bitmask of the occupation state. Bit of level j is 1 if j is occupied.
+    bitmask=unrank_bitmask(first,tocc,nlevel);
+    // Initalize permutations vector
+    perm.resize(tocc,0);
+
+    // For each occupation configuration
+    for(iout=first;iout<last;iout++){
+        //Transform into photon - level sequence
+        j=0;
+        for (i=0; i<nlevel; i++){
+            if (bitmask[i]){
+                perm[j]=(char)i;
+                j++;
             }
         }
 
-        // Translate these sequences into actual coefficients and occupations
-        occs.resize(nlevel);
-        //Initalize the bitmask of the occupation state. Bit of level j is 1 if j is occupied.
-        bitmask.resize(0,0);
-        bitmask.resize(tocc,1);
-        bitmask.resize(nlevel,0);
-        // Initalize permutations vector
-        perm.resize(tocc,0);
-
-        // For each occupation configuration
-        sort(bitmask.begin(),bitmask.end());
+        // Permute all the possible photon in level configurations that give the same occupation
         do{
-            //Transform into photon - level sequence
-            j=0;
-            for (i=0; i<nlevel; i++){
-                if (bitmask[i]){
-                    perm[j]=(char)i;
-                    j++;
-                }
+            coef=1.0;
+            occs.setZero(nlevel);
+            iseq=0;
+            while((iseq<tocc)&&(abs(coef)>xcut)){
+                ilin=ilev(iseq);
+                ilout=(int)perm[iseq];
+                occs(ilout)=occs(ilout)+1;
+                coef=coef*qoc->circmtx(ilout,ilin)*sqrt((double)occs(ilout));
+                iseq++;
             }
 
-            // Permute all the possible photon in level configurations that give the same occupation
-            do{
-                coef=1.0;
-                occs.setZero(nlevel);
-                iseq=0;
-                while((iseq<tocc)&&(abs(coef)>xcut)){
-                    ilin=ilev(iseq);
-                    ilout=(int)perm[iseq];
-                    occs(ilout)=occs(ilout)+1;
-                    coef=coef*qoc->circmtx(ilout,ilin)*sqrt((double)occs(ilout));
-                    iseq++;
-                }
-
-                // Normalize
-                coef=istate->ampl[iket]*coef/sqfact;
+            // Normalize
+            coef=istate->ampl[iket]*coef/sqfact;
 
-                // Store
-                if(abs(coef)>xcut){
-                    index=ostate->add_term(coef,(int *)(occs.data()));
-                    if(index<0){
-                        cout << "Simulator(DirectR): Warning! Simulation canceled because the memory limit has been exceeded.  Increase *mem* for more memory." << endl;
-                        return ostate;
-                    }
-                }
+            // Store
+            if(abs(coef)>xcut){
+                ostate->add_term(coef,(int *)(occs.data()));
+            }
 
 
-            }while (next_permutation(perm.begin(), perm.end()));
-        }while (next_permutation(bitmask.begin(), bitmask.end()));
-    }
+        }while (next_permutation(perm.begin(), perm.end()));
+        next_permutation(bitmask.begin(), bitmask.end());
     }
-
-    // Return output
-    return ostate;
 }
 
 
 //--------------------------------------------------------------
 //
-// Permanent calculation method (using Glynn formula). Full distribution.
+// Auxiliary method of the Glynn method. Full distribution.
+// Calculates the outputs from first to last-1 of an input ket.
 //
 //---------------------------------------------------------------
-state *simulator::GlynnF( state *istate, qocircuit *qoc ){
+void simulator::aux_GlynnF( state *istate, int iket, qocircuit *qoc, long long int first, long long int last, state *ostate, cmplx *dampl ){
 //  state     *istate;           // Input state
+//  int        iket;             // Input ket
 //  qocircuit *qoc               // Circuit to be simulated
+//  long long int first;         // First output occupation
+//  long long int last;          // Last output occupation (not included)
+//  state     *ostate;           // Output state
+//  cmplx     *dampl;            // Output amplitudes by rank. Used instead of ostate if not null.
 //  Variables
     int    nph;                  // Number of photons present in input ket.
     int    nlevel;               // Number of levels (qoc has this information, but it is put in this variable for easy access)
-    int    index;                // Ket list position where a new term of the output state is stored.
     int   *pos;                  // Level where each photon is located. "Photon position"
     int   *occ;                  // Occupation
     cmplx  coef;                 // Coefficient for the transformation of a ket.
     cmplx  s;                    // Normalization coefficient of the input ket
     cmplx  t;                    // Normalization coefficient of the output ket
-    matc   Ust;                  // Matrix to calculate the permanent
-    state *ostate;               // Output state
 //  Index
-    int    iket;                 // Index of input kets elements
-    int    ilin;                 // Index of input levels
-    int    ilout;                // Index of output levels
-    int    irow;                 // Row index of Ust
-    int    icol;                 // Col index of Ust
+    long long int iout;          // Index of output occupations
 //  Auxiliary index
     int    i;                    // Aux index
     int    j;                    // Aux index
 
 
-    //Set up variables and reserve memory
+    // Calculate variables from the input ket
     nlevel=qoc->nlevel;
-    ostate=new state(istate->nph,nlevel,mem);
-
-    // Main loop
-    // For each ket of a state calculate transformation rule.
-    for(iket=0;iket<istate->nket;iket++){
-    if(abs(istate->ampl[iket])>xcut){
-        // Calculate variables from the input ket
-        nph=0;
-        s=1.0;
-        for(i=0;i<nlevel;i++){
-            nph=nph+istate->ket[iket][i];
-            s=s*(cmplx)factorial(istate->ket[iket][i]);
-        }
+    nph=0;
+    s=1.0;
+    for(i=0;i<nlevel;i++){
+        nph=nph+istate->ket[iket][i];
+        s=s*(cmplx)factorial(istate->ket[iket][i]);
+    }
 
 
-        // Check all the possible outputs
-        pos=new int[nph+1]();
-        occ=new int[nlevel]();
-        Ust.setZero(nph,nph);
+    // Check the outputs of the range
+    pos=unrank_multiset(first,nph,nlevel);
+    occ=new int[nlevel]();
 
-        while(pos[0] < nlevel){
-             // Calculate variables from the output ket
-            t=1.0;
-            for(j=0;j<nlevel;j++) occ[j]=0;
-            for(j=0;j<nph;j++) {
-                occ[pos[j]]=occ[pos[j]]+1;
-                t=t*(cmplx)occ[pos[j]]; // This is the factorial implicitly.
-            }
+    for(iout=first;iout<last;iout++){
+         // Calculate variables from the output ket
+        t=1.0;
+        for(j=0;j<nlevel;j++) occ[j]=0;
+        for(j=0;j<nph;j++) {
+            occ[pos[j]]=occ[pos[j]]+1;
+            t=t*(cmplx)occ[pos[j]]; // This is the factorial implicitly.
+        }
 
 
-            // If the number of photons coincide (it always should)
-            if(nph>0){
-                // Create Ust
-                icol=0;
-                for(ilin=0;ilin<nlevel;ilin++){
-                for(i=0;i<istate->ket[iket][ilin];i++){
-                    irow=0;
-                    for(ilout=0;ilout<nlevel;ilout++){
-                    for(j=0;j<occ[ilout];j++){
-                        Ust(irow,icol)=qoc->circmtx(ilout,ilin);
-                        irow=irow+1;
-                    }}
-                    icol=icol+1;
-                }}
-
-                // Calculate coefficient
-                coef=istate->ampl[iket]*glynn(Ust)/(sqrt(t)*sqrt(s));
-            }else{
-                coef=1.0;
-             }
+        // If the number of photons coincide (it always should)
+        if(nph>0){
+            // Calculate coefficient
+            coef=istate->ampl[iket]*calc_perm(istate->ket[iket],occ,qoc,0,1)/(sqrt(t)*sqrt(s));
+        }else{
+            coef=1.0;
+         }
 
 
-            // Store
-            if(abs(coef)>xcut){
-                index= ostate->add_term(coef,occ);
-                if(index<0){
-                    cout << "Simulator(GlynnF): Warning! Simulation canceled because the memory limit has been exceeded.  Increase *mem* for more memory." << endl;
-                    // Free memory
-                    delete[] pos;
-                    delete[] occ;
-                    // Return partial calculation
-                    return ostate;
-                }
-            }
+        // Store
+        if(dampl!=nullptr){
+            dampl[iout]=dampl[iout]+coef;
+        }else if(abs(coef)>xcut){
+            ostate->add_term(coef,occ);
+        }
 
 
-            // Obtain new photon level "position"
-            pos[nph-1] += 1; // xxxxN -> xxxxN+1
-            for (i = nph; i > 0; i -= 1) {
-                if (pos[i] > nlevel - 1) // if number spilled over: xx0(n-1)xx
-                {
-                    pos[i - 1] += 1; // set xx1(n-1)xx
-                    for (j = i; j <= nph; j += 1)
-                        pos[j] = pos[j - 1]; // set xx11..1
-                }
+        // Obtain new photon level "position"
+        if(nph==0) break;
+        pos[nph-1] += 1; // xxxxN -> xxxxN+1
+        for (i = nph; i > 0; i -= 1) {
+            if (pos[i] > nlevel - 1) // if number spilled over: xx0(n-1)xx
+            {
+                pos[i - 1] += 1; // set xx1(n-1)xx
+                for (j = i; j <= nph; j += 1)
+                    pos[j] = pos[j - 1]; // set xx11..1
             }
         }
+    }
 
-        // Free memory
-        delete[] pos;
-        delete[] occ;
-
-    }}
-    // Return output
-    return ostate;
+    // Free memory
+    delete[] pos;
+    delete[] occ;
 }
 
 
 //--------------------------------------------------------------
 //
-// Permanent calculation method (using Glynn formula). Restricted distribution.
-// We consider only output states with occupation zero or one.
+// Auxiliary method of the Glynn method. Restricted distribution.
+// Calculates the outputs from first to last-1 of an input ket.
 //
 //---------------------------------------------------------------
-state *simulator::GlynnR( state *istate, qocircuit *qoc ){
+void simulator::aux_GlynnR( state *istate, int iket, qocircuit *qoc, long long int first, long long int last, state *ostate, cmplx *dampl ){
 //  state     *istate;         // Input state
+//  int        iket;           // Input ket
 //  qocircuit *qoc             // Circuit to be simulated
+//  long long int first;       // First output occupation
+//  long long int last;        // Last output occupation (not included)
+//  state     *ostate;         // Output state
+//  cmplx     *dampl;          // Output amplitudes by rank. Used instead of ostate if not null.
 //  Variables
     int    nph;                // Number of photons present in input ket.
     int    nlevel;             // Number of levels (qoc has this information, but it is put in this variable for easy access)
-    int    index;              // Ket list position where a new term of the output state is stored.
     int   *occ;                // Occupation
     cmplx  coef;               // Coefficient for the transformation of a ket.
     cmplx  s;                  // Normalization coefficient of the input ket
     cmplx  t;                  // Normalization coefficient of the output ket
-    matc   Ust;                // Matrix to calculate the permanent
     string bitmask;            // Bit mask
-    state *ostate;             // Output state
 //  Index
-    int    iket;               // Index of input kets elements
-    int    ilin;               // Index of input levels
-    int    ilout;              // Index of output levels
-    int    irow;               // Row index of Ust
-    int    icol;               // Col index of Ust
+    long long int iout;        // Index of output occupations
 //  Auxiliary index
     int    i;                  // Aux idex
     int    j;                  // Aux index
 
 
-    //Set up variables and reserve memory
+    // Calculate variables from the input ket
     nlevel=qoc->nlevel;
-    ostate=new state(istate->nph,nlevel,mem);
-
-    // Main loop
-    // For each ket of a state calculate transformation rule.
-    for(iket=0;iket<istate->nket;iket++){
-    if(abs(istate->ampl[iket])>xcut){
-        // Calculate variables from the input ket
-        nph=0;
-        s=1.0;
-        for(i=0;i<nlevel;i++){
-            nph=nph+istate->ket[iket][i];
-            s=s*(cmplx)factorial(istate->ket[iket][i]);
-        }
-
-        // Translate these sequences into actual coefficients and occupations
-        occ=new int[nlevel]();
-        //Initalize the bitmask of the occupation state. Bit of level j is 1 if j is occupied.
-        bitmask.resize(0,0);
-        bitmask.resize(nph,1);
-        bitmask.resize(nlevel,0);
-
-        // For each occupation configuration
-        sort(bitmask.begin(),bitmask.end());
-        // For each occupation configuration
-        do{
-            Ust.setZero(nph,nph);
+    nph=0;
+    s=1.0;
+    for(i=0;i<nlevel;i++){
+        nph=nph+istate->ket[iket][i];
+        s=s*(cmplx)factorial(istate->ket[iket][i]);
+    }
 
-            // Calculate variables from the output ket
-            t=1.0;
-            for(j=0;j<nlevel;j++) {
-                if (bitmask[j]){
-                    occ[j]=1;
-                }else{
-                    occ[j]=0;
-                }
-                t=t*(cmplx)factorial(occ[j]);
-            }
+    // Translate these sequences into actual coefficients and occupations
+    occ=new int[nlevel]();
+    //Initalize the bitmask of the occupation state. Bit of level j is 1 if j is occupied.
+    bitmask=unrank_bitmask(first,nph,nlevel);
 
-            // If the number of photons coincide (it always should)
-            if(nph>0){
-                // Create Ust
-                icol=0;
-                for(ilin=0;ilin<nlevel;ilin++){
-                for(i=0;i<istate->ket[iket][ilin];i++){
-                    irow=0;
-                    for(ilout=0;ilout<nlevel;ilout++){
-                    for(j=0;j<occ[ilout];j++){
-                        Ust(irow,icol)=qoc->circmtx(ilout,ilin);
-                        irow=irow+1;
-                    }}
-                    icol=icol+1;
-                }}
-
-                // Calculate coefficient
-                coef=istate->ampl[iket]*glynn(Ust)/(sqrt(t)*sqrt(s));
+    // For each occupation configuration
+    for(iout=first;iout<last;iout++){
+        // Calculate variables from the output ket
+        t=1.0;
+        for(j=0;j<nlevel;j++) {
+            if (bitmask[j]){
+                occ[j]=1;
             }else{
-                coef=1.0;
+                occ[j]=0;
             }
+            t=t*(cmplx)factorial(occ[j]);
+        }
 
-            // Store
-            if(abs(coef)>xcut){
-                index= ostate->add_term(coef,occ);
-                if(index<0){
-                    cout << "Simulator(GlynnR): Warning! Simulation canceled because the memory limit has been exceeded.  Increase *mem* for more memory." << endl;
-                    // Free memory
-                    delete occ;
-                    // Return partial calculation
-                    return ostate;
-                }
-            }
+        // If the number of photons coincide (it always should)
+        if(nph>0){
+            // Calculate coefficient
+            coef=istate->ampl[iket]*calc_perm(istate->ket[iket],occ,qoc,0,1)/(sqrt(t)*sqrt(s));
+        }else{
+            coef=1.0;
+        }
 
-        } while (std::next_permutation(bitmask.begin(), bitmask.end()));
+        // Store
+        if(dampl!=nullptr){
+            dampl[iout]=dampl[iout]+coef;
+        }else if(abs(coef)>xcut){
+            ostate->add_term(coef,occ);
+        }
 
-        // Free memory
-        delete occ;
+        next_permutation(bitmask.begin(), bitmask.end());
+    }
 
-    }}
-    // Return output
-    return ostate;
+    // Free memory
+    delete[] occ;
 }
 
 
@@ -659,7 +1020,6 @@ state *simulator::DirectS( state *istate, ket_list *olist, qocircuit *qoc ){
     int    tocc;                 // Number of photons present in the input  ket.
     int    nph;                  // Number of photons present in the output ket.
     int    nlevel;               // Number of levels (qoc has this information, but it is put in this variable for easy access)
-    int    index;                // Ket list position where a new term of the output state is stored.
     double sqfacti;              // Global sqrt factor to divide to get proper normalization of the input ket
     double sqfacto;              // Global sqrt factor to divide to get proper normalization of the output ket
     cmplx  coef;                 // Coefficient for the transformation of a ket.
@@ -745,11 +1105,7 @@ state *simulator::DirectS( state *istate, ket_list *olist, qocircuit *qoc ){
 
                 // Store
                 if(abs(coef)>xcut){
-                    index= ostate->add_term(coef,olist->ket[oket]);
-                    if(index<0){
-                        cout << "Simulator(DirectS): Warning! Simulation canceled because the memory limit has been exceeded.  Increase *mem* for more memory." << endl;
-                        return ostate;
-                    }
+                    ostate->add_term(coef,olist->ket[oket]);
                 }
 
 
@@ -777,22 +1133,15 @@ state *simulator::GlynnS( state *istate, ket_list *olist, qocircuit *qoc ){
     int    tocc;               // Number of photons present in input ket.
     int    nph;                // Number of photons present in output ket.
     int    nlevel;             // Number of levels (qoc has this information, but it is put in this variable for easy access)
-    int    index;              // Ket list position where a new term of the output state is stored.
     cmplx  coef;               // Coefficient for the transformation of a ket.
     cmplx  s;                  // Normalization coefficient of the input ket
     cmplx  t;                  // Normalization coefficient of the output ket
-    matc   Ust;                // Matrix to calculate the permanent
     state *ostate;             // Output state
 //  Index
     int    iket;               // Index of input kets elements
     int    oket;               // Index of output kets elements
-    int    ilin;               // Index of input levels
-    int    ilout;              // Index of output levels
-    int    irow;               // Row index of Ust
-    int    icol;               // Col index of Ust
 //  Auxiliary index
     int    i;                  // Aux idex
-    int    j;                  // Aux index
 
 
     //Set up variables and reserve memory
@@ -824,33 +1173,15 @@ state *simulator::GlynnS( state *istate, ket_list *olist, qocircuit *qoc ){
             // If the number of photons coincide
             if(nph==tocc){
                 if(nph>0){
-                    // Create Ust
-                    Ust.setZero(nph,nph);
-                    icol=0;
-                    for(ilin=0;ilin<nlevel;ilin++){
-                    for(i=0;i<istate->ket[iket][ilin];i++){
-                        irow=0;
-                        for(ilout=0;ilout<nlevel;ilout++){
-                        for(j=0;j<olist->ket[oket][ilout];j++){
-                            Ust(irow,icol)=qoc->circmtx(ilout,ilin);
-                            irow=irow+1;
-                        }}
-                        icol=icol+1;
-                    }}
-
                     // Normalize
-                    coef=istate->ampl[iket]*glynn(Ust)/(sqrt(t)*sqrt(s));
+                    coef=istate->ampl[iket]*calc_perm(istate->ket[iket],olist->ket[oket],qoc,0,1)/(sqrt(t)*sqrt(s));
                 }else{
                     coef=1.0;
                 }
 
                 // Store
                 if(abs(coef)>xcut){
-                    index= ostate->add_term(coef,olist->ket[oket]);
-                    if(index<0){
-                        cout << "Simulator(GlynnS): Warning! Simulation canceled because the memory limit has been exceeded.  Increase *mem* for more memory." << endl;
-                        return ostate;
-                    }
+                    ostate->add_term(coef,olist->ket[oket]);
                 }
 
             }
@@ -876,22 +1207,15 @@ state *simulator::RyserS( state *istate, ket_list *olist, qocircuit *qoc, int nt
     int    tocc;               // Number of photons present in input ket.
     int    nph;                // Number of photons present in output ket.
     int    nlevel;             // Number of levels (qoc has this information, but it is put in this variable for easy access)
-    int    index;              // Ket list position where a new term of the output state is stored.
     cmplx  coef;               // Coefficient for the transformation of a ket.
     cmplx  s;                  // Normalization coefficient of the input ket
     cmplx  t;                  // Normalization coefficient of the output ket
-    matc   Ust;                // Matrix to calculate the permanent
     state *ostate;             // Output state
 //  Index
     int    iket;               // Index of input kets elements
     int    oket;               // Index of output kets elements
-    int    ilin;               // Index of input levels
-    int    ilout;              // Index of output levels
-    int    irow;               // Row index of Ust
-    int    icol;               // Col index of Ust
 //  Auxiliary index
     int    i;                  // Aux idex
-    int    j;                  // Aux index
 
 
     //Set up variables and reserve memory
@@ -923,33 +1247,106 @@ state *simulator::RyserS( state *istate, ket_list *olist, qocircuit *qoc, int nt
             // If the number of photons coincide
             if(nph==tocc){
                 if(nph>0){
-                    // Create Ust
-                    Ust.setZero(nph,nph);
-                    icol=0;
-                    for(ilin=0;ilin<nlevel;ilin++){
-                    for(i=0;i<istate->ket[iket][ilin];i++){
-                        irow=0;
-                        for(ilout=0;ilout<nlevel;ilout++){
-                        for(j=0;j<olist->ket[oket][ilout];j++){
-                            Ust(irow,icol)=qoc->circmtx(ilout,ilin);
-                            irow=irow+1;
-                        }}
-                        icol=icol+1;
-                    }}
-
                     // Normalize
-                    coef=istate->ampl[iket]*ryser_omp(Ust,nthreads)/(sqrt(t)*sqrt(s));
+                    coef=istate->ampl[iket]*calc_perm(istate->ket[iket],olist->ket[oket],qoc,1,nthreads)/(sqrt(t)*sqrt(s));
+                }else{
+                    coef=1.0;
+                }
+
+                // Store
+                if(abs(coef)>xcut){
+                    ostate->add_term(coef,olist->ket[oket]);
+                }
+
+            }
+        }
+    }}
+
+    // Return output
+    return ostate;
+}
+
+
+//--------------------------------------------------------------
+//
+// Permanent estimation method (using Gurvits randomized estimator)
+// for a restricted list of outputs.
+//
+//---------------------------------------------------------------
+state *simulator::GurvitsS( state *istate, ket_list *olist, qocircuit *qoc, double eps, double conf, int nthreads, vecd &serr ){
+//  state     *istate;         // Input state
+//  ket_list  *olist;          // Output ket list
+//  qocircuit *qoc             // Circuit to be simulated
+//  double     eps;            // Additive error of each estimated term
+//  double     conf;           // Confidence of the error
+//  int        nthreads;       // Number of threads
+//  vecd       serr;           // Standard error of each output ket. Output variable.
+//  Variables
+    int    tocc;               // Number of photons present in input ket.
+    int    nph;                // Number of photons present in output ket.
+    int    nlevel;             // Number of levels (qoc has this information, but it is put in this variable for easy access)
+    long long int nsamples;    // Number of samples of the estimator
+    double norm_t;             // Normalization of the term
+    double bound;              // Upper bound of a sample of the term
+    double perr;               // Standard error of the permanent
+    cmplx  coef;               // Coefficient for the transformation of a ket.
+    cmplx  s;                  // Normalization coefficient of the input ket
+    cmplx  t;                  // Normalization coefficient of the output ket
+    matc   Ust;                // Matrix to estimate the permanent
+    state *ostate;             // Output state
+//  Index
+    int    iket;               // Index of input kets elements
+    int    oket;               // Index of output kets elements
+//  Auxiliary index
+    int    i;                  // Aux idex
+
+
+    //Set up variables and reserve memory
+    nlevel=qoc->nlevel;
+    ostate=new state(istate->nph,nlevel,olist->nket+1);
+    serr.setZero(olist->nket);
+
+    // Main loop
+    // For each ket of a state calculate transformation rule.
+    for(iket=0;iket<istate->nket;iket++){
+    if(abs(istate->ampl[iket])>xcut){
+        // Calculate variables of the input ket
+        tocc=0;
+        s=1.0;
+        for(i=0;i<nlevel;i++){
+            tocc=tocc+istate->ket[iket][i];
+            s=s*(cmplx)factorial(istate->ket[iket][i]);
+        }
+
+        // For each output ket of the list
+        for(oket=0;oket<olist->nket;oket++){
+            // Calculate variables of the output key
+            nph=0;
+            t=1.0;
+            for(i=0;i<nlevel;i++){
+                nph=nph+olist->ket[oket][i];
+                t=t*(cmplx)factorial(olist->ket[oket][i]);
+            }
+
+            // If the number of photons coincide
+            if(nph==tocc){
+                if(nph>0){
+                    // Number of samples from the bound |X|<=||Ust||^n of the samples
+                    Ust=perm_matrix(istate->ket[iket],olist->ket[oket],qoc);
+                    norm_t=abs(istate->ampl[iket])/(sqrt(abs(t))*sqrt(abs(s)));
+                    bound=norm_t*pow(Ust.jacobiSvd().singularValues()(0),nph);
+                    nsamples=gurvits_samples(bound,eps,conf);
+
+                    // Estimate
+                    coef=istate->ampl[iket]*gurvits_perm(Ust,nsamples,nthreads,perr)/(sqrt(t)*sqrt(s));
+                    serr(oket)=sqrt(serr(oket)*serr(oket)+norm_t*norm_t*perr*perr);
                 }else{
                     coef=1.0;
                 }
 
                 // Store
                 if(abs(coef)>xcut){
-                    index= ostate->add_term(coef,olist->ket[oket]);
-                    if(index<0){
-                        cout << "Simulator(RyserS): Warning! Simulation canceled because the memory limit has been exceeded.  Increase *mem* for more memory." << endl;
-                        return ostate;
-                    }
+                    ostate->add_term(coef,olist->ket[oket]);
                 }
 
             }
@@ -1201,6 +1598,9 @@ state *simulator::RyserR( state *istate, qocircuit *qoc, int nthreads){
 //
 // Auxiliary method for the permanent calculation (using parallelized Ryser formula)
 // Full distribution.
+// If the permanents are too small to be split between threads
+// the outputs are split instead. Each thread calculates a range
+// of outputs in its own output state. These are merged at the end.
 //
 //---------------------------------------------------------------
 void simulator::aux_RyserF( state *istate, state* ostate, qocircuit *qoc, int c_nph, veci constraint, int nthreads){
@@ -1209,34 +1609,72 @@ void simulator::aux_RyserF( state *istate, state* ostate, qocircuit *qoc, int c_
 //  qocircuit *qoc               // Circuit to be simulated
 //  int        c_nph;            // Constraint photons. Photons that are part of the constraint.
 //  veci       constraint;       // Constraint vector.
+//  int        nthreads;         // Number of threads.
+
+
+    split_ryser(istate,ostate,qoc,c_nph,constraint,true,nthreads);
+}
+
+
+//--------------------------------------------------------------
+//
+// Auxiliary method for the permanent calculation (using parallelized Ryser formula)
+// Restricted distribution.
+// If the permanents are too small to be split between threads
+// the outputs are split instead.
+//
+//---------------------------------------------------------------
+void simulator::aux_RyserR( state *istate, state* ostate, qocircuit *qoc , int c_nph, veci constraint, int nthreads){
+//  state     *istate;         // Input state
+//  state     *ostate;         // Output state. Output variable
+//  qocircuit *qoc             // Circuit to be simulated
+//  int        c_nph;          // Constraint photons. Photons that are part of the constraint.
+//  veci       constraint;     // Constraint vector.
+//  int        nthreads;       // Number of threads.
+
+
+    split_ryser(istate,ostate,qoc,c_nph,constraint,false,nthreads);
+}
+
+
+//--------------------------------------------------------------
+//
+// Chooses for each input ket between splitting each permanent
+// between threads or splitting the outputs between threads.
+// The outputs are split when there are enough of them and each
+// thread would get less than RYSERGRAIN steps of a permanent.
+//
+//---------------------------------------------------------------
+void simulator::split_ryser( state *istate, state* ostate, qocircuit *qoc, int c_nph, veci constraint, bool F, int nthreads){
+//  state     *istate;           // Input state
+//  state     *ostate;           // Output state. Output variable
+//  qocircuit *qoc               // Circuit to be simulated
+//  int        c_nph;            // Constraint photons. Photons that are part of the constraint.
+//  veci       constraint;       // Constraint vector.
+//  bool       F;                // True: Full distribution. False: Only kets with at most one photon by level.
 //  int        nthreads;         // Number of threads.
 //  Variables
     int    nph;                  // Number of photons present in input ket.
     int    uc_nph;               // Unconstrained number of photons. Photons that are not part of the constraint.
     int    nlevel;               // Number of levels (qoc has this information, but it is put in this variable for easy access)
     int    uc_nlevel;            // Number of levels without a constraint.
-    int    index;                // Ket list position where a new term of the output state is stored.
-    int   *pos;                  // Level where each photon is located. "Photon position"
-    int   *occ;                  // Occupation
-    cmplx  coef;                 // Coefficient for the transformation of a ket.
-    cmplx  s;                    // Normalization coefficient of the input ket
-    cmplx  t;                    // Normalization coefficient of the output ket
-    veci uclevels;               // List of levels without a constraint
-    matc   Ust;                  // Matrix to calculate the permanent
+    long long int nout;          // Number of outputs of an input ket
+    veci   uclevels;             // List of levels without a constraint
+    state **tstate;              // Output state of each thread
 //  Index
     int    iket;                 // Index of input kets elements
-    int    ilin;                 // Index of input levels
-    int    ilout;                // Index of output levels
-    int    irow;                 // Row index of Ust
-    int    icol;                 // Col index of Ust
+    int    ithread;              // Index of threads
+    int    ik;                   // Index of kets of the thread output states
 //  Auxiliary index
     int    i;                    // Aux index
     int    j;                    // Aux index
-    int    k;                    // Aux index
 
 
     //Set up variables and reserve memory
     nlevel=qoc->nlevel;
+    if(nthreads<1) nthreads=1;
+    tstate=new state*[nthreads]();
+    tstate[0]=ostate;
 
     // Process contraint information
     uc_nlevel=qoc->nlevel-qoc->ncond*qoc->nm*qoc->ns;
@@ -1253,80 +1691,388 @@ void simulator::aux_RyserF( state *istate, state* ostate, qocircuit *qoc, int c_
         }
     }
 
+    // Main loop
+    // For each ket of a state calculate transformation rule.
+    for(iket=0;iket<istate->nket;iket++){
+    if(abs(istate->ampl[iket])>xcut){
+        // Number of outputs
+        nph=0;
+        for(i=0;i<nlevel;i++) nph=nph+istate->ket[iket][i];
+        uc_nph=nph-c_nph;
+        if(uc_nph<0)  nout=0;
+        else if(F)    nout=binomial(uc_nlevel+uc_nph-1,uc_nph);
+        else          nout=binomial(uc_nlevel,uc_nph);
+
+        if((nthreads>1)&&(nout>=nthreads)&&(nph>0)&&(nph<32)&&(((long int)1<<(nph-1))<RYSERGRAIN*nthreads)){
+            // Many small permanents. Each thread calculates a range of outputs.
+            for(ithread=1;ithread<nthreads;ithread++){
+                if(tstate[ithread]==nullptr) tstate[ithread]=new state(istate->nph,nlevel,mem);
+            }
+            #pragma omp parallel for schedule(static) num_threads(nthreads)
+            for(ithread=0;ithread<nthreads;ithread++){
+                if(F) range_RyserF(istate,iket,tstate[ithread],qoc,c_nph,constraint,uclevels,nout*ithread/nthreads,nout*(ithread+1)/nthreads,1,nullptr);
+                else  range_RyserR(istate,iket,tstate[ithread],qoc,c_nph,constraint,uclevels,nout*ithread/nthreads,nout*(ithread+1)/nthreads,1,nullptr);
+            }
+        }else{
+            // Large permanents. Each one is split between threads.
+            if(F) range_RyserF(istate,iket,ostate,qoc,c_nph,constraint,uclevels,0,nout,nthreads,nullptr);
+            else  range_RyserR(istate,iket,ostate,qoc,c_nph,constraint,uclevels,0,nout,nthreads,nullptr);
+        }
+    }}
+
+    // Merge the output of the threads
+    for(ithread=1;ithread<nthreads;ithread++){
+        if(tstate[ithread]!=nullptr){
+            for(ik=0;ik<tstate[ithread]->nket;ik++){
+                ostate->add_term(tstate[ithread]->ampl[ik],tstate[ithread]->ket[ik]);
+            }
+            delete tstate[ithread];
+        }
+    }
+
+    // Free memory
+    delete[] tstate;
+}
+
+
+//--------------------------------------------------------------
+//
+// Auxiliary method for the permanent calculation (using parallelized Ryser formula)
+// Full distribution. Calculates the outputs from first to last-1 of an input ket.
+//
+//---------------------------------------------------------------
+void simulator::range_RyserF( state *istate, int iket, state* ostate, qocircuit *qoc, int c_nph, veci &constraint, veci &uclevels, long long int first, long long int last, int nthreads, cmplx *dampl){
+//  state     *istate;           // Input state
+//  int        iket;             // Input ket
+//  state     *ostate;           // Output state. Output variable
+//  qocircuit *qoc               // Circuit to be simulated
+//  int        c_nph;            // Constraint photons. Photons that are part of the constraint.
+//  veci       constraint;       // Constraint vector.
+//  veci       uclevels;         // List of levels without a constraint
+//  long long int first;         // First output occupation
+//  long long int last;          // Last output occupation (not included)
+//  int        nthreads;         // Number of threads.
+//  cmplx     *dampl;            // Output amplitudes by rank. Used instead of ostate if not null.
+//  Variables
+    int    nph;                  // Number of photons present in input ket.
+    int    uc_nph;               // Unconstrained number of photons. Photons that are not part of the constraint.
+    int    nlevel;               // Number of levels (qoc has this information, but it is put in this variable for easy access)
+    int    uc_nlevel;            // Number of levels without a constraint.
+    int   *pos;                  // Level where each photon is located. "Photon position"
+    int   *occ;                  // Occupation
+    cmplx  coef;                 // Coefficient for the transformation of a ket.
+    cmplx  s;                    // Normalization coefficient of the input ket
+    cmplx  t;                    // Normalization coefficient of the output ket
+//  Index
+    long long int iout;          // Index of output occupations
+//  Auxiliary index
+    int    i;                    // Aux index
+    int    j;                    // Aux index
+    int    k;                    // Aux index
+
+
+    // Calculate variables from the input ket
+    nlevel=qoc->nlevel;
+    uc_nlevel=uclevels.size();
+    nph=0;
+    s=1.0;
+    for(i=0;i<nlevel;i++){
+        nph=nph+istate->ket[iket][i];
+        s=s*(cmplx)factorial(istate->ket[iket][i]);
+    }
+    uc_nph=nph-c_nph;
+
+    // Check the outputs of the range
+    pos=unrank_multiset(first,uc_nph,uc_nlevel);
+    occ=new int[nlevel]();
+
+    for(iout=first;iout<last;iout++){
+         // Calculate variables from the output ket
+
+        for(j=0;j<nlevel;j++) occ[j]=0;
+        for(j=0;j<uc_nph;j++) {
+            k=uclevels(pos[j]);
+            occ[k]=occ[k]+1;
+        }
+
+        t=1.0;
+        for(j=0;j<nlevel;j++){
+            if(constraint(j)>=0) occ[j]=constraint(j);
+            t=t*(cmplx)factorial(occ[j]);
+        }
+
+        // If the number of photons coincide (it always should)
+        if(nph>0){
+            // Calculate coefficient
+            coef=istate->ampl[iket]*calc_perm(istate->ket[iket],occ,qoc,1,nthreads)/(sqrt(t)*sqrt(s));
+        }else{
+            coef=1.0;
+        }
+
+        // Store
+        if(dampl!=nullptr){
+            dampl[iout]=dampl[iout]+coef;
+        }else if(abs(coef)>xcut){
+            ostate->add_term(coef,occ);
+        }
+
+        // Obtain new photon level "position"
+        if(uc_nph==0) break;
+        pos[uc_nph-1] += 1; // xxxxN -> xxxxN+1
+        for (i = uc_nph; i > 0; i -= 1) {
+            if (pos[i] > uc_nlevel - 1) // if number spilled over: xx0(n-1)xx
+            {
+                pos[i - 1] += 1; // set xx1(n-1)xx
+                for (j = i; j <= uc_nph; j += 1)
+                    pos[j] = pos[j - 1]; // set xx11..1
+            }
+        }
+    }
+
+    // Free memory
+    delete[] pos;
+    delete[] occ;
+}
+
+
+//--------------------------------------------------------------
+//
+// Auxiliary method for the permanent calculation (using parallelized Ryser formula)
+// Restricted distribution. Calculates the outputs from first to last-1 of an input ket.
+//
+//---------------------------------------------------------------
+void simulator::range_RyserR( state *istate, int iket, state* ostate, qocircuit *qoc, int c_nph, veci &constraint, veci &uclevels, long long int first, long long int last, int nthreads, cmplx *dampl){
+//  state     *istate;         // Input state
+//  int        iket;           // Input ket
+//  state     *ostate;         // Output state. Output variable
+//  qocircuit *qoc             // Circuit to be simulated
+//  int        c_nph;          // Constraint photons. Photons that are part of the constraint.
+//  veci       constraint;     // Constraint vector.
+//  veci       uclevels;       // List of levels without a constraint
+//  long long int first;       // First output occupation
+//  long long int last;        // Last output occupation (not included)
+//  int        nthreads;       // Number of threads.
+//  cmplx     *dampl;          // Output amplitudes by rank. Used instead of ostate if not null.
+//  Variables
+    int    nph;                // Number of photons present in input ket.
+    int    uc_nph;             // Unconstrained number of photons. Photons that are not part of the constraint.
+    int    nlevel;             // Number of levels (qoc has this information, but it is put in this variable for easy access)
+    int    uc_nlevel;          // Number of levels without a constraint.
+    int   *occ;                // Occupation
+    cmplx  coef;               // Coefficient for the transformation of a ket.
+    cmplx  s;                  // Normalization coefficient of the input ket
+    cmplx  t;                  // Normalization coefficient of the output ket
+    string bitmask;            // Bit mask
+//  Index
+    long long int iout;        // Index of output occupations
+//  Auxiliary index
+    int    i;                  // Aux idex
+    int    j;                  // Aux index
+    int    k;                  // Aux index
+
+
+    // Calculate variables from the input ket
+    nlevel=qoc->nlevel;
+    uc_nlevel=uclevels.size();
+    nph=0;
+    s=1.0;
+    for(i=0;i<nlevel;i++){
+        nph=nph+istate->ket[iket][i];
+        s=s*(cmplx)factorial(istate->ket[iket][i]);
+    }
+
+    // Translate these sequences into actual coefficients and occupations
+    uc_nph=nph-c_nph;
+    occ=new int[nlevel]();
+    //Initalize the bitmask of the occupation state. Bit of level j is 1 if j is occupied.
+    bitmask=unrank_bitmask(first,uc_nph,uc_nlevel);
+
+    // For each occupation configuration
+    for(iout=first;iout<last;iout++){
+        t=1.0;
+        k=0;
+        for(j=0;j<nlevel;j++) {
+            if(constraint(j)<0){
+                if (bitmask[k]){
+                    occ[j]=1;
+                }else{
+                    occ[j]=0;
+                }
+                k=k+1;
+            }else{
+                occ[j]=constraint(j);
+            }
+            t=t*(cmplx)factorial(occ[j]);
+        }
+
+
+        // If the number of photons coincide (it always should)
+        if(nph>0){
+            // Calculate coefficient
+            coef=istate->ampl[iket]*calc_perm(istate->ket[iket],occ,qoc,1,nthreads)/(sqrt(t)*sqrt(s));
+        }else{
+            coef=1.0;
+        }
+
+        // Store
+        if(dampl!=nullptr){
+            dampl[iout]=dampl[iout]+coef;
+        }else if(abs(coef)>xcut){
+            ostate->add_term(coef,occ);
+        }
+
+        next_permutation(bitmask.begin(), bitmask.end());
+    }
+
+    // Free memory
+    delete[] occ;
+}
+
+//--------------------------------------------------------------
+//
+// Permanent calculation method (using Laplace expansion with
+// shared minors). Full distribution.
+// The outputs are visited in order so consecutive outputs share
+// the levels of their first photons. The permanent is expanded by
+// the last photon and the minors of each prefix of photons are
+// stored for every sub-multiset of input columns to reuse them.
+//
+//---------------------------------------------------------------
+state *simulator::LaplaceF( state *istate, qocircuit *qoc ){
+//  state     *istate;           // Input state
+//  qocircuit *qoc               // Circuit to be simulated
+//  Variables
+    int    nph;                  // Number of photons present in input ket.
+    int    nlevel;               // Number of levels (qoc has this information, but it is put in this variable for easy access)
+    int    ncol;                 // Number of occupied input levels
+    int    nsub;                 // Number of sub-multisets of input columns
+    int    depth;                // First photon whose level has changed
+    int    digit;                // Multiplicity of a column in a sub-multiset
+    int   *pos;                  // Level where each photon is located. "Photon position"
+    int   *last;                 // Photon positions used to calculate the stored minors
+    int   *occ;                  // Occupation
+    int   *clev;                 // Occupied input levels
+    int   *cmult;                // Occupation of each occupied input level
+    int   *stride;               // Index stride of each occupied input level
+    int   *ksize;                // Size of each sub-multiset
+    int   *order;                // Sub-multisets ordered by size
+    int   *first;                // First sub-multiset of each size in order
+    cmplx *minor;                // Minors of the current prefix for each sub-multiset
+    cmplx  coef;                 // Coefficient for the transformation of a ket.
+    cmplx  s;                    // Normalization coefficient of the input ket
+    cmplx  t;                    // Normalization coefficient of the output ket
+    state *ostate;               // Output state
+//  Index
+    int    iket;                 // Index of input kets elements
+    int    isub;                 // Index of sub-multisets
+    int    icol;                 // Index of occupied input levels
+    int    id;                   // Index of photons
+//  Auxiliary index
+    int    i;                    // Aux index
+    int    j;                    // Aux index
+
+
+    //Set up variables and reserve memory
+    nlevel=qoc->nlevel;
+    ostate=new state(istate->nph,nlevel,mem);
+
     // Main loop
     // For each ket of a state calculate transformation rule.
     for(iket=0;iket<istate->nket;iket++){
     if(abs(istate->ampl[iket])>xcut){
         // Calculate variables from the input ket
         nph=0;
+        ncol=0;
+        nsub=1;
         s=1.0;
+        clev=new int[nlevel]();
+        cmult=new int[nlevel]();
+        stride=new int[nlevel]();
         for(i=0;i<nlevel;i++){
             nph=nph+istate->ket[iket][i];
             s=s*(cmplx)factorial(istate->ket[iket][i]);
+            if(istate->ket[iket][i]>0){
+                clev[ncol]=i;
+                cmult[ncol]=istate->ket[iket][i];
+                stride[ncol]=nsub;
+                nsub=nsub*(cmult[ncol]+1);
+                ncol=ncol+1;
+            }
         }
-        uc_nph=nph-c_nph;
+
+        // Order the sub-multisets of input columns by size.
+        // The minors of a sub-multiset are calculated at the depth given by its size.
+        ksize=new int[nsub]();
+        order=new int[nsub];
+        first=new int[nph+2];
+        for(isub=0;isub<nsub;isub++){
+            for(icol=0;icol<ncol;icol++) ksize[isub]=ksize[isub]+(isub/stride[icol])%(cmult[icol]+1);
+        }
+        j=0;
+        for(id=0;id<=nph;id++){
+            first[id]=j;
+            for(isub=0;isub<nsub;isub++){
+                if(ksize[isub]==id){
+                    order[j]=isub;
+                    j=j+1;
+                }
+            }
+        }
+        first[nph+1]=j;
+
 
         // Check all the possible outputs
-        pos=new int[uc_nph+1]();
+        pos=new int[nph+1]();
+        last=new int[nph+1];
         occ=new int[nlevel]();
-        Ust.setZero(nph,nph);
-
-        while(pos[0] < uc_nlevel){
-             // Calculate variables from the output ket
+        minor=new cmplx[nsub];
+        for(id=0;id<=nph;id++) last[id]=-1;
+        minor[0]=1.0;
 
-            for(j=0;j<nlevel;j++) occ[j]=0;
-            for(j=0;j<uc_nph;j++) {
-                k=uclevels(pos[j]);
-                occ[k]=occ[k]+1;
+        while(pos[0] < nlevel){
+            // Update the minors of the photons whose level has changed.
+            // The minors of the previous photons are still valid.
+            depth=0;
+            while((depth<nph)&&(pos[depth]==last[depth])) depth=depth+1;
+            for(id=depth;id<nph;id++){
+                for(j=first[id+1];j<first[id+2];j++){
+                    isub=order[j];
+                    minor[isub]=0.0;
+                    for(icol=0;icol<ncol;icol++){
+                        digit=(isub/stride[icol])%(cmult[icol]+1);
+                        if(digit>0) minor[isub]=minor[isub]+(double)digit*qoc->circmtx(pos[id],clev[icol])*minor[isub-stride[icol]];
+                    }
+                }
+                last[id]=pos[id];
             }
 
+            // Calculate variables from the output ket
             t=1.0;
-            for(j=0;j<nlevel;j++){
-                if(constraint(j)>=0) occ[j]=constraint(j);
-                t=t*(cmplx)factorial(occ[j]);
+            for(j=0;j<nlevel;j++) occ[j]=0;
+            for(j=0;j<nph;j++) {
+                occ[pos[j]]=occ[pos[j]]+1;
+                t=t*(cmplx)occ[pos[j]]; // This is the factorial implicitly.
             }
 
-            // If the number of photons coincide (it always should)
-            if(nph>0){
-                // Create Ust
-                icol=0;
-                for(ilin=0;ilin<nlevel;ilin++){
-                for(i=0;i<istate->ket[iket][ilin];i++){
-                    irow=0;
-                    for(ilout=0;ilout<nlevel;ilout++){
-                    for(j=0;j<occ[ilout];j++){
-                        Ust(irow,icol)=qoc->circmtx(ilout,ilin);
-                        irow=irow+1;
-                    }}
-                    icol=icol+1;
-                }}
-
-                // Calculate coefficient
-                coef=istate->ampl[iket]*ryser_omp(Ust,nthreads)/(sqrt(t)*sqrt(s));
-            }else{
-                coef=1.0;
-            }
+
+            // Calculate coefficient
+            coef=istate->ampl[iket]*minor[nsub-1]/(sqrt(t)*sqrt(s));
+
 
             // Store
             if(abs(coef)>xcut){
-                index= ostate->add_term(coef,occ);
-                if(index<0){
-                    cout << "Simulator(aux_RyserF): Warning! Simulation canceled because the memory limit has been exceeded.  Increase *mem* for more memory." << endl;
-                    // Free memory
-                    delete[] pos;
-                    delete[] occ;
-                    // Finish partial calculation
-                    return;
-                }
+                ostate->add_term(coef,occ);
             }
 
+
             // Obtain new photon level "position"
-            pos[uc_nph-1] += 1; // xxxxN -> xxxxN+1
-            for (i = uc_nph; i > 0; i -= 1) {
-                if (pos[i] > uc_nlevel - 1) // if number spilled over: xx0(n-1)xx
+            if(nph==0) break;
+            pos[nph-1] += 1; // xxxxN -> xxxxN+1
+            for (i = nph; i > 0; i -= 1) {
+                if (pos[i] > nlevel - 1) // if number spilled over: xx0(n-1)xx
                 {
                     pos[i - 1] += 1; // set xx1(n-1)xx
-                    for (j = i; j <= uc_nph; j += 1)
+                    for (j = i; j <= nph; j += 1)
                         pos[j] = pos[j - 1]; // set xx11..1
                 }
             }
@@ -1334,144 +2080,172 @@ void simulator::aux_RyserF( state *istate, state* ostate, qocircuit *qoc, int c_
 
         // Free memory
         delete[] pos;
+        delete[] last;
         delete[] occ;
+        delete[] minor;
+        delete[] clev;
+        delete[] cmult;
+        delete[] stride;
+        delete[] ksize;
+        delete[] order;
+        delete[] first;
 
     }}
+    // Return output
+    return ostate;
 }
 
 
 //--------------------------------------------------------------
 //
-// Auxiliary method for the permanent calculation (using parallelized Ryser formula)
-// Restricted distribution.
+// Permanent of the circuit matrix for given input and output
+// occupations. Bunched levels are treated with the Ryser formula
+// with multiplicities instead of repeating rows and columns.
+// The permanent only depends on the distinct submatrix and the
+// multiplicities therefore they are the key of the cache.
 //
 //---------------------------------------------------------------
-void simulator::aux_RyserR( state *istate, state* ostate, qocircuit *qoc , int c_nph, veci constraint, int nthreads){
-//  state     *istate;         // Input state
-//  state     *ostate;         // Output state. Output variable
-//  qocircuit *qoc             // Circuit to be simulated
-//  int        c_nph;          // Constraint photons. Photons that are part of the constraint.
-//  veci       constraint;     // Constraint vector.
-//  int        nthreads;       // Number of threads.
-//  Variables
-    int    nph;                // Number of photons present in input ket.
-    int    uc_nph;             // Unconstrained number of photons. Photons that are not part of the constraint.
-    int    nlevel;             // Number of levels (qoc has this information, but it is put in this variable for easy access)
-    int    uc_nlevel;          // Number of levels without a constraint.
-    int    index;              // Ket list position where a new term of the output state is stored.
-    int   *occ;                // Occupation
-    cmplx  coef;               // Coefficient for the transformation of a ket.
-    cmplx  s;                  // Normalization coefficient of the input ket
-    cmplx  t;                  // Normalization coefficient of the output ket
-    matc   Ust;                // Matrix to calculate the permanent
-    string bitmask;            // Bit mask
+cmplx simulator::calc_perm( int *iocc, int *oocc, qocircuit *qoc, int kernel, int nthreads ){
+//  int       *iocc;             // Input occupations
+//  int       *oocc;             // Output occupations
+//  qocircuit *qoc;              // Circuit to be simulated
+//  int        kernel;           // Kernel for the expanded matrix 0=Glynn/1=Ryser
+//  int        nthreads;         // Number of threads
+//  Variables
+    int    nph;                  // Number of photons
+    int    nlevel;               // Number of levels (qoc has this information, but it is put in this variable for easy access)
+    int    nrow;                 // Number of occupied output levels
+    int    ncol;                 // Number of occupied input levels
+    veci   rlev;                 // Occupied output levels
+    veci   clev;                 // Occupied input levels
+    veci   rmult;                // Occupation of each occupied output level
+    veci   cmult;                // Occupation of each occupied input level
+    bool   rep;                  // Calculate with multiplicities true=Yes/false=No
+    matc   Ust;                  // Matrix to calculate the permanent
+    string key;                  // Key of the cache
+    cmplx  value;                // Permanent
 //  Index
-    int    iket;               // Index of input kets elements
-    int    ilin;               // Index of input levels
-    int    ilout;              // Index of output levels
-    int    irow;               // Row index of Ust
-    int    icol;               // Col index of Ust
+    int    irow;                 // Row index of Ust
+    int    icol;                 // Col index of Ust
 //  Auxiliary index
-    int    i;                  // Aux idex
-    int    j;                  // Aux index
-    int    k;                  // Aux index
+    int    i;                    // Aux index
 
 
-    //Set up variables and reserve memory
+    // Find the occupied levels and their multiplicities
     nlevel=qoc->nlevel;
-    uc_nlevel=qoc->nlevel-qoc->ncond*qoc->nm*qoc->ns;
-    if(c_nph<0){ // No constraint want to be applied
-        c_nph=0;
-        uc_nlevel=qoc->nlevel;
+    rlev.resize(nlevel);
+    clev.resize(nlevel);
+    rmult.resize(nlevel);
+    cmult.resize(nlevel);
+    nph=0;
+    nrow=0;
+    ncol=0;
+    for(i=0;i<nlevel;i++){
+        if(oocc[i]>0){
+            rlev(nrow)=i;
+            rmult(nrow)=oocc[i];
+            nrow=nrow+1;
+        }
+        if(iocc[i]>0){
+            clev(ncol)=i;
+            cmult(ncol)=iocc[i];
+            nph=nph+iocc[i];
+            ncol=ncol+1;
+        }
     }
-
-    // Main loop
-    // For each ket of a state calculate transformation rule.
-    for(iket=0;iket<istate->nket;iket++){
-    if(abs(istate->ampl[iket])>xcut){
-        // Calculate variables from the input ket
-        nph=0;
-        s=1.0;
-        for(i=0;i<nlevel;i++){
-            nph=nph+istate->ket[iket][i];
-            s=s*(cmplx)factorial(istate->ket[iket][i]);
+    if(nph==0) return 1.0;
+    rmult.conservativeResize(nrow);
+    cmult.conservativeResize(ncol);
+
+    // Create the matrix of distinct rows and columns if
+    // there is bunching and it is cheaper to calculate
+    // the permanent from it or if it is needed by the cache.
+    // Beyond 62 photons 2^(nph-1) does not fit in a long long int
+    // and the form with multiplicities is always used.
+    rep=(nph-1>=62)||(min(rep_steps(rmult),rep_steps(cmult))<((long long int)1<<(nph-1)));
+    if(rep || cachesize>0){
+        Ust.resize(nrow,ncol);
+        for(irow=0;irow<nrow;irow++){
+            for(icol=0;icol<ncol;icol++){
+                Ust(irow,icol)=qoc->circmtx(rlev(irow),clev(icol));
+            }
         }
+    }
 
-        // Translate these sequences into actual coefficients and occupations
-        uc_nph=nph-c_nph;
-        occ=new int[nlevel]();
-        //Initalize the bitmask of the occupation state. Bit of level j is 1 if j is occupied.
-        bitmask.resize(0,0);
-        bitmask.resize(uc_nph,1);
-        bitmask.resize(uc_nlevel,0);
-
-        // For each occupation configuration
-        sort(bitmask.begin(),bitmask.end());
-        // For each occupation configuration
-        do{
-            Ust.setZero(nph,nph);
+    // Look for the permanent in the cache
+    if(cachesize>0){
+        key.append((const char*)&nrow,sizeof(int));
+        key.append((const char*)&ncol,sizeof(int));
+        key.append((const char*)rmult.data(),nrow*sizeof(int));
+        key.append((const char*)cmult.data(),ncol*sizeof(int));
+        key.append((const char*)Ust.data(),nrow*ncol*sizeof(cmplx));
+        if(pcache.find(key,value)) return value;
+    }
 
-            t=1.0;
-            k=0;
-            for(j=0;j<nlevel;j++) {
-                if(constraint(j)<0){
-                    if (bitmask[k]){
-                        occ[j]=1;
-                    }else{
-                        occ[j]=0;
-                    }
-                    k=k+1;
-                }else{
-                    occ[j]=constraint(j);
-                }
-                t=t*(cmplx)factorial(occ[j]);
-            }
+    // Calculate the permanent
+    if(rep){
+        value=ryser_rep(Ust,rmult,cmult);
+    }else{
+        // Otherwise create the expanded Ust and
+        // use the requested kernel
+        Ust=perm_matrix(iocc,oocc,qoc);
+        if(kernel==0) value=glynn(Ust);
+        else          value=ryser_omp(Ust,nthreads);
+    }
 
+    // Store it in the cache
+    if(cachesize>0) pcache.insert(key,value);
+    return value;
+}
 
-            // If the number of photons coincide (it always should)
-            if(nph>0){
-                // Create Ust
-                icol=0;
-                for(ilin=0;ilin<nlevel;ilin++){
-                for(i=0;i<istate->ket[iket][ilin];i++){
-                    irow=0;
-                    for(ilout=0;ilout<nlevel;ilout++){
-                    for(j=0;j<occ[ilout];j++){
-                        Ust(irow,icol)=qoc->circmtx(ilout,ilin);
-                        irow=irow+1;
-                    }}
-                    icol=icol+1;
-                }}
-
-                // Calculate coefficient
-                coef=istate->ampl[iket]*ryser_omp(Ust,nthreads)/(sqrt(t)*sqrt(s));
-            }else{
-                coef=1.0;
-            }
 
-            // Store
-            if(abs(coef)>xcut){
-                index= ostate->add_term(coef,occ);
-                if(index<0){
-                    cout << "Simulator(RyserR): Warning! Simulation canceled because the memory limit has been exceeded.  Increase *mem* for more memory." << endl;
-                    // Free memory
-                    delete occ;
-                    // Finish partial calculation
-                    return;
-                }
-            }
+//--------------------------------------------------------------
+//
+// Circuit matrix restricted to the levels occupied in the
+// input and output kets. Each level is repeated as many times
+// as its occupation.
+//
+//---------------------------------------------------------------
+matc simulator::perm_matrix( int *iocc, int *oocc, qocircuit *qoc ){
+//  int       *iocc;             // Input occupations
+//  int       *oocc;             // Output occupations
+//  qocircuit *qoc;              // Circuit to be simulated
+//  Variables
+    int    nph;                  // Number of photons
+    matc   Ust;                  // Expanded matrix
+//  Index
+    int    ilin;                 // Index of input levels
+    int    ilout;                // Index of output levels
+    int    irow;                 // Row index of Ust
+    int    icol;                 // Col index of Ust
+//  Auxiliary index
+    int    i;                    // Aux index
+    int    j;                    // Aux index
 
-        } while (std::next_permutation(bitmask.begin(), bitmask.end()));
 
-        // Free memory
-        delete occ;
+    nph=0;
+    for(ilin=0;ilin<qoc->nlevel;ilin++) nph=nph+iocc[ilin];
 
+    Ust.resize(nph,nph);
+    icol=0;
+    for(ilin=0;ilin<qoc->nlevel;ilin++){
+    for(i=0;i<iocc[ilin];i++){
+        irow=0;
+        for(ilout=0;ilout<qoc->nlevel;ilout++){
+        for(j=0;j<oocc[ilout];j++){
+            Ust(irow,icol)=qoc->circmtx(ilout,ilin);
+            irow=irow+1;
+        }}
+        icol=icol+1;
     }}
+
+    return Ust;
 }
 
+
 //----------------------------------------
 //
-// Clifford A Sampling method. Sampling from a device.
+// Clifford B Sampling method. Sampling from a device.
 //
 //----------------------------------------
 p_bin *simulator::sample(qodev *circuit, int N){
@@ -1498,7 +2272,9 @@ p_bin *simulator::sample(qodev *circuit, int N){
 
 //--------------------------------------------------------------
 //
-// Clifford A Sampling method. Sampling from a circuit.
+// Clifford B Sampling method. Sampling from a circuit.
+// Each photon is sampled conditioned to the previous ones by
+// a Laplace expansion over the permanents of the column minors.
 //
 //---------------------------------------------------------------
 p_bin *simulator::sample( state *istate, qocircuit *qoc ,int N){
@@ -1508,7 +2284,6 @@ p_bin *simulator::sample( state *istate, qocircuit *qoc ,int N){
 //  Variables
     int     maxnph;         // Maximum number of photons in the input kets
     int     nlevel;         // Number of levels (qoc has this information, but it is put in this variable for easy access)
-    int     index;          // Bin position where a new output count is stored.
     int    *nph;            // Number of photons present in the input ket.
     int    *ilist;          // Sequence of input photons
     int    *occ;            // Occupation
@@ -1517,24 +2292,23 @@ p_bin *simulator::sample( state *istate, qocircuit *qoc ,int N){
     double *w;              // Conditioned probability distribution
     double *iw;             // Conditioned probability distribution
     cmplx   p;              // Probability auxiliary variable
-    string  bitmask;        // Bit mask
-    string  perm;           // Permutations
-    matc    Ust;            // Matrix to calculate the permanent
+    matc    Ust;            // Matrix to calculate the permanents of the minors
+    vecc    minors;         // Permanents of the minors of Ust
     p_bin  *obin;           // Output set of bins
 //  Index
     int     iket;           // Index of input kets elements
     int     isample;        // Index of sample
-    int     ilin;           // Index of input levels
-    int     ilout;          // Index of output levels
     int     irow;           // Row index of Ust
     int     icol;           // Col index of Ust
 //  Auxiliary index
     int     i;              // Aux index
     int     j;              // Aux index
     int     k;              // Aux index
-    int     m;              // Aux index
 
 
+    // Compute the circuit matrix if needed
+    qoc->compile();
+
     //Set up variables and reserve memory
     nlevel=qoc->nlevel;
 
@@ -1579,50 +2353,32 @@ p_bin *simulator::sample( state *istate, qocircuit *qoc ,int N){
             }
         }
 
+        // The input photons are taken in a random order
+        for(i=nph[iket]-1;i>0;i--){
+            j=min((int)(urand()*(i+1)),i);
+            swap(ilist[i],ilist[j]);
+        }
+
         // Generate a sequence of photons
         for(k=0;k<nph[iket];k++){
+            // Permanents of the minors of the rows of the previous
+            // photons and the first k+1 input photons.
+            Ust.resize(k,k+1);
+            for(irow=0;irow<k;irow++){
+                for(icol=0;icol<=k;icol++){
+                    Ust(irow,icol)=qoc->circmtx(r[irow],ilist[icol]);
+                }
+            }
+            minors=glynn_minors(Ust);
+
             // Calculate the conditional probability of each position
             // level where the next photon can be
             for(i=0;i<nlevel;i++){
-                // Initialize variables
-                r[k]=i;
-                w[i]=0.0;
-
-                // Reserve memory
-                Ust.resize(k+1,k+1);
-                perm.resize(k+1,0);
-
-                //All the possible subsets of columns have to be considered
-                bitmask.resize(0,0);
-                bitmask.resize(k+1,1);
-                bitmask.resize(nph[iket],0);
-                sort(bitmask.begin(),bitmask.end());
-                do{
-                    // Also in all possible orders
-                    j=0;
-                    for (m=0; m<nph[iket]; m++){
-                        if(bitmask[m]==1){
-                            perm[j]=(char)ilist[m];
-                            j=j+1;
-                        }
-                    }
-                    sort(perm.begin(),perm.end());
-                    do{
-                        // Prepare Ust
-                        icol=0;
-                        for(ilin=0;ilin<k+1;ilin++){
-                            irow=0;
-                            for(ilout=0;ilout<=k;ilout++){
-
-                                Ust(irow,icol)=qoc->circmtx(r[ilout],(int)perm[ilin]);
-                                irow=irow+1;
-                            }
-                            icol=icol+1;
-                        }
-                        p=glynn(Ust);
-                        w[i]=w[i]+pow(abs(p),2);
-                    }while (next_permutation(perm.begin(), perm.end()));
-                }while (next_permutation(bitmask.begin(), bitmask.end()));
+                p=0.0;
+                for(icol=0;icol<=k;icol++){
+                    p=p+qoc->circmtx(i,ilist[icol])*minors(icol);
+                }
+                w[i]=pow(abs(p),2);
             }
 
             // Calculated accumulated probability
@@ -1646,22 +2402,8 @@ p_bin *simulator::sample( state *istate, qocircuit *qoc ,int N){
             occ[r[i]]=occ[r[i]]+1;
         }
         // Store the count
-        index=obin->add_count(occ);
+        obin->add_count(occ);
         delete[] occ;
-
-        if(index<0){
-            cout << "Sample: Warning! Sampling canceled because the memory limit has been exceeded.  Increase *mem* for more memory." << endl;
-
-            // Free memory
-            delete[] r;
-            delete[] w;
-            delete[] iw;
-            delete[] nph;
-            delete[] ilist;
-
-            // Return partial calculation.
-            return obin;
-        }
     }
 
     // Free memory
@@ -1714,6 +2456,42 @@ tuple<p_bin*, double> simulator::metropolis( qodev *circuit ,int method, int N,
 }
 
 
+//--------------------------------------------------------------
+//
+// Metropolis sampling method. Sampling from a device with
+// several independent chains.
+//
+//---------------------------------------------------------------
+tuple<p_bin*, double, double, double> simulator::metropolis( qodev *circuit ,int method, int N, int Nburn, int Nthin, int nchains, int nthreads){
+//  qodev *circuit;     // Device to be samples.
+//  int    method;      // Sampling method
+//  int N;                  // Number of samples
+//  int Nburn;              // Number of initial samples before arriving to stationary distribution.
+//  int Nthin;              // Number of thining samples to avoid correlation.
+//  int nchains;            // Number of chains
+//  int nthreads;           // Number of threads
+//  Variables
+    double p;           // Acceptance ratio
+    double rhat;        // Gelman-Rubin diagnostic
+    double ess;         // Effective sample size
+    p_bin *outcome;     // Device outcomes and their probabilities
+    p_bin *measured;    // Measured outcomes after going through physical detectors
+
+
+    // Run simulation
+    tie(outcome,p,rhat,ess)=metropolis(circuit->inpt,circuit->circ,method,N,Nburn,Nthin,nchains,nthreads);
+
+    // Calculate the measured outcome including possible detector errors, etc
+    measured=outcome->calc_measure(circuit->circ);
+
+    // Free memory
+    delete outcome;
+
+    // Return result.
+    return {measured,p,rhat,ess};
+}
+
+
 //--------------------------------------------------------------
 //
 // Metropolis sampling method. Sampling from a circuit. ( Circuit version )
@@ -1722,6 +2500,36 @@ tuple<p_bin*, double> simulator::metropolis( qodev *circuit ,int method, int N,
 tuple<p_bin*, double> simulator::metropolis( state *istate, qocircuit *qoc ,int method, int N, int Nburn, int Nthin){
 //  state     *istate;      // Input state
 //  qocircuit *qoc;         // Circuit to be samples.
+//  int        method;      // Sampling method
+//  int N;                  // Number of samples
+//  int Nburn;              // Number of initial samples before arriving to stationary distribution.
+//  int Nthin;              // Number of thinning samples to avoid correlation.
+//  Variables
+    double  acc;            // Acceptance ratio
+    double  rhat;           // Gelman-Rubin diagnostic
+    double  ess;            // Effective sample size
+    p_bin  *obin;           // Output set of bins
+
+
+    // Compute the circuit matrix if needed
+    qoc->compile();
+
+    tie(obin,acc,rhat,ess)=metropolis(istate,qoc,method,N,Nburn,Nthin,1,1);
+    return {obin,acc};
+}
+
+
+//--------------------------------------------------------------
+//
+// Metropolis sampling method. Sampling from a circuit with
+// several independent chains. ( Circuit version )
+// Chains are run in parallel, each one with its own random
+// stream, and their bins are merged at the end.
+//
+//---------------------------------------------------------------
+tuple<p_bin*, double, double, double> simulator::metropolis( state *istate, qocircuit *qoc ,int method, int N, int Nburn, int Nthin, int nchains, int nthreads){
+//  state     *istate;      // Input state
+//  qocircuit *qoc;         // Circuit to be samples.
 //  int        method;      // Sampling method
                                 // 0: f classical
                                 // 1: g Uniform
@@ -1732,65 +2540,44 @@ tuple<p_bin*, double> simulator::metropolis( state *istate, qocircuit *qoc ,int
 //  int N;                  // Number of samples
 //  int Nburn;              // Number of initial samples before arriving to stationary distribution.
 //  int Nthin;              // Number of thinning samples to avoid correlation.
+//  int nchains;            // Number of chains
+//  int nthreads;           // Number of threads
 //  Variables
     bool   gral;            // True='Unrestricted sampling'/'False=Restricted sampling'
     bool   uniform;         // True='Uniform sampling'/'False=Circuit classical distribution sampling'
     bool   classic;         // Classical output True='Yes'/False='No'
-    int    Neff;            // Effective number of samples calculated. ( Not every sample is stored by different reasons)
     int    nph;             // Number of photons present in the input ket.
     int    nlevel;          // Number of levels (qoc has this information, but it is put in this variable for easy access)
-    int    index;           // Bin position where a new output count is stored.
-    int    *ilist;          // Sequence of input photons
-    int    *occ;            // Occupation
-    int    *r;              // Sequence of output photons
-    double  T;              // Sample acceptance probability
-    double  s;              // n1!n2!...nl! of the input
-    double  t;              // n1!n2!...nl! of the proposed sample
-    double  p=1.0;          // Probability of the sample.
-    double  p_old=1.0;      // Probability of the previous sample.
-    double  pc;             // Classical probability of the sample.
-    double  pc_old;         // Classical probability of the previous sample.
-    matc    Ust;            // Matrix to calculate the permanent
+    long long int naccept;  // Number of accepted proposals
+    long long int nprop;    // Number of proposals
+    long long int **count;  // Accepted proposals and proposals of each chain
+    unsigned long long stream; // First random stream of the chains
+    double  rhat;           // Gelman-Rubin diagnostic
+    double  ess;            // Effective sample size
+    vecd   *trace;          // Probability of the stored samples of each chain
     p_bin  *obin;           // Output set of bins
+    p_bin **cbin;           // Set of bins of each chain
 //  Index
-    int     isample;        // Index of accepted samples
-    int     istored;        // Index of stored samples
-    int     ilin;           // Index of input levels
-    int     ilout;          // Index of output levels
-    int     irow;           // Row index of Ust
-    int     icol;           // Col index of Ust
+    int     ichain;         // Index of chains
 //  Auxiliary index
     int     i;              // Aux index
-    int     j;              // Aux index
-    int     k;              // Aux index
 
 
+    // Compute the circuit matrix if needed
+    qoc->compile();
+
     // If the input has more than one ket the metropolis method can not sample it.
     if(istate->nket>1) cout << "metropolis warning!: Multiple ket input state. All kets are ignored except the first one" << endl;
 
-    // Set up dimensions of the probel,
-    s=1.0;
+    // Set up dimensions of the problem
     nph=0;
     nlevel=qoc->nlevel;
-    for(i=0;i<nlevel;i++){
-        nph=nph+istate->ket[0][i];
-        s=s*(double)factorial(istate->ket[0][i]);
-    }
-
-    //Reserve memory
-    ilist=new int[nph]();
-    r=new int[nph]();
-    Ust.resize(nph,nph);
+    for(i=0;i<nlevel;i++) nph=nph+istate->ket[0][i];
     obin=new p_bin(nph,nlevel,mem);
-
-    //Initialize input configuration.
-    k=0;
-    for(i=0;i<nlevel;i++){
-        for(j=0;j<istate->ket[0][i];j++){
-            ilist[k]=i;
-            k=k+1;
-        }
-    }
+    if(nchains<1) nchains=1;
+    if(nchains>N) nchains=max(1,N);
+    if(nthreads<1) nthreads=1;
+    if(Nthin<1) Nthin=1;
 
     // Configure the flags of the chosen method.
     switch (method){
@@ -1826,162 +2613,266 @@ tuple<p_bin*, double> simulator::metropolis( state *istate, qocircuit *qoc ,int
             break;
         default:
             cout << "Metropolis error: No recognized method." << endl;
-            return {obin,0.0};
+            return {obin,0.0,0.0,0.0};
             break;
     }
 
+    // Reserve memory
+    cbin=new p_bin*[nchains];
+    count=new long long int*[nchains];
+    trace=new vecd[nchains];
+    for(ichain=0;ichain<nchains;ichain++){
+        cbin[ichain]=new p_bin(nph,nlevel,mem);
+        count[ichain]=new long long int[2]();
+    }
+
+    // Run the chains. Each one has its own stream.
+    stream=rng_thread()();
+    #pragma omp parallel for schedule(dynamic,1) num_threads(nthreads)
+    for(ichain=0;ichain<nchains;ichain++){
+        philox rng=rng_stream(stream+ichain); // Random stream of the chain
+
+        metropolis_chain(istate,qoc,gral,uniform,classic,
+                         (int)((long long int)N*(ichain+1)/nchains-(long long int)N*ichain/nchains),
+                         Nburn,Nthin,rng,cbin[ichain],trace[ichain],count[ichain]);
+    }
+
+    // Merge the results of the chains
+    naccept=0;
+    nprop=0;
+    for(ichain=0;ichain<nchains;ichain++){
+        obin->add_bin(cbin[ichain]);
+        naccept=naccept+count[ichain][0];
+        nprop=nprop+count[ichain][1];
+    }
+
+    // Convergence diagnostics
+    rhat=gelman_rubin(trace,nchains);
+    ess=0.0;
+    for(ichain=0;ichain<nchains;ichain++) ess=ess+eff_size(trace[ichain]);
+
+    // Free memory
+    for(ichain=0;ichain<nchains;ichain++){
+        delete cbin[ichain];
+        delete[] count[ichain];
+    }
+    delete[] cbin;
+    delete[] count;
+    delete[] trace;
+
+    // Return output
+    return {obin,(double)naccept/(double)max(nprop,1LL),rhat,ess};
+}
+
+
+//--------------------------------------------------------------
+//
+// Single Metropolis chain. A rejected proposal repeats
+// the current sample of the chain.
+//
+//---------------------------------------------------------------
+void simulator::metropolis_chain( state *istate, qocircuit *qoc, bool gral, bool uniform, bool classic, int N, int Nburn, int Nthin, philox &rng, p_bin *obin, vecd &trace, long long int *count){
+//  state     *istate;      // Input state
+//  qocircuit *qoc;         // Circuit to be samples.
+//  bool       gral;        // True='Unrestricted sampling'/'False=Restricted sampling'
+//  bool       uniform;     // True='Uniform sampling'/'False=Circuit classical distribution sampling'
+//  bool       classic;     // Classical output True='Yes'/False='No'
+//  int N;                  // Number of samples
+//  int Nburn;              // Number of initial samples before arriving to stationary distribution.
+//  int Nthin;              // Number of thinning samples to avoid correlation.
+//  philox    &rng;         // Random stream of the chain
+//  p_bin     *obin;        // Output set of bins. Output variable
+//  vecd      &trace;       // Probability of the stored samples. Output variable
+//  long long int *count;   // Accepted proposals and proposals. Output variable
+//  Variables
+    int    nph;             // Number of photons present in the input ket.
+    int    nlevel;          // Number of levels (qoc has this information, but it is put in this variable for easy access)
+    int    *ilist;          // Sequence of input photons
+    int    *occ;            // Occupation
+    int    *cur;            // Occupation of the current sample of the chain
+    double  T;              // Sample acceptance probability
+    double  s;              // n1!n2!...nl! of the input
+    double  t;              // n1!n2!...nl! of the proposed sample
+    double  p=1.0;          // Probability of the sample.
+    double  p_old=1.0;      // Probability of the current sample.
+    double  pc;             // Classical probability of the sample.
+    double  pc_old=1.0;     // Classical probability of the current sample.
+//  Index
+    long long int isample;  // Index of samples of the chain
+    int     istored;        // Index of stored samples
+//  Auxiliary index
+    int     i;              // Aux index
+    int     j;              // Aux index
+    int     k;              // Aux index
+
+
+    // Set up dimensions of the problem
+    s=1.0;
+    nph=0;
+    nlevel=qoc->nlevel;
+    for(i=0;i<nlevel;i++){
+        nph=nph+istate->ket[0][i];
+        s=s*(double)factorial(istate->ket[0][i]);
+    }
+
+    //Reserve memory
+    ilist=new int[nph]();
+    cur=new int[nlevel]();
+    trace.resize(N);
+
+    //Initialize input configuration.
+    k=0;
+    for(i=0;i<nlevel;i++){
+        for(j=0;j<istate->ket[0][i];j++){
+            ilist[k]=i;
+            k=k+1;
+        }
+    }
 
     // Initialize loop variables and counters
     isample=0;
     istored=0;
-    Neff=0;
-    p_old=1.0;
-    pc_old=1.0;
+    count[0]=0;
+    count[1]=0;
     while(istored<N){
         // Generate classically distributed sample
-        tie(occ,pc)=classical_sample(ilist,nph,gral,uniform,qoc);
-
+        tie(occ,pc)=classical_sample(ilist,nph,gral,uniform,qoc,rng);
 
         // Obtain acceptance probability
         if(classic==false){
             // Init variables
-            for(i=0;i<nph;i++) r[i]=0;
-            k=0;
             t=1.0;
             for(i=0;i<nlevel;i++){
                 t=t*(double)factorial(occ[i]);
-                for(j=0;j<occ[i];j++){
-                    r[k]=i;
-                    k=k+1;
-
-                }
-            }
-
-            // Generate Ust
-            icol=0;
-            for(ilin=0;ilin<nph;ilin++){
-                irow=0;
-                for(ilout=0;ilout<nph;ilout++){
-                    Ust(irow,icol)=qoc->circmtx(r[ilout],ilist[ilin]);
-                    irow=irow+1;
-                }
-                icol=icol+1;
             }
 
             // Calculate probability
-            p=pow(abs(glynn(Ust)),2)/(s*t);
+            p=pow(abs(calc_perm(istate->ket[0],occ,qoc,0,1)),2)/(s*t);
 
             // Calculate acceptance probability
-            if(uniform==false) T=min(1.0,(p*pc_old)/(pc*p_old));
-            else T=min(1.0,p/p_old);
+            // The first proposal starts the chain.
+            if(isample==0)          T=1.0;
+            else if(uniform==false) T=min(1.0,(p*pc_old)/(pc*p_old));
+            else                    T=min(1.0,p/p_old);
         }else{
+            p=pc;
             T=1.0;
         }
 
-
         // Accept sample with probability T
-        if(urand()<T){
+        count[1]=count[1]+1;
+        if(rng.uniform()<T){
             p_old=p;
             pc_old=pc;
-            isample=isample+1;
-
-            // Store sample if it is not burn or thined
-            if((isample>Nburn)&&(isample%Nthin==0)){
-
-                index=obin->add_count(occ);
-                istored=istored+1;
-
-                if(index<0){
-                    cout << "Sample: Warning! Sampling canceled because the memory limit has been exceeded.  Increase *mem* for more memory." << endl;
+            for(i=0;i<nlevel;i++) cur[i]=occ[i];
+            count[0]=count[0]+1;
+        }
+        delete[] occ;
+        isample=isample+1;
 
-                    // Free memory
-                    delete[] r;
-                    delete[] ilist;
-                    delete [] occ;
+        // Store the current sample if it is not burn or thined
+        if((isample>Nburn)&&(isample%Nthin==0)){
+            trace(istored)=p_old;
+            istored=istored+1;
 
-                    // Return partial calculation.
-                    return {obin,(double) isample/(double)Neff};
-                }
-            }
+            obin->add_count(cur);
         }
-
-        Neff=Neff+1;
-        delete[] occ;
     }
 
     // Free memory
-    delete[] r;
     delete[] ilist;
-
-    // Return output
-    return {obin,(double) isample/(double)Neff};
+    delete[] cur;
 }
 
 
 //-----------------------------------------------
 //
 //  Obtain a sample from a circuit assuming photons
-//  are classical particles.
+//  are classical particles. Each photon is sent
+//  independently to an output level with probability
+//  given by the |U|^2 column of its input level.
+//  The probability of the sample is the permanent of
+//  the non-negative |U|^2 submatrix divided by n1!n2!..nl!
 //
 //-----------------------------------------------
-tuple<int*, double> simulator::classical_sample(int *ilist, int nph, bool gral, bool uniform, qocircuit *qoc ){
+tuple<int*, double> simulator::classical_sample(int *ilist, int nph, bool gral, bool uniform, qocircuit *qoc, philox &rng ){
 //  int *ilist;       // List of input photons.
 //  bool gral;        // Levels may have any number of photons true='Yes'/False='No'
 //  bool uniform;     // Uniform or classical distribution.   True='uniform'/False='Classical'
 //  qocircuit *qoc;   // Circuit being sampled.
+//  philox &rng;      // Random stream
 //  Variables
+    bool   valid;     // The sample is valid (restricted sampling) true='Yes'/False='No'
     int    nlevel;    // Number of levels
+    int    l;         // Output level of a photon
     double t;         // n1!n2!..nl!
-    double c;         // nph!
+    double u;         // Random number
+    double cum;       // Cumulative probability
     double pc;        // Classical probability
-    double auxpc;     // Auxiliary variable to calculate classical probability.
     int   *occ;       // Occupation
-    string perm;      // Permutations of the output photon list.
+    double **prob;    // |U|^2 column of the input level of each photon
+    matd   P;         // |U|^2 submatrix of the sample
 //  Auxiliary index
     int    i;         // Aux index
     int    j;         // Aux index
     int    k;         // Aux index
 
 
-    // Initialize variables
-    pc=0.0;
-    c=(double)factorial(nph);
-    nlevel=qoc->nlevel;
-    perm.resize(nph);
+    // Uniform distribution
+    if(uniform==true){
+        if(gral==true) tie(occ,t)=uniform_general(nph,qoc,rng);
+        else tie(occ,t)=uniform_restricted(nph,qoc,rng);
+        return {occ,1.0};
+    }
 
+    // Initialize variables and reserve memory
+    nlevel=qoc->nlevel;
+    occ=new int[nlevel]();
+    prob=new double*[nph];
+    for(i=0;i<nph;i++){
+        prob[i]=new double[nlevel];
+        for(l=0;l<nlevel;l++) prob[i][l]=norm(qoc->circmtx(l,ilist[i]));
+    }
 
     // Generate state.
-    // Accept only with probability pc
-    while(urand()>=pc){
-        // Generate uniform distribution
-        if(gral==true) tie(occ,t)=uniform_general(nph,qoc);
-        else tie(occ,t)=uniform_restricted(nph,qoc);
-
-
-        // Generate classical distribution of the circuit if asked.
-        if(uniform==false){
-            k=0;
-            for(i=0;i<nlevel;i++){
-                for(j=0;j<occ[i];j++){
-                    perm[k]=i;
-                    k=k+1;
-                }
+    // In restricted sampling samples with more
+    // than one photon in a level are rejected.
+    valid=false;
+    while(!valid){
+        for(l=0;l<nlevel;l++) occ[l]=0;
+        valid=true;
+        for(i=0;(i<nph)&&valid;i++){
+            // Total probability may be smaller than one if the circuit has losses.
+            cum=0.0;
+            for(l=0;l<nlevel;l++) cum=cum+prob[i][l];
+            u=cum*rng.uniform();
+            cum=0.0;
+            l=0;
+            while((l<nlevel-1)&&(cum+prob[i][l]<=u)){
+                cum=cum+prob[i][l];
+                l=l+1;
             }
+            occ[l]=occ[l]+1;
+            if((gral==false)&&(occ[l]>1)) valid=false;
+        }
+    }
 
-            pc=0.0;
-            sort(perm.begin(),perm.end());
-            do{
-                auxpc=1.0;
-                for(i=0;i<nph;i++){
-                    auxpc=auxpc*pow(abs(qoc->circmtx(perm[i],ilist[i])),2);
-                }
-                pc=pc+auxpc;
-            }while (next_permutation(perm.begin(), perm.end()));
-            pc=pc*t/c;
-        }else{
-            pc=1.0;
+    // Probability of the sample
+    P.resize(nph,nph);
+    t=1.0;
+    k=0;
+    for(l=0;l<nlevel;l++){
+        t=t*(double)factorial(occ[l]);
+        for(j=0;j<occ[l];j++){
+            for(i=0;i<nph;i++) P(k,i)=prob[i][l];
+            k=k+1;
         }
     }
+    pc=ryser_nonneg(P)/t;
+
+    // Free memory
+    for(i=0;i<nph;i++) delete[] prob[i];
+    delete[] prob;
 
     // Return sample.
     return {occ,pc};
@@ -1994,9 +2885,10 @@ tuple<int*, double> simulator::classical_sample(int *ilist, int nph, bool gral,
 //  ( Uniform distribution)
 //
 //-----------------------------------------------
-tuple<int*, double> simulator::uniform_general(int nph, qocircuit *qoc){
+tuple<int*, double> simulator::uniform_general(int nph, qocircuit *qoc, philox &rng){
 //  int nph;         // Number of photons
 //  int qocircuit;   // Circuit being sampled
+//  philox &rng;     // Random stream
 //  Variables
     int nlevel;      // Number of levels
     double t;        // n1!n2!..nl!
@@ -2014,12 +2906,12 @@ tuple<int*, double> simulator::uniform_general(int nph, qocircuit *qoc){
     // Generate state.
     // Accept only with probability p.
     p=0.0;
-    while(urand()>=p){
+    while(rng.uniform()>=p){
         // Init occupation
         for(i=0;i<nlevel;i++) occ[i]=0;
         // Generate state
         for(i=0;i<nph;i++){
-            l=floor(nlevel*urand());
+            l=floor(nlevel*rng.uniform());
             occ[l]=occ[l]+1;
         }
 
@@ -2045,9 +2937,10 @@ tuple<int*, double> simulator::uniform_general(int nph, qocircuit *qoc){
 //  ( Uniform distribution)
 //
 //-----------------------------------------------
-tuple<int*, double> simulator::uniform_restricted(int nph, qocircuit *qoc){
+tuple<int*, double> simulator::uniform_restricted(int nph, qocircuit *qoc, philox &rng){
 //  int nph;         // Number of photons
 //  int qocircuit;   // Circuit being sampled
+//  philox &rng;     // Random stream
 //  Variables
     int iph;         // Photons allocated
     int *occ;        // Occupation
@@ -2061,7 +2954,7 @@ tuple<int*, double> simulator::uniform_restricted(int nph, qocircuit *qoc){
     // Generate a random state. (Max one photon by level)
     iph=0;
     while(iph<nph){
-        l=floor(qoc->nlevel*urand());
+        l=floor(qoc->nlevel*rng.uniform());
         if(occ[l]==0){
             occ[l]=occ[l]+1;
             iph=iph+1;
@@ -26,37 +26,60 @@ public:
     simulator();                                                                  // Create a circuit simulator. Memory quantity set by default.
     simulator(int i_mem);                                                         // Create a circuit simulator. Memory quantity explicitly.
     ~simulator();                                                                 // Destroy circuit simulator
+    void set_cache(long long int size);                                           // Enables a cache of permanents with a maximum number of entries ( zero disables it )
+    void clear_cache();                                                           // Removes the permanents stored in the cache and restarts its counters
+    tuple<long long int, long long int> cache_stats();                            // Returns the number of hits and misses of the cache of permanents
+    void set_dense(bool i_dense);                                                 // Enables the dense output mode of the Glynn and Ryser methods
 
     // Simulation execution functions
     p_bin *run(qodev *circuit, int method);                                       // Calculate output of a device
     p_bin *run(qodev *circuit, int method, int nthreads);                         // Calculate output of a device with multi-threading support
     state *run(state *istate,qocircuit *qoc, int method );                        // Calculate output state as function of the input state
     state *run(state *istate,qocircuit *qoc, int method, int nthreads );          // Calculate output state as function of the input state with multi-threading support
+    dense_state *run_dense(state *istate,qocircuit *qoc, int method, int nthreads );                           // Calculate output state as function of the input state stored by rank in a dense array
     state *run( state *istate, ket_list *olist, qocircuit *qoc, int method );     // Calculates the output amplitudes of the kets specified
     state *run( state *istate, ket_list *olist, qocircuit *qoc, int method, int nthreads );                    // Calculates the output amplitudes of the kets specified with multi-threading support
-    p_bin *sample( qodev *input, int N );                                         // Calculate output sample of a device ( Clifford A )
-    p_bin *sample( state *istate,qocircuit *qoc, int N );                         // Calculate output sample as function of the input state ( Clifford A )
+    tuple<state*, vecd> gurvits( state *istate, ket_list *olist, qocircuit *qoc, double eps, double conf, int nthreads ); // Estimates the output amplitudes of the kets specified and their standard errors ( Gurvits )
+    p_bin *sample( qodev *input, int N );                                         // Calculate output sample of a device ( Clifford B )
+    p_bin *sample( state *istate,qocircuit *qoc, int N );                         // Calculate output sample as function of the input state ( Clifford B )
     tuple<p_bin*, double> metropolis( qodev *input ,int method, int N, int Nburn, int Nthin);                  // Calculate output sample of a device ( Metropolis )
     tuple<p_bin*, double> metropolis( state *istate, qocircuit *qoc ,int method, int N, int Nburn, int Nthin); // Calculate output sample as function of the input state  ( Metropolis )
+    tuple<p_bin*, double, double, double> metropolis( qodev *input ,int method, int N, int Nburn, int Nthin, int nchains, int nthreads);                  // Calculate output sample of a device with several chains in parallel ( Metropolis )
+    tuple<p_bin*, double, double, double> metropolis( state *istate, qocircuit *qoc ,int method, int N, int Nburn, int Nthin, int nchains, int nthreads); // Calculate output sample as function of the input state with several chains in parallel ( Metropolis )
 
 protected:
-    state *DirectF(state *istate,qocircuit *qoc );                                // Direct  full distribution
-    state *DirectR(state *istate,qocircuit *qoc );                                // DirectR restricted distribution
-    state *GlynnF (state *istate,qocircuit *qoc );                                // Glynn  full distribution
-    state *GlynnR (state *istate,qocircuit *qoc );                                // GlynnR restricted distribution
+    state *DirectF(state *istate,qocircuit *qoc, int nthreads );                  // Direct  full distribution with multi-threading support
+    state *DirectR(state *istate,qocircuit *qoc, int nthreads );                  // DirectR restricted distribution with multi-threading support
+    state *DirectP( state *istate, qocircuit *qoc, bool F );                      // Direct method applied photon by photon. Full or restricted distribution
+    state *GlynnF (state *istate,qocircuit *qoc, int nthreads );                  // Glynn  full distribution with multi-threading support
+    state *GlynnR (state *istate,qocircuit *qoc, int nthreads );                  // GlynnR restricted distribution with multi-threading support
+    state *split_outputs( state *istate, qocircuit *qoc, int core, int nthreads );                              // Splits the outputs of the Direct and Glynn methods between threads
+    dense_state *split_dense( state *istate, qocircuit *qoc, int core, int nthreads );                          // Splits the outputs of the Glynn and Ryser methods between threads writing into a dense state
+    void aux_DirectF( state *istate, int iket, qocircuit *qoc, long long int first, long long int last, state *ostate ); // Auxiliary method to calculate a range of outputs of DirectF
+    void aux_DirectR( state *istate, int iket, qocircuit *qoc, long long int first, long long int last, state *ostate ); // Auxiliary method to calculate a range of outputs of DirectR
+    void aux_GlynnF( state *istate, int iket, qocircuit *qoc, long long int first, long long int last, state *ostate, cmplx *dampl );  // Auxiliary method to calculate a range of outputs of GlynnF
+    void aux_GlynnR( state *istate, int iket, qocircuit *qoc, long long int first, long long int last, state *ostate, cmplx *dampl );  // Auxiliary method to calculate a range of outputs of GlynnR
     state *RyserF( state *istate, qocircuit *qoc, int nthreads);                  // Ryser full distribution with multi-threading support
     state *RyserR( state *istate, qocircuit *qoc, int nthreads);                  // RyserR restricted distribution with multi-threading support
     state *Fast_Ryser(state *istate,qocircuit *qoc, bool F, int nthreads);        // Ryser with the distribution restricted by the post-selection condition. This method supports multi-threading.
     void aux_RyserF( state *istate, state* ostate, qocircuit *qoc, int c_nph, veci constraint, int nthreads);   // Auxiliary method to calculate RyserF
     void aux_RyserR( state *istate, state* ostate, qocircuit *qoc, int c_nph, veci constraint, int nthreads);   // Auxiliary method to calculate RyserR
+    void split_ryser( state *istate, state* ostate, qocircuit *qoc, int c_nph, veci constraint, bool F, int nthreads); // Splits the permanents or the outputs of the Ryser methods between threads
+    void range_RyserF( state *istate, int iket, state* ostate, qocircuit *qoc, int c_nph, veci &constraint, veci &uclevels, long long int first, long long int last, int nthreads, cmplx *dampl); // Auxiliary method to calculate a range of outputs of RyserF
+    void range_RyserR( state *istate, int iket, state* ostate, qocircuit *qoc, int c_nph, veci &constraint, veci &uclevels, long long int first, long long int last, int nthreads, cmplx *dampl); // Auxiliary method to calculate a range of outputs of RyserR
+    state *LaplaceF( state *istate, qocircuit *qoc );                             // Laplace expansion full distribution. Minors are shared between outputs
 
     state *DirectS( state *istate, ket_list *olist, qocircuit *qoc );             // Direct single set of kets
     state *GlynnS( state *istate, ket_list *olist, qocircuit *qoc );              // Glynn single set of kets
     state *RyserS( state *istate, ket_list *olist, qocircuit *qoc, int nthreads );// Ryser single set of kets. This method supports multi-threading..
-
-    tuple<int*, double> classical_sample(int *ilist, int nph, bool gral, bool uniform, qocircuit *qoc);         // Generate a classically calculated sample
-    tuple<int*, double> uniform_general(int nph, qocircuit *qoc);                                               // Generate a uniformly distributed sample ( General    )
-    tuple<int*, double>uniform_restricted(int nph, qocircuit *qoc);                                             // Generate a uniformly distributed sample ( Restricted )
+    state *GurvitsS( state *istate, ket_list *olist, qocircuit *qoc, double eps, double conf, int nthreads, vecd &serr ); // Gurvits estimation for a single set of kets. This method supports multi-threading.
+    cmplx calc_perm( int *iocc, int *oocc, qocircuit *qoc, int kernel, int nthreads ); // Permanent of the circuit matrix for an input and output occupation
+    matc perm_matrix( int *iocc, int *oocc, qocircuit *qoc );                     // Circuit matrix expanded for an input and output occupation
+
+    void metropolis_chain( state *istate, qocircuit *qoc, bool gral, bool uniform, bool classic, int N, int Nburn, int Nthin, philox &rng, p_bin *obin, vecd &trace, long long int *count); // Runs a single Metropolis chain
+    tuple<int*, double> classical_sample(int *ilist, int nph, bool gral, bool uniform, qocircuit *qoc, philox &rng); // Generate a classically calculated sample
+    tuple<int*, double> uniform_general(int nph, qocircuit *qoc, philox &rng);                                  // Generate a uniformly distributed sample ( General    )
+    tuple<int*, double>uniform_restricted(int nph, qocircuit *qoc, philox &rng);                                // Generate a uniformly distributed sample ( Restricted )
 };
 ***********************************************************************************/
 
@@ -66,7 +89,7 @@ protected:
 #include <future>
 
 // Constant defaults
-const int DEFSIMMEM=1000;          ///< Default simulator reserved memory for output (in bytes).
+const int DEFSIMMEM=1000;          ///< Default initial number of terms reserved for the output. The output grows when it is full.
 
 
 /** @defgroup Simulator
@@ -89,7 +112,9 @@ const int DEFSIMMEM=1000;          ///< Default simulator reserved memory for ou
 class simulator{
 public:
     // Public variables
-    int mem;                       ///< Memory reserved for operations
+    int mem;                       ///< Initial number of terms reserved for the outputs. They grow when they are full.
+    long long int cachesize;       ///< Maximum number of permanents in the cache. Zero if disabled.
+    bool dense;                    ///< True if the Glynn and Ryser methods store their output by rank in a dense array.
 
 
     // Public functions
@@ -108,7 +133,7 @@ public:
     /**
     *  Creates a simulator object.
     *
-    *  @param int i_mem Reserved memory for the output expressed as a maximum number of terms.
+    *  @param int i_mem Initial number of terms reserved for the output. The output grows beyond it when it is full.
     *  @ingroup Simulation_management
     * \xrefitem know "KnowIss" "Known Issues" If the quantity of memory reserved is too large it is possible to see certain slow down due the time to reserve and initialize memory.
     */
@@ -119,6 +144,41 @@ public:
     *  @ingroup Simulation_management
     */
     ~simulator();
+    /**
+    *  Enables a bounded cache of permanents. Permanents are stored by the submatrix of the circuit and the occupations
+    *  of the input and output levels involved. Once the cache is full the least recently used permanent is removed. <br>
+    *  The cache is shared by all the threads and it is kept between runs. It is used by the Glynn and Ryser cores, the manual mode and the Metropolis sampling.
+    *  It is useful for peaked distributions where the same outputs are calculated many times.
+    *
+    *  @param long long int size Maximum number of permanents stored. Zero disables the cache.
+    *  @ingroup Simulation_management
+    */
+    void set_cache(long long int size);
+    /**
+    *  Removes all the permanents stored in the cache and restarts its counters.
+    *
+    *  @ingroup Simulation_management
+    */
+    void clear_cache();
+    /**
+    *  Returns the counters of the cache of permanents.
+    *
+    *  @return Number of permanents found in the cache (hits) and number of permanents not found and calculated (misses).
+    *  @ingroup Simulation_management
+    */
+    tuple<long long int, long long int> cache_stats();
+    /**
+    *  Enables the dense output mode of the Glynn and Ryser methods for full and restricted distributions (methods 2 to 5). <br>
+    *  In this mode every output ket is identified by its combinatorial rank and its amplitude is written directly into a preallocated
+    *  array instead of being searched in the dictionary of the output state. The threads write into disjoint ranges of the array.
+    *  The memory used is the number of kets with the photon number of the input state times the size of a complex number even if
+    *  most of them are zero. It is only used when all the input kets have the same number of photons.
+    *
+    *  @param bool i_dense True to enable the dense output mode. False to disable it.
+    *  @ingroup Simulation_management
+    *  @see dense_state *run_dense(state *istate,qocircuit *qoc, int method, int nthreads );
+    */
+    void set_dense(bool i_dense);
 
 
     // Simulation execution functions
@@ -131,7 +191,7 @@ public:
     *  Calculates an output outcome from a device using the selected core method and the physical detectors definitions established in that device description. ( Default single thread version ).
     *
     *  @param qodev  *circuit  Device to be simulated.
-    *  @param int method  Core method. There are four to choose:
+    *  @param int method  Core method. There are eleven to choose:
     *                            <br>
     *                            <b style="color:blue;">0</b> = <b>Direct method</b>: The calculation is performed similarly on how it is done analytically.<br>
     *                            <b style="color:blue;">1</b> = <b>Direct restricted</b>: Same as the direct method but considering only output states of occupations by level zero or one. This restricts but speeds up the output.<br>
@@ -141,6 +201,9 @@ public:
     *                            <b style="color:blue;">5</b> = <b>Ryser restricted</b>: Same as the Ryser method but considering only output states of occupations by level zero or one. This restricts but speeds up the output. <br>
     *                            <b style="color:blue;">6</b> = <b>Fast Ryser method</b>:  Same as the Ryser method but only those kets with non-zero contribution to post-selection are considered. This restriction speeds up the output.<br>
     *                            <b style="color:blue;">7</b> = <b>Fast Ryser restricted</b>: Same as the Fast Ryser method but considering only output states of occupations by level zero or one. This further restricts but speeds up the output. <br>
+    *                            <b style="color:blue;">8</b> = <b>Laplace method</b>: Full distribution using permanents expanded by the last photon. The minors are shared between outputs that only differ in the level of the last photon.<br>
+    *                            <b style="color:blue;">9</b> = <b>Direct photon by photon</b>: Same as the direct method but the circuit is applied one input photon at a time merging equal partial occupations.<br>
+    *                            <b style="color:blue;">10</b> = <b>Direct photon by photon restricted</b>: Same as the direct photon by photon method but considering only output states of occupations by level zero or one.<br>
     *                            <br>
     *  @return Returns the final outcomes and their probabilities.
     *  @ingroup Simulation_execution
@@ -148,10 +211,10 @@ public:
     p_bin *run(qodev *circuit, int method);
     /**
     *  Calculates an output outcome from a device using the selected core method and the physical detectors definitions established in that device description. ( Multi-thread version ). <br>
-    *  Multi-threading available for Ryser based methods. The number of threads parameter is ignored for the rest of the methods.
+    *  Multi-threading available for Direct, Glynn and Ryser based methods (0 to 7). The number of threads parameter is ignored for the rest of the methods.
     *
     *  @param qodev  *circuit  Device to be simulated.
-    *  @param int method  Core method. There are four to choose:
+    *  @param int method  Core method. There are eleven to choose:
     *                            <br>
     *                            <b style="color:blue;">0</b> = <b>Direct method</b>: The calculation is performed similarly on how it is done analytically.<br>
     *                            <b style="color:blue;">1</b> = <b>Direct restricted</b>: Same as the direct method but considering only output states of occupations by level zero or one. This restricts but speeds up the output.<br>
@@ -161,6 +224,9 @@ public:
     *                            <b style="color:blue;">5</b> = <b>Ryser restricted</b>: Same as the Ryser method but considering only output states of occupations by level zero or one. This restricts but speeds up the output. <br>
     *                            <b style="color:blue;">6</b> = <b>Fast Ryser method</b>:  Same as the Ryser method but only those kets with non-zero contribution to post-selection are considered. This restriction speeds up the output.<br>
     *                            <b style="color:blue;">7</b> = <b>Fast Ryser restricted</b>: Same as the Fast Ryser method but considering only output states of occupations by level zero or one. This further restricts but speeds up the output. <br>
+    *                            <b style="color:blue;">8</b> = <b>Laplace method</b>: Full distribution using permanents expanded by the last photon. The minors are shared between outputs that only differ in the level of the last photon.<br>
+    *                            <b style="color:blue;">9</b> = <b>Direct photon by photon</b>: Same as the direct method but the circuit is applied one input photon at a time merging equal partial occupations.<br>
+    *                            <b style="color:blue;">10</b> = <b>Direct photon by photon restricted</b>: Same as the direct photon by photon method but considering only output states of occupations by level zero or one.<br>
     *                            <br>
     *  @param int nthreads Number of threads.
     *  @return Returns the final outcomes and their probabilities.
@@ -172,7 +238,7 @@ public:
     *
     *  @param state     *istate Initial state.
     *  @param qocircuit *qoc    Circuit to be simulated.
-    *  @param int method  Core method. There are four to choose:
+    *  @param int method  Core method. There are eleven to choose:
     *                            <br>
     *                            <b style="color:blue;">0</b> = <b>Direct method</b>: The calculation is performed similarly on how it is done analytically.<br>
     *                            <b style="color:blue;">1</b> = <b>Direct restricted</b>: Same as the direct method but considering only output states of occupations by level zero or one. This restricts but speeds up the output.<br>
@@ -182,6 +248,9 @@ public:
     *                            <b style="color:blue;">5</b> = <b>Ryser restricted</b>: Same as the Ryser method but considering only output states of occupations by level zero or one. This restricts but speeds up the output. <br>
     *                            <b style="color:blue;">6</b> = <b>Fast Ryser method</b>:  Same as the Ryser method but only those kets with non-zero contribution to post-selection are considered. This restriction speeds up the output.<br>
     *                            <b style="color:blue;">7</b> = <b>Fast Ryser restricted</b>: Same as the Fast Ryser method but considering only output states of occupations by level zero or one. This further restricts but speeds up the output. <br>
+    *                            <b style="color:blue;">8</b> = <b>Laplace method</b>: Full distribution using permanents expanded by the last photon. The minors are shared between outputs that only differ in the level of the last photon.<br>
+    *                            <b style="color:blue;">9</b> = <b>Direct photon by photon</b>: Same as the direct method but the circuit is applied one input photon at a time merging equal partial occupations.<br>
+    *                            <b style="color:blue;">10</b> = <b>Direct photon by photon restricted</b>: Same as the direct photon by photon method but considering only output states of occupations by level zero or one.<br>
     *                            <br>
     *  @param int nthreads Number of threads.
     *  @return Returns the final state that correspond to an application of the circuit to the
@@ -191,11 +260,11 @@ public:
     state *run(state *istate,qocircuit *qoc, int method);
     /**
     *  Calculates an output state as a function of an input initial state using the selected core method according to the rules established by a quantum circuit. ( Multi-thread version ). <br>
-    *  Multi-threading available for Ryser based methods. The number of threads parameter is ignored for the rest of the methods.
+    *  Multi-threading available for Direct, Glynn and Ryser based methods (0 to 7). The number of threads parameter is ignored for the rest of the methods.
     *
     *  @param state     *istate Initial state.
     *  @param qocircuit *qoc    Circuit to be simulated.
-    *  @param int method  Core method. There are four to choose:
+    *  @param int method  Core method. There are eleven to choose:
     *                            <br>
     *                            <b style="color:blue;">0</b> = <b>Direct method</b>: The calculation is performed similarly on how it is done analytically.<br>
     *                            <b style="color:blue;">1</b> = <b>Direct restricted</b>: Same as the direct method but considering only output states of occupations by level zero or one. This restricts but speeds up the output.<br>
@@ -205,6 +274,9 @@ public:
     *                            <b style="color:blue;">5</b> = <b>Ryser restricted</b>: Same as the Ryser method but considering only output states of occupations by level zero or one. This restricts but speeds up the output. <br>
     *                            <b style="color:blue;">6</b> = <b>Fast Ryser method</b>:  Same as the Ryser method but only those kets with non-zero contribution to post-selection are considered. This restriction speeds up the output.<br>
     *                            <b style="color:blue;">7</b> = <b>Fast Ryser restricted</b>: Same as the Fast Ryser method but considering only output states of occupations by level zero or one. This further restricts but speeds up the output. <br>
+    *                            <b style="color:blue;">8</b> = <b>Laplace method</b>: Full distribution using permanents expanded by the last photon. The minors are shared between outputs that only differ in the level of the last photon.<br>
+    *                            <b style="color:blue;">9</b> = <b>Direct photon by photon</b>: Same as the direct method but the circuit is applied one input photon at a time merging equal partial occupations.<br>
+    *                            <b style="color:blue;">10</b> = <b>Direct photon by photon restricted</b>: Same as the direct photon by photon method but considering only output states of occupations by level zero or one.<br>
     *                            <br>
     *  @param int nthreads Number of threads.
     *  @return Returns the final state that correspond to an application of the circuit to the
@@ -212,6 +284,26 @@ public:
     *  @ingroup Simulation_execution
     */
     state *run(state *istate,qocircuit *qoc, int method, int nthreads );
+    /**
+    *  Calculates an output state as a function of an input initial state using the Glynn or Ryser methods. The amplitudes of the
+    *  output are stored by rank in a dense state. All the input kets must have the same number of photons. <br>
+    *  Multi-threading available. Each thread writes a range of ranks of the output.
+    *
+    *  @param state     *istate Initial state.
+    *  @param qocircuit *qoc    Circuit to be simulated.
+    *  @param int method  Core method. There are four to choose:
+    *                            <br>
+    *                            <b style="color:blue;">2</b> = <b>Glynn method</b>: Full distribution using the Glynn formula.<br>
+    *                            <b style="color:blue;">3</b> = <b>Glynn restricted</b>: Restricted distribution using the Glynn formula.<br>
+    *                            <b style="color:blue;">4</b> = <b>Ryser method</b>: Full distribution using the Ryser formula.<br>
+    *                            <b style="color:blue;">5</b> = <b>Ryser restricted</b>: Restricted distribution using the Ryser formula.<br>
+    *                            <br>
+    *  @param int nthreads Number of threads.
+    *  @return Returns the final dense state that correspond to an application of the circuit to the
+    *  initial state. nullptr if the method is not available or the input kets have different numbers of photons.
+    *  @ingroup Simulation_execution
+    */
+    dense_state *run_dense(state *istate,qocircuit *qoc, int method, int nthreads );
 
     /**
     *  Calculates the output amplitudes for a given list of kets as a function of an input initial state using the selected core method according to the rules established by a quantum circuit. ( Default single thread version ).<br>
@@ -251,9 +343,29 @@ public:
     */
     state *run( state *istate, ket_list *olist, qocircuit *qoc, int method, int nthreads );
     /**
-    *  Sampling of a device using Clifford A algorithm. <br>
+    *  Estimates the output amplitudes for a given list of kets as a function of an input initial state using the randomized
+    *  Gurvits estimator of the permanent. The computational cost is polynomial in the number of photons. It is intended
+    *  to validate large experiments where the exact methods are not feasible.<br>
+    *  The number of samples of each term is chosen from the Hoeffding inequality so that its additive error is smaller than
+    *  eps with probability conf. The samples are split between threads.
+    *  The output probabilities are the squared modulus of the amplitudes with standard error 2|ampl|serr.
+    *  <b> L. Gurvits, Lecture Notes in Computer Science 3618, 447-458 (2005). </b> <br>
+    *
+    *  @param state     *istate Initial state.
+    *  @param ket_list  *olist List of the kets whose output amplitude we intend to estimate.
+    *  @param qocircuit *qoc    Circuit to be simulated.
+    *  @param double eps  Additive error of each term of the amplitudes.
+    *  @param double conf Confidence. Probability of each term being within the additive error.
+    *  @param int nthreads Number of threads.
+    *  @return Returns a final state with the estimated amplitudes of the kets of the list and a vector with the standard error
+    *  of the amplitude of each ket in the same order as in the list.
+    *  @ingroup Simulation_execution
+    */
+    tuple<state*, vecd> gurvits( state *istate, ket_list *olist, qocircuit *qoc, double eps, double conf, int nthreads );
+    /**
+    *  Sampling of a device using Clifford B algorithm. <br>
     *  <b> Proceedings of the 2018 Annual ACM-SIAM Symposium on Discrete Algorithms (SODA). Page 146-155. SIAM Publications Library (2018). </b>  <br>
-    *  <b>Warning!</b> Clifford A is defined to be used with a single input ket. Therefore neither Bell or QD initializations are recommended.
+    *  <b>Warning!</b> Clifford B is defined to be used with a single input ket. Therefore neither Bell or QD initializations are recommended.
     *
     *  @param qodev  *input  Device to be sampled.
     *  @param int N Number of samples.
@@ -262,9 +374,9 @@ public:
     */
     p_bin *sample( qodev *input, int N );
     /**
-    *  Sampling of a circuit using Clifford A algorithm.<br>
+    *  Sampling of a circuit using Clifford B algorithm.<br>
     *  <b> Proceedings of the 2018 Annual ACM-SIAM Symposium on Discrete Algorithms (SODA). Page 146-155. SIAM Publications Library (2018). </b> <br>
-    *  <b>Warning!</b> Clifford A is defined to be used with a single input ket. Input states with multiple kets are not recommended.
+    *  <b>Warning!</b> Clifford B is defined to be used with a single input ket. Input states with multiple kets are not recommended.
     *
     *  @param state     *istate Initial state.
     *  @param qocircuit *qoc    Circuit to be sampled.
@@ -314,9 +426,49 @@ public:
     *  @ingroup Simulation_execution
     */
     tuple<p_bin*, double> metropolis( state *istate, qocircuit *qoc ,int method, int N, int Nburn, int Nthin);
+    /**
+    *  Sampling of a device using several independent metropolis chains run in parallel. <br>
+    *  Each chain has its own random stream and the samples of all the chains are merged. <br>
+    *  <b> Nature Physics 13, 1153-1157 (2017). </b> <br>
+    *  <b>Warning!</b> Metropolis defined to be used with a single input ket. Therefore neither Bell or QD initializations are recommended.
+    *
+    *  @param qodev  *input  Device to be sampled.
+    *  @param int method Sampling method. Same as in the single chain version.
+    *  @param int N Total number of samples. They are split between the chains.
+    *  @param int Nburn Number of initial samples of each chain to be skipped.
+    *  @param int Nthin Number of thinning samples.
+    *  @param int nchains Number of chains.
+    *  @param int nthreads Number of threads.
+    *  @return Returns a set of probability bins with the number of samples for each state, the acceptance ratio, the Gelman-Rubin potential
+    *  scale reduction factor and the effective sample size. The diagnostics are calculated for the probability of the samples along the chains.
+    *  @ingroup Simulation_execution
+    */
+    tuple<p_bin*, double, double, double> metropolis( qodev *input ,int method, int N, int Nburn, int Nthin, int nchains, int nthreads);
+    /**
+    *  Sampling of a circuit using several independent metropolis chains run in parallel. <br>
+    *  Each chain has its own random stream and the samples of all the chains are merged. <br>
+    *  <b> Nature Physics 13, 1153-1157 (2017). </b> <br>
+    *  <b>Warning!</b> Metropolis is defined to be used with a single input ket. Input states with multiple kets are not recommended.
+    *
+    *  @param state     *istate Initial state.
+    *  @param qocircuit *qoc    Circuit to be sampled.
+    *  @param int method Sampling method. Same as in the single chain version.
+    *  @param int N Total number of samples. They are split between the chains.
+    *  @param int Nburn Number of initial samples of each chain to be skipped.
+    *  @param int Nthin Number of thinning samples.
+    *  @param int nchains Number of chains.
+    *  @param int nthreads Number of threads.
+    *  @return Returns a set of probability bins with the number of samples for each state, the acceptance ratio, the Gelman-Rubin potential
+    *  scale reduction factor and the effective sample size. The diagnostics are calculated for the probability of the samples along the chains.
+    *  @ingroup Simulation_execution
+    */
+    tuple<p_bin*, double, double, double> metropolis( state *istate, qocircuit *qoc ,int method, int N, int Nburn, int Nthin, int nchains, int nthreads);
 
 
 protected:
+    // Protected variables
+    perm_cache pcache;             ///< Cache of permanents
+
     /** @defgroup Simulation_auxiliary Simulator auxiliary methods
     *   @ingroup Simulator
     *   Auxiliary methods to run a simulation.
@@ -330,11 +482,12 @@ protected:
     *
     *  @param state     *istate Initial state.
     *  @param qocircuit *qoc    Circuit to be simulated.
+    *  @param int nthreads Number of threads.
     *  @return Returns the final state that correspond to an application of the circuit to the
     *  initial state.
     *  @ingroup Simulation_auxiliary
     */
-    state *DirectF(state *istate,qocircuit *qoc );
+    state *DirectF(state *istate,qocircuit *qoc, int nthreads );
     /**
     *  Calculates an output state as a function of an input initial state using the Direct method for a restricted output distribution.
     *  In this case the amplitudes of probability are calculated only for kets with 0 or 1 number of photons in each level. The rest
@@ -343,12 +496,28 @@ protected:
     *
     *  @param state     *istate Initial state.
     *  @param qocircuit *qoc    Circuit to be simulated.
+    *  @param int nthreads Number of threads.
+    *  @return Returns the final state that correspond to an application of the circuit to the
+    *  initial state.
+    *  @see DirectF(state *istate,qocircuit *qoc, int nthreads );
+    *  @ingroup Simulation_auxiliary
+    */
+    state *DirectR( state *istate,qocircuit *qoc, int nthreads );
+    /**
+    *  Calculates an output state as a function of an input initial state using the Direct method applied photon by photon.
+    *  The transformed creation operator of each input photon is applied to the partial output state and equal partial occupations are
+    *  merged after each photon. Therefore the work scales with the number of different partial occupations instead of nlevel^nph. <br>
+    *  <b> Intended for internal use of the library. </b>
+    *
+    *  @param state     *istate Initial state.
+    *  @param qocircuit *qoc    Circuit to be simulated.
+    *  @param bool F. True: The full distribution is calculated. False: Only those kets with at most one photon by level.
     *  @return Returns the final state that correspond to an application of the circuit to the
     *  initial state.
-    *  @see DirectF(state *istate,qocircuit *qoc );
+    *  @see DirectF(state *istate,qocircuit *qoc, int nthreads );
     *  @ingroup Simulation_auxiliary
     */
-    state *DirectR( state *istate,qocircuit *qoc );
+    state *DirectP( state *istate, qocircuit *qoc, bool F );
     /**
     *  Calculates an output state as a function of an input initial state using a permanent calculation method for a full output distribution.
     *  This is, calculating the amplitude of probability of every possible ket with the same number of photons that the input.
@@ -357,11 +526,12 @@ protected:
     *
     *  @param state     *istate Initial state.
     *  @param qocircuit *qoc    Circuit to be simulated.
+    *  @param int nthreads Number of threads.
     *  @return Returns the final state that correspond to an application of the circuit to the
     *  initial state.
     *  @ingroup Simulation_auxiliary
     */
-    state *GlynnF( state *istate,qocircuit *qoc );
+    state *GlynnF( state *istate,qocircuit *qoc, int nthreads );
     /**
     *  Calculates an output state as a function of an input initial state using a permanent calculation method for a restricted output distribution.
     *  In this case the amplitudes of probability are calculated only for kets with 0 or 1 number of photons in each level. The rest
@@ -370,12 +540,99 @@ protected:
     *
     *  @param state     *istate Initial state.
     *  @param qocircuit *qoc    Circuit to be simulated.
+    *  @param int nthreads Number of threads.
     *  @return Returns the final state that correspond to an application of the circuit to the
     *  initial state.
     *  @ingroup Simulation_auxiliary
-    *  @see GlynnF( state *istate,qocircuit *qoc );
+    *  @see GlynnF( state *istate,qocircuit *qoc, int nthreads );
     */
-    state *GlynnR( state *istate,qocircuit *qoc );
+    state *GlynnR( state *istate,qocircuit *qoc, int nthreads );
+    /**
+    *  Splits the enumeration of the outputs of each input ket of the Direct and Glynn methods in one consecutive range for each thread.
+    *  Each thread stores its results in its own output state. These are merged at the end in the order of the ranges. <br>
+    *  <b> Intended for internal use of the library. </b>
+    *
+    *  @param state     *istate Initial state.
+    *  @param qocircuit *qoc    Circuit to be simulated.
+    *  @param int core Core method. 0=DirectF, 1=DirectR, 2=GlynnF and 3=GlynnR.
+    *  @param int nthreads Number of threads.
+    *  @return Returns the final state that correspond to an application of the circuit to the
+    *  initial state.
+    *  @ingroup Simulation_auxiliary
+    */
+    state *split_outputs( state *istate, qocircuit *qoc, int core, int nthreads );
+    /**
+    *  Splits the outputs of each input ket of the Glynn and Ryser methods in one consecutive range of ranks for each thread.
+    *  The threads add their amplitudes directly into a shared dense state. The ranges do not overlap so no synchronization is needed. <br>
+    *  <b> Intended for internal use of the library. </b>
+    *
+    *  @param state     *istate Initial state.
+    *  @param qocircuit *qoc    Circuit to be simulated.
+    *  @param int core Core method. 2=GlynnF, 3=GlynnR, 4=RyserF and 5=RyserR.
+    *  @param int nthreads Number of threads.
+    *  @return Returns the final dense state that correspond to an application of the circuit to the
+    *  initial state. nullptr if the input kets have different numbers of photons.
+    *  @ingroup Simulation_auxiliary
+    */
+    dense_state *split_dense( state *istate, qocircuit *qoc, int core, int nthreads );
+    /**
+    *  Auxiliary method to calculate a range of the outputs of an input ket using the Direct method for a full output distribution.
+    *  <b> Intended for internal use of the library. </b>
+    *
+    *  @param state     *istate Initial state.
+    *  @param int iket Index of the input ket.
+    *  @param qocircuit *qoc    Circuit to be simulated.
+    *  @param long long int first First output sequence of the range.
+    *  @param long long int last  Last output sequence of the range (not included).
+    *  @param state     *ostate Output state. <b> Warning! this is an output variable </b>
+    *  @ingroup Simulation_auxiliary
+    *  @see split_outputs( state *istate, qocircuit *qoc, int core, int nthreads );
+    */
+    void aux_DirectF( state *istate, int iket, qocircuit *qoc, long long int first, long long int last, state *ostate );
+    /**
+    *  Auxiliary method to calculate a range of the outputs of an input ket using the Direct method for a restricted output distribution.
+    *  <b> Intended for internal use of the library. </b>
+    *
+    *  @param state     *istate Initial state.
+    *  @param int iket Index of the input ket.
+    *  @param qocircuit *qoc    Circuit to be simulated.
+    *  @param long long int first First output occupation of the range.
+    *  @param long long int last  Last output occupation of the range (not included).
+    *  @param state     *ostate Output state. <b> Warning! this is an output variable </b>
+    *  @ingroup Simulation_auxiliary
+    *  @see split_outputs( state *istate, qocircuit *qoc, int core, int nthreads );
+    */
+    void aux_DirectR( state *istate, int iket, qocircuit *qoc, long long int first, long long int last, state *ostate );
+    /**
+    *  Auxiliary method to calculate a range of the outputs of an input ket using the Glynn method for a full output distribution.
+    *  <b> Intended for internal use of the library. </b>
+    *
+    *  @param state     *istate Initial state.
+    *  @param int iket Index of the input ket.
+    *  @param qocircuit *qoc    Circuit to be simulated.
+    *  @param long long int first First output occupation of the range.
+    *  @param long long int last  Last output occupation of the range (not included).
+    *  @param state     *ostate Output state. <b> Warning! this is an output variable </b>
+    *  @param cmplx     *dampl  Amplitudes of a dense state indexed by rank. If it is not nullptr the outputs are added there instead of ostate. <b> Warning! this is an output variable </b>
+    *  @ingroup Simulation_auxiliary
+    *  @see split_outputs( state *istate, qocircuit *qoc, int core, int nthreads );
+    */
+    void aux_GlynnF( state *istate, int iket, qocircuit *qoc, long long int first, long long int last, state *ostate, cmplx *dampl );
+    /**
+    *  Auxiliary method to calculate a range of the outputs of an input ket using the Glynn method for a restricted output distribution.
+    *  <b> Intended for internal use of the library. </b>
+    *
+    *  @param state     *istate Initial state.
+    *  @param int iket Index of the input ket.
+    *  @param qocircuit *qoc    Circuit to be simulated.
+    *  @param long long int first First output occupation of the range.
+    *  @param long long int last  Last output occupation of the range (not included).
+    *  @param state     *ostate Output state. <b> Warning! this is an output variable </b>
+    *  @param cmplx     *dampl  Amplitudes of a dense state indexed by rank. If it is not nullptr the outputs are added there instead of ostate. <b> Warning! this is an output variable </b>
+    *  @ingroup Simulation_auxiliary
+    *  @see split_outputs( state *istate, qocircuit *qoc, int core, int nthreads );
+    */
+    void aux_GlynnR( state *istate, int iket, qocircuit *qoc, long long int first, long long int last, state *ostate, cmplx *dampl );
 
     /**
     *  Calculates an output state as a function of an input initial state using a permanent calculation method for a full output distribution.
@@ -449,6 +706,76 @@ protected:
     *  @see state *Fast_Ryser(state *istate,qocircuit *qoc, bool F, int nthreads);
     */
     void aux_RyserR( state *istate, state* ostate, qocircuit *qoc, int c_nph, veci constraint, int nthreads);
+    /**
+    *  Auxiliary method of the Ryser methods that decides for each input ket how threads are used. If the permanents are small
+    *  and there are enough outputs, each thread calculates a range of outputs with single-threaded permanents. Otherwise
+    *  each permanent is split between the threads.
+    *  <b> Intended for internal use of the library. </b>
+    *
+    *  @param state     *istate Initial state.
+    *  @param state     *ostate Output state. <b> Warning! this is an output variable </b>
+    *  @param qocircuit *qoc    Circuit to be simulated.
+    *  @param int c_nph  Constrained number of photons.
+    *  @param veci constraint  List of occupation by mode representing a post-selection condition.
+    *  @param bool F  True: Full distribution. False: Restricted distribution.
+    *  @param int nthreads Number of threads.
+    *  @ingroup Simulation_auxiliary
+    *  @see void aux_RyserF( state *istate, state* ostate, qocircuit *qoc, int c_nph, veci constraint, int nthreads);
+    */
+    void split_ryser( state *istate, state* ostate, qocircuit *qoc, int c_nph, veci constraint, bool F, int nthreads);
+    /**
+    *  Auxiliary method to calculate the outputs from first to last-1 of an input ket using the Ryser formula. Full distribution.
+    *  <b> Intended for internal use of the library. </b>
+    *
+    *  @param state     *istate Initial state.
+    *  @param int iket   Input ket.
+    *  @param state     *ostate Output state. <b> Warning! this is an output variable </b>
+    *  @param qocircuit *qoc    Circuit to be simulated.
+    *  @param int c_nph  Constrained number of photons.
+    *  @param veci constraint  List of occupation by mode representing a post-selection condition.
+    *  @param veci uclevels  List of levels without a constraint.
+    *  @param long long int first First output in lexicographic order.
+    *  @param long long int last  Last output (not included).
+    *  @param int nthreads Number of threads used by each permanent.
+    *  @param cmplx *dampl Amplitudes of a dense state indexed by rank. If it is not nullptr the outputs are added there instead of ostate. <b> Warning! this is an output variable </b>
+    *  @ingroup Simulation_auxiliary
+    *  @see void split_ryser( state *istate, state* ostate, qocircuit *qoc, int c_nph, veci constraint, bool F, int nthreads);
+    */
+    void range_RyserF( state *istate, int iket, state* ostate, qocircuit *qoc, int c_nph, veci &constraint, veci &uclevels, long long int first, long long int last, int nthreads, cmplx *dampl);
+    /**
+    *  Auxiliary method to calculate the outputs from first to last-1 of an input ket using the Ryser formula. Restricted distribution.
+    *  <b> Intended for internal use of the library. </b>
+    *
+    *  @param state     *istate Initial state.
+    *  @param int iket   Input ket.
+    *  @param state     *ostate Output state. <b> Warning! this is an output variable </b>
+    *  @param qocircuit *qoc    Circuit to be simulated.
+    *  @param int c_nph  Constrained number of photons.
+    *  @param veci constraint  List of occupation by mode representing a post-selection condition.
+    *  @param veci uclevels  List of levels without a constraint.
+    *  @param long long int first First output in lexicographic order.
+    *  @param long long int last  Last output (not included).
+    *  @param int nthreads Number of threads used by each permanent.
+    *  @param cmplx *dampl Amplitudes of a dense state indexed by rank. If it is not nullptr the outputs are added there instead of ostate. <b> Warning! this is an output variable </b>
+    *  @ingroup Simulation_auxiliary
+    *  @see void split_ryser( state *istate, state* ostate, qocircuit *qoc, int c_nph, veci constraint, bool F, int nthreads);
+    */
+    void range_RyserR( state *istate, int iket, state* ostate, qocircuit *qoc, int c_nph, veci &constraint, veci &uclevels, long long int first, long long int last, int nthreads, cmplx *dampl);
+
+    /**
+    *  Calculates an output state as a function of an input initial state using a permanent calculation method for a full output distribution.
+    *  The outputs are grouped by the levels of their first nph-1 photons. The permanent of each output is expanded by the row of the last
+    *  photon (Laplace expansion) and the minors are calculated only once for the whole group. <br>
+    *  <b> Intended for internal use of the library. </b>
+    *
+    *  @param state     *istate Initial state.
+    *  @param qocircuit *qoc    Circuit to be simulated.
+    *  @return Returns the final state that correspond to an application of the circuit to the
+    *  initial state.
+    *  @ingroup Simulation_auxiliary
+    *  @see GlynnF( state *istate,qocircuit *qoc, int nthreads );
+    */
+    state *LaplaceF( state *istate, qocircuit *qoc );
 
     /**
     *  Calculates the output amplitudes of the specified list of kets as a function of an input initial state according to the rules established by a quantum circuit using the Direct method.
@@ -461,7 +788,7 @@ protected:
     *  @return Returns the final state that correspond to an application of the circuit to the
     *  initial state.
     *  @ingroup Simulation_auxiliary
-    *  @see DirectF(state *istate,qocircuit *qoc );
+    *  @see DirectF(state *istate,qocircuit *qoc, int nthreads );
     */
     state *DirectS( state *istate, ket_list *olist, qocircuit *qoc );
     /**
@@ -475,7 +802,7 @@ protected:
     *  @return Returns the final state that correspond to an application of the circuit to the
     *  initial state.
     *  @ingroup Simulation_auxiliary
-    *  @see GlynnF( state *istate,qocircuit *qoc );
+    *  @see GlynnF( state *istate,qocircuit *qoc, int nthreads );
     */
     state *GlynnS( state *istate, ket_list *olist, qocircuit *qoc );
     /**
@@ -490,12 +817,81 @@ protected:
     *  @return Returns the final state that correspond to an application of the circuit to the
     *  initial state.
     *  @ingroup Simulation_auxiliary
-    *  @see GlynnF( state *istate,qocircuit *qoc );
+    *  @see GlynnF( state *istate,qocircuit *qoc, int nthreads );
     */
     state *RyserS( state *istate, ket_list *olist, qocircuit *qoc, int nthreads );
+    /**
+    *  Estimates the output amplitudes for a given list of kets as a function of an input initial state using the randomized
+    *  Gurvits estimator of the permanent. <br>
+    *  <b> Intended for internal use of the library. </b>
+    *
+    *  @param state     *istate Initial state.
+    *  @param ket_list  *olist List of the kets whose output amplitude we intend to estimate.
+    *  @param qocircuit *qoc    Circuit to be simulated.
+    *  @param double eps  Additive error of each term of the amplitudes.
+    *  @param double conf Confidence. Probability of each term being within the additive error.
+    *  @param int nthreads Number of threads.
+    *  @param vecd serr Standard error of the amplitude of each ket of the list. <b> Warning! this is an output variable </b>
+    *  @return Returns a final state with the estimated amplitudes of the kets of the list.
+    *  @ingroup Simulation_auxiliary
+    *  @see cmplx gurvits_perm(const matc &M, long long int nsamples, int nthreads, double &serr);
+    */
+    state *GurvitsS( state *istate, ket_list *olist, qocircuit *qoc, double eps, double conf, int nthreads, vecd &serr );
+    /**
+    *  Calculates the permanent of the circuit matrix restricted to the levels occupied in the input and output kets.
+    *  Each level is repeated as many times as its occupation. If some level has more than one photon the permanent is
+    *  calculated from the distinct rows and columns with the Ryser formula with multiplicities, provided this takes fewer steps.
+    *  Otherwise the permanent of the expanded matrix is calculated with the requested kernel. <br>
+    *  <b> Intended for internal use of the library. </b>
+    *
+    *  @param int *iocc Occupations of the input ket.
+    *  @param int *oocc Occupations of the output ket.
+    *  @param qocircuit *qoc Circuit to be simulated.
+    *  @param int kernel Kernel for the expanded matrix. 0=Glynn / 1=Ryser.
+    *  @param int nthreads Number of threads of the Ryser kernel.
+    *  @return The permanent of the circuit matrix for the given input and output occupations. If the cache is enabled it is looked up first.
+    *  @ingroup Simulation_auxiliary
+    *  @see cmplx ryser_rep(matc M, veci rmult, veci cmult);
+    *  @see void set_cache(long long int size);
+    */
+    cmplx calc_perm( int *iocc, int *oocc, qocircuit *qoc, int kernel, int nthreads );
+    /**
+    *  Circuit matrix restricted to the levels occupied in the input and output kets. Each level is repeated as many times as its occupation. <br>
+    *  <b> Intended for internal use of the library. </b>
+    *
+    *  @param int *iocc Occupations of the input ket.
+    *  @param int *oocc Occupations of the output ket.
+    *  @param qocircuit *qoc Circuit to be simulated.
+    *  @return The expanded matrix. Its permanent gives the transition amplitude (without normalization).
+    *  @ingroup Simulation_auxiliary
+    */
+    matc perm_matrix( int *iocc, int *oocc, qocircuit *qoc );
 
+    /**
+    *  Runs a single metropolis chain. A rejected proposal repeats the current sample of the chain. <br>
+    *  <b> Intended for internal use of the library. </b>
+    *
+    *  @param state     *istate Initial state.
+    *  @param qocircuit *qoc    Circuit to be sampled.
+    *  @param bool gral Flag that configures the generator to use a general or a restricted Hilbert space true='General'/false='Restricted'
+    *  @param bool uniform Flag that configures the generator to use an uniform distribution instead.  true='Uniform'/false='Classical distribution of a circuit'
+    *  @param bool classic Flag to return the classical distribution. true='Classical'/false='Quantum'
+    *  @param int N Number of samples.
+    *  @param int Nburn Number of initial samples to be skipped.
+    *  @param int Nthin Number of thinning samples.
+    *  @param philox &rng  Random stream of the chain.
+    *  @param p_bin *obin Set of bins where the samples are counted. <b> Warning! this is an output variable </b>
+    *  @param vecd &trace Probability of each stored sample. <b> Warning! this is an output variable </b>
+    *  @param long long int *count Number of accepted proposals and number of proposals. <b> Warning! this is an output variable </b>
+    *  @ingroup Simulation_auxiliary
+    *  @see metropolis( state *istate, qocircuit *qoc ,int method, int N, int Nburn, int Nthin, int nchains, int nthreads);
+    */
+    void metropolis_chain( state *istate, qocircuit *qoc, bool gral, bool uniform, bool classic, int N, int Nburn, int Nthin, philox &rng, p_bin *obin, vecd &trace, long long int *count);
     /**
     *  Calculates a sample for a circuit given an initial state assuming al photons are distinguishable. <br>
+    *  Each photon is sent independently to an output level drawn from the |U|^2 column of its input level. The probability of
+    *  the sample is obtained as the permanent of the non-negative |U|^2 submatrix. In restricted sampling samples with more
+    *  than one photon in a level are rejected. <br>
     *  <b> Intended for internal use of the library. </b>
     *
     *  @param int *ilist Initial photon configuration
@@ -503,22 +899,24 @@ protected:
     *  @param bool gral Flag that configures the generator to use a general or a restricted Hilbert space true='General'/false='Restricted'
     *  @param bool uniform Flag that configures the generator to use an uniform distribution instead.  true='Uniform'/false='Classical distribution of a circuit'
     *  @param qocircuit *qoc    Circuit to be sampled classically.
-    *  @return a sample and the success probability of the procedure.
+    *  @param philox &rng  Random stream.
+    *  @return a sample and the probability of the sample (up to a constant factor).
     *  @ingroup Simulation_auxiliary
     *  @see metropolis( state *istate, qocircuit *qoc ,int method, int N, int Nburn, int Nthin);
     */
-    tuple<int*, double> classical_sample(int *ilist, int nph, bool gral, bool uniform, qocircuit *qoc);
+    tuple<int*, double> classical_sample(int *ilist, int nph, bool gral, bool uniform, qocircuit *qoc, philox &rng);
     /**
     *  Obtains a sample from a general Hilbert space with a uniform distribution. (Same probability for every element of the base)<br>
     *  <b> Intended for internal use of the library. </b>
     *
     *  @param int nph Total number of photons.
     *  @param qocircuit *qoc    Circuit to which the sample is referred.
+    *  @param philox &rng  Random stream.
     *  @return a sample uniformly distributed and the success probability of the procedure.
     *  @ingroup Simulation_auxiliary
-    *  @see classical_sample(int *ilist, int nph, bool gral, bool uniform, qocircuit *qoc);
+    *  @see classical_sample(int *ilist, int nph, bool gral, bool uniform, qocircuit *qoc, philox &rng);
     */
-    tuple<int*, double> uniform_general(int nph, qocircuit *qoc);
+    tuple<int*, double> uniform_general(int nph, qocircuit *qoc, philox &rng);
     /**
     *  Obtains a sample from a restricted Hilbert space with a uniform distribution. (Same probability for every element of the base)<br>
     *  In a restricted Hilbert space we only allow maximum one photon by level
@@ -526,11 +924,12 @@ protected:
     *
     *  @param int nph Total number of photons.
     *  @param qocircuit *qoc    Circuit to which the sample is referred.
+    *  @param philox &rng  Random stream.
     *  @return a sample uniformly distributed and the success probability of the procedure.
     *  @ingroup Simulation_auxiliary
-    *  @see classical_sample(int *ilist, int nph, bool gral, bool uniform, qocircuit *qoc);
+    *  @see classical_sample(int *ilist, int nph, bool gral, bool uniform, qocircuit *qoc, philox &rng);
     */
-    tuple<int*, double>uniform_restricted(int nph, qocircuit *qoc);
+    tuple<int*, double>uniform_restricted(int nph, qocircuit *qoc, philox &rng);
 };
 
 
@@ -78,16 +78,18 @@
  *     - <b style="color:blue;">noise</b>(double stdev2): Adds noise to the output. <br>
  *
  * \section cores Simulator cores
- *    The simulator can be configured to use four different cores for exact calculation:
+ *    The simulator can be configured to use six different cores for exact calculation:
  *     - <b style="color:blue;">Direct</b>: The calculation is performed similarly on how it is done analytically. This method is recommended when the <b>number of photons <=4</b>.<br>
  *     - <b style="color:blue;">Glynn</b>: We use the Balasubramanian/Bax/Franklin/Glynn formula implemented in gray code to calculate the permanent [1]. This method is recommended  when the  <b>number of photons >=4 and <=15 </b>.<br>
  *     - <b style="color:blue;">Ryser</b>: We use the Ryser formula [2] to calculate the permanent using parallelization in the ways described in ref [3]. This method is recommended  when the <b>number of photons >=7</b>.<br>
  *     - <b style="color:blue;">Fast Ryser</b>:  Same as the Ryser method but automatically restricting the output distribution to the non-zero contributions after post-selection.
+ *     - <b style="color:blue;">Laplace</b>: Full distribution where the permanent of each output is expanded by its last photon. The minors are shared between all the outputs that only differ in the level of that photon.<br>
+ *     - <b style="color:blue;">Direct photon by photon</b>: Same as the Direct method but the circuit is applied one input photon at a time. Equal partial occupations are merged after each photon.<br>
  * <br>
  *    It is also possible to call the simulator in a <b style="color:blue;"> manual mode</b> where only the amplitudes of a pre-determined list of kets are calculated if this list is provided to the simulator. <br>
  *
  *    The simulator can also be used for sampling with two possible methods:
- *     - <b style="color:blue;">Clifford A</b>: [4]
+ *     - <b style="color:blue;">Clifford B</b>: [4]
  *     - <b style="color:blue;">Metropolis*</b>:[5]
  *   <br>
  *   <br>
@@ -96,13 +96,24 @@ void ket_list::create_ket_list(int i_nph, int i_level, int i_maxket){
     nket=0;
     nlevel=i_level;
     maxket=i_maxket;
+    nodef=0;
 
-    // Create and int amplitude/coefficient and ket structures
+    // Create the ket structures. All the occupations
+    // are stored in a single block.
+    kstore=new int[(long long int)maxket*nlevel]();
     ket=new int*[maxket];
     for(i=0;i<maxket;i++){
-        ket[i]=new int[nlevel]();
+        ket[i]=kstore+(long long int)i*nlevel;
     }
 
+    // The lists of occupied levels are built
+    // only when an operation needs them.
+    nsket=0;
+    maxsocc=0;
+    sidx=nullptr;
+    slev=nullptr;
+    socc=nullptr;
+
     // Compute the trivial print visibility vector.
     vis=new int[nlevel];
     for(i=0;i<nlevel;i++){
@@ -117,17 +128,14 @@ void ket_list::create_ket_list(int i_nph, int i_level, int i_maxket){
 //
 //----------------------------------------
 ket_list::~ket_list(){
-//  Auxiliary index
-    int i;          // Aux index
 
 
-    // Liberate memory of amplitude/coefficients and ket structures
-    for(i=0;i<maxket;i++){
-        delete[] ket[i];
-    }
-
     //Free memory
+    delete[] kstore;
     delete[] ket;
+    delete[] sidx;
+    delete[] slev;
+    delete[] socc;
     delete[] vis;
     // Clear hash table
     ketindex.clear();
@@ -143,25 +151,127 @@ ket_list *ket_list::clone(){
     // Variable
     ket_list *aux;  // Auxiliary state recipient of the copy
     // Auxiliary index
-    int i;          // Aux index
     int j;          // Aux index
 
 
     aux=new ket_list(nph, nlevel,maxket);
-    aux->nket=nket;
-    for(i=0;i<nket;i++){
-        for(j=0;j<nlevel;j++){
-            aux->ket[i][j]=ket[i][j];
-        }
-    }
+    copy_kets(aux);
     for(j=0;j<nlevel;j++){
         aux->vis[j]=vis[j];
     }
-    aux->ketindex=ketindex;
     return aux;
 }
 
 
+//----------------------------------------
+//
+//  Copies the kets and the index into
+//  another list of the same number of levels.
+//
+//----------------------------------------
+void ket_list::copy_kets(ket_list *dst){
+//  ket_list *dst;  // List recipient of the copy
+
+
+    dst->reserve(nket);
+    dst->nket=nket;
+    dst->nsket=0;
+    memcpy(dst->kstore,kstore,(size_t)nket*nlevel*sizeof(int));
+    dst->ketindex=ketindex;
+}
+
+
+//----------------------------------------
+//
+//  Lists the occupied levels of the kets
+//  added since the last call.
+//
+//----------------------------------------
+void ket_list::list_levels(){
+//  Variables
+    int *newidx;    // New start of the occupied levels of each ket
+    int *newlev;    // New storage of the occupied levels
+    int *newocc;    // New storage of their occupations
+    int  nnz;       // Number of occupied levels
+//  Auxiliary index
+    int  i;         // Aux index
+    int  j;         // Aux index
+
+
+    if(nsket>=nket) return;
+
+    // Room for the starts of every ket
+    newidx=new int[nket+1];
+    if(nsket>0) memcpy(newidx,sidx,(nsket+1)*sizeof(int));
+    else newidx[0]=0;
+    delete[] sidx;
+    sidx=newidx;
+
+    // Room for the occupied levels of the new kets
+    nnz=sidx[nsket];
+    for(i=nsket;i<nket;i++) for(j=0;j<nlevel;j++) if(ket[i][j]!=0) nnz++;
+    if(nnz>maxsocc){
+        maxsocc=max(2*maxsocc,nnz);
+        newlev=new int[maxsocc];
+        newocc=new int[maxsocc];
+        memcpy(newlev,slev,sidx[nsket]*sizeof(int));
+        memcpy(newocc,socc,sidx[nsket]*sizeof(int));
+        delete[] slev;
+        delete[] socc;
+        slev=newlev;
+        socc=newocc;
+    }
+
+    // Append them
+    nnz=sidx[nsket];
+    for(i=nsket;i<nket;i++){
+        for(j=0;j<nlevel;j++){
+            if(ket[i][j]!=0){
+                slev[nnz]=j;
+                socc[nnz]=ket[i][j];
+                nnz++;
+            }
+        }
+        sidx[i+1]=nnz;
+    }
+    nsket=nket;
+}
+
+
+//----------------------------------------
+//
+//  Increases the number of kets that can
+//  be stored in the list.
+//
+//----------------------------------------
+void ket_list::reserve(int i_maxket){
+//  int i_maxket    // New number of kets
+//  Variables
+    int  *newstore; // New storage of occupations
+//  Auxiliary index
+    int   i;        // Aux index
+
+
+    if(i_maxket<=maxket) return;
+
+    // Move the occupations to a larger block
+    newstore=new int[(long long int)i_maxket*nlevel];
+    memcpy(newstore,kstore,(size_t)maxket*nlevel*sizeof(int));
+    fill(newstore+(long long int)maxket*nlevel,newstore+(long long int)i_maxket*nlevel,nodef);
+    delete[] kstore;
+    delete[] ket;
+    kstore=newstore;
+    maxket=i_maxket;
+    ketindex.reserve(maxket);
+
+    // Point to the new rows
+    ket=new int*[maxket];
+    for(i=0;i<maxket;i++){
+        ket[i]=kstore+(long long int)i*nlevel;
+    }
+}
+
+
 //----------------------------------------
 //
 // Finds the position of a ket in the list
@@ -169,21 +279,9 @@ ket_list *ket_list::clone(){
 //----------------------------------------
 int ket_list::find_ket(int *occ){
 //  int *occ;                    // Occupation of those levels
-//  Variables
-    long long int value;         // Hash value in a dynamic base dictionary
-    thash::const_iterator hashv; // Hash value constant iterator.
 
 
-    // Update amplitude and occupation
-    // Store
-    value=hashval(occ,nlevel,nph);
-    hashv=ketindex.find(value);
-    // If the ket does not exist yet on the output create new one.
-    if(hashv==ketindex.end()){
-        return -1;
-    }else{
-        return hashv->second;
-    }
+    return ketindex.find(rowhash(occ,nlevel),occ,kstore,nlevel);
 }
 
 
@@ -226,34 +324,31 @@ int ket_list::add_ket(int *occ){
 //  int *occ;                    // Level occupation
 //  Variables
     int  index;                  // Index/List position to be returned
-    long long int value;         // Hash value in a dynamic base dictionary
-    thash::const_iterator hashv; // Hash value constant iterator.
-//  Auxiliary index
-    int  i;                      // Aux index
+    unsigned long long int h;    // Hash value of the occupation
+    int *aux;                    // Copy of the occupation
 
 
-    // Check and warn about memory limits.
-    if(nket>=maxket){
-        cout << "Ket list add ket error #1: Memory limit exceeded." << endl;
-        return -1;
-    }
-
     // Update amplitude and occupation
     //Store
-    value=hashval(occ,nlevel,nph);
-    hashv=ketindex.find(value);
-
-    if(hashv==ketindex.end()){
-        index=nket;
-        ketindex[value]=nket;
-        for(i=0;i<nlevel;i++){
-            ket[nket][i]=occ[i];
-
+    h=rowhash(occ,nlevel);
+    index=ketindex.find(h,occ,kstore,nlevel);
+
+    if(index<0){
+        // Grow the list if it is full. The occupation may
+        // be a ket of this list therefore it is copied first.
+        if(nket>=maxket){
+            aux=new int[nlevel];
+            memcpy(aux,occ,nlevel*sizeof(int));
+            reserve(max(2*maxket,1));
+            memcpy(ket[nket],aux,nlevel*sizeof(int));
+            delete[] aux;
+        }else{
+            memcpy(ket[nket],occ,nlevel*sizeof(int));
         }
 
+        index=nket;
+        ketindex.insert(h,nket);
         nket=nket+1;
-    }else{
-        index=hashv->second;
     }
 
     // Return storage index
@@ -280,18 +375,12 @@ int ket_list::add_ket(hterm term, qocircuit *qoc){
     int  num;                    // Number of columns in term
 
 
-    // Check and warn about memory limits.
-    if(nket>=maxket){
-        cout << "Ket list add ket error #2: Memory limit exceeded." << endl;
-        exit(0);
-    }
-
     // Initializations
     ivis=new int[qoc->nlevel];
     for(i=0;i<qoc->nlevel;i++) ivis[i]=-1;
     for(i=0;i<nlevel;i++) ivis[vis[i]]=i;
-    occ=new int[nlevel]();
-    for(i=0;i<nlevel;i++) occ[i]=ket[maxket-1][0];
+    occ=new int[nlevel];
+    for(i=0;i<nlevel;i++) occ[i]=nodef;
 
     num=term.cols();
     // Update occupation
@@ -375,21 +464,21 @@ ket_list *ket_list:: remove_time(qocircuit *qoc){
     int  newnlevel;                 // New number of levels
     int *auxket;                    // Auxiliary ket
     int *newvis;                    // New visibility vector
-    int *isincluded;                // Levels included
+    int *newpos;                    // Position of each level in the new kets. -1 if not included
     ket_list *auxlist;              // Auxiliary ket list (to be returned)
 //  Auxiliary index
     int i;                          // Aux index
-    int j;                          // Aux index
     int k;                          // Aux index
 
 
     // Init variables
     newnlevel=0;
     newvis=new int[nlevel]();
-    isincluded=new int[nlevel]();
+    newpos=new int[nlevel];
     for(i=0;i<nlevel;i++){
+        newpos[i]=-1;
         if(qoc->idx[vis[i]].s==0){
-                isincluded[i]=1;
+                newpos[i]=newnlevel;
                 newvis[newnlevel]=vis[i];
                 newnlevel=newnlevel+1;
         }
@@ -398,22 +487,23 @@ ket_list *ket_list:: remove_time(qocircuit *qoc){
     auxlist=new ket_list(nph, newnlevel,maxket,newvis);
     delete[] newvis;
 
-    // Compute operation
+    // Compute operation. Only the occupied
+    // levels of each ket are visited.
+    list_levels();
     auxket=new int[newnlevel]();
     for(i=0;i<nket;i++){
-        k=0;
-        for(j=0;j<nlevel;j++){
-            if(isincluded[j]==1){
-                auxket[k]=ket[i][j];
-                k++;
-            }
+        for(k=sidx[i];k<sidx[i+1];k++){
+            if(newpos[slev[k]]>=0) auxket[newpos[slev[k]]]=socc[k];
         }
         auxlist->add_ket(auxket);
+        for(k=sidx[i];k<sidx[i+1];k++){
+            if(newpos[slev[k]]>=0) auxket[newpos[slev[k]]]=0;
+        }
     }
 
     // Free memory
-    delete auxket;
-    delete[] isincluded;
+    delete[] auxket;
+    delete[] newpos;
 
     // Return value
     return auxlist;
@@ -429,6 +519,7 @@ void ket_list::clear_kets(){
 
 
     nket=0;
+    nsket=0;
     ketindex.clear();
 }
 
@@ -615,23 +706,16 @@ state *state::clone(){
     // Variable
     state *aux;  // Auxiliary state
     // Auxiliary index
-    int    i;    // Aux index
     int    j;    // Aux index
 
 
     aux=new state(nph, nlevel,maxket);
-    aux->nket=nket;
-    for(i=0;i<nket;i++){
-        aux->ampl[i]=ampl[i];
-        for(j=0;j<nlevel;j++){
-            aux->ket[i][j]=ket[i][j];
-        }
-    }
+    copy_kets(aux);
+    memcpy(aux->ampl,ampl,nket*sizeof(cmplx));
     for(j=0;j<nlevel;j++){
         aux->vis[j]=vis[j];
     }
 
-    aux->ketindex=ketindex;
     return aux;
 }
 
@@ -650,6 +734,28 @@ void state::clear(){
 }
 
 
+//----------------------------------------
+//
+//  Increases the number of terms that
+//  can be stored in the state.
+//
+//----------------------------------------
+void state::reserve(int i_maxket){
+//  int i_maxket    // New number of terms
+//  Variables
+    cmplx *newampl; // New amplitudes
+
+
+    if(i_maxket<=maxket) return;
+
+    newampl=new cmplx[i_maxket]();
+    memcpy(newampl,ampl,maxket*sizeof(cmplx));
+    delete[] ampl;
+    ampl=newampl;
+    ket_list::reserve(i_maxket);
+}
+
+
 //----------------------------------------
 //
 //  Adds a new term to a state
@@ -785,7 +891,10 @@ state *state::post_selection(state *prj){
 //  Variables
     int    npost;    // Number of levels in which post selection is performed
     int    selected; // Is this state selected 0=No/1=Yes
+    int    nsel;     // Number of levels checked for a projector term
     int   *islincl;  // Is level included? 0=No/1=Yes
+    int   *newpos;   // Position of each included level in the new kets
+    int   *sellev;   // Levels checked for a projector term
     int   *occ;      // Occupation
     state *nstate;   // New post-selected state
 // Auxiliary index
@@ -810,44 +919,57 @@ state *state::post_selection(state *prj){
 
     // Create new post-selected state / Reserve memory
     nstate=new state(nph, nlevel-npost,maxket);
+    newpos=new int[nlevel];
     k=0;
     for(l=0;l<nlevel;l++){
+        newpos[l]=-1;
         if(islincl[l]==1){
             nstate->vis[k]=vis[l];
+            newpos[l]=k;
             k++;
         }
     }
 
     // For each projector term
+    list_levels();
     occ=new int[nlevel-npost]();
+    sellev=new int[nlevel];
     for(i=0;i<prj->nket;i++){
+        // Levels defined by this term
+        nsel=0;
+        for(k=0;k<nlevel;k++){
+            if(prj->ket[i][k]>=0){
+                sellev[nsel]=k;
+                nsel++;
+            }
+        }
+
         // Post-select each ket
         for(j=0;j<nket;j++){
             // Check selection condition
             selected=1;
-            k=0;
-            while((k<nlevel)&&(selected==1)){
-                if ((ket[j][k]!=prj->ket[i][k])&&(prj->ket[i][k]>=0))  selected=0;
-                k++;
+            l=0;
+            while((l<nsel)&&(selected==1)){
+                k=sellev[l];
+                if (ket[j][k]!=prj->ket[i][k])  selected=0;
+                l++;
             }
 
             // If is selected create the list of levels and
             // occupations for those not post-selected
+            // from the occupied levels of the ket.
             if(selected==1){
-                k=0;
-                for(l=0;l<nlevel;l++){
-                    if(islincl[l]==1){
-                        occ[k]=ket[j][l];
-                        k++;
-                    }
-                }
+                for(k=sidx[j];k<sidx[j+1];k++) if(newpos[slev[k]]>=0) occ[newpos[slev[k]]]=socc[k];
                 nstate->add_term(ampl[j]*conj(prj->ampl[i]),occ);
+                for(k=sidx[j];k<sidx[j+1];k++) if(newpos[slev[k]]>=0) occ[newpos[slev[k]]]=0;
             }
         }
     }
 
     // Free memory
     delete[] occ;
+    delete[] sellev;
+    delete[] newpos;
     delete[] islincl;
 
     // Return state.
@@ -872,7 +994,11 @@ state *state::post_selection(state *prj,qocircuit *qoc){
     int    nwf;      // Last period (+1) of the window of detection
     int    ch;       // Channel
     int    s;        // Packet number
+    int    nsel;     // Number of levels checked for a projector term
     int   *islincl;  // Is level included? 0=No/1=Yes
+    int   *inwin;    // Is level inside the detection window? 0=No/1=Yes
+    int   *newpos;   // Position of each included level in the new kets
+    int   *sellev;   // Levels checked for a projector term
     int   *occ;      // Occupation
     state *nstate;   // New post-selected state
 // Auxiliary index
@@ -897,56 +1023,75 @@ state *state::post_selection(state *prj,qocircuit *qoc){
 
     // Create new post-selected state / Reserve memory
     nstate=new state(nph, nlevel-npost,maxket);
+    newpos=new int[nlevel];
     k=0;
     for(l=0;l<nlevel;l++){
+        newpos[l]=-1;
         if(islincl[l]==1){
             nstate->vis[k]=vis[l];
+            newpos[l]=k;
             k++;
         }
     }
 
+    // Levels inside the detection window
+    inwin=new int[nlevel];
+    for(k=0;k<nlevel;k++){
+        ch=qoc->idx[k].ch;
+        s=qoc->idx[k].s;
+        if((qoc->losses==0)||(ch<qoc->nch/2)){
+            nwi=qoc->det_win(0,ch);
+            nwf=qoc->det_win(1,ch)+1;
+            if(qoc->det_win(0,ch)<0) nwi=0;
+            if(qoc->det_win(1,ch)<0) nwf=qoc->np+1;
+        }else{
+            nwi=0;
+            nwf=qoc->np+1;
+        }
+        inwin[k]=(s>=nwi*qoc->nsp)&&(s<nwf*qoc->nsp);
+    }
+
     // For each projector term
+    list_levels();
     occ=new int[nlevel-npost]();
+    sellev=new int[nlevel];
     for(i=0;i<prj->nket;i++){
+        // Levels defined by this term inside the window
+        nsel=0;
+        for(k=0;k<nlevel;k++){
+            if((prj->ket[i][k]>=0)&&(inwin[k]==1)){
+                sellev[nsel]=k;
+                nsel++;
+            }
+        }
+
         // Post-select each ket
         for(j=0;j<nket;j++){
             // Check selection condition
             selected=1;
-            k=0;
-            while((k<nlevel)&&(selected==1)){
-                ch=qoc->idx[k].ch;
-                s=qoc->idx[k].s;
-                if((qoc->losses==0)||(ch<qoc->nch/2)){
-                    nwi=qoc->det_win(0,ch);
-                    nwf=qoc->det_win(1,ch)+1;
-                    if(qoc->det_win(0,ch)<0) nwi=0;
-                    if(qoc->det_win(1,ch)<0) nwf=qoc->np+1;
-                }else{
-                    nwi=0;
-                    nwf=qoc->np+1;
-                }
-
-                if ((ket[j][k]!=prj->ket[i][k])&&(prj->ket[i][k]>=0)&&(s>=nwi*qoc->nsp)&&(s<nwf*qoc->nsp))  selected=0;
-                k++;
+            l=0;
+            while((l<nsel)&&(selected==1)){
+                k=sellev[l];
+                if (ket[j][k]!=prj->ket[i][k])  selected=0;
+                l++;
             }
 
             // If is selected create the list of levels and
             // occupations for those not post-selected
+            // from the occupied levels of the ket.
             if(selected==1){
-                k=0;
-                for(l=0;l<nlevel;l++){
-                    if(islincl[l]==1){
-                        occ[k]=ket[j][l];
-                        k++;
-                    }
-                }
+                for(k=sidx[j];k<sidx[j+1];k++) if(newpos[slev[k]]>=0) occ[newpos[slev[k]]]=socc[k];
                 nstate->add_term(ampl[j]*conj(prj->ampl[i]),occ);
+                for(k=sidx[j];k<sidx[j+1];k++) if(newpos[slev[k]]>=0) occ[newpos[slev[k]]]=0;
             }
         }
     }
 
     // Free memory
     delete[] occ;
+    delete[] sellev;
+    delete[] inwin;
+    delete[] newpos;
     delete[] islincl;
 
     // Return state.
@@ -2315,9 +2460,150 @@ void projector::create_projector(int i_level, int i_maxket){
     int j;          // Aux index
 
 
+    nodef=-1;
     for(i=0;i<maxket;i++){
         for(j=0;j<nlevel;j++){
-            ket[i][j]=-1;
+            ket[i][j]=nodef;
         }
     }
 }
+
+
+//-------------------------------------------------------
+//
+// Creates a dense state with all the amplitudes set to
+// zero.
+//
+//-------------------------------------------------------
+dense_state::dense_state(int i_nph, int i_level, bool i_full){
+//  int  i_nph      // Number of photons
+//  int  i_level    // Number of levels to describe a ket
+//  bool i_full     // True: All the occupations. False: Only occupations of zero or one
+
+
+    nph=i_nph;
+    nlevel=i_level;
+    full=i_full;
+    if(full) size=binomial(nlevel+nph-1,nph);
+    else     size=binomial(nlevel,nph);
+    if(nph==0) size=1;
+    ampl=new cmplx[size]();
+}
+
+
+//-------------------------------------------------------
+//
+// Destroys a dense state
+//
+//-------------------------------------------------------
+dense_state::~dense_state(){
+
+
+    delete[] ampl;
+}
+
+
+//-------------------------------------------------------
+//
+// Sets all the amplitudes to zero
+//
+//-------------------------------------------------------
+void dense_state::clear(){
+//  Index
+    long long int r;        // Index of ranks
+
+
+    for(r=0;r<size;r++) ampl[r]=0.0;
+}
+
+
+//-------------------------------------------------------
+//
+// Returns the position of a ket in the dense state.
+// -1 if the ket does not belong to this dense state.
+//
+//-------------------------------------------------------
+long long int dense_state::rank(int *occ){
+//  int *occ        // Occupation of each level
+//  Variables
+    int  tocc;      // Number of photons
+//  Auxiliary index
+    int i;          // Aux index
+
+
+    // Check that the ket belongs to the dense state
+    tocc=0;
+    for(i=0;i<nlevel;i++){
+        if((occ[i]<0)||((!full)&&(occ[i]>1))) return -1;
+        tocc=tocc+occ[i];
+    }
+    if(tocc!=nph) return -1;
+
+    // Return rank
+    if(full) return rank_multiset(occ,nlevel);
+    else     return rank_bitmask(occ,nlevel);
+}
+
+
+//-------------------------------------------------------
+//
+// Returns the ket stored in a position of the dense state.
+//
+//-------------------------------------------------------
+void dense_state::unrank(long long int r, int *occ){
+//  long long int r // Rank of the ket
+//  int *occ        // Occupation of each level. Output variable
+//  Variables
+    int   *pos;     // Level where each photon is located
+    string bitmask; // Bit mask
+//  Auxiliary index
+    int i;          // Aux index
+
+
+    for(i=0;i<nlevel;i++) occ[i]=0;
+    if(full){
+        pos=unrank_multiset(r,nph,nlevel);
+        for(i=0;i<nph;i++) occ[pos[i]]=occ[pos[i]]+1;
+        delete[] pos;
+    }else{
+        bitmask=unrank_bitmask(r,nph,nlevel);
+        for(i=0;i<nlevel;i++) occ[i]=bitmask[i];
+    }
+}
+
+
+//-------------------------------------------------------
+//
+// Returns the terms with non-zero amplitude as a state.
+// The terms are ordered by rank.
+//
+//-------------------------------------------------------
+state *dense_state::to_state(){
+//  Variables
+    int    nterm;           // Number of non-zero terms
+    int   *occ;             // Occupation
+    state *ostate;          // Output state
+//  Index
+    long long int r;        // Index of ranks
+
+
+    // Reserve exactly the memory needed
+    nterm=0;
+    for(r=0;r<size;r++) if(abs(ampl[r])>xcut) nterm++;
+    ostate=new state(nph,nlevel,max(nterm,1));
+
+    // Store the non-zero terms
+    occ=new int[nlevel]();
+    for(r=0;r<size;r++){
+        if(abs(ampl[r])>xcut){
+            unrank(r,occ);
+            ostate->add_term(ampl[r],occ);
+        }
+    }
+
+    // Free memory
+    delete[] occ;
+
+    // Return state
+    return ostate;
+}
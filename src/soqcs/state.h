@@ -24,9 +24,10 @@ public:
     ket_list(int i_nph, int i_level);                                    //  Creates a ket list.The maximum number of kets is set by default.
     ket_list(int i_nph, int i_level,int i_maxket);                       //  Creates a ket list specifying the maximum number of kets.
     ket_list(int i_nph, int i_level, int i_maxket, int *i_vis);          //  Creates a ket list specifying the maximum number of kets and a vector of equivalence between state and circuit levels.
-    ~ket_list();                                                         //  Destroys a ket_list
+    virtual ~ket_list();                                                 //  Destroys a ket_list
     void clone();                                                        //  Copies a ket list
     void clear_kets();                                                   //  Clear the list (without destroying it).
+    virtual void reserve(int i_maxket);                                  //  Increases the number of kets that can be stored without reallocation
 
     // State manipulation methods.
     int add_ket(int *occ);                                               // Adds a new ket to a ket list
@@ -42,6 +43,8 @@ public:
 
 protected:
     void create_ket_list(int i_nph, int i_level, int i_maxket);          // Create ket list auxiliary function
+    void copy_kets(ket_list *dst);                                       // Copies the kets and the index into another list
+    void list_levels();                                                  // Lists the occupied levels of the kets added since the last call
 };
 
 
@@ -57,6 +60,7 @@ public:
     ~state();                                                            //  Destroys a state
     state *clone();                                                      //  Copy a state
     void clear();                                                        //  Clears a state
+    void reserve(int i_maxket);                                          //  Increases the number of terms that can be stored without reallocation
 
     // State manipulation methods.
     int add_term(cmplx i_ampl, int *occ);                                // Adds a new term to a state
@@ -113,6 +117,20 @@ public:
     void create_projector(int i_level, int i_maxket);                    // Create projector auxiliary function
 };
 
+class dense_state{
+public:
+    // Public methods
+    // Management methods
+    dense_state(int i_nph, int i_level, bool i_full);                     //  Creates a dense state of all the kets with a given number of photons
+    ~dense_state();                                                      //  Destroys a dense state
+    void clear();                                                        //  Sets all the amplitudes to zero
+
+    // Rank methods
+    long long int rank(int *occ);                                        // Position of a ket in the dense state
+    void unrank(long long int r, int *occ);                              // Ket stored in a position of the dense state
+    state *to_state();                                                   // Returns the non-zero terms as a state
+};
+
 ***********************************************************************************/
 
 
@@ -150,12 +168,21 @@ public:
     // Public variables
     int nph;               ///< Maximum number of photons
     int nket;              ///< Number of kets (C1|1>+C2|2>+...+Cn|nket>.
-    int maxket;            ///< Maximum number of kets.
+    int maxket;            ///< Number of kets that can be stored. It grows when the list is full.
     int nlevel;            ///< Number of levels in each ket |0, 1, 2, ... nlevel>.
+    int nodef;             ///< Occupation of the levels not defined in a ket. Zero except in projectors where they are ignored.
 
     // Ket list definition
-    thash ketindex;        ///< Hash table of the dynamic dictionary of kets
-    int **ket;             ///< Ket definitions. Level occupations of each ket/term
+    row_index ketindex;    ///< Hash index of the dynamic dictionary of kets. Exact for any number of levels and photons.
+    int *kstore;           ///< Contiguous storage of the level occupations of all the kets. Row major.
+    int **ket;             ///< Ket definitions. Level occupations of each ket/term. They point to rows of kstore.
+    int *sidx;             ///< Occupied levels of each ket. An auxiliary copy of the non-zero entries of ket used to iterate over them.
+                           ///< The occupied levels of ket i are the positions sidx[i] to sidx[i+1]-1 of slev and socc.
+                           ///< Built by list_levels() only for the operations that use them.
+    int *slev;             ///< Occupied levels of each ket in ascending order.
+    int *socc;             ///< Occupation of those levels.
+    int maxsocc;           ///< Number of entries that can be stored in slev and socc.
+    int nsket;             ///< Number of kets whose occupied levels are listed.
     int *vis;              ///< Correspondence vector. Position to level index.
                            ///< It stores to which level correspond each vector position.
                            ///< After post-selection it keeps track of the original level number.
@@ -187,7 +214,7 @@ public:
     *
     *  @param int i_nph     Maximum number of photons.
     *  @param int i_level   Number of levels to describe a ket.
-    *  @param int i_maxket  Maximum number of different kets in the list.
+    *  @param int i_maxket  Number of kets reserved. The list grows when it is full.
     *  @ingroup Ket_management
     */
     ket_list(int i_nph, int i_level,int i_maxket);
@@ -198,7 +225,7 @@ public:
     *
     *  @param int i_nph     Maximum number of photons.
     *  @param int i_level   Number of levels to describe a ket.
-    *  @param int i_maxket  Maximum number of different kets in the list.
+    *  @param int i_maxket  Number of kets reserved. The list grows when it is full.
     *  @param int i_vis  Vector that translates the ket levels to the circuit levels defined by the circuit indexes.
     *  @ingroup Ket_management
     */
@@ -208,7 +235,7 @@ public:
     *
     *  @ingroup Ket_management
     */
-    ~ket_list();
+    virtual ~ket_list();
     /**
     *   Creates a copy of this list of kets.
     *
@@ -222,6 +249,15 @@ public:
     *  @ingroup Ket_management
     */
     void clear_kets();
+    /**
+    *  Increases the number of kets that can be stored. The kets are kept in a single block of memory that is
+    *  reallocated when the list is full doubling its size. Therefore the ket pointers are not valid after a ket is added. <br>
+    *  Derived classes reallocate their per-ket data in the same way.
+    *
+    *  @param int i_maxket  New number of kets. Nothing is done if it is not larger than the present one.
+    *  @ingroup Ket_management
+    */
+    virtual void reserve(int i_maxket);
 
     // State manipulation methods.
     /** @defgroup Ket_operations List of kets operations
@@ -230,10 +266,10 @@ public:
     */
 
     /**
-    *   Adds a new ket to the list.
+    *   Adds a new ket to the list. The list grows if it is full.
     *
     *  @param int   *occ    Array with the occupation of each level in the new ket.
-    *  @return the ket index if success -1 otherwise.
+    *  @return the ket index.
     *  @ingroup Ket_operations
     */
     int add_ket(int *occ);
@@ -375,9 +411,21 @@ protected:
     *
     *  @param int i_nph     Maximum number of photons.
     *  @param int i_level   Number of levels to describe a ket.
-    *  @param int i_maxket  Maximum number of different kets in the list.
+    *  @param int i_maxket  Number of kets reserved. The list grows when it is full.
     */
     void create_ket_list(int i_nph, int i_level, int i_maxket);
+    /**
+    *  Auxiliary method to copy the kets of this list and the index into another list
+    *  with the same number of levels.
+    *
+    *  @param ket_list *dst  List where the kets are copied. Its previous kets are overwritten.
+    */
+    void copy_kets(ket_list *dst);
+    /**
+    *  Auxiliary method to list the occupied levels of the kets added since the last call in sidx, slev and socc.
+    *  Called by the operations that iterate over the occupied levels before they read these lists.
+    */
+    void list_levels();
 
 };
 
@@ -433,7 +481,7 @@ public:
     *
     *  @param int i_nph     Maximum number of photons.
     *  @param int i_level   Number of levels to describe the state.
-    *  @param int i_maxket  Maximum number of different kets in the summation.
+    *  @param int i_maxket  Number of kets reserved. The state grows when it is full.
     *  @ingroup State_management
     */
     state(int i_nph, int i_level, int i_maxket);
@@ -445,7 +493,7 @@ public:
     *
     *  @param int i_nph     Maximum number of photons.
     *  @param int i_level   Number of levels to describe the state.
-    *  @param int i_maxket  Maximum number of different kets in the summation.
+    *  @param int i_maxket  Number of kets reserved. The state grows when it is full.
     *  @param int i_vis  Vector that translates the state levels to the circuit levels defined by the circuit indexes.
     *  @ingroup State_management
     */
@@ -469,6 +517,13 @@ public:
     *  @ingroup State_management
     */
     void clear();
+    /**
+    *  Increases the number of terms that can be stored. Amplitudes are reallocated together with the kets.
+    *
+    *  @param int i_maxket  New number of terms. Nothing is done if it is not larger than the present one.
+    *  @ingroup State_management
+    */
+    void reserve(int i_maxket);
 
 
     // State manipulation methods
@@ -992,3 +1047,69 @@ public:
     */
     void create_projector(int i_level, int i_maxket);
 };
+
+
+/** \class dense_state
+*   \brief Contains the amplitudes of all the kets with a given number of photons stored in a preallocated array. <br>
+*          Each ket is stored at its combinatorial rank. In the full case these are all the ways to distribute the photons
+*          between the levels ordered lexicographically as non-decreasing sequences of photon levels. In the restricted case these are
+*          the kets with zero or one photons by level ordered lexicographically as bit masks. No dictionary is needed to find a ket and the memory
+*          used is known in advance.
+*   \author Javier Osca
+*   \author Jiri Vala
+*
+*   \copyright Copyright &copy; 2023 National University of Ireland Maynooth, Maynooth University. All rights reserved. <br>
+*              The contents and use of this document and the related code are subject to the licence terms detailed in <a  href="../assets/LICENCE.TXT"> LICENCE.txt </a>.
+*
+*   @ingroup State
+*/
+class dense_state{
+public:
+    // Public variables
+    int nph;               ///< Number of photons of all the kets.
+    int nlevel;            ///< Number of levels in each ket.
+    bool full;             ///< True: All the occupations. False: Only occupations of zero or one photons by level.
+    long long int size;    ///< Number of kets. Binomial C(nlevel+nph-1,nph) if full. Binomial C(nlevel,nph) otherwise.
+    cmplx *ampl;           ///< Amplitude of each ket stored by rank.
+
+    // Public methods
+    // Management methods
+    /**
+    *  Creates a dense state with all the amplitudes set to zero.
+    *
+    *  @param int i_nph     Number of photons.
+    *  @param int i_level   Number of levels to describe a ket.
+    *  @param bool i_full   True: All the occupations. False: Only occupations of zero or one photons by level.
+    */
+    dense_state(int i_nph, int i_level, bool i_full);
+    /**
+    *  Destroys a dense state.
+    */
+    ~dense_state();
+    /**
+    *  Sets all the amplitudes to zero.
+    */
+    void clear();
+
+    // Rank methods
+    /**
+    *  Returns the position of a ket in the dense state.
+    *
+    *  @param int *occ Occupation of each level.
+    *  @return Rank of the ket. -1 if the ket does not belong to this dense state.
+    */
+    long long int rank(int *occ);
+    /**
+    *  Returns the ket stored in a position of the dense state.
+    *
+    *  @param long long int r Rank of the ket.
+    *  @param int *occ Occupation of each level. Output variable.
+    */
+    void unrank(long long int r, int *occ);
+    /**
+    *  Returns the terms with non-zero amplitude as a state. The terms are ordered by rank.
+    *
+    *  @return State with the non-zero terms of the dense state.
+    */
+    state *to_state();
+};
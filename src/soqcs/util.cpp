@@ -10,12 +10,293 @@
 //======================================================================================================
 #include "util.h"
 #include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <atomic>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+
+// Row index constants
+static const unsigned char ROWEMPTY=0x80;                             // Control byte of an empty slot
+static const int ROWGROUP=16;                                         // Number of slots probed together
+
+
+// Full unroll of the loops of fixed size
+#if defined(__GNUC__)
+#define PERM_UNROLL _Pragma("GCC unroll 16")
+#else
+#define PERM_UNROLL
+#endif
 
 
 // Initialization of extern variables
 int def_nph=4;        // Default value of the maximum photon occupation by level.
 
 
+// Random number generator service.
+// Thread generators are restarted when the epoch changes.
+static atomic<unsigned long long> rng_seed_value(random_device{}());  // Seed of the library
+static atomic<unsigned long long> rng_epoch(0);                       // Number of times the seed has been set
+static atomic<unsigned long long> rng_nthread(0);                     // Number of thread streams given
+static const unsigned long long RNG_THREAD_STREAM=1ULL<<63;           // First stream of the thread generators
+
+
+//--------------------------------------------
+//
+//  Philox4x32-10 generator. Default constructor.
+//
+//--------------------------------------------
+philox::philox(){
+
+
+    set(0,0);
+}
+
+
+//--------------------------------------------
+//
+//  Philox4x32-10 generator for a seed and stream.
+//
+//--------------------------------------------
+philox::philox(unsigned long long seed, unsigned long long stream){
+//  unsigned long long seed;    // Seed
+//  unsigned long long stream;  // Stream identifier
+
+
+    set(seed,stream);
+}
+
+
+//--------------------------------------------
+//
+//  Sets the key and the counter of the generator.
+//
+//--------------------------------------------
+void philox::set(unsigned long long seed, unsigned long long stream){
+//  unsigned long long seed;    // Seed
+//  unsigned long long stream;  // Stream identifier
+
+
+    key[0]=(unsigned int)seed;
+    key[1]=(unsigned int)(seed>>32);
+    ctr[0]=0;
+    ctr[1]=0;
+    ctr[2]=(unsigned int)stream;
+    ctr[3]=(unsigned int)(stream>>32);
+    nbuf=0;
+}
+
+
+//--------------------------------------------
+//
+//  Advances the block counter. Numbers left
+//  in the buffer are discarded.
+//
+//--------------------------------------------
+void philox::jump(unsigned long long nblocks){
+//  unsigned long long nblocks; // Number of blocks to skip
+//  Variables
+    unsigned long long pos;     // Block number
+
+
+    pos=((unsigned long long)ctr[1]<<32)|ctr[0];
+    pos=pos+nblocks;
+    ctr[0]=(unsigned int)pos;
+    ctr[1]=(unsigned int)(pos>>32);
+    nbuf=0;
+}
+
+
+//--------------------------------------------
+//
+//  Calculates the ten rounds of Philox4x32
+//  for the current counter. Then the block
+//  counter is incremented.
+//
+//--------------------------------------------
+void philox::block(){
+//  Variables
+    unsigned int  c[4];         // Counter being mixed
+    unsigned int  k[2];         // Round key
+    unsigned long long p0;      // Product of the first multiplier
+    unsigned long long p1;      // Product of the second multiplier
+//  Index
+    int           iround;       // Round index
+
+
+    c[0]=ctr[0]; c[1]=ctr[1]; c[2]=ctr[2]; c[3]=ctr[3];
+    k[0]=key[0]; k[1]=key[1];
+    for(iround=0;iround<10;iround++){
+        p0=(unsigned long long)0xD2511F53u*c[0];
+        p1=(unsigned long long)0xCD9E8D57u*c[2];
+        c[0]=(unsigned int)(p1>>32)^c[1]^k[0];
+        c[1]=(unsigned int)p1;
+        c[2]=(unsigned int)(p0>>32)^c[3]^k[1];
+        c[3]=(unsigned int)p0;
+        k[0]=k[0]+0x9E3779B9u;
+        k[1]=k[1]+0xBB67AE85u;
+    }
+    buf[0]=((unsigned long long)c[1]<<32)|c[0];
+    buf[1]=((unsigned long long)c[3]<<32)|c[2];
+    nbuf=2;
+
+    // Next block
+    ctr[0]=ctr[0]+1;
+    if(ctr[0]==0) ctr[1]=ctr[1]+1;
+}
+
+
+//--------------------------------------------
+//
+//  Generates a 64-bit random number.
+//
+//--------------------------------------------
+philox::result_type philox::operator()(){
+
+
+    if(nbuf==0) block();
+    nbuf=nbuf-1;
+    return buf[1-nbuf];
+}
+
+
+//--------------------------------------------
+//
+//  Generates a real random number in [0,1).
+//  The 53 upper bits fill the mantissa.
+//
+//--------------------------------------------
+double philox::uniform(){
+
+
+    return (double)((*this)()>>11)*0x1.0p-53;
+}
+
+
+//--------------------------------------------
+//
+//  Generates n real random numbers in [0,1).
+//
+//--------------------------------------------
+void philox::uniform(double *v, int n){
+//  double *v;      // Random numbers. Output variable
+//  int     n;      // Number of random numbers
+//  Auxiliary index
+    int     i;      // Aux index
+
+
+    for(i=0;i<n;i++) v[i]=uniform();
+}
+
+
+//--------------------------------------------
+//
+//  Generates n Normally distributed random
+//  numbers using the Box-Muller method.
+//
+//--------------------------------------------
+void philox::gauss(double *v, int n, double mu, double stdev){
+//  double *v;      // Random numbers. Output variable
+//  int     n;      // Number of random numbers
+//  double  mu;     // Mean value
+//  double  stdev;  // Standard deviation
+//  Variables
+    double  r;      // Radius
+    double  theta;  // Angle
+//  Auxiliary index
+    int     i;      // Aux index
+
+
+    for(i=0;i<n;i=i+2){
+        r=stdev*sqrt(-2.0*log(1.0-uniform()));
+        theta=2.0*pi*uniform();
+        v[i]=mu+r*cos(theta);
+        if(i+1<n) v[i+1]=mu+r*sin(theta);
+    }
+}
+
+
+//--------------------------------------------
+//
+//  Generates n Poisson distributed random
+//  numbers.
+//
+//--------------------------------------------
+void philox::poisson(int *v, int n, double lambda){
+//  int    *v;      // Random numbers. Output variable
+//  int     n;      // Number of random numbers
+//  double  lambda; // Most probable value
+//  Variables
+    poisson_distribution<int> rng(lambda);          // Poisson distribution
+//  Auxiliary index
+    int     i;      // Aux index
+
+
+    for(i=0;i<n;i++) v[i]=rng(*this);
+}
+
+
+//--------------------------------------------
+//
+//  Sets the seed of the library generators.
+//
+//--------------------------------------------
+void rng_seed(unsigned long long seed){
+//  unsigned long long seed;    // Seed
+
+
+    rng_seed_value=seed;
+    rng_nthread=0;
+    rng_epoch=rng_epoch+1;
+}
+
+
+//--------------------------------------------
+//
+//  Returns the seed of the library generators.
+//
+//--------------------------------------------
+unsigned long long rng_get_seed(){
+
+
+    return rng_seed_value;
+}
+
+
+//--------------------------------------------
+//
+//  Generator of a task stream.
+//
+//--------------------------------------------
+philox rng_stream(unsigned long long stream){
+//  unsigned long long stream;  // Stream identifier
+
+
+    return philox(rng_seed_value,stream);
+}
+
+
+//--------------------------------------------
+//
+//  Generator of the calling thread.
+//  It is restarted if the seed has changed.
+//
+//--------------------------------------------
+philox &rng_thread(){
+//  Variables
+    thread_local philox tgen;                       // Generator of the thread
+    thread_local unsigned long long tepoch=~0ULL;   // Epoch of the generator of the thread
+
+
+    if(tepoch!=rng_epoch){
+        tepoch=rng_epoch;
+        tgen.set(rng_seed_value,RNG_THREAD_STREAM+rng_nthread++);
+    }
+    return tgen;
+}
+
+
 //-----------------------------------------------
 //
 // Calculates the power p of an integer x.
@@ -61,11 +342,9 @@ long int factorial(long int n){
 //
 //--------------------------------------------
 double urand(){
-//  Variables
-    uniform_real_distribution<double> rng(0.0, 1.0);    // Uniform distribution
 
 
-    return rng(gen);
+    return rng_thread().uniform();
 }
 
 
@@ -82,7 +361,7 @@ int prand(double lambda){
     poisson_distribution<int> rng(lambda);          // Poisson distribution
 
 
-    return rng(gen);
+    return rng(rng_thread());
 }
 
 
@@ -96,10 +375,11 @@ double grand(double mu, double stdev){
 //  double mu;      // Mean value
 //  double stdev;   // Standard deviation
 //  Variables
-    normal_distribution<double> rng(mu,stdev);
+    double value;   // Random number
 
 
-    return rng(gen);
+    rng_thread().gauss(&value,1,mu,stdev);
+    return value;
 }
 
 
@@ -116,7 +396,108 @@ void cfg_soqcs(int nph){
 
     def_nph=nph;
     // Random seed for the random number generator that feeds the distributions
-    gen.seed(std::chrono::system_clock::now().time_since_epoch().count());
+    rng_seed(std::chrono::system_clock::now().time_since_epoch().count());
+}
+
+
+//-----------------------------------------------
+//
+//  Gelman-Rubin potential scale reduction factor
+//  of a set of chains. Each chain is split in two
+//  halves so a single chain can also be checked.
+//  A. Gelman, D. B. Rubin, Statistical Science 7 (1992) 457-472.
+//
+//-----------------------------------------------
+double gelman_rubin(vecd *chains, int nchains){
+//  vecd  *chains;         // Values of a scalar quantity along each chain
+//  int    nchains;        // Number of chains
+//  Variables
+    int    n;              // Length of the half chains
+    int    m;              // Number of half chains
+    double W;              // Average of the variances within the half chains
+    double B;              // Variance between the means of the half chains times n
+    double mean;           // Mean of all the half chains
+    double var;            // Estimated variance of the quantity
+    vecd   hmean;          // Mean of each half chain
+    vecd   hvar;           // Variance of each half chain
+//  Index
+    int    ichain;         // Index of chains
+    int    ihalf;          // Index of halves
+//  Auxiliary index
+    int    i;              // Aux index
+
+
+    // Length of the half chains
+    n=INT_MAX;
+    for(ichain=0;ichain<nchains;ichain++) n=min(n,(int)chains[ichain].size()/2);
+    if(n<2) return 0.0;
+
+    // Mean and variance of each half chain
+    m=2*nchains;
+    hmean.setZero(m);
+    hvar.setZero(m);
+    for(ichain=0;ichain<nchains;ichain++){
+        for(ihalf=0;ihalf<2;ihalf++){
+            auto h=chains[ichain].segment(ihalf*n,n);
+            hmean(2*ichain+ihalf)=h.mean();
+            for(i=0;i<n;i++) hvar(2*ichain+ihalf)=hvar(2*ichain+ihalf)+pow(h(i)-hmean(2*ichain+ihalf),2);
+            hvar(2*ichain+ihalf)=hvar(2*ichain+ihalf)/(double)(n-1);
+        }
+    }
+
+    // Potential scale reduction factor
+    mean=hmean.mean();
+    B=0.0;
+    for(i=0;i<m;i++) B=B+pow(hmean(i)-mean,2);
+    B=B*(double)n/(double)(m-1);
+    W=hvar.mean();
+    if(W<=0.0) return 1.0;
+    var=(double)(n-1)/(double)n*W+B/(double)n;
+
+    return sqrt(var/W);
+}
+
+
+//-----------------------------------------------
+//
+//  Effective sample size of a chain. The sum of
+//  autocorrelations is truncated with the initial
+//  positive sequence estimator of Geyer.
+//  C. J. Geyer, Statistical Science 7 (1992) 473-483.
+//
+//-----------------------------------------------
+double eff_size(const vecd &x){
+//  vecd   x;              // Values of a scalar quantity along a chain
+//  Variables
+    int    n;              // Length of the chain
+    double mean;           // Mean of the chain
+    double c0;             // Variance of the chain
+    double rho;            // Autocorrelation at lag k
+    double pair;           // Sum of a pair of consecutive autocorrelations
+    double tau;            // Integrated autocorrelation time
+    vecd   y;              // Centered chain
+//  Index
+    int    k;              // Lag
+
+
+    n=x.size();
+    if(n<2) return (double)n;
+    mean=x.mean();
+    y=x.array()-mean;
+    c0=y.squaredNorm()/(double)n;
+    if(c0<=0.0) return (double)n;
+
+    // Sum the autocorrelations by pairs while they are positive
+    tau=-1.0;
+    for(k=0;k+1<n;k=k+2){
+        rho =y.head(n-k).dot(y.tail(n-k))/((double)n*c0);
+        pair=rho+y.head(n-k-1).dot(y.tail(n-k-1))/((double)n*c0);
+        if(pair<=0.0) break;
+        tau=tau+2.0*pair;
+    }
+    if(tau<1.0) tau=1.0;
+
+    return (double)n/tau;
 }
 
 
@@ -161,6 +542,217 @@ long long int decval(int *chainv,int n,int base){
     return value;
 }
 
+
+//--------------------------------------------
+//
+//  Calculate a 64-bit hash of an integer vector.
+//  Each value is mixed with a multiplicative step
+//  and the result with the splitmix64 finalizer.
+//
+//--------------------------------------------
+unsigned long long int rowhash(const int *v, int n){
+//  const int *v      // Integer vector
+//  int n             // Length of v
+//  Variables
+    unsigned long long int h;   // Hash value
+//  Auxiliary index
+    int i;            // Aux index
+
+
+    h=(unsigned long long int)n;
+    for(i=0;i<n;i++){
+        h=(h^(unsigned int)v[i])*0x9E3779B97F4A7C15ULL;
+        h=h^(h>>32);
+    }
+    h=(h^(h>>30))*0xBF58476D1CE4E5B9ULL;
+    h=(h^(h>>27))*0x94D049BB133111EBULL;
+    return h^(h>>31);
+}
+
+
+//--------------------------------------------
+//
+//  Row index. Creates an empty index.
+//
+//--------------------------------------------
+row_index::row_index(){
+
+
+    cap=0;
+    nused=0;
+}
+
+
+//--------------------------------------------
+//
+//  Reserves slots for a number of rows.
+//  The load is kept below 7/8.
+//
+//--------------------------------------------
+void row_index::reserve(int n){
+//  int n             // Number of rows
+//  Variables
+    int newcap;       // New number of slots
+
+
+    newcap=ROWGROUP;
+    while((long long int)newcap*7<(long long int)n*8) newcap=2*newcap;
+    if(newcap>cap) rehash(newcap);
+}
+
+
+//--------------------------------------------
+//
+//  Removes all the rows from the index.
+//
+//--------------------------------------------
+void row_index::clear(){
+
+
+    fill(ctrl.begin(),ctrl.end(),ROWEMPTY);
+    nused=0;
+}
+
+
+//--------------------------------------------
+//
+//  Finds the position of a row. The slots are
+//  probed a group at a time starting from the
+//  group given by the hash.
+//
+//--------------------------------------------
+int row_index::find(unsigned long long int h, const int *row, const int *store, int width) const{
+//  unsigned long long int h;   // Hash of the row
+//  const int *row;             // Row to be found
+//  const int *store;           // Block where the rows are stored
+//  int width;                  // Length of each row
+//  Variables
+    unsigned char tag;          // Control byte of the row
+    unsigned int  match;        // Slots of the group with the same control byte
+    unsigned int  empty;        // Empty slots of the group
+    int           group;        // First slot of the group
+    int           slot;         // Slot
+#if defined(__SSE2__) && defined(__GNUC__)
+    __m128i       ctrlv;        // Control bytes of the group
+#endif
+//  Auxiliary index
+    int           i;            // Aux index
+
+
+    if(cap==0) return -1;
+    tag=(unsigned char)(h&0x7F);
+    group=(int)((h>>7)&(unsigned long long int)(cap-1))&~(ROWGROUP-1);
+    while(true){
+        // Compare the control bytes of the group
+#if defined(__SSE2__) && defined(__GNUC__)
+        ctrlv=_mm_loadu_si128((const __m128i *)&ctrl[group]);
+        match=(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrlv,_mm_set1_epi8((char)tag)));
+        empty=(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrlv,_mm_set1_epi8((char)ROWEMPTY)));
+#else
+        match=0;
+        empty=0;
+        for(i=0;i<ROWGROUP;i++){
+            if(ctrl[group+i]==tag)      match=match|(1u<<i);
+            if(ctrl[group+i]==ROWEMPTY) empty=empty|(1u<<i);
+        }
+#endif
+        // Check the candidates against the stored rows
+        while(match!=0){
+#if defined(__GNUC__)
+            i=__builtin_ctz(match);
+#else
+            i=0;
+            while(((match>>i)&1)==0) i++;
+#endif
+            slot=group+i;
+            if((hashes[slot]==h)&&(memcmp(store+(long long int)pos[slot]*width,row,width*sizeof(int))==0)) return pos[slot];
+            match=match&(match-1);
+        }
+
+        // Rows are never removed therefore
+        // an empty slot ends the search.
+        if(empty!=0) return -1;
+        group=(group+ROWGROUP)&(cap-1);
+    }
+}
+
+
+//--------------------------------------------
+//
+//  Adds a row to the index in the first empty
+//  slot of its probe sequence.
+//
+//--------------------------------------------
+void row_index::insert(unsigned long long int h, int ipos){
+//  unsigned long long int h;   // Hash of the row
+//  int ipos;                   // Position of the row
+//  Variables
+    int           group;        // First slot of the group
+    int           slot;         // Slot
+//  Auxiliary index
+    int           i;            // Aux index
+
+
+    if((long long int)(nused+1)*8>(long long int)cap*7) reserve(max(nused+1,2*nused));
+
+    group=(int)((h>>7)&(unsigned long long int)(cap-1))&~(ROWGROUP-1);
+    slot=-1;
+    while(slot<0){
+        for(i=0;(i<ROWGROUP)&&(slot<0);i++){
+            if(ctrl[group+i]==ROWEMPTY) slot=group+i;
+        }
+        group=(group+ROWGROUP)&(cap-1);
+    }
+
+    ctrl[slot]=(unsigned char)(h&0x7F);
+    hashes[slot]=h;
+    pos[slot]=ipos;
+    nused=nused+1;
+}
+
+
+//--------------------------------------------
+//
+//  Number of rows in the index.
+//
+//--------------------------------------------
+int row_index::size() const{
+
+
+    return nused;
+}
+
+
+//--------------------------------------------
+//
+//  Changes the number of slots and places
+//  again the rows.
+//
+//--------------------------------------------
+void row_index::rehash(int newcap){
+//  int newcap;                         // New number of slots
+//  Variables
+    vector<unsigned char> oldctrl;      // Previous control bytes
+    vector<unsigned long long int> oldhashes; // Previous hashes
+    vector<int> oldpos;                 // Previous positions
+//  Auxiliary index
+    int i;                              // Aux index
+
+
+    oldctrl.swap(ctrl);
+    oldhashes.swap(hashes);
+    oldpos.swap(pos);
+
+    cap=newcap;
+    nused=0;
+    ctrl.assign(cap,ROWEMPTY);
+    hashes.assign(cap,0);
+    pos.assign(cap,-1);
+    for(i=0;i<(int)oldctrl.size();i++){
+        if(oldctrl[i]!=ROWEMPTY) insert(oldhashes[i],oldpos[i]);
+    }
+}
+
 //--------------------------------------------------
 //
 // Calculates the coupling of two Gaussian wave packets.
@@ -278,106 +870,819 @@ matc GSP(matc S){
     // Reconstruct the coupling matrix
     SA=U*D*U.adjoint();
 
-    // Perform Cholesky decomposition
-    L = SA.llt().matrixL();
+    // Perform Cholesky decomposition
+    L = SA.llt().matrixL();
+
+    // Return matrix with the transformation coefficients.
+    return L;
+}
+
+
+//-----------------------------------------------
+//
+//  Index of the row flipped at a given step of
+//  the Gray code (number of trailing zeros).
+//
+//-----------------------------------------------
+static inline long int gray_flip(long int bin_index){
+//  long int bin_index; // Step of the Gray code (>0)
+#if defined(__GNUC__)
+    return __builtin_ctzl((unsigned long)bin_index);
+#else
+    long int k;         // Number of trailing zeros
+
+
+    k=0;
+    while((bin_index&1)==0){
+        bin_index=bin_index>>1;
+        k=k+1;
+    }
+    return k;
+#endif
+}
+
+
+//-----------------------------------------------
+//
+//  Glynn Gray code loop. Scalar version.
+//  Matrix rows and row combinations are given
+//  in separated real and imaginary arrays padded
+//  to np elements.
+//
+//-----------------------------------------------
+static cmplx glynn_loop_scalar(const double *mr, const double *mi, double *rr, double *ri, long int n, long int np, long int num_loops){
+//  const double *mr;     // Real part of the matrix rows
+//  const double *mi;     // Imaginary part of the matrix rows
+//  double   *rr;         // Real part of the row combination
+//  double   *ri;         // Imaginary part of the row combination
+//  long int  n;          // Number of row/columns of the matrix
+//  long int  np;         // Padded row length
+//  long int  num_loops;  // Number of loops
+//  Variables
+    double   tr;          // Real part of the total
+    double   ti;          // Imaginary part of the total
+    double   pr;          // Real part of the product
+    double   pi;          // Imaginary part of the product
+    double   aux;         // Aux variable
+    double   sign;        // Sign value
+    double   direction;   // Direction of the difference
+    const double *vr;     // Real part of the flipped row
+    const double *vi;     // Imaginary part of the flipped row
+//  Index
+    long int bin_index;   // Binary index
+    long int k;           // Flipped row
+//  Auxiliary index
+    long int i;           // Aux index
+
+
+    tr=0.0;
+    ti=0.0;
+    sign=1.0;
+    for(bin_index=1;bin_index<=num_loops;bin_index++){
+        // Product of the row combination
+        pr=1.0;
+        pi=0.0;
+        for(i=0;i<n;i++){
+            aux=pr*rr[i]-pi*ri[i];
+            pi=pr*ri[i]+pi*rr[i];
+            pr=aux;
+        }
+        tr=tr+sign*pr;
+        ti=ti+sign*pi;
+
+        // Update the row combination
+        k=gray_flip(bin_index);
+        direction=((bin_index>>(k+1))&1)? 2.0 : -2.0;
+        vr=mr+k*np;
+        vi=mi+k*np;
+        for(i=0;i<n;i++){
+            rr[i]=rr[i]+direction*vr[i];
+            ri[i]=ri[i]+direction*vi[i];
+        }
+        sign=-sign;
+    }
+
+    return cmplx(tr,ti);
+}
+
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+//-----------------------------------------------
+//
+//  Glynn Gray code loop. AVX2 version.
+//  The product is accumulated independently in
+//  each lane and reduced at the end.
+//  The padding of the row combination is 1+0i.
+//
+//-----------------------------------------------
+__attribute__((target("avx2,fma")))
+static cmplx glynn_loop_avx2(const double *mr, const double *mi, double *rr, double *ri, long int n, long int np, long int num_loops){
+//  const double *mr;     // Real part of the matrix rows
+//  const double *mi;     // Imaginary part of the matrix rows
+//  double   *rr;         // Real part of the row combination
+//  double   *ri;         // Imaginary part of the row combination
+//  long int  n;          // Number of row/columns of the matrix
+//  long int  np;         // Padded row length
+//  long int  num_loops;  // Number of loops
+//  Variables
+    double   tr;          // Real part of the total
+    double   ti;          // Imaginary part of the total
+    double   pr;          // Real part of the product
+    double   pi;          // Imaginary part of the product
+    double   aux;         // Aux variable
+    double   sign;        // Sign value
+    double   lr[4];       // Real part of the lane products
+    double   li[4];       // Imaginary part of the lane products
+    __m256d  vpr;         // Lane products. Real part
+    __m256d  vpi;         // Lane products. Imaginary part
+    __m256d  vrr;         // Row combination. Real part
+    __m256d  vri;         // Row combination. Imaginary part
+    __m256d  vaux;        // Aux vector
+    __m256d  vdir;        // Direction of the difference
+    const double *vr;     // Real part of the flipped row
+    const double *vi;     // Imaginary part of the flipped row
+//  Index
+    long int bin_index;   // Binary index
+    long int k;           // Flipped row
+//  Auxiliary index
+    long int i;           // Aux index
+
+
+    tr=0.0;
+    ti=0.0;
+    sign=1.0;
+    for(bin_index=1;bin_index<=num_loops;bin_index++){
+        // Product of the row combination
+        vpr=_mm256_load_pd(rr);
+        vpi=_mm256_load_pd(ri);
+        for(i=4;i<np;i=i+4){
+            vrr=_mm256_load_pd(rr+i);
+            vri=_mm256_load_pd(ri+i);
+            vaux=_mm256_fmsub_pd(vpr,vrr,_mm256_mul_pd(vpi,vri));
+            vpi=_mm256_fmadd_pd(vpr,vri,_mm256_mul_pd(vpi,vrr));
+            vpr=vaux;
+        }
+        _mm256_store_pd(lr,vpr);
+        _mm256_store_pd(li,vpi);
+        pr=lr[0];
+        pi=li[0];
+        for(i=1;i<4;i++){
+            aux=pr*lr[i]-pi*li[i];
+            pi=pr*li[i]+pi*lr[i];
+            pr=aux;
+        }
+        tr=tr+sign*pr;
+        ti=ti+sign*pi;
+
+        // Update the row combination
+        k=gray_flip(bin_index);
+        vdir=_mm256_set1_pd(((bin_index>>(k+1))&1)? 2.0 : -2.0);
+        vr=mr+k*np;
+        vi=mi+k*np;
+        for(i=0;i<n;i=i+4){
+            _mm256_store_pd(rr+i,_mm256_fmadd_pd(vdir,_mm256_load_pd(vr+i),_mm256_load_pd(rr+i)));
+            _mm256_store_pd(ri+i,_mm256_fmadd_pd(vdir,_mm256_load_pd(vi+i),_mm256_load_pd(ri+i)));
+        }
+        sign=-sign;
+    }
+
+    return cmplx(tr,ti);
+}
+
+
+//-----------------------------------------------
+//
+//  Glynn Gray code loop. AVX-512 version.
+//
+//-----------------------------------------------
+__attribute__((target("avx512f")))
+static cmplx glynn_loop_avx512(const double *mr, const double *mi, double *rr, double *ri, long int n, long int np, long int num_loops){
+//  const double *mr;     // Real part of the matrix rows
+//  const double *mi;     // Imaginary part of the matrix rows
+//  double   *rr;         // Real part of the row combination
+//  double   *ri;         // Imaginary part of the row combination
+//  long int  n;          // Number of row/columns of the matrix
+//  long int  np;         // Padded row length
+//  long int  num_loops;  // Number of loops
+//  Variables
+    double   tr;          // Real part of the total
+    double   ti;          // Imaginary part of the total
+    double   pr;          // Real part of the product
+    double   pi;          // Imaginary part of the product
+    double   aux;         // Aux variable
+    double   sign;        // Sign value
+    double   lr[8];       // Real part of the lane products
+    double   li[8];       // Imaginary part of the lane products
+    __m512d  vpr;         // Lane products. Real part
+    __m512d  vpi;         // Lane products. Imaginary part
+    __m512d  vrr;         // Row combination. Real part
+    __m512d  vri;         // Row combination. Imaginary part
+    __m512d  vaux;        // Aux vector
+    __m512d  vdir;        // Direction of the difference
+    const double *vr;     // Real part of the flipped row
+    const double *vi;     // Imaginary part of the flipped row
+//  Index
+    long int bin_index;   // Binary index
+    long int k;           // Flipped row
+//  Auxiliary index
+    long int i;           // Aux index
+
+
+    tr=0.0;
+    ti=0.0;
+    sign=1.0;
+    for(bin_index=1;bin_index<=num_loops;bin_index++){
+        // Product of the row combination
+        vpr=_mm512_load_pd(rr);
+        vpi=_mm512_load_pd(ri);
+        for(i=8;i<np;i=i+8){
+            vrr=_mm512_load_pd(rr+i);
+            vri=_mm512_load_pd(ri+i);
+            vaux=_mm512_fmsub_pd(vpr,vrr,_mm512_mul_pd(vpi,vri));
+            vpi=_mm512_fmadd_pd(vpr,vri,_mm512_mul_pd(vpi,vrr));
+            vpr=vaux;
+        }
+        _mm512_store_pd(lr,vpr);
+        _mm512_store_pd(li,vpi);
+        pr=lr[0];
+        pi=li[0];
+        for(i=1;i<8;i++){
+            aux=pr*lr[i]-pi*li[i];
+            pi=pr*li[i]+pi*lr[i];
+            pr=aux;
+        }
+        tr=tr+sign*pr;
+        ti=ti+sign*pi;
+
+        // Update the row combination
+        k=gray_flip(bin_index);
+        vdir=_mm512_set1_pd(((bin_index>>(k+1))&1)? 2.0 : -2.0);
+        vr=mr+k*np;
+        vi=mi+k*np;
+        for(i=0;i<n;i=i+8){
+            _mm512_store_pd(rr+i,_mm512_fmadd_pd(vdir,_mm512_load_pd(vr+i),_mm512_load_pd(rr+i)));
+            _mm512_store_pd(ri+i,_mm512_fmadd_pd(vdir,_mm512_load_pd(vi+i),_mm512_load_pd(ri+i)));
+        }
+        sign=-sign;
+    }
+
+    return cmplx(tr,ti);
+}
+#endif
+
+
+//-----------------------------------------------
+//
+//  Product of the N complex elements of a row
+//  combination. It is calculated in two independent
+//  chains (even and odd columns) to halve the
+//  latency of the multiplications.
+//
+//-----------------------------------------------
+template<int N>
+static inline void prod_fixed(const double *rr, const double *ri, double &pr, double &pi){
+//  const double *rr;     // Real part of the row combination
+//  const double *ri;     // Imaginary part of the row combination
+//  double   &pr;         // Real part of the product. Output variable.
+//  double   &pi;         // Imaginary part of the product. Output variable.
+//  Variables
+    double   er;          // Real part of the product of even columns
+    double   ei;          // Imaginary part of the product of even columns
+    double   orr;         // Real part of the product of odd columns
+    double   oi;          // Imaginary part of the product of odd columns
+    double   aux;         // Aux variable
+//  Auxiliary index
+    int      j;           // Aux index
+
+
+    er=rr[0];
+    ei=ri[0];
+    orr=1.0;
+    oi=0.0;
+    PERM_UNROLL
+    for(j=1;j<N;j++){
+        if(j%2==0){
+            aux=er*rr[j]-ei*ri[j];
+            ei=er*ri[j]+ei*rr[j];
+            er=aux;
+        }else{
+            aux=orr*rr[j]-oi*ri[j];
+            oi=orr*ri[j]+oi*rr[j];
+            orr=aux;
+        }
+    }
+    pr=er*orr-ei*oi;
+    pi=er*oi+ei*orr;
+}
+
+
+//-----------------------------------------------
+//
+//  Glynn formula for a fixed matrix size N.
+//  The size is known at compile time, therefore
+//  the row combination is kept in local arrays
+//  (registers) and the loops over the columns
+//  are fully unrolled. No memory is reserved.
+//  The Gray code is unrolled by pairs of steps.
+//  In odd steps the flipped row is always the first.
+//
+//-----------------------------------------------
+template<int N>
+static cmplx perm_fixed(const matc &M){
+//  matc M Square matrix of size N to calculate the permanent.
+//  Variables
+    const long int num_loops=(long int)1<<(N-1); // Number of loops
+    double   mr[N][N];    // Real part of the rows of M
+    double   mi[N][N];    // Imaginary part of the rows of M
+    double   rr[N];       // Real part of the row combination
+    double   ri[N];       // Imaginary part of the row combination
+    double   tr;          // Real part of the total
+    double   ti;          // Imaginary part of the total
+    double   pr;          // Real part of the product
+    double   pi;          // Imaginary part of the product
+    double   direction;   // Direction of the difference
+//  Index
+    long int bin_index;   // Binary index
+    long int k;           // Flipped row
+//  Auxiliary index
+    int      i;           // Aux index
+    int      j;           // Aux index
+
+
+    // Initializations
+    for(j=0;j<N;j++){
+        rr[j]=0.0;
+        ri[j]=0.0;
+        for(i=0;i<N;i++){
+            mr[i][j]=real(M(i,j));
+            mi[i][j]=imag(M(i,j));
+            rr[j]=rr[j]+mr[i][j];
+            ri[j]=ri[j]+mi[i][j];
+        }
+    }
+
+    //  Main loop
+    tr=0.0;
+    ti=0.0;
+    for(bin_index=1;bin_index<num_loops;bin_index+=2){
+        // Odd step. Positive sign.
+        prod_fixed<N>(rr,ri,pr,pi);
+        tr=tr+pr;
+        ti=ti+pi;
+
+        direction=((bin_index>>1)&1)? 2.0 : -2.0;
+        PERM_UNROLL
+        for(j=0;j<N;j++){
+            rr[j]=rr[j]+direction*mr[0][j];
+            ri[j]=ri[j]+direction*mi[0][j];
+        }
+
+        // Even step. Negative sign.
+        prod_fixed<N>(rr,ri,pr,pi);
+        tr=tr-pr;
+        ti=ti-pi;
+
+        if(bin_index+1<num_loops){
+            k=gray_flip(bin_index+1);
+            direction=(((bin_index+1)>>(k+1))&1)? 2.0 : -2.0;
+            PERM_UNROLL
+            for(j=0;j<N;j++){
+                rr[j]=rr[j]+direction*mr[k][j];
+                ri[j]=ri[j]+direction*mi[k][j];
+            }
+        }
+    }
+
+    // Return value
+    return cmplx(tr,ti)/(double)num_loops;
+}
+
+
+//-----------------------------------------------
+//
+//  Permanents of the trivial sizes
+//  calculated by direct expansion.
+//
+//-----------------------------------------------
+template<>
+cmplx perm_fixed<0>(const matc &M){
+//  matc M 0x0 matrix
+
+
+    return 1.0;
+}
+
+template<>
+cmplx perm_fixed<1>(const matc &M){
+//  matc M 1x1 matrix
+
+
+    return M(0,0);
+}
+
+template<>
+cmplx perm_fixed<2>(const matc &M){
+//  matc M 2x2 matrix
+
+
+    return M( 0, 0 )*M( 1, 1 ) +  M( 0, 1 )*M( 1, 0 );
+}
+
+template<>
+cmplx perm_fixed<3>(const matc &M){
+//  matc M 3x3 matrix
+
+
+    return M( 0, 0 )*M( 1, 1 )*M( 2, 2 )  // 123
+         + M( 0, 0 )*M( 1, 2 )*M( 2, 1 )  // 132
+         + M( 0, 1 )*M( 1, 0 )*M( 2, 2 )  // 213
+         + M( 0, 1 )*M( 1, 2 )*M( 2, 0 )  // 231
+         + M( 0, 2 )*M( 1, 0 )*M( 2, 1 )  // 312
+         + M( 0, 2 )*M( 1, 1 )*M( 2, 0 ); // 321
+}
+
+
+// Dispatch table of the fixed size permanent kernels
+static cmplx (* const perm_kernel[SMALLPERM+1])(const matc &M)={
+    perm_fixed<0>, perm_fixed<1>, perm_fixed<2>,  perm_fixed<3>,  perm_fixed<4>,  perm_fixed<5>, perm_fixed<6>,
+    perm_fixed<7>, perm_fixed<8>, perm_fixed<9>,  perm_fixed<10>, perm_fixed<11>, perm_fixed<12>
+};
+
+
+//-----------------------------------------------
+//
+//  Calculation of the permanent of a small matrix
+//  with a kernel specialized for its size.
+//
+//-----------------------------------------------
+cmplx perm_small(const matc &M){
+//  matc M Square matrix of size n<=SMALLPERM to calculate the permanent.
+
+
+    return perm_kernel[M.rows()](M);
+}
+
+
+//-----------------------------------------------
+//
+//  Calculation of the permanent of a matrix using
+//  the Glynn method in Gray code. Translation to C++
+//  of the algorithm in python coded by "xnor" in:
+//  https://codegolf.stackexchange.com/questions/97060/calculate-the-permanent-as-quickly-as-possible
+//
+//  Glynn Formula:
+//  https://en.wikipedia.org/wiki/Computing_the_permanent
+//
+//  Row combinations are stored as separated real and
+//  imaginary aligned arrays. The main loop is selected
+//  at runtime between AVX-512, AVX2 and scalar code.
+//
+//-----------------------------------------------
+cmplx glynn(matc M){
+//  matc M Square matrix to calculate the permanent.
+//  Variables
+    long int n;         // Number of row/columns of the square matrix M.
+    long int np;        // Row length padded to a multiple of the vector width.
+    long int num_loops; // Number of loops
+    double  *mr;        // Real part of the rows of M
+    double  *mi;        // Imaginary part of the rows of M
+    double  *rr;        // Real part of the row combination
+    double  *ri;        // Imaginary part of the row combination
+    cmplx    total;     // Total value of the permanent.
+//  Auxiliary index.
+    long int i;         // Aux index
+    long int j;         // Aux index
+
+
+    // Configuration
+    n=M.cols();
+    if(n<=SMALLPERM) return perm_small(M);
+    np=((n+7)/8)*8;
+    num_loops=(long int)1<<(n-1);
+
+    // Initializations
+    // Padding is set so it does not change the products.
+    mr=(double*)aligned_alloc(64,n*np*sizeof(double));
+    mi=(double*)aligned_alloc(64,n*np*sizeof(double));
+    rr=(double*)aligned_alloc(64,np*sizeof(double));
+    ri=(double*)aligned_alloc(64,np*sizeof(double));
+    for(i=0;i<n;i++){
+        for(j=0;j<np;j++){
+            if(j<n){
+                mr[i*np+j]=real(M(i,j));
+                mi[i*np+j]=imag(M(i,j));
+            }else{
+                mr[i*np+j]=0.0;
+                mi[i*np+j]=0.0;
+            }
+        }
+    }
+    for(j=0;j<np;j++){
+        rr[j]=1.0;
+        ri[j]=0.0;
+        if(j<n){
+            rr[j]=0.0;
+            for(i=0;i<n;i++){
+                rr[j]=rr[j]+mr[i*np+j];
+                ri[j]=ri[j]+mi[i*np+j];
+            }
+        }
+    }
+
+    //  Main loop
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    if(__builtin_cpu_supports("avx512f"))   total=glynn_loop_avx512(mr,mi,rr,ri,n,np,num_loops);
+    else if(__builtin_cpu_supports("avx2")
+         && __builtin_cpu_supports("fma")) total=glynn_loop_avx2(mr,mi,rr,ri,n,np,num_loops);
+    else                                    total=glynn_loop_scalar(mr,mi,rr,ri,n,np,num_loops);
+#else
+    total=glynn_loop_scalar(mr,mi,rr,ri,n,np,num_loops);
+#endif
+
+    // Free memory
+    free(mr);
+    free(mi);
+    free(rr);
+    free(ri);
+
+    // Return value
+    return total/(double)num_loops;
+
+}
+
+
+//-----------------------------------------------
+//
+//  Calculation of the permanents of all the minors
+//  obtained removing one column of a (n-1)xn matrix.
+//  All of them are calculated in a single pass of
+//  the Glynn formula in Gray code. The product for
+//  each minor is obtained from prefix and suffix
+//  products of the row combination.
+//
+//-----------------------------------------------
+vecc glynn_minors(matc M){
+//  matc M (n-1)xn matrix to calculate the permanents of its minors.
+//  Variables
+    long int n;         // Number of columns of M.
+    long int nr;        // Number of rows of M.
+    long int num_loops; // Number of loops
+    long int k;         // Flipped row
+    double   sign;      // Sign value
+    double   direction; // Direction of the difference
+    cmplx    prod;      // Prefix product
+    cmplx   *row_comb;  // Row combination
+    cmplx   *suffix;    // Suffix products of the row combination
+    vecc     minors;    // Permanents of the minors
+//  Index
+    long int bin_index; // Binary index
+//  Auxiliary index.
+    long int i;         // Aux index
+    long int j;         // Aux index
+
+
+    // Configuration
+    n=M.cols();
+    nr=M.rows();
+    minors.setZero(n);
+    if(nr==0){
+        minors.setOnes(n);
+        return minors;
+    }
+    num_loops=(long int)1<<(nr-1);
+
+    // Initializations
+    row_comb=new cmplx[n];
+    suffix=new cmplx[n+1];
+    for(j=0;j<n;j++){
+        row_comb[j]=0.0;
+        for(i=0;i<nr;i++){
+            row_comb[j]=row_comb[j]+M(i,j);
+        }
+    }
+
+    //  Main loop
+    sign=1.0;
+    suffix[n]=1.0;
+    for(bin_index=1;bin_index<=num_loops;bin_index++){
+        // Products skipping each column
+        for(j=n-1;j>=0;j--) suffix[j]=suffix[j+1]*row_comb[j];
+        prod=1.0;
+        for(j=0;j<n;j++){
+            minors(j)=minors(j)+sign*prod*suffix[j+1];
+            prod=prod*row_comb[j];
+        }
+
+        // Update the row combination
+        if(bin_index<num_loops){
+            k=gray_flip(bin_index);
+            direction=((bin_index>>(k+1))&1)? 2.0 : -2.0;
+            for(j=0;j<n;j++) row_comb[j]=row_comb[j]+direction*M(k,j);
+        }
+        sign=-sign;
+    }
+
+    // Free memory
+    delete[] row_comb;
+    delete[] suffix;
+
+    // Return value
+    return minors/(double)num_loops;
+}
+
+
+//-----------------------------------------------
+//
+//  Randomized estimation of the permanent of a
+//  matrix using the Glynn/Gurvits estimator
+//
+//  X = prod_i x_i * prod_j ( sum_i x_i M(i,j) )
+//
+//  with x_i random signs +/-1. Its average is the
+//  permanent and |X| <= ||M||^n.
+//  L. Gurvits, Lecture Notes in Computer Science 3618 (2005) 447-458.
+//
+//  Samples are split between threads. All of them
+//  use the same random stream. Each sample starts in
+//  its own block of the stream so the result does not
+//  depend on the number of threads.
+//
+//-----------------------------------------------
+cmplx gurvits_perm(const matc &M, long long int nsamples, int nthreads, double &serr){
+//  matc      M;            // Square matrix to estimate the permanent.
+//  long long int nsamples; // Number of samples
+//  int       nthreads;     // Number of threads
+//  double   &serr;         // Standard error of the estimation. Output variable.
+//  Variables
+    int       n;            // Number of rows and columns of the square matrix M
+    double    sr;           // Sum of the real parts of the samples
+    double    si;           // Sum of the imaginary parts of the samples
+    double    s2;           // Sum of the squared modulus of the samples
+    double    var;          // Variance of the samples
+    cmplx     mean;         // Average of the samples
+    long long int nblock;   // Number of random blocks of a sample
+    unsigned long long stream; // Random stream of the estimation
+//  Index
+    int       ithread;      // Index of threads
+
+
+    // Check trivial cases
+    n=M.rows();
+    serr=0.0;
+    if(n==0) return 1.0;
+    if(nsamples<1) nsamples=1;
+    if(nthreads<1) nthreads=1;
+    if(nsamples<nthreads) nthreads=(int)nsamples;
+
+    // Each block has 128 random bits
+    stream=rng_thread()();
+    nblock=(n+127)/128;
+
+    // Sampling
+    sr=0.0;
+    si=0.0;
+    s2=0.0;
+    #pragma omp parallel for schedule(static) num_threads(nthreads) reduction(+:sr,si,s2)
+    for(ithread=0;ithread<nthreads;ithread++){
+        philox       tgen=rng_stream(stream); // Generator of the thread
+        vecc         comb(n);              // Row combination
+        unsigned long long bits=0;         // Random bits
+        int          nbits=0;              // Number of random bits left
+        long long int isample;             // Sample index
+        double       sign;                 // Product of the signs
+        cmplx        x;                    // Sample value
+        int          i;                    // Aux index
+
+        tgen.jump(nblock*(nsamples*ithread/nthreads));
+        for(isample=nsamples*ithread/nthreads;isample<nsamples*(ithread+1)/nthreads;isample++){
+            // Start the sample in a new block
+            tgen.jump(0);
+            comb.setZero();
+            nbits=0;
+            sign=1.0;
+            for(i=0;i<n;i++){
+                if(nbits==0){
+                    bits=tgen();
+                    nbits=64;
+                }
+                if(bits&1){
+                    comb=comb+M.row(i).transpose();
+                }else{
+                    comb=comb-M.row(i).transpose();
+                    sign=-sign;
+                }
+                bits=bits>>1;
+                nbits=nbits-1;
+            }
+            x=sign*comb.prod();
+            sr=sr+real(x);
+            si=si+imag(x);
+            s2=s2+norm(x);
+        }
+    }
+
+    // Statistics
+    mean=cmplx(sr,si)/(double)nsamples;
+    if(nsamples>1){
+        var=(s2-(double)nsamples*norm(mean))/(double)(nsamples-1);
+        serr=sqrt(max(var,0.0)/(double)nsamples);
+    }
+
+    // Return estimation
+    return mean;
+}
+
+
+//-----------------------------------------------
+//
+//  Number of samples of the Gurvits estimator to
+//  obtain an additive error eps with probability
+//  conf when the samples are bounded by |X|<=bound.
+//  Hoeffding inequality applied separately to the
+//  real and imaginary parts with error eps/sqrt(2).
+//
+//-----------------------------------------------
+long long int gurvits_samples(double bound, double eps, double conf){
+//  double bound;          // Bound of the modulus of the samples
+//  double eps;            // Additive error
+//  double conf;           // Confidence
+//  Variables
+    double nsamples;       // Number of samples
 
-    // Return matrix with the transformation coefficients.
-    return L;
+
+    if((eps<=0.0)||(conf<=0.0)||(conf>=1.0)){
+        cout << "gurvits_samples: Warning! The error has to be positive and the confidence between 0 and 1." << endl;
+        return 1;
+    }
+    nsamples=ceil(4.0*bound*bound*log(4.0/(1.0-conf))/(eps*eps));
+    if(nsamples<1.0) nsamples=1.0;
+    if(nsamples>(double)LLONG_MAX) return LLONG_MAX;
+    return (long long int)nsamples;
 }
 
 
 //-----------------------------------------------
 //
-//  Calculation of the permanent of a matrix using
-//  the Glynn method in Gray code. Translation to C++
-//  of the algorithm in python coded by "xnor" in:
-//  https://codegolf.stackexchange.com/questions/97060/calculate-the-permanent-as-quickly-as-possible
+//  Calculation of the permanent of a real
+//  non-negative matrix using the Ryser formula
+//  in Gray code. The row sums are updated by
+//  a single column in each step.
 //
-//  Glynn Formula:
+//  Ryser Formula:
 //  https://en.wikipedia.org/wiki/Computing_the_permanent
 //
 //-----------------------------------------------
-cmplx glynn(matc M){
-//  matc M Square matrix to calculate the permanent.
+double ryser_nonneg(const matd &M){
+//  matd M Square non-negative matrix to calculate the permanent.
 //  Variables
-//  Iteration variables
-    long int n;         // Number of row/columns of the square matrix M.
-    cmplx total;        // Total value of the permanent.
-    long int old_gray;  // Old gray codification
-    long int new_gray;  // New gray codification
-    long int num_loops; // Number of loops
-    long int diff;      // old_gray - new_gray
-    long int gray_diff; // old_gray^new_grays
-    long int bin_index; // Binary index
-    cmplx sign;         // Sing value
-    cmplx direction;    // Direction of the difference.
-    cmplx reduce;       // Reduced row combination
-    cmplx *row_comb;    // Row combination
-    cmplx *new_vector;  // New vector
-    long int gray_diff_index;                   // Gray code index of differences
-    thash binary_power_dict;                    // Hash table of binary power differences.
-    thash::const_iterator hash_gray_diff_index; // Iterator for the has table of binary power differences.
-//  Auxiliary index.
-    long int i;         // Aux index
-    long int j;         // Aux index
+    int      n;           // Number of rows and columns of the square matrix M
+    long int num_loops;   // Number of loops
+    long int k;           // Flipped column
+    double   sign;        // Sign of the term
+    double   prod;        // Product of the row sums
+    double   total;       // Total value of the permanent
+    double  *rsum;        // Row sums of the selected columns
+    bool    *sel;         // Selected columns
+//  Index
+    long int bin_index;   // Binary index
+//  Auxiliary index
+    int      i;           // Aux index
 
 
-    // Configuration
-    n=M.cols();
+    // Trivial cases
+    n=M.rows();
     if(n==0) return 1.0;
+    if(n==1) return M(0,0);
 
     // Initializations
-    row_comb=new cmplx[n];
-    for(j=0;j<n;j++){
-        row_comb[j]=0.0;
-        for(i=0;i<n;i++){
-            row_comb[j]=row_comb[j]+M(i,j);
-        }
-    }
-
-    total = 0;
-    old_gray = 0;
-    sign = +1;
-
-    new_vector=new cmplx[n];
-    for(i=0;i<n;i++) binary_power_dict[pow(2,i)]=i;
-    num_loops=pow(2,n-1);
-
+    num_loops=(long int)1<<n;
+    rsum=new double[n]();
+    sel=new bool[n]();
 
     //  Main loop
-    for(bin_index=1;bin_index<=num_loops;bin_index++){
-
-        reduce=1.0;
-        for(i=0;i<n;i++) reduce=reduce*row_comb[i];
-        total=total+(sign*reduce);
-
-        new_gray = bin_index^(bin_index/2);
-        gray_diff = old_gray^new_gray;
-        gray_diff_index = binary_power_dict[gray_diff];
-        hash_gray_diff_index=binary_power_dict.find(gray_diff);
-        gray_diff_index=hash_gray_diff_index->second;
-
-        for(i=0;i<n;i++) new_vector[i]=M(gray_diff_index,i);
-        diff=old_gray-new_gray;
-        direction=0;
-        if(diff>0) direction=2;
-        if(diff<0) direction=-2;
-
-        for(i=0;i<n;i++){
-            row_comb[i] = row_comb[i]+ (new_vector[i] * direction);
-        }
-
-        sign = -sign;
-        old_gray = new_gray;
+    total=0.0;
+    sign=-1.0;
+    for(bin_index=1;bin_index<num_loops;bin_index++){
+        // Update row sums
+        k=gray_flip(bin_index);
+        sel[k]=!sel[k];
+        if(sel[k]) for(i=0;i<n;i++) rsum[i]=rsum[i]+M(i,k);
+        else       for(i=0;i<n;i++) rsum[i]=rsum[i]-M(i,k);
+
+        // Product of the row sums
+        prod=sign;
+        for(i=0;i<n;i++) prod=prod*rsum[i];
+        total=total+prod;
+        sign=-sign;
     }
 
     // Free memory
-    delete[] row_comb;
-    delete[] new_vector;
+    delete[] rsum;
+    delete[] sel;
 
     // Return value
-    return total/(double)num_loops;
-
+    if(n%2==0) return total;
+    else       return -total;
 }
 
 
@@ -396,61 +1701,49 @@ cmplx glynn(matc M){
 //  https://en.wikipedia.org/wiki/Computing_the_permanent
 //
 //-----------------------------------------------
-cmplx ryser_omp( matc M, int nthreads){
+cmplx ryser_omp( const matc &M, int nthreads){
 //  matc   M;            // Square matrix to calculate the permanent.
 //  int    nthreads;     // Number of threads
 //  Variables
     int    n;            // Number of rows and columns of the square matrix M
+    long int nstep;      // Number of steps of the Gray code
+    double fr;           // Real part of the permanent value
+    double fi;           // Imaginary part of the permanent value
     cmplx  f;            // Permanent value
-    cmplx *f_priv;       // Partial values of the permanent calculated by each thread.
+    cmplx  fp;           // Partial value of the permanent calculated by a thread
     // Auxiliary index
     int    i;            // Aux index
 
     // Obtain the number of rows
     n=M.rows();
 
-    // Discard trivial solutions
-    switch (n)
-    {
-        case 0: // 0x0 matrix
-            f=1.0;
-            break;
-        case 1: // 1x1 matrix
-            f= M(0,0);
-            break;
-        case 2: // 2x2 matrix
-            f = M( 0, 0 )*M( 1, 1 ) +  M( 0, 1 )*M( 1, 0 );
-            break;
-        case 3: // 3x3 matrix
-            f = M( 0, 0 )*M( 1, 1 )*M( 2, 2 )  // 123
-              + M( 0, 0 )*M( 1, 2 )*M( 2, 1 )  // 132
-              + M( 0, 1 )*M( 1, 0 )*M( 2, 2 )  // 213
-              + M( 0, 1 )*M( 1, 2 )*M( 2, 0 )  // 231
-              + M( 0, 2 )*M( 1, 0 )*M( 2, 1 )  // 312
-              + M( 0, 2 )*M( 1, 1 )*M( 2, 0 ); // 321
-            break;
-        default: // nxn matrix
-            // Reserve memory for the thread results.
-            // prama reduce directive does not work with complex numbers.
-            f_priv = new cmplx[nthreads]();
-
-            // Create threads
-            #pragma omp parallel
-            {
-                #pragma omp for nowait schedule (static)
-                for(i=0;i<nthreads;i++){
-                    f_priv[i] = sub_permanent(M, nthreads, i);
-                }
-            }
+    // Small matrices have their own kernel
+    if(n<=SMALLPERM){
+        f=perm_small(M);
+    }else{
+        // Do not give to a thread less than RYSERGRAIN steps.
+        // Small permanents are calculated without opening a parallel region.
+        nstep=(long int)1<<(n-1);
+        nthreads=(int)max(1L,min((long int)nthreads,nstep/RYSERGRAIN));
 
-            // Join results and calculate the permanent
-            f = 0.0;
-            for(i=0;i<nthreads;i++) f=f+f_priv[i];
-            f = f * 2.0* pow((-1.0),n);
+        if(nthreads==1){
+            f=sub_permanent(M, 1, 0);
+        }else{
+            // pragma reduce directive does not work with complex numbers.
+            // Real and imaginary parts are reduced separately.
+            fr=0.0;
+            fi=0.0;
+            #pragma omp parallel for schedule (static) num_threads(nthreads) private(fp) reduction(+:fr,fi)
+            for(i=0;i<nthreads;i++){
+                fp = sub_permanent(M, nthreads, i);
+                fr = fr + real(fp);
+                fi = fi + imag(fp);
+            }
+            f=cmplx(fr,fi);
+        }
 
-            // Free memory
-            delete[] f_priv;
-            break;
+        // Calculate the permanent
+        f = f * 2.0* pow((-1.0),n);
     }
 
     // Return permanent
@@ -470,7 +1763,7 @@ cmplx ryser_omp( matc M, int nthreads){
 //  https://en.wikipedia.org/wiki/Computing_the_permanent
 //
 //-----------------------------------------------
-cmplx sub_permanent( matc a, int num, int inx){
+cmplx sub_permanent( const matc &a, int num, int inx){
 //  matc   a;            // Square matrix to calculate the permanent.
 //  int    num;          // Number of threads
 //  int    inx;          // Threads index.
@@ -581,6 +1874,457 @@ bool *unrank_gray(int r, int n){
 }
 
 
+//-----------------------------------------------
+//
+//  Calculation of the permanent of a matrix with
+//  repeated rows and columns using the Ryser formula
+//  with multiplicities. A subset of columns is defined
+//  by how many copies k_j of each distinct column j are
+//  taken. These are weighted by the binomial C(m_j,k_j):
+//
+//  perm = (-1)^n sum_k (-1)^|k| prod_j C(m_j,k_j) prod_i (sum_j k_j M_ij)^r_i
+//
+//  The k vectors are traversed in reflected mixed-radix gray code
+//  so each step only updates one column of the row sums.
+//
+//-----------------------------------------------
+cmplx ryser_rep(matc M, veci rmult, veci cmult){
+//  matc M;             // Matrix with distinct rows and columns.
+//  veci rmult;         // Row multiplicities.
+//  veci cmult;         // Column multiplicities.
+//  Variables
+    int    n;           // Size of the expanded matrix
+    int    nr;          // Number of distinct rows
+    int    nc;          // Number of distinct columns
+    int    ksum;        // Number of columns in the current subset
+    int   *k;           // Copies of each distinct column in the current subset
+    int   *d;           // Direction of change of each digit in the gray code
+    long long int nstep;// Number of steps
+    double w;           // Binomial weight of the current subset
+    double *wc;         // Binomial weight of each column C(m_j,k_j)
+    cmplx  p;           // Product of the row sums
+    cmplx  total;       // Total value of the permanent
+    cmplx *rsum;        // Row sums of the current subset
+    veci   aux;         // Auxiliary vector to swap multiplicities
+//  Auxiliary index
+    long long int istep;// Step index
+    int    i;           // Aux index
+    int    j;           // Aux index
+    int    l;           // Aux index
+
+
+    // The permanent is invariant under transposition.
+    // Traverse the side with the shortest enumeration.
+    if(rep_steps(rmult)<rep_steps(cmult)){
+        M=M.transpose().eval();
+        aux=rmult;
+        rmult=cmult;
+        cmult=aux;
+    }
+
+    // Configuration
+    nr=M.rows();
+    nc=M.cols();
+    n=cmult.sum();
+    if(n==0) return 1.0;
+    nstep=rep_steps(cmult);
+
+    // Initializations
+    k=new int[nc]();
+    d=new int[nc];
+    wc=new double[nc];
+    for(j=0;j<nc;j++){
+        d[j]=1;
+        wc[j]=1.0;
+    }
+    rsum=new cmplx[nr]();
+    total=0.0;
+    ksum=0;
+
+    //  Main loop. The empty subset k=0 does not contribute.
+    for(istep=1;istep<nstep;istep++){
+        // Find the digit to move. The lower ones are in
+        // a boundary and reverse their direction.
+        j=0;
+        while((k[j]+d[j]<0)||(k[j]+d[j]>cmult(j))){
+            d[j]=-d[j];
+            j++;
+        }
+
+        // Update binomial weight C(m_j,k_j) and subset
+        if(d[j]>0) wc[j]=wc[j]*(cmult(j)-k[j])/(k[j]+1);
+        else       wc[j]=wc[j]*k[j]/(cmult(j)-k[j]+1);
+        k[j]=k[j]+d[j];
+        ksum=ksum+d[j];
+
+        // Update row sums
+        if(d[j]>0) for(i=0;i<nr;i++) rsum[i]=rsum[i]+M(i,j);
+        else       for(i=0;i<nr;i++) rsum[i]=rsum[i]-M(i,j);
+
+        // Add the contribution of this subset
+        w=1.0;
+        for(l=0;l<nc;l++) w=w*wc[l];
+        p=1.0;
+        for(i=0;i<nr;i++){
+            for(l=0;l<rmult(i);l++) p=p*rsum[i];
+        }
+        if(ksum%2==0) total=total+w*p;
+        else          total=total-w*p;
+    }
+
+    // Free memory
+    delete[] k;
+    delete[] d;
+    delete[] wc;
+    delete[] rsum;
+
+    // Return value
+    if(n%2==0) return total;
+    else       return -total;
+}
+
+
+//-----------------------------------------------
+//
+//  Number of steps of the Ryser formula with multiplicities.
+//
+//-----------------------------------------------
+long long int rep_steps(veci mult){
+//  veci mult;          // Multiplicities
+//  Variables
+    long long int nstep;// Number of steps
+//  Auxiliary index
+    int i;              // Aux index
+
+
+    nstep=1;
+    for(i=0;i<mult.size();i++){
+        if(nstep>LLONG_MAX/(mult(i)+1)) return LLONG_MAX;
+        nstep=nstep*(mult(i)+1);
+    }
+    return nstep;
+}
+
+
+//-----------------------------------------------
+//
+//  Binomial coefficient C(n,k).
+//
+//-----------------------------------------------
+long long int binomial(int n, int k){
+//  int n;              // Number of elements
+//  int k;              // Number of chosen elements
+//  Variables
+    long long int c;    // Binomial coefficient
+//  Auxiliary index
+    int i;              // Aux index
+
+
+    if((k<0)||(k>n)) return 0;
+    k=min(k,n-k);
+    c=1;
+    for(i=1;i<=k;i++) c=c*(n-k+i)/i;
+    return c;
+}
+
+
+//-----------------------------------------------
+//
+//  Returns the r:th non-decreasing sequence of k
+//  levels out of n in lexicographic order.
+//  This is, the r:th state of the photon "position"
+//  odometer. The last element is a copy of the
+//  previous one to be used as guard by the odometer.
+//
+//-----------------------------------------------
+int *unrank_multiset(long long int r, int k, int n){
+//  long long int r;    // Rank of the sequence
+//  int k;              // Number of elements of the sequence
+//  int n;              // Number of levels
+//  Variables
+    long long int c;    // Number of sequences with a given prefix
+    int   l;            // Level
+    int  *pos;          // Sequence of levels
+//  Auxiliary index
+    int i;              // Aux index
+
+
+    pos=new int[k+1]();
+    l=0;
+    for(i=0;i<k;i++){
+        c=binomial(n-l+k-i-2,k-i-1);
+        while(r>=c){
+            r=r-c;
+            l=l+1;
+            c=binomial(n-l+k-i-2,k-i-1);
+        }
+        pos[i]=l;
+    }
+    if(k>0) pos[k]=pos[k-1];
+
+    // Return sequence
+    return pos;
+}
+
+
+//-----------------------------------------------
+//
+//  Returns the r:th bit mask of n bits with k ones in
+//  lexicographic order. This is, the r:th value
+//  obtained calling next_permutation on the sorted mask.
+//
+//-----------------------------------------------
+string unrank_bitmask(long long int r, int k, int n){
+//  long long int r;    // Rank of the bit mask
+//  int k;              // Number of ones
+//  int n;              // Number of bits
+//  Variables
+    long long int c;    // Number of masks with a zero in the present position
+    string bitmask;     // Bit mask
+//  Auxiliary index
+    int i;              // Aux index
+
+
+    bitmask.resize(n,0);
+    for(i=0;i<n;i++){
+        c=binomial(n-i-1,k);
+        if(r>=c){
+            r=r-c;
+            bitmask[i]=1;
+            k=k-1;
+        }
+    }
+
+    // Return bit mask
+    return bitmask;
+}
+
+
+//-----------------------------------------------
+//
+//  Returns the rank of an occupation in the
+//  lexicographic order of the non-decreasing
+//  sequences of photon levels. Inverse of
+//  unrank_multiset.
+//
+//-----------------------------------------------
+long long int rank_multiset(int *occ, int n){
+//  int *occ;           // Occupation of each level
+//  int n;              // Number of levels
+//  Variables
+    int   k;            // Number of photons
+    int   l;            // Level of the previous photon
+    long long int r;    // Rank
+//  Auxiliary index
+    int i;              // Aux index
+    int j;              // Aux index
+    int m;              // Aux index
+
+
+    k=0;
+    for(j=0;j<n;j++) k=k+occ[j];
+
+    // Add the sequences skipped at each photon position
+    r=0;
+    l=0;
+    i=0;
+    for(j=0;j<n;j++){
+        for(m=0;m<occ[j];m++){
+            while(l<j){
+                r=r+binomial(n-l+k-i-2,k-i-1);
+                l=l+1;
+            }
+            i=i+1;
+        }
+    }
+
+    // Return rank
+    return r;
+}
+
+
+//-----------------------------------------------
+//
+//  Returns the rank of an occupation of zeros and
+//  ones in the lexicographic order of the bit masks.
+//  Inverse of unrank_bitmask.
+//
+//-----------------------------------------------
+long long int rank_bitmask(int *occ, int n){
+//  int *occ;           // Occupation of each level
+//  int n;              // Number of levels
+//  Variables
+    int   k;            // Number of remaining photons
+    long long int r;    // Rank
+//  Auxiliary index
+    int i;              // Aux index
+
+
+    k=0;
+    for(i=0;i<n;i++) k=k+occ[i];
+
+    // Add the masks with a zero where there is a photon
+    r=0;
+    for(i=0;i<n;i++){
+        if(occ[i]>0){
+            r=r+binomial(n-i-1,k);
+            k=k-1;
+        }
+    }
+
+    // Return rank
+    return r;
+}
+
+
+//-----------------------------------------------
+//
+//  Permanent cache. Creates a disabled cache.
+//
+//-----------------------------------------------
+perm_cache::perm_cache(){
+
+
+    maxsize=0;
+    nhit=0;
+    nmiss=0;
+}
+
+
+//-----------------------------------------------
+//
+//  Changes the maximum number of entries
+//  of the cache.
+//
+//-----------------------------------------------
+void perm_cache::resize(long long int size){
+//  long long int size;  // Maximum number of entries
+
+
+    lock_guard<mutex> guard(lock);
+    maxsize=max(size,(long long int)0);
+    while((long long int)order.size()>maxsize){
+        table.erase(order.back().first);
+        order.pop_back();
+    }
+}
+
+
+//-----------------------------------------------
+//
+//  Removes all the entries of the cache.
+//
+//-----------------------------------------------
+void perm_cache::clear(){
+
+
+    lock_guard<mutex> guard(lock);
+    order.clear();
+    table.clear();
+    nhit=0;
+    nmiss=0;
+}
+
+
+//-----------------------------------------------
+//
+//  Looks for a permanent in the cache.
+//
+//-----------------------------------------------
+bool perm_cache::find(const string &key, cmplx &value){
+//  const string &key;   // Key of the permanent
+//  cmplx &value;        // Value of the permanent
+//  Variables
+    unordered_map<string,list<pair<string,cmplx>>::iterator>::iterator it; // Entry of the table
+
+
+    lock_guard<mutex> guard(lock);
+    it=table.find(key);
+    if(it==table.end()){
+        nmiss=nmiss+1;
+        return false;
+    }
+
+    // Move the entry to the front of the list
+    order.splice(order.begin(),order,it->second);
+    value=it->second->second;
+    nhit=nhit+1;
+    return true;
+}
+
+
+//-----------------------------------------------
+//
+//  Stores a permanent in the cache. If the cache
+//  is full the least recently used entry is removed.
+//
+//-----------------------------------------------
+void perm_cache::insert(const string &key, cmplx value){
+//  const string &key;   // Key of the permanent
+//  cmplx value;         // Value of the permanent
+//  Variables
+    unordered_map<string,list<pair<string,cmplx>>::iterator>::iterator it; // Entry of the table
+
+
+    lock_guard<mutex> guard(lock);
+    if(maxsize==0) return;
+
+    // Another thread may have stored it
+    it=table.find(key);
+    if(it!=table.end()){
+        order.splice(order.begin(),order,it->second);
+        return;
+    }
+
+    // Make room and store
+    if((long long int)order.size()>=maxsize){
+        table.erase(order.back().first);
+        order.pop_back();
+    }
+    order.emplace_front(key,value);
+    table[key]=order.begin();
+}
+
+
+//-----------------------------------------------
+//
+//  Maximum number of entries of the cache.
+//
+//-----------------------------------------------
+long long int perm_cache::capacity(){
+
+
+    lock_guard<mutex> guard(lock);
+    return maxsize;
+}
+
+
+//-----------------------------------------------
+//
+//  Number of successful look-ups.
+//
+//-----------------------------------------------
+long long int perm_cache::hits(){
+
+
+    lock_guard<mutex> guard(lock);
+    return nhit;
+}
+
+
+//-----------------------------------------------
+//
+//  Number of failed look-ups.
+//
+//-----------------------------------------------
+long long int perm_cache::misses(){
+
+
+    lock_guard<mutex> guard(lock);
+    return nmiss;
+}
+
+
 //-----------------------------------------------
 //
 //  Estimation of the confidence we have in a triangular
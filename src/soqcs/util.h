@@ -17,8 +17,13 @@
 #include <complex>       // Complex numbers
 #include <random>        // Random number generators
 #include <string>        // Strings management
+#include <cstring>       // Memory copy
 #include <algorithm>     // Permutations
 #include <unordered_map> // Hash tables
+#include <vector>        // Vectors
+#include <memory>        // Smart pointers
+#include <list>          // Lists
+#include <mutex>         // Mutual exclusion
 #include <Eigen/Dense>   // Eigen3 library
 
 // Name spaces
@@ -41,16 +46,15 @@ typedef unordered_map<long long int,long long int> thash; ///< Simplified type n
 //Extern variables.
 extern int def_nph;                        ///< Default value of the maximum photon occupation by level.
                                            ///< It is also the base of our index system.
-// Static variables (a single instance for all the library) Random Number Generator (RNG) variables
-// Recipe taken from literature (cpp reference guide, common knowledge).
-static std::random_device rd;              ///< Variable to be used to obtain a seed for the random number engine.
-static std::mt19937_64 gen(rd());          ///< 64-bit Mersenne Twister by Matsumoto and Nishimura, 2000 generator set up.
-
 // Constant to be used across the library
 const double xcut = 1.0e-10;               ///< Value below which a real number is truncated to zero.
 const double pi   = std::acos(-1);         ///< Value of Pi.
 const std::complex<double> jm(0, 1);       ///< The pure imaginary number i.
 
+// Permanent constants
+const long int RYSERGRAIN = 4096;          ///< Minimum number of Gray code steps given to each thread by the parallelized Ryser formula.
+const int SMALLPERM = 12;                  ///< Largest matrix size with a permanent kernel specialized at compile time.
+
 // Erfi constants
 const int DEFLIMERF = 100;                 /// Number of elements in erfi approximation.
 const double cerf   = 0.5*sqrt(pi);        /// Constant used in erfi calculation
@@ -100,8 +104,140 @@ int intpow(int x, unsigned int p);
 */
 long int factorial(long int n);
 
+/** \class philox
+*   \brief Counter-based random number generator Philox4x32-10. <br>
+*   J. K. Salmon, M. A. Moraes, R. O. Dror, D. E. Shaw, Proceedings of SC'11 (2011) 16. <br>
+*   The output is a function of a key (the seed), a stream identifier and a counter. Different streams
+*   are independent and any position of a stream can be reached in constant time. This allows parallel and
+*   reproducible sampling by giving each task its own stream.
+*
+*   It satisfies the requirements of an uniform random bit generator so it can be used with the standard distributions.
+*/
+class philox{
+    // Private variables
+    unsigned int key[2];                   ///< Key obtained from the seed.
+    unsigned int ctr[4];                   ///< Counter. The first two words are the block number and the last two the stream.
+    unsigned long long buf[2];             ///< Random numbers of the last block.
+    int nbuf;                              ///< Random numbers left in the buffer.
+
+public:
+    typedef unsigned long long result_type; ///< Type of the generated numbers.
+
+    /**
+    *  Creates a generator of stream zero of the seed zero.
+    */
+    philox();
+    /**
+    *  Creates a generator for a given seed and stream.
+    *
+    *  @param unsigned long long seed Seed.
+    *  @param unsigned long long stream Stream identifier.
+    */
+    philox(unsigned long long seed, unsigned long long stream);
+    /**
+    *  Sets the seed and stream of the generator and restarts its counter.
+    *
+    *  @param unsigned long long seed Seed.
+    *  @param unsigned long long stream Stream identifier.
+    */
+    void set(unsigned long long seed, unsigned long long stream);
+    /**
+    *  Advances the stream a number of blocks. Each block contains two 64-bit numbers. The numbers left of the current block are discarded.
+    *
+    *  @param unsigned long long nblocks Number of blocks to skip.
+    */
+    void jump(unsigned long long nblocks);
+    /**
+    *  Generates a 64-bit random number.
+    *
+    *  @return Random number.
+    */
+    result_type operator()();
+    /**
+    *  Smallest value that can be generated.
+    *
+    *  @return Zero.
+    */
+    static constexpr result_type min(){ return 0; }
+    /**
+    *  Largest value that can be generated.
+    *
+    *  @return 2^64-1.
+    */
+    static constexpr result_type max(){ return ~0ULL; }
+    /**
+    *  Generates an uniformly distributed random number in the interval [0,1).
+    *
+    *  @return Random number.
+    */
+    double uniform();
+    /**
+    *  Generates n uniformly distributed random numbers in the interval [0,1).
+    *
+    *  @param double *v Vector of random numbers. <b> Warning! this is an output variable </b>
+    *  @param int n Number of random numbers.
+    */
+    void uniform(double *v, int n);
+    /**
+    *  Generates n Normally distributed random numbers (Box-Muller method).
+    *
+    *  @param double *v Vector of random numbers. <b> Warning! this is an output variable </b>
+    *  @param int n Number of random numbers.
+    *  @param double mu  Mean value.
+    *  @param double stdev  Standard deviation.
+    */
+    void gauss(double *v, int n, double mu, double stdev);
+    /**
+    *  Generates n Poisson distributed random numbers.
+    *
+    *  @param int *v Vector of random numbers. <b> Warning! this is an output variable </b>
+    *  @param int n Number of random numbers.
+    *  @param double lambda  Most probable outcome.
+    */
+    void poisson(int *v, int n, double lambda);
+
+protected:
+    /**
+    *  Calculates the block of random numbers of the current counter and increments the counter.
+    */
+    void block();
+};
+
+/**
+* Sets the seed of the random number generators of the library. The generator of each thread and
+* the task streams are restarted from it. The default seed is random.
+*
+* @param unsigned long long seed New seed.
+*/
+void rng_seed(unsigned long long seed);
+
+/**
+* Returns the seed of the random number generators of the library.
+*
+* @return Current seed.
+*/
+unsigned long long rng_get_seed();
+
+/**
+* Creates a generator of an independent stream of the current seed. Tasks that use their own
+* stream obtain the same random numbers regardless of the thread that executes them.
+*
+* @param unsigned long long stream Stream identifier.
+* @return Generator of the stream.
+*/
+philox rng_stream(unsigned long long stream);
+
+/**
+* Returns the generator of the calling thread. Each thread has its own stream so the generator
+* can be used without synchronization. Streams are given to the threads in order of first use.
+*
+* @return Generator of the thread.
+*/
+philox &rng_thread();
+
 /**
 * Generates an uniformly distributed random number in the interval between 0 and 1.
+* It uses the generator of the calling thread.
 *
 * @return A random number uniformly distributed between 0 and 1.
 */
@@ -132,6 +268,26 @@ double grand(double mu, double stdev);
 */
 void cfg_soqcs(int nph);
 
+/**
+* Calculates the Gelman-Rubin potential scale reduction factor of a set of Markov chains.
+* Each chain is split in two halves so that a single chain can also be diagnosed.
+* Values close to one indicate that the chains have mixed.
+*
+* @param vecd *chains  Values of a scalar quantity along each chain.
+* @param int nchains   Number of chains.
+* @return Potential scale reduction factor. Zero if the chains are too short.
+*/
+double gelman_rubin(vecd *chains, int nchains);
+
+/**
+* Calculates the effective sample size of a Markov chain using Geyer's initial positive sequence
+* estimator of the integrated autocorrelation time.
+*
+* @param vecd x  Values of a scalar quantity along the chain.
+* @return Effective sample size.
+*/
+double eff_size(const vecd &x);
+
 
 /**
 * Calculation of a hash value for a given occupation vector. The maximum number of photons is specified explicitly to be used as a base.
@@ -153,6 +309,79 @@ long long int hashval(int *chainv,int n,int nph);
 */
 long long int decval(int *chainv,int n,int base);
 
+/**
+* Calculation of a 64-bit hash of an integer vector. Unlike hashval it does not assume any bound on the values
+* but different vectors may have the same hash.
+*
+* @param const int *v  Integer vector.
+* @param int  n        Length of v.
+* @return              Hash of v.
+*/
+unsigned long long int rowhash(const int *v, int n);
+
+/** \class row_index
+*   \brief Open addressing hash index of the rows of a contiguous block of integers. <br>
+*   The table stores the position of each row and its hash. The rows themselves are not copied, they are compared
+*   against the block when the hashes are equal. Therefore the index is exact for any row length and any values. <br>
+*   Slots are probed in groups of sixteen using a control byte with seven bits of the hash for each slot. The comparison
+*   of a group is vectorized when SSE2 is available. Rows can not be removed individually.
+*/
+class row_index{
+    // Private variables
+    int cap;                               ///< Number of slots. Zero or a power of two not smaller than 16.
+    int nused;                             ///< Number of rows in the index.
+    vector<unsigned char> ctrl;            ///< Control byte of each slot. Seven bits of the hash or empty.
+    vector<unsigned long long int> hashes; ///< Hash of the row of each slot.
+    vector<int> pos;                       ///< Position of the row of each slot.
+
+public:
+    /**
+    *  Creates an empty index.
+    */
+    row_index();
+    /**
+    *  Reserves slots for a number of rows so they can be added without rehashing.
+    *
+    *  @param int n Number of rows.
+    */
+    void reserve(int n);
+    /**
+    *  Removes all the rows from the index. The slots are kept.
+    */
+    void clear();
+    /**
+    *  Finds a row.
+    *
+    *  @param unsigned long long int h Hash of the row calculated with rowhash.
+    *  @param const int *row  Row to be found.
+    *  @param const int *store Block where the rows are stored.
+    *  @param int width Length of each row.
+    *  @return Position of the row in the block. -1 if it is not in the index.
+    */
+    int find(unsigned long long int h, const int *row, const int *store, int width) const;
+    /**
+    *  Adds a row that is not already present in the index.
+    *
+    *  @param unsigned long long int h Hash of the row calculated with rowhash.
+    *  @param int ipos Position of the row in the block.
+    */
+    void insert(unsigned long long int h, int ipos);
+    /**
+    *  Returns the number of rows in the index.
+    *
+    *  @return Number of rows.
+    */
+    int size() const;
+
+protected:
+    /**
+    *  Changes the number of slots and places again the rows.
+    *
+    *  @param int newcap New number of slots. It must be a power of two not smaller than 16.
+    */
+    void rehash(int newcap);
+};
+
 
 /**
 * Calculates the coupling between two Gaussian wave packets of defined parameters.
@@ -221,6 +450,48 @@ double mat_confidence(matc L);
 */
 cmplx glynn(matc M);
 
+/**
+* Calculates the permanent of a small square matrix (n<=SMALLPERM) with a kernel specialized for its size.
+* The kernels are instances of the Glynn formula with the loops unrolled at compile time and without memory reservation.
+*
+* @param matc M   Square matrix of size n<=SMALLPERM.
+* @return         The permanent of a square complex matrix.
+*/
+cmplx perm_small(const matc &M);
+
+/**
+* Calculates the permanents of all the minors of a (n-1)xn matrix obtained by removing one of its columns.
+* All of them are obtained in a single pass of the Glynn formula in gray code.
+*
+* @param matc M   Matrix of (n-1) rows and n columns.
+* @return         Vector with the permanent of the minor obtained by removing each column.
+*/
+vecc glynn_minors(matc M);
+
+/**
+* Estimates the permanent of a square matrix with the randomized Glynn/Gurvits estimator. The average of the
+* samples is an unbiased estimation of the permanent and each sample is bounded by ||M||^n.
+* The samples are split between threads.
+*
+* @param matc M   Square matrix.
+* @param long long int nsamples Number of samples.
+* @param int nthreads Number of threads to be used.
+* @param double serr  Standard error of the estimation. <b> Warning! this is an output variable </b>
+* @return         Estimation of the permanent of a square complex matrix.
+*/
+cmplx gurvits_perm(const matc &M, long long int nsamples, int nthreads, double &serr);
+
+/**
+* Calculates the number of samples of the Gurvits estimator needed to obtain an additive error eps with a given confidence.
+*
+* @param double bound  Upper bound of the modulus of a sample.
+* @param double eps    Additive error.
+* @param double conf   Confidence. Probability of the error being smaller than eps.
+* @return         Number of samples.
+* @see cmplx gurvits_perm(const matc &M, long long int nsamples, int nthreads, double &serr);
+*/
+long long int gurvits_samples(double bound, double eps, double conf);
+
 /**
 * Calculates the permanent of a square matrix using a parallelized version of the Ryser formula as
 * published in:
@@ -236,7 +507,16 @@ cmplx glynn(matc M);
 * @param int nthreads Number of threads to be used.
 * @return         The permanent of a square complex matrix.
 */
-cmplx ryser_omp( matc M, int nthreads);
+cmplx ryser_omp( const matc &M, int nthreads);
+
+/**
+* Calculates the permanent of a real non-negative square matrix using the Ryser formula in gray code.
+* It is used for probabilities of distinguishable photons, this is, permanents of |U|^2 submatrices.
+*
+* @param matd M   Square non-negative matrix.
+* @return         The permanent of the matrix.
+*/
+double ryser_nonneg(const matd &M);
 
 /**
 *  Auxiliary method to calculate a sub-permanet using the Ryser formula ( Normal sum )
@@ -251,9 +531,9 @@ cmplx ryser_omp( matc M, int nthreads);
 * @param int num Number of threads to be used.
 * @param inx num Thread number
 * @return         The permanent of a square complex matrix.
-* @see cmplx ryser_omp( matc M, int nthreads);
+* @see cmplx ryser_omp( const matc &M, int nthreads);
 */
-cmplx sub_permanent( matc a, int num, int inx);
+cmplx sub_permanent( const matc &a, int num, int inx);
 
 /**
 *  Auxiliary method required for sub-permanet calculations.
@@ -266,11 +546,152 @@ cmplx sub_permanent( matc a, int num, int inx);
 * @param int r Integer
 * @param int n Size of the output vector
 * @return Booleans vector
-* @see cmplx ryser_omp( matc M, int nthreads);
-* @see cmplx sub_permanent( matc a, int num, int inx);
+* @see cmplx ryser_omp( const matc &M, int nthreads);
+* @see cmplx sub_permanent( const matc &a, int num, int inx);
 */
 bool *unrank_gray(int r, int n);
 
+/**
+* Calculates the permanent of the square matrix built by repeating each row i of M rmult(i) times and
+* each column j of M cmult(j) times. It uses the Ryser formula with multiplicities where subsets of repeated
+* columns are summed together with binomial weights. The sums are traversed in a reflected mixed-radix gray code.
+* The calculation needs prod(m_j+1) steps over the rows or the columns, whatever is shorter,
+* instead of the 2^n steps of the expanded n x n matrix.
+*
+* @param matc M     Matrix with the distinct rows and columns.
+* @param veci rmult Number of times that each row is repeated.
+* @param veci cmult Number of times that each column is repeated.
+* @return           The permanent of the expanded square complex matrix.
+*/
+cmplx ryser_rep(matc M, veci rmult, veci cmult);
+
+/**
+* Number of steps needed by the Ryser formula with multiplicities to traverse a given list of multiplicities. <br>
+* The value saturates at the maximum of a long long integer.
+*
+* @param veci mult Multiplicities.
+* @return          Product of the multiplicities plus one.
+* @see cmplx ryser_rep(matc M, veci rmult, veci cmult);
+*/
+long long int rep_steps(veci mult);
+
+/**
+* Binomial coefficient.
+*
+* @param int n Number of elements.
+* @param int k Number of chosen elements.
+* @return      The binomial coefficient C(n,k). Zero if k is out of range.
+*/
+long long int binomial(int n, int k);
+
+/**
+* Returns the r:th non-decreasing sequence of k levels out of n in lexicographic order. <br>
+* This is the r:th configuration of the photon "position" odometer used to enumerate the outputs of the simulator.
+*
+* @param long long int r Rank of the sequence.
+* @param int k Number of elements of the sequence.
+* @param int n Number of levels.
+* @return      Vector of k+1 integers. The last one is a copy of the previous one to be used as guard by the odometer.
+*/
+int *unrank_multiset(long long int r, int k, int n);
+
+/**
+* Returns the r:th bit mask of n bits with k ones in lexicographic order. <br>
+* This is the r:th mask obtained calling next_permutation from the sorted mask.
+*
+* @param long long int r Rank of the bit mask.
+* @param int k Number of ones.
+* @param int n Number of bits.
+* @return      Bit mask stored as a string of zero and one values.
+*/
+string unrank_bitmask(long long int r, int k, int n);
+
+/**
+* Returns the rank of an occupation in the lexicographic order of the non-decreasing sequences of photon levels. <br>
+* It is the inverse of unrank_multiset written in terms of occupations.
+*
+* @param int *occ Occupation of each level.
+* @param int n Number of levels.
+* @return      Rank of the occupation between all the ones with the same number of photons.
+* @see int *unrank_multiset(long long int r, int k, int n);
+*/
+long long int rank_multiset(int *occ, int n);
+
+/**
+* Returns the rank of an occupation of zeros and ones in the lexicographic order of the bit masks. <br>
+* It is the inverse of unrank_bitmask written in terms of occupations.
+*
+* @param int *occ Occupation of each level. Zero or one.
+* @param int n Number of levels.
+* @return      Rank of the occupation between all the ones with the same number of photons.
+* @see string unrank_bitmask(long long int r, int k, int n);
+*/
+long long int rank_bitmask(int *occ, int n);
+
+/** \class perm_cache
+*   \brief Bounded memoisation table of permanents with a least recently used (LRU) eviction policy. <br>
+*   Each entry maps a key that identifies a permanent to its value. When the table is full the entry that
+*   has not been used for the longest time is removed. The table can be shared between threads.
+*/
+class perm_cache{
+    // Private variables
+    long long int maxsize;                                      ///< Maximum number of entries. Zero if disabled.
+    long long int nhit;                                         ///< Number of successful look-ups.
+    long long int nmiss;                                        ///< Number of failed look-ups.
+    list<pair<string,cmplx>> order;                             ///< Entries from the most to the least recently used.
+    unordered_map<string,list<pair<string,cmplx>>::iterator> table; ///< Position in the list of each key.
+    mutex lock;                                                 ///< Lock of the table.
+
+public:
+    /**
+    *  Creates a disabled cache.
+    */
+    perm_cache();
+    /**
+    *  Changes the maximum number of entries. Least recently used entries are removed if needed.
+    *
+    *  @param long long int size Maximum number of entries. Zero disables the cache.
+    */
+    void resize(long long int size);
+    /**
+    *  Removes all the entries and restarts the counters.
+    */
+    void clear();
+    /**
+    *  Looks for a key in the cache. If it is found the entry becomes the most recently used.
+    *
+    *  @param const string &key Key of the permanent.
+    *  @param cmplx &value Value of the permanent. <b> Warning! this is an output variable </b>
+    *  @return True if the key is in the cache. False otherwise.
+    */
+    bool find(const string &key, cmplx &value);
+    /**
+    *  Stores a permanent as the most recently used entry.
+    *
+    *  @param const string &key Key of the permanent.
+    *  @param cmplx value Value of the permanent.
+    */
+    void insert(const string &key, cmplx value);
+    /**
+    *  Returns the maximum number of entries.
+    *
+    *  @return Maximum number of entries. Zero if the cache is disabled.
+    */
+    long long int capacity();
+    /**
+    *  Returns the number of successful look-ups.
+    *
+    *  @return Number of hits.
+    */
+    long long int hits();
+    /**
+    *  Returns the number of failed look-ups.
+    *
+    *  @return Number of misses.
+    */
+    long long int misses();
+};
+
 
 /**
 * String to integer converter that can be initialized with constant strings.